@@ -32,13 +32,23 @@
 #include "sysemu/qtest.h"
 #include "hw/xen/xen.h"
 #include "qom/object.h"
+#include "qom/cpu.h"
+#include "qemu/error-report.h"
 #include "hw/boards.h"
 
 int tcg_tb_size;
+const char *tcg_tb_cache_file;
 static bool tcg_allowed = true;
 
 static int tcg_init(MachineState *ms)
 {
+    if (ms->tcg_multithread) {
+#ifdef _WIN32
+        error_report("tcg-thread=multi is not supported on this host");
+        return -ENOTSUP;
+#endif
+        mttcg_enabled = true;
+    }
     tcg_exec_init(tcg_tb_size * 1024 * 1024);
     return 0;
 }
@@ -17,12 +17,17 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/atomic.h"
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 struct AioHandler
 {
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     int pollfds_idx;
     void *opaque;
@@ -42,13 +47,159 @@ static AioHandler *find_aio_handler(AioContext *ctx, int fd)
     return NULL;
 }
 
-void aio_set_fd_handler(AioContext *ctx,
-                        int fd,
-                        IOHandler *io_read,
-                        IOHandler *io_write,
-                        void *opaque)
+#ifdef CONFIG_EPOLL_CREATE1
+
+/* Switch to epoll once this many file descriptors are being polled */
+#define EPOLL_ENABLE_THRESHOLD 64
+
+/* Maximum number of events fetched by one epoll_wait() call */
+#define EPOLL_MAX_EVENTS 128
+
+static void aio_epoll_disable(AioContext *ctx)
+{
+    ctx->epoll_available = false;
+    if (!ctx->epoll_enabled) {
+        return;
+    }
+    ctx->epoll_enabled = false;
+    close(ctx->epollfd);
+    ctx->epollfd = -1;
+}
+
+static int epoll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? EPOLLIN : 0) |
+           (pfd_events & G_IO_OUT ? EPOLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? EPOLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static int pfd_events_from_epoll(int epoll_events)
+{
+    return (epoll_events & EPOLLIN ? G_IO_IN : 0) |
+           (epoll_events & EPOLLOUT ? G_IO_OUT : 0) |
+           (epoll_events & EPOLLHUP ? G_IO_HUP : 0) |
+           (epoll_events & EPOLLERR ? G_IO_ERR : 0);
+}
+
+/* Add every handler to the epoll interest set */
+static bool aio_epoll_try_enable(AioContext *ctx)
 {
     AioHandler *node;
+    struct epoll_event event;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (node->deleted || !node->pfd.events) {
+            continue;
+        }
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        event.data.ptr = node;
+        if (epoll_ctl(ctx->epollfd, EPOLL_CTL_ADD, node->pfd.fd, &event)) {
+            return false;
+        }
+    }
+    ctx->epoll_enabled = true;
+    return true;
+}
+
+/* Keep the epoll interest set in sync with a handler that was just added,
+ * changed or removed.  A handler is removed when its pfd.events is zero.
+ */
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+    struct epoll_event event;
+    int r;
+
+    if (!ctx->epoll_enabled) {
+        return;
+    }
+    if (!node->pfd.events) {
+        r = epoll_ctl(ctx->epollfd, EPOLL_CTL_DEL, node->pfd.fd, &event);
+    } else {
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        event.data.ptr = node;
+        r = epoll_ctl(ctx->epollfd, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                      node->pfd.fd, &event);
+    }
+    if (r) {
+        /* Fall back to ppoll() for good */
+        aio_epoll_disable(ctx);
+    }
+}
+
+/* Wait on the epoll fd and store the events in the handlers' revents.
+ * The wait itself uses ppoll() for its nanosecond timeout.
+ */
+static int aio_epoll(AioContext *ctx, int64_t timeout)
+{
+    GPollFD pfd = {
+        .fd = ctx->epollfd,
+        .events = G_IO_IN | G_IO_OUT | G_IO_HUP | G_IO_ERR,
+    };
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    AioHandler *node;
+    int i, ret = 0;
+
+    if (timeout != 0) {
+        ret = qemu_poll_ns(&pfd, 1, timeout);
+    }
+    if (timeout == 0 || ret > 0) {
+        ret = epoll_wait(ctx->epollfd, events, ARRAY_SIZE(events), 0);
+        for (i = 0; i < ret; i++) {
+            node = events[i].data.ptr;
+            node->pfd.revents = pfd_events_from_epoll(events[i].events);
+        }
+    }
+    return ret;
+}
+
+/* Decide whether this aio_poll() iteration waits with epoll, enabling it
+ * the first time @npfd file descriptors reach the threshold.
+ */
+static bool aio_epoll_check_poll(AioContext *ctx, unsigned npfd)
+{
+    if (!ctx->epoll_available) {
+        return false;
+    }
+    if (ctx->epoll_enabled) {
+        return true;
+    }
+    if (npfd >= EPOLL_ENABLE_THRESHOLD) {
+        if (aio_epoll_try_enable(ctx)) {
+            return true;
+        }
+        aio_epoll_disable(ctx);
+    }
+    return false;
+}
+
+#else
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+}
+
+static int aio_epoll(AioContext *ctx, int64_t timeout)
+{
+    abort();
+}
+
+static bool aio_epoll_check_poll(AioContext *ctx, unsigned npfd)
+{
+    return false;
+}
+
+#endif
+
+void aio_set_fd_handler_poll(AioContext *ctx,
+                             int fd,
+                             IOHandler *io_read,
+                             IOHandler *io_write,
+                             AioPollFn *io_poll,
+                             void *opaque)
+{
+    AioHandler *node;
+    bool is_new = false;
 
     node = find_aio_handler(ctx, fd);
 
@@ -56,6 +207,13 @@ void aio_set_fd_handler(AioContext *ctx,
     if (!io_read && !io_write) {
         if (node) {
             g_source_remove_poll(&ctx->source, &node->pfd);
+            if (!node->io_poll) {
+                ctx->poll_disable_cnt--;
+            }
+
+            /* The caller may close the fd as soon as we return */
+            node->pfd.events = 0;
+            aio_epoll_update(ctx, node, false);
 
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
@@ -78,20 +236,39 @@ void aio_set_fd_handler(AioContext *ctx,
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
 
             g_source_add_poll(&ctx->source, &node->pfd);
+            is_new = true;
+        } else if (!node->io_poll) {
+            ctx->poll_disable_cnt--;
+        }
+        if (!io_poll) {
+            ctx->poll_disable_cnt++;
         }
+
         /* Update handler with latest information */
         node->io_read = io_read;
         node->io_write = io_write;
+        node->io_poll = io_poll;
         node->opaque = opaque;
         node->pollfds_idx = -1;
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
+
+        aio_epoll_update(ctx, node, is_new);
     }
 
     aio_notify(ctx);
 }
 
+void aio_set_fd_handler(AioContext *ctx,
+                        int fd,
+                        IOHandler *io_read,
+                        IOHandler *io_write,
+                        void *opaque)
+{
+    aio_set_fd_handler_poll(ctx, fd, io_read, io_write, NULL, opaque);
+}
+
 void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read)
@@ -100,6 +277,15 @@ void aio_set_event_notifier(AioContext *ctx,
                        (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 EventNotifierHandler *io_read,
+                                 AioPollFn *io_poll)
+{
+    aio_set_fd_handler_poll(ctx, event_notifier_get_fd(notifier),
+                            (IOHandler *)io_read, NULL, io_poll, notifier);
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     return false;
@@ -186,12 +372,112 @@ bool aio_dispatch(AioContext *ctx)
     return progress;
 }
 
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    bool progress = false;
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            node->io_poll(node->opaque)) {
+            /* aio_notify() does not count as progress */
+            if (node->opaque != &ctx->notifier) {
+                progress = true;
+            }
+        }
+
+        /* Caller handles freeing deleted nodes.  Don't do it here. */
+    }
+
+    return progress;
+}
+
+/* Busy-wait on the io_poll callbacks for up to @max_ns nanoseconds.
+ * Polling also stops early on aio_notify(), e.g. when a BH was scheduled;
+ * the notifier is then readable and ppoll() returns right away.
+ *
+ * Returns true if any of them made progress.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    bool progress;
+    int64_t end_time;
+
+    assert(ctx->walking_handlers > 0);
+
+    end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+    do {
+        progress = run_poll_handlers_once(ctx);
+    } while (!progress && !atomic_read(&ctx->notified) &&
+             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+
+    return progress;
+}
+
+/* Poll for as long as the current polling time allows, but no longer than
+ * until the next timer expires.
+ *
+ * Returns true if progress was made, in which case aio_poll() does not need
+ * to sleep in ppoll().
+ */
+static bool try_poll_mode(AioContext *ctx, bool blocking)
+{
+    int64_t max_ns;
+
+    if (!blocking || !ctx->poll_ns || ctx->poll_disable_cnt) {
+        return false;
+    }
+
+    /* The cast also turns an infinite (-1) timeout into a huge value */
+    max_ns = MIN((uint64_t)aio_compute_timeout(ctx), (uint64_t)ctx->poll_ns);
+    if (max_ns && run_poll_handlers(ctx, max_ns)) {
+        ctx->poll_hits++;
+        return true;
+    }
+
+    ctx->poll_misses++;
+    return false;
+}
+
+/* Grow or shrink the polling time depending on how long we had to block */
+static void adjust_poll_time(AioContext *ctx, int64_t block_ns)
+{
+    if (block_ns <= ctx->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        int64_t grow = ctx->poll_grow ? ctx->poll_grow : 2;
+
+        if (ctx->poll_ns) {
+            ctx->poll_ns *= grow;
+        } else {
+            /* start polling at 4 microseconds */
+            ctx->poll_ns = 4000;
+        }
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     bool was_dispatching;
-    int ret;
+    int ret = 0;
     bool progress;
+    bool can_poll;
+    bool nested;
+    bool use_epoll = false;
+    int64_t timeout;
+    int64_t start = 0;
 
     was_dispatching = ctx->dispatching;
     progress = false;
@@ -208,32 +494,62 @@ bool aio_poll(AioContext *ctx, bool blocking)
      */
     aio_set_dispatching(ctx, !blocking);
 
+    /* Nested event loops, run from a handler callback, always use ppoll()
+     * so that epoll_wait() is not re-entered while the outer loop is still
+     * dispatching the events it returned.
+     */
+    nested = ctx->walking_handlers > 0;
+
     ctx->walking_handlers++;
 
-    g_array_set_size(ctx->pollfds, 0);
+    can_poll = blocking && ctx->poll_max_ns && !ctx->poll_disable_cnt;
+    if (can_poll) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
 
-    /* fill pollfds */
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-        node->pollfds_idx = -1;
-        if (!node->deleted && node->pfd.events) {
-            GPollFD pfd = {
-                .fd = node->pfd.fd,
-                .events = node->pfd.events,
-            };
-            node->pollfds_idx = ctx->pollfds->len;
-            g_array_append_val(ctx->pollfds, pfd);
+    if (try_poll_mode(ctx, blocking)) {
+        progress = true;
+    } else {
+        g_array_set_size(ctx->pollfds, 0);
+
+        /* fill pollfds, unless epoll already tracks them */
+        if (!ctx->epoll_enabled || nested) {
+            QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+                node->pollfds_idx = -1;
+                if (!node->deleted && node->pfd.events) {
+                    GPollFD pfd = {
+                        .fd = node->pfd.fd,
+                        .events = node->pfd.events,
+                    };
+                    node->pollfds_idx = ctx->pollfds->len;
+                    g_array_append_val(ctx->pollfds, pfd);
+                }
+            }
+        }
+
+        /* wait until next event */
+        timeout = blocking ? aio_compute_timeout(ctx) : 0;
+        use_epoll = !nested && aio_epoll_check_poll(ctx, ctx->pollfds->len);
+        if (use_epoll) {
+            ret = aio_epoll(ctx, timeout);
+        } else {
+            ret = qemu_poll_ns((GPollFD *)ctx->pollfds->data,
+                                 ctx->pollfds->len, timeout);
         }
     }
 
     ctx->walking_handlers--;
 
-    /* wait until next event */
-    ret = qemu_poll_ns((GPollFD *)ctx->pollfds->data,
-                         ctx->pollfds->len,
-                         blocking ? aio_compute_timeout(ctx) : 0);
+    if (can_poll) {
+        adjust_poll_time(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
+
+    aio_notify_accept(ctx);
 
-    /* if we have any readable fds, dispatch event */
-    if (ret > 0) {
+    /* if we have any readable fds, dispatch event; epoll has already
+     * stored the events in the handlers
+     */
+    if (ret > 0 && !use_epoll) {
         QLIST_FOREACH(node, &ctx->aio_handlers, node) {
             if (node->pollfds_idx != -1) {
                 GPollFD *pfd = &g_array_index(ctx->pollfds, GPollFD,
@@ -252,3 +568,35 @@ bool aio_poll(AioContext *ctx, bool blocking)
     aio_set_dispatching(ctx, was_dispatching);
     return progress;
 }
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    /* No thread synchronization here, it doesn't matter if an incorrect value
+     * is used once.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    ctx->epoll_available = ctx->epollfd != -1;
+#endif
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    aio_epoll_disable(ctx);
+    if (ctx->epollfd >= 0) {
+        close(ctx->epollfd);
+    }
+#endif
+}
@@ -351,3 +351,38 @@ bool aio_poll(AioContext *ctx, bool blocking)
     aio_set_dispatching(ctx, was_dispatching);
     return progress;
 }
+
+/* There is no poll mode on Windows, the io_poll callbacks are never used */
+void aio_set_fd_handler_poll(AioContext *ctx,
+                             int fd,
+                             IOHandler *io_read,
+                             IOHandler *io_write,
+                             AioPollFn *io_poll,
+                             void *opaque)
+{
+    aio_set_fd_handler(ctx, fd, io_read, io_write, opaque);
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 EventNotifierHandler *io_read,
+                                 AioPollFn *io_poll)
+{
+    aio_set_event_notifier(ctx, notifier, io_read);
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    if (max_ns) {
+        error_setg(errp, "AioContext polling is not implemented on Windows");
+    }
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+}
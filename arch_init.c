@@ -28,11 +28,13 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#include <zlib.h>
 #include "config.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
+#include "qemu/hbitmap.h"
 #include "sysemu/arch_init.h"
 #include "audio/audio.h"
 #include "hw/i386/pc.h"
@@ -40,6 +42,7 @@
 #include "hw/audio/audio.h"
 #include "sysemu/kvm.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "hw/i386/smbios.h"
 #include "exec/address-spaces.h"
 #include "hw/audio/pcspk.h"
@@ -126,6 +129,8 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
+#define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_POSTCOPY_DISCARD 0x200
 
 static struct defconfig_file {
     const char *filename;
@@ -240,6 +245,9 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
+    uint64_t compress_pages;
+    uint64_t compress_busy;
+    uint64_t compress_bytes;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -304,6 +312,30 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+uint64_t compress_mig_pages_transferred(void)
+{
+    return acct_info.compress_pages;
+}
+
+uint64_t compress_mig_busy(void)
+{
+    return acct_info.compress_busy;
+}
+
+uint64_t compress_mig_bytes_transferred(void)
+{
+    return acct_info.compress_bytes;
+}
+
+double compress_mig_rate(void)
+{
+    if (!acct_info.compress_bytes) {
+        return 0;
+    }
+    return (double)acct_info.compress_pages * TARGET_PAGE_SIZE /
+           acct_info.compress_bytes;
+}
+
 static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
                              int cont, int flag)
 {
@@ -327,10 +359,30 @@ static RAMBlock *last_seen_block;
 /* This is the last block from where we have sent data */
 static RAMBlock *last_sent_block;
 static ram_addr_t last_offset;
-static unsigned long *migration_bitmap;
+/* Hierarchical so that finding the next dirty page skips clean regions
+ * in O(log n) instead of scanning the whole bitmap.
+ */
+static HBitmap *migration_bitmap;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
+/* Set once we've switched to postcopy */
+static bool ram_postcopy_active;
+
+/* Pages the destination asked for in postcopy, sent ahead of the rest */
+typedef struct RAMSrcPageRequest {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    ram_addr_t len;
+
+    QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
+} RAMSrcPageRequest;
+
+static QemuMutex src_page_req_mutex;
+static QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(src_page_requests);
+/* Requests are only queued between setup and migration_end() */
+static bool src_page_req_open;
 
 /* Update the xbzrle cache to reflect a page that's been sent as all 0.
  * The important thing is that a stale (not-yet-0'd) page be replaced
@@ -422,15 +474,21 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     unsigned long size = base + (mr_size >> TARGET_PAGE_BITS);
 
     unsigned long next;
+    HBitmapIter hbi;
+    int64_t item;
 
     if (ram_bulk_stage && nr > base) {
         next = nr + 1;
+    } else if (nr >= size) {
+        next = size;
     } else {
-        next = find_next_bit(migration_bitmap, size, nr);
+        hbitmap_iter_init(&hbi, migration_bitmap, nr);
+        item = hbitmap_iter_next(&hbi);
+        next = (item < 0 || item >= size) ? size : item;
     }
 
     if (next < size) {
-        clear_bit(next, migration_bitmap);
+        hbitmap_reset(migration_bitmap, next, 1);
         migration_dirty_pages--;
     }
     return (next - base) << TARGET_PAGE_BITS;
@@ -439,11 +497,12 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
 static inline bool migration_bitmap_set_dirty(ram_addr_t addr)
 {
     bool ret;
-    int nr = addr >> TARGET_PAGE_BITS;
+    uint64_t nr = addr >> TARGET_PAGE_BITS;
 
-    ret = test_and_set_bit(nr, migration_bitmap);
+    ret = hbitmap_get(migration_bitmap, nr);
 
     if (!ret) {
+        hbitmap_set(migration_bitmap, nr, 1);
         migration_dirty_pages++;
     }
     return ret;
@@ -456,17 +515,18 @@ static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 
     /* start address is aligned at the start of a word? */
     if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
+        unsigned long k;
+        unsigned long end = page + BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
         unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
+        unsigned long *summary = ram_list.dirty_memory_summary;
 
-        for (k = page; k < page + nr; k++) {
+        /* Only visit the words that the summary says may be dirty.  */
+        for (k = find_next_bit(summary, end, page); k < end;
+             k = find_next_bit(summary, end, k + 1)) {
+            clear_bit(k, summary);
             if (src[k]) {
-                unsigned long new_dirty;
-                new_dirty = ~migration_bitmap[k];
-                migration_bitmap[k] |= src[k];
-                new_dirty &= src[k];
-                migration_dirty_pages += ctpopl(new_dirty);
+                migration_dirty_pages +=
+                    hbitmap_set_word(migration_bitmap, k, src[k]);
                 src[k] = 0;
             }
         }
@@ -505,10 +565,12 @@ static void migration_bitmap_sync(void)
     MigrationState *s = migrate_get_current();
     int64_t end_time;
     int64_t bytes_xfer_now;
+    int64_t sync_start, sync_time;
     static uint64_t xbzrle_cache_miss_prev;
     static uint64_t iterations_prev;
 
     bitmap_sync_count++;
+    sync_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     if (!bytes_xfer_prev) {
         bytes_xfer_prev = ram_bytes_transferred();
@@ -526,6 +588,9 @@ static void migration_bitmap_sync(void)
     }
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
+    sync_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - sync_start;
+    s->dirty_sync_time = sync_time;
+    s->dirty_sync_total_time += sync_time;
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -569,13 +634,221 @@ static void migration_bitmap_sync(void)
     }
 }
 
+/* Multi-threaded compression.  Pages are handed to the compression
+ * threads in round-robin order and their output is written to the stream
+ * in the same order, so the stream never reorders the pages it carries.
+ * All pending output is flushed before each RAM_SAVE_FLAG_EOS: a page
+ * can only be dirtied and sent again after the next bitmap sync, which
+ * happens between two sections, so no two copies of a page are ever in
+ * flight at the same time.
+ */
+typedef struct CompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    int level;
+    /* Protected by mutex.  */
+    bool busy;
+    bool done;
+    bool quit;
+    RAMBlock *block;
+    ram_addr_t offset;
+    /* The page was already copied, do not read guest RAM.  */
+    bool copied;
+    /* Owned by the thread while busy && !done.  */
+    uint8_t *page;
+    uint8_t *buf;
+    uLongf len;
+} CompressParam;
+
+static CompressParam *comp_param;
+static int comp_thread_count;
+static int comp_next;
+
+static void *do_data_compress(void *opaque)
+{
+    CompressParam *param = opaque;
+    uint8_t *p;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (!param->busy || param->done) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+            continue;
+        }
+        qemu_mutex_unlock(&param->mutex);
+
+        /* Work on a copy, deflate does not like its input changing
+         * under its feet.
+         */
+        if (!param->copied) {
+            p = memory_region_get_ram_ptr(param->block->mr) + param->offset;
+            memcpy(param->page, p, TARGET_PAGE_SIZE);
+        }
+        param->len = compressBound(TARGET_PAGE_SIZE);
+        if (compress2(param->buf, &param->len, param->page, TARGET_PAGE_SIZE,
+                      param->level) != Z_OK) {
+            param->len = 0;
+        }
+
+        qemu_mutex_lock(&param->mutex);
+        param->done = true;
+        qemu_cond_signal(&param->cond);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static void compress_threads_init(void)
+{
+    int i;
+
+    comp_thread_count = migrate_compress_threads();
+    comp_next = 0;
+    comp_param = g_new0(CompressParam, comp_thread_count);
+    acct_info.compress_pages = 0;
+    acct_info.compress_busy = 0;
+    acct_info.compress_bytes = 0;
+    for (i = 0; i < comp_thread_count; i++) {
+        CompressParam *param = &comp_param[i];
+
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        param->level = migrate_compress_level();
+        param->page = g_malloc(TARGET_PAGE_SIZE);
+        param->buf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        qemu_thread_create(&param->thread, "compress", do_data_compress,
+                           param, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void compress_threads_join(void)
+{
+    int i;
+
+    if (!comp_param) {
+        return;
+    }
+    for (i = 0; i < comp_thread_count; i++) {
+        CompressParam *param = &comp_param[i];
+
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+        qemu_thread_join(&param->thread);
+        qemu_cond_destroy(&param->cond);
+        qemu_mutex_destroy(&param->mutex);
+        g_free(param->page);
+        g_free(param->buf);
+    }
+    g_free(comp_param);
+    comp_param = NULL;
+    comp_thread_count = 0;
+}
+
+/* Wait for @param to finish and write its page to the stream.  Pages that
+ * do not shrink are sent uncompressed.  Returns the number of bytes
+ * written.
+ */
+static int compress_flush_one(QEMUFile *f, CompressParam *param)
+{
+    int bytes_sent;
+    int cont;
+
+    qemu_mutex_lock(&param->mutex);
+    if (param->busy && !param->done) {
+        acct_info.compress_busy++;
+        do {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        } while (!param->done);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    if (!param->busy) {
+        return 0;
+    }
+
+    cont = (param->block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    if (param->len > 0 && param->len < TARGET_PAGE_SIZE) {
+        bytes_sent = save_block_hdr(f, param->block, param->offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS_PAGE);
+        qemu_put_be32(f, param->len);
+        qemu_put_buffer(f, param->buf, param->len);
+        bytes_sent += 4 + param->len;
+        acct_info.compress_pages++;
+        acct_info.compress_bytes += 4 + param->len;
+    } else {
+        bytes_sent = save_block_hdr(f, param->block, param->offset, cont,
+                                    RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, param->page, TARGET_PAGE_SIZE);
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+    last_sent_block = param->block;
+
+    qemu_mutex_lock(&param->mutex);
+    param->busy = false;
+    param->done = false;
+    qemu_mutex_unlock(&param->mutex);
+
+    return bytes_sent;
+}
+
+/* Queue a page for compression.  If @data is not NULL it is compressed
+ * instead of the current contents of guest RAM.  Returns the number of
+ * bytes written for the page that previously occupied the chosen thread.
+ */
+static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                           ram_addr_t offset,
+                                           const uint8_t *data)
+{
+    CompressParam *param = &comp_param[comp_next];
+    int bytes_sent;
+
+    comp_next = (comp_next + 1) % comp_thread_count;
+    bytes_sent = compress_flush_one(f, param);
+
+    /* The thread is idle, so param->page is ours until busy is set */
+    if (data) {
+        memcpy(param->page, data, TARGET_PAGE_SIZE);
+    }
+
+    qemu_mutex_lock(&param->mutex);
+    param->block = block;
+    param->offset = offset;
+    param->copied = data != NULL;
+    param->busy = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    return bytes_sent;
+}
+
+static int flush_compressed_data(QEMUFile *f)
+{
+    int i, bytes_sent = 0;
+
+    if (!comp_param) {
+        return 0;
+    }
+    for (i = 0; i < comp_thread_count; i++) {
+        bytes_sent += compress_flush_one(f, &comp_param[comp_next]);
+        comp_next = (comp_next + 1) % comp_thread_count;
+    }
+    return bytes_sent;
+}
+
 /*
- * ram_save_page: Send the given page to the stream
+ * ram_save_page: Send the given page to the stream, or queue it for
+ * compression
  *
- * Returns: Number of bytes written.
+ * Returns: Number of pages sent or queued (0 or 1); the number of bytes
+ *          written is added to *bytes_transferred.
  */
 static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
-                         bool last_stage)
+                         bool last_stage, uint64_t *bytes_transferred)
 {
     int bytes_sent;
     int cont;
@@ -626,6 +899,18 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
         }
     }
 
+    if (bytes_sent == -1 && comp_param) {
+        /* The page header is written when the compressed data is.  When
+         * XBZRLE has just cached the page, p points to the cached copy:
+         * send exactly that, since the next delta is encoded against it.
+         */
+        *bytes_transferred +=
+            compress_page_with_multi_thread(f, block, offset,
+                                            send_async ? NULL : p);
+        XBZRLE_cache_unlock();
+        return 1;
+    }
+
     /* XBZRLE overflow or normal page */
     if (bytes_sent == -1) {
         bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
@@ -640,22 +925,65 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
 
     XBZRLE_cache_unlock();
 
-    return bytes_sent;
+    if (bytes_sent <= 0) {
+        return 0;
+    }
+    last_sent_block = block;
+    *bytes_transferred += bytes_sent;
+    return 1;
+}
+
+/*
+ * ram_save_postcopy_page: Send a page after the switch to postcopy
+ *
+ * The destination places each page in a single go while the guest may
+ * already be waiting on it, so the page goes out as it is or as a zero
+ * page, never XBZRLE encoded or compressed.
+ *
+ * Returns: Number of pages sent (1)
+ */
+static int ram_save_postcopy_page(QEMUFile *f, RAMBlock *block,
+                                  ram_addr_t offset,
+                                  uint64_t *bytes_transferred)
+{
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    uint8_t *p = memory_region_get_ram_ptr(block->mr) + offset;
+    int bytes_sent;
+
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        acct_info.dup_pages++;
+        bytes_sent = save_block_hdr(f, block, offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        bytes_sent++;
+    } else {
+        /* The source guest is stopped, so the page can't change under us */
+        bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+
+    last_sent_block = block;
+    *bytes_transferred += bytes_sent;
+    return 1;
 }
 
 /*
  * ram_find_and_save_block: Finds a page to send and sends it to f
  *
- * Returns:  The number of bytes written.
+ * Returns:  The number of pages sent or queued; the number of bytes
+ *           written is added to *bytes_transferred.
  *           0 means no dirty pages
  */
 
-static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
+static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
+                                   uint64_t *bytes_transferred)
 {
     RAMBlock *block = last_seen_block;
     ram_addr_t offset = last_offset;
     bool complete_round = false;
-    int bytes_sent = 0;
+    int pages = 0;
     MemoryRegion *mr;
 
     if (!block)
@@ -677,11 +1005,16 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
                 ram_bulk_stage = false;
             }
         } else {
-            bytes_sent = ram_save_page(f, block, offset, last_stage);
+            if (ram_postcopy_active) {
+                pages = ram_save_postcopy_page(f, block, offset,
+                                               bytes_transferred);
+            } else {
+                pages = ram_save_page(f, block, offset, last_stage,
+                                      bytes_transferred);
+            }
 
             /* if page is unmodified, continue to the next */
-            if (bytes_sent > 0) {
-                last_sent_block = block;
+            if (pages > 0) {
                 break;
             }
         }
@@ -689,7 +1022,7 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
     last_seen_block = block;
     last_offset = offset;
 
-    return bytes_sent;
+    return pages;
 }
 
 static uint64_t bytes_transferred;
@@ -740,11 +1073,23 @@ void free_xbzrle_decoded_buf(void)
 
 static void migration_end(void)
 {
+    RAMSrcPageRequest *entry;
+
+    ram_postcopy_active = false;
+    qemu_mutex_lock(&src_page_req_mutex);
+    src_page_req_open = false;
+    while ((entry = QSIMPLEQ_FIRST(&src_page_requests))) {
+        QSIMPLEQ_REMOVE_HEAD(&src_page_requests, next_req);
+        g_free(entry);
+    }
+    qemu_mutex_unlock(&src_page_req_mutex);
+
     if (migration_bitmap) {
         memory_global_dirty_log_stop();
-        g_free(migration_bitmap);
+        hbitmap_free(migration_bitmap);
         migration_bitmap = NULL;
     }
+    compress_threads_join();
 
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
@@ -814,14 +1159,18 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         acct_clear();
     }
 
+    if (migrate_use_compression()) {
+        compress_threads_init();
+    }
+
     qemu_mutex_lock_iothread();
     qemu_mutex_lock_ramlist();
     bytes_transferred = 0;
     reset_ram_globals();
 
     ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
-    migration_bitmap = bitmap_new(ram_bitmap_pages);
-    bitmap_set(migration_bitmap, 0, ram_bitmap_pages);
+    migration_bitmap = hbitmap_alloc(ram_bitmap_pages, 0);
+    hbitmap_set(migration_bitmap, 0, ram_bitmap_pages);
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -839,6 +1188,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     migration_bitmap_sync();
     qemu_mutex_unlock_iothread();
 
+    qemu_mutex_lock(&src_page_req_mutex);
+    src_page_req_open = true;
+    qemu_mutex_unlock(&src_page_req_mutex);
+
     qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
 
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
@@ -862,7 +1215,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     int ret;
     int i;
     int64_t t0;
-    int total_sent = 0;
+    uint64_t total_sent = 0;
 
     qemu_mutex_lock_ramlist();
 
@@ -875,14 +1228,13 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
     while ((ret = qemu_file_rate_limit(f)) == 0) {
-        int bytes_sent;
+        int pages;
 
-        bytes_sent = ram_find_and_save_block(f, false);
+        pages = ram_find_and_save_block(f, false, &total_sent);
         /* no more blocks to sent */
-        if (bytes_sent == 0) {
+        if (pages == 0) {
             break;
         }
-        total_sent += bytes_sent;
         acct_info.iterations++;
         check_guest_throttling();
         /* we want to check in the 1st loop, just in case it was the 1st time
@@ -900,6 +1252,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         i++;
     }
+    total_sent += flush_compressed_data(f);
 
     qemu_mutex_unlock_ramlist();
 
@@ -926,26 +1279,81 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     return total_sent;
 }
 
+/*
+ * Tell the destination which pages are still dirty: it throws away what
+ * it got for them during precopy, so that they fault once the guest runs
+ * there.  Each block is sent by name, followed by (start, length) pairs
+ * in bytes and a zero length; an empty name ends the list.
+ */
+static void ram_postcopy_send_discard(QEMUFile *f)
+{
+    int64_t size = last_ram_offset() >> TARGET_PAGE_BITS;
+    RAMBlock *block;
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY_DISCARD);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        int64_t first = block->offset >> TARGET_PAGE_BITS;
+        int64_t last = first + (block->used_length >> TARGET_PAGE_BITS);
+        int64_t start, end;
+        HBitmapIter hbi;
+
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+
+        hbitmap_iter_init(&hbi, migration_bitmap, first);
+        start = hbitmap_iter_next(&hbi);
+        while (start >= 0 && start < last) {
+            end = start + 1;
+            while (end < last && hbitmap_get(migration_bitmap, end)) {
+                end++;
+            }
+            qemu_put_be64(f, (start - first) << TARGET_PAGE_BITS);
+            qemu_put_be64(f, (end - start) << TARGET_PAGE_BITS);
+
+            if (end >= size) {
+                break;
+            }
+            hbitmap_iter_init(&hbi, migration_bitmap, end);
+            start = hbitmap_iter_next(&hbi);
+        }
+        qemu_put_be64(f, 0);
+        qemu_put_be64(f, 0);
+    }
+    qemu_put_byte(f, 0);
+}
+
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     qemu_mutex_lock_ramlist();
     migration_bitmap_sync();
 
+    if (migration_in_postcopy(migrate_get_current())) {
+        /* The pages themselves follow in ram_postcopy_iterate() */
+        ram_postcopy_send_discard(f);
+        ram_bulk_stage = false;
+        ram_postcopy_active = true;
+
+        qemu_mutex_unlock_ramlist();
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 0;
+    }
+
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
     /* try transferring iterative blocks of memory */
 
     /* flush all remaining blocks regardless of rate limiting */
     while (true) {
-        int bytes_sent;
+        int pages;
 
-        bytes_sent = ram_find_and_save_block(f, true);
+        pages = ram_find_and_save_block(f, true, &bytes_transferred);
         /* no more blocks to sent */
-        if (bytes_sent == 0) {
+        if (pages == 0) {
             break;
         }
-        bytes_transferred += bytes_sent;
     }
+    bytes_transferred += flush_compressed_data(f);
 
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
     migration_end();
@@ -956,6 +1364,145 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     return 0;
 }
 
+/*
+ * Queue a request from the destination for 'len' bytes at 'start' in
+ * the RAMBlock called 'rbname'; called from the return path thread.
+ */
+int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
+{
+    RAMSrcPageRequest *new_entry;
+    RAMBlock *block;
+
+    qemu_mutex_lock_ramlist();
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(rbname, block->idstr, sizeof(block->idstr))) {
+            break;
+        }
+    }
+    qemu_mutex_unlock_ramlist();
+
+    if (!block) {
+        error_report("ram_save_queue_pages no block '%s'", rbname);
+        return -1;
+    }
+    if (start + len > block->used_length) {
+        error_report("ram_save_queue_pages request overrun start="
+                     RAM_ADDR_FMT " len=" RAM_ADDR_FMT " blocklen="
+                     RAM_ADDR_FMT, start, len, block->used_length);
+        return -1;
+    }
+
+    new_entry = g_new0(RAMSrcPageRequest, 1);
+    new_entry->rb = block;
+    new_entry->offset = start & TARGET_PAGE_MASK;
+    new_entry->len = len;
+
+    qemu_mutex_lock(&src_page_req_mutex);
+    if (!src_page_req_open) {
+        /*
+         * The return path can still deliver requests after the last page
+         * went out; nothing would take them off the queue any more.
+         */
+        qemu_mutex_unlock(&src_page_req_mutex);
+        g_free(new_entry);
+        return 0;
+    }
+    QSIMPLEQ_INSERT_TAIL(&src_page_requests, new_entry, next_req);
+    qemu_mutex_unlock(&src_page_req_mutex);
+
+    return 0;
+}
+
+/*
+ * Send the pages of the oldest request from the destination, whether or
+ * not they are still dirty: a clean one may be a zero page that the
+ * destination never populated.
+ *
+ * Returns: Number of pages sent, 0 if nothing was queued
+ */
+static int ram_save_requested_pages(QEMUFile *f, uint64_t *bytes_transferred)
+{
+    RAMSrcPageRequest *entry;
+    ram_addr_t offset;
+    int pages = 0;
+
+    qemu_mutex_lock(&src_page_req_mutex);
+    entry = QSIMPLEQ_FIRST(&src_page_requests);
+    if (entry) {
+        QSIMPLEQ_REMOVE_HEAD(&src_page_requests, next_req);
+    }
+    qemu_mutex_unlock(&src_page_req_mutex);
+
+    if (!entry) {
+        return 0;
+    }
+
+    for (offset = entry->offset; offset < entry->offset + entry->len;
+         offset += TARGET_PAGE_SIZE) {
+        uint64_t nr = (entry->rb->offset + offset) >> TARGET_PAGE_BITS;
+
+        if (hbitmap_get(migration_bitmap, nr)) {
+            hbitmap_reset(migration_bitmap, nr, 1);
+            migration_dirty_pages--;
+        }
+        pages += ram_save_postcopy_page(f, entry->rb, offset,
+                                        bytes_transferred);
+    }
+    g_free(entry);
+
+    return pages;
+}
+
+/*
+ * ram_postcopy_iterate: Send the pages the destination asked for, then
+ * carry on with the remaining dirty ones
+ *
+ * Returns: 1 once everything has been sent, 0 if there is more to do,
+ *          negative on error
+ */
+int ram_postcopy_iterate(QEMUFile *f)
+{
+    bool done = false;
+    int i, ret;
+
+    qemu_mutex_lock_ramlist();
+    for (i = 0; i < 64; i++) {
+        if (ram_save_requested_pages(f, &bytes_transferred) > 0) {
+            /* Someone is waiting for this one */
+            qemu_fflush(f);
+            continue;
+        }
+        if (ram_find_and_save_block(f, true, &bytes_transferred) == 0) {
+            done = true;
+            break;
+        }
+    }
+    qemu_mutex_unlock_ramlist();
+
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!done) {
+        return 0;
+    }
+
+    /*
+     * Anything the destination asks for from now on was either sent
+     * already or is a zero page that it will get once it unregisters
+     * guest RAM on seeing EOS.
+     */
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    qemu_fflush(f);
+
+    qemu_mutex_lock_iothread();
+    migration_end();
+    qemu_mutex_unlock_iothread();
+
+    ret = qemu_file_get_error(f);
+    return ret < 0 ? ret : 1;
+}
+
 static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
 {
     uint64_t remaining_size;
@@ -1049,6 +1596,285 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
     }
 }
 
+/* Decompression threads.  Like on the sending side pages are handed out
+ * in round-robin order; all threads are drained at each
+ * RAM_SAVE_FLAG_EOS, before the same page can appear again in the stream.
+ */
+typedef struct DecompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* Protected by mutex.  */
+    bool busy;
+    bool quit;
+    bool error;
+    /* Owned by the thread while busy.  */
+    void *des;
+    uint8_t *compbuf;
+    int len;
+} DecompressParam;
+
+static DecompressParam *decomp_param;
+static int decomp_thread_count;
+static int decomp_next;
+
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+    uLongf pagesize;
+    int ret;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (!param->busy) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+            continue;
+        }
+        qemu_mutex_unlock(&param->mutex);
+
+        pagesize = TARGET_PAGE_SIZE;
+        ret = uncompress(param->des, &pagesize, param->compbuf, param->len);
+
+        qemu_mutex_lock(&param->mutex);
+        if (ret != Z_OK || pagesize != TARGET_PAGE_SIZE) {
+            param->error = true;
+        }
+        param->busy = false;
+        qemu_cond_signal(&param->cond);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static void decompress_threads_init(void)
+{
+    int i;
+
+    decomp_thread_count = migrate_decompress_threads();
+    decomp_next = 0;
+    decomp_param = g_new0(DecompressParam, decomp_thread_count);
+    for (i = 0; i < decomp_thread_count; i++) {
+        DecompressParam *param = &decomp_param[i];
+
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        param->compbuf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        qemu_thread_create(&param->thread, "decompress", do_data_decompress,
+                           param, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void wait_for_decompress_idle(DecompressParam *param)
+{
+    while (param->busy) {
+        qemu_cond_wait(&param->cond, &param->mutex);
+    }
+}
+
+/* Wait for all pending pages; returns -EINVAL if any of them was corrupt */
+static int wait_for_decompress_done(void)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < decomp_thread_count; i++) {
+        DecompressParam *param = &decomp_param[i];
+
+        qemu_mutex_lock(&param->mutex);
+        wait_for_decompress_idle(param);
+        if (param->error) {
+            ret = -EINVAL;
+        }
+        qemu_mutex_unlock(&param->mutex);
+    }
+    return ret;
+}
+
+void migrate_decompress_threads_join(void)
+{
+    int i;
+
+    if (!decomp_param) {
+        return;
+    }
+    for (i = 0; i < decomp_thread_count; i++) {
+        DecompressParam *param = &decomp_param[i];
+
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+        qemu_thread_join(&param->thread);
+        qemu_cond_destroy(&param->cond);
+        qemu_mutex_destroy(&param->mutex);
+        g_free(param->compbuf);
+    }
+    g_free(decomp_param);
+    decomp_param = NULL;
+    decomp_thread_count = 0;
+}
+
+static int load_compressed_page(QEMUFile *f, void *host)
+{
+    DecompressParam *param;
+    int len;
+
+    len = qemu_get_be32(f);
+    if (len <= 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+        error_report("Invalid compressed page length %d", len);
+        return -EINVAL;
+    }
+
+    if (!decomp_param) {
+        decompress_threads_init();
+    }
+    param = &decomp_param[decomp_next];
+    decomp_next = (decomp_next + 1) % decomp_thread_count;
+
+    qemu_mutex_lock(&param->mutex);
+    wait_for_decompress_idle(param);
+    qemu_mutex_unlock(&param->mutex);
+
+    qemu_get_buffer(f, param->compbuf, len);
+
+    qemu_mutex_lock(&param->mutex);
+    param->des = host;
+    param->len = len;
+    param->busy = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    return 0;
+}
+
+/*
+ * Throw away the pages that the source is going to send again after the
+ * switch to postcopy (see ram_postcopy_send_discard), then hand guest
+ * RAM over to userfaultfd.
+ */
+static int ram_load_postcopy_discard(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    char id[256];
+    uint8_t len;
+    int ret;
+
+    if (getpagesize() != TARGET_PAGE_SIZE) {
+        error_report("Postcopy needs the host page size (%d) to match the "
+                     "target page size (%d)", getpagesize(),
+                     (int)TARGET_PAGE_SIZE);
+        return -EINVAL;
+    }
+
+    while ((len = qemu_get_byte(f)) != 0) {
+        RAMBlock *block;
+        uint8_t *host;
+
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block) {
+            error_report("Can't find block %s!", id);
+            return -EINVAL;
+        }
+        host = memory_region_get_ram_ptr(block->mr);
+
+        while (true) {
+            uint64_t start = qemu_get_be64(f);
+            uint64_t length = qemu_get_be64(f);
+
+            if (!length) {
+                break;
+            }
+            if (start + length > block->used_length) {
+                error_report("Postcopy discard past the end of %s", id);
+                return -EINVAL;
+            }
+            ret = postcopy_ram_discard_range(host + start, length);
+            if (ret) {
+                return ret;
+            }
+        }
+
+        ret = qemu_file_get_error(f);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return postcopy_ram_incoming_init(mis);
+}
+
+/*
+ * Load the pages that the source streams after the switch to postcopy,
+ * up to its final EOS; the guest may be running and waiting for any of
+ * them, so each is placed atomically.  Called from the listen thread.
+ */
+int ram_load_postcopy(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    uint8_t *page_buffer = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+    int flags = 0, ret = 0;
+
+    while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
+        ram_addr_t addr;
+        void *host;
+        uint8_t ch;
+
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
+        case RAM_SAVE_FLAG_COMPRESS:
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+
+            ch = qemu_get_byte(f);
+            if (ch == 0) {
+                ret = postcopy_place_zero_page(mis, host);
+            } else {
+                memset(page_buffer, ch, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(mis, host, page_buffer);
+            }
+            break;
+        case RAM_SAVE_FLAG_PAGE:
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+
+            qemu_get_buffer(f, page_buffer, TARGET_PAGE_SIZE);
+            ret = postcopy_place_page(mis, host, page_buffer);
+            break;
+        case RAM_SAVE_FLAG_EOS:
+            /* normal exit */
+            break;
+        default:
+            error_report("Unknown combination of migration flags: %#x"
+                         " (postcopy mode)", flags);
+            ret = -EINVAL;
+        }
+        if (!ret) {
+            ret = qemu_file_get_error(f);
+        }
+    }
+
+    qemu_vfree(page_buffer);
+    return ret;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0;
@@ -1144,6 +1970,19 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_COMPRESS_PAGE:
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+
+            ret = load_compressed_page(f, host);
+            break;
+        case RAM_SAVE_FLAG_POSTCOPY_DISCARD:
+            ret = ram_load_postcopy_discard(f);
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -1161,6 +2000,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    if (decomp_param && wait_for_decompress_done() < 0) {
+        error_report("Failed to decompress RAM pages");
+        if (!ret) {
+            ret = -EINVAL;
+        }
+    }
+
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
@@ -1178,6 +2024,7 @@ static SaveVMHandlers savevm_ram_handlers = {
 void ram_mig_init(void)
 {
     qemu_mutex_init(&XBZRLE.lock);
+    qemu_mutex_init(&src_page_req_mutex);
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 }
 
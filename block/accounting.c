@@ -46,6 +46,17 @@ void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
         qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - cookie->start_time_ns;
 }
 
+/* Count @num_requests requests that were merged into others before being
+ * submitted; each of them still goes through block_acct_done().
+ */
+void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
+                           int num_requests)
+{
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    stats->merged[type] += num_requests;
+}
+
 
 void block_acct_highest_sector(BlockAcctStats *stats, int64_t sector_num,
                                unsigned int nb_sectors)
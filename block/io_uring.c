@@ -0,0 +1,391 @@
+/*
+ * Linux io_uring support.
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Requests are placed in a submission ring that is shared with the kernel
+ * and their results are read from a completion ring, so submitting a batch
+ * takes a single io_uring_enter() and reaping completions takes no system
+ * call at all.  Unlike Linux AIO, io_uring also handles buffered I/O and
+ * fsync asynchronously, which avoids the thread pool for those as well.
+ */
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+
+#include <liburing.h>
+
+/* Ring size (per-device), same as the Linux AIO queue depth */
+#define MAX_ENTRIES 128
+
+/* Back-off before resubmitting when the kernel refused a submission */
+#define SUBMIT_RETRY_MS 1
+
+typedef struct LuringAIOCB {
+    BlockAIOCB common;
+    struct LuringState *s;
+    struct io_uring_sqe sqeq;
+    ssize_t ret;
+    size_t nbytes;
+    QEMUIOVector *qiov;
+    bool is_read;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+
+    /* What is left of a short read, and how much of it has been read */
+    QEMUIOVector resubmit_qiov;
+    size_t total_read;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+} LuringQueue;
+
+typedef struct LuringState {
+    struct io_uring ring;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* I/O completion processing */
+    QEMUBH *completion_bh;
+
+    /* Resubmits the ring when it was refused with nothing in flight */
+    QEMUTimer *retry_timer;
+} LuringState;
+
+static void ioq_submit(LuringState *s);
+
+/* Requests are waiting for a submission, queued or already in the ring */
+static bool ioq_pending(LuringState *s)
+{
+    return !QSIMPLEQ_EMPTY(&s->io_q.submit_queue) ||
+           io_uring_sq_ready(&s->ring);
+}
+
+/*
+ * Queue a request again, e.g. after the kernel returned -EAGAIN for it.
+ */
+static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
+{
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+/*
+ * A read can return less than was asked for without having hit the end of
+ * the file, e.g. when it was interrupted or crossed into a range that is
+ * not in the page cache.  Read the rest starting where this read stopped.
+ */
+static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
+                                       int nread)
+{
+    QEMUIOVector *resubmit_qiov = &luringcb->resubmit_qiov;
+    size_t remaining;
+
+    luringcb->total_read += nread;
+    remaining = luringcb->qiov->size - luringcb->total_read;
+
+    if (resubmit_qiov->iov == NULL) {
+        qemu_iovec_init(resubmit_qiov, luringcb->qiov->niov);
+    } else {
+        qemu_iovec_reset(resubmit_qiov);
+    }
+    qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
+                      remaining);
+
+    luringcb->sqeq.off += nread;
+    luringcb->sqeq.addr = (__u64)(uintptr_t)resubmit_qiov->iov;
+    luringcb->sqeq.len = resubmit_qiov->niov;
+
+    luring_resubmit(s, luringcb);
+}
+
+/*
+ * Completes an AIO request (calls the callback and frees the ACB).
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *luringcb)
+{
+    ssize_t ret;
+
+    ret = luringcb->ret;
+    if (ret != -ECANCELED && luringcb->qiov) {
+        if (ret >= 0 && luringcb->is_read) {
+            ret += luringcb->total_read;
+        }
+        if (ret == luringcb->nbytes) {
+            ret = 0;
+        } else if (ret >= 0) {
+            /* Only a read that returned 0 got here: EOF, pad with zeros. */
+            if (luringcb->is_read) {
+                qemu_iovec_memset(luringcb->qiov, ret, 0,
+                                  luringcb->qiov->size - ret);
+                ret = 0;
+            } else {
+                ret = -EINVAL;
+            }
+        }
+    }
+    luringcb->common.cb(luringcb->common.opaque, ret);
+
+    if (luringcb->resubmit_qiov.iov != NULL) {
+        qemu_iovec_destroy(&luringcb->resubmit_qiov);
+    }
+    qemu_aio_unref(luringcb);
+}
+
+/*
+ * Walk the completion ring and complete every request found there.  This
+ * only reads shared memory, no system call is needed.
+ *
+ * Like the Linux AIO completion BH, this supports nested event loops: the
+ * BH is scheduled before each callback, so that a callback that runs
+ * aio_poll() still sees the completions that follow it.
+ */
+static void luring_process_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        LuringAIOCB *luringcb = io_uring_cqe_get_data(cqe);
+        int ret = cqe->res;
+
+        io_uring_cqe_seen(&s->ring, cqe);
+        s->io_q.in_flight--;
+
+        if (ret == -EINTR || ret == -EAGAIN) {
+            luring_resubmit(s, luringcb);
+            continue;
+        }
+        if (ret > 0 && luringcb->is_read && luringcb->qiov &&
+            luringcb->total_read + ret < luringcb->qiov->size) {
+            luring_resubmit_short_read(s, luringcb, ret);
+            continue;
+        }
+        luringcb->ret = ret;
+
+        /* Reschedule so nested event loops see pending completions */
+        qemu_bh_schedule(s->completion_bh);
+
+        luring_process_completion(s, luringcb);
+    }
+
+    qemu_bh_cancel(s->completion_bh);
+
+    if (!s->io_q.plugged && ioq_pending(s)) {
+        ioq_submit(s);
+    }
+}
+
+static void luring_completion_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions(s);
+}
+
+static bool luring_poll_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    if (!io_uring_cq_ready(&s->ring)) {
+        return false;
+    }
+
+    luring_process_completions(s);
+    return true;
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(LuringAIOCB),
+};
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->submit_queue);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+/*
+ * Copy as many queued requests as fit into the submission ring and hand
+ * them to the kernel with one system call.  Requests that do not fit stay
+ * queued until completions make room.
+ */
+static void ioq_submit(LuringState *s)
+{
+    LuringAIOCB *luringcb;
+    int ret;
+
+    while (s->io_q.in_flight < MAX_ENTRIES &&
+           (luringcb = QSIMPLEQ_FIRST(&s->io_q.submit_queue)) != NULL) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+
+        if (!sqe) {
+            break;
+        }
+        *sqe = luringcb->sqeq;
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+        s->io_q.in_queue--;
+        s->io_q.in_flight++;
+    }
+
+    ret = io_uring_submit(&s->ring);
+    if (ret == -EAGAIN || ret == -EBUSY) {
+        /*
+         * The kernel is short of resources or wants its completions reaped
+         * first; the requests stay in the ring.  If the kernel still has
+         * requests of ours, their completions submit the ring again.
+         * Otherwise nothing else may come along, so try again a little
+         * later instead of spinning on a refused submission.
+         */
+        if (s->io_q.in_flight == io_uring_sq_ready(&s->ring)) {
+            timer_mod(s->retry_timer,
+                      qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                      SUBMIT_RETRY_MS);
+        }
+    } else if (ret < 0) {
+        abort();
+    }
+    s->io_q.blocked = (s->io_q.in_queue > 0);
+}
+
+static void luring_retry_timer_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    if (ioq_pending(s)) {
+        ioq_submit(s);
+    }
+}
+
+void luring_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    LuringState *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug)
+{
+    LuringState *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0 || !unplug);
+
+    if (unplug && --s->io_q.plugged > 0) {
+        return;
+    }
+
+    if (!s->io_q.blocked && ioq_pending(s)) {
+        ioq_submit(s);
+    }
+}
+
+BlockAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type)
+{
+    LuringState *s = aio_ctx;
+    LuringAIOCB *luringcb;
+    struct io_uring_sqe *sqes;
+    off_t offset = sector_num * BDRV_SECTOR_SIZE;
+
+    luringcb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    luringcb->nbytes = nb_sectors * BDRV_SECTOR_SIZE;
+    luringcb->s = s;
+    luringcb->ret = -EINPROGRESS;
+    luringcb->is_read = (type == QEMU_AIO_READ);
+    luringcb->qiov = qiov;
+    luringcb->resubmit_qiov.iov = NULL;
+    luringcb->total_read = 0;
+
+    sqes = &luringcb->sqeq;
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqes, fd, qiov->iov, qiov->niov, offset);
+        break;
+    case QEMU_AIO_READ:
+        io_uring_prep_readv(sqes, fd, qiov->iov, qiov->niov, offset);
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        goto out_free_aiocb;
+    }
+    io_uring_sqe_set_data(sqes, luringcb);
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged || s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+    return &luringcb->common;
+
+out_free_aiocb:
+    qemu_aio_unref(luringcb);
+    return NULL;
+}
+
+void luring_detach_aio_context(void *s_, AioContext *old_context)
+{
+    LuringState *s = s_;
+
+    aio_set_fd_handler(old_context, s->ring.ring_fd, NULL, NULL, NULL);
+    qemu_bh_delete(s->completion_bh);
+    timer_del(s->retry_timer);
+    timer_free(s->retry_timer);
+}
+
+void luring_attach_aio_context(void *s_, AioContext *new_context)
+{
+    LuringState *s = s_;
+
+    s->completion_bh = aio_bh_new(new_context, luring_completion_cb, s);
+    s->retry_timer = aio_timer_new(new_context, QEMU_CLOCK_REALTIME,
+                                   SCALE_MS, luring_retry_timer_cb, s);
+    aio_set_fd_handler_poll(new_context, s->ring.ring_fd,
+                            luring_completion_cb, NULL, luring_poll_cb, s);
+}
+
+void *luring_init(void)
+{
+    LuringState *s;
+    int rc;
+
+    s = g_new0(LuringState, 1);
+    rc = io_uring_queue_init(MAX_ENTRIES, &s->ring, 0);
+    if (rc < 0) {
+        errno = -rc;
+        g_free(s);
+        return NULL;
+    }
+
+    ioq_init(&s->io_q);
+
+    return s;
+}
+
+void luring_cleanup(void *s_)
+{
+    LuringState *s = s_;
+
+    io_uring_queue_exit(&s->ring);
+    g_free(s);
+}
@@ -61,6 +61,27 @@ struct qemu_laio_state {
 
 static void ioq_submit(struct qemu_laio_state *s);
 
+/*
+ * The io_context_t returned by io_setup() points to the completion ring,
+ * which the kernel maps into our address space.  Its head and tail tell
+ * whether completions are pending without a system call.
+ */
+#define AIO_RING_MAGIC 0xa10a10a1
+
+struct aio_ring {
+    unsigned id;                /* kernel internal index number */
+    unsigned nr;                /* number of io_events */
+    unsigned head;
+    unsigned tail;
+
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;     /* size of aio_ring */
+
+    struct io_event io_events[0];
+};
+
 static inline ssize_t io_event_ret(struct io_event *ev)
 {
     return (ssize_t)(((uint64_t)ev->res2 << 32) | ev->res);
@@ -152,6 +173,21 @@ static void qemu_laio_completion_cb(EventNotifier *e)
     }
 }
 
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+
+    if (ring->magic != AIO_RING_MAGIC ||
+        atomic_read(&ring->head) == atomic_read(&ring->tail)) {
+        return false;
+    }
+
+    qemu_laio_completion_bh(s);
+    return true;
+}
+
 static void laio_cancel(BlockAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
@@ -296,7 +332,8 @@ void laio_attach_aio_context(void *s_, AioContext *new_context)
     struct qemu_laio_state *s = s_;
 
     s->completion_bh = aio_bh_new(new_context, qemu_laio_completion_bh, s);
-    aio_set_event_notifier(new_context, &s->e, qemu_laio_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, qemu_laio_completion_cb,
+                                qemu_laio_poll_cb);
 }
 
 void *laio_init(void)
@@ -22,54 +22,148 @@
  * THE SOFTWARE.
  */
 
+
+/*
+ * Tables are replaced following the ARC policy (Megiddo and Modha, "ARC: A
+ * Self-Tuning, Low Overhead Replacement Cache"): cached tables are either on
+ * t1 (seen once recently) or t2 (seen at least twice), and the offsets of
+ * tables evicted from them are remembered on the ghost lists b1 and b2. A
+ * lookup that hits a ghost shifts the target size of t1 towards the list
+ * that would have kept the table, so that both scans and a frequently used
+ * working set are served reasonably well.
+ *
+ * All lists have the most recently used element at their head.
+ */
+
+#include <sys/mman.h>
+
 #include "block/block_int.h"
 #include "qemu-common.h"
 #include "qcow2.h"
 #include "trace.h"
 
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
+    bool    frequent;   /* on t2 rather than t1 */
+    bool    used;       /* looked up since the last cache clean */
     int     ref;
+    QTAILQ_ENTRY(Qcow2CachedTable) lru;
+    QLIST_ENTRY(Qcow2CachedTable) hash;
 } Qcow2CachedTable;
 
+typedef struct Qcow2CacheGhost {
+    int64_t offset;
+    bool    frequent;   /* on b2 rather than b1 */
+    QTAILQ_ENTRY(Qcow2CacheGhost) lru;
+    QLIST_ENTRY(Qcow2CacheGhost) hash;
+} Qcow2CacheGhost;
+
+typedef struct Qcow2CachePrefetch {
+    uint64_t                offset;
+    CoQueue                 waiters;
+    QLIST_ENTRY(Qcow2CachePrefetch) next;
+} Qcow2CachePrefetch;
+
+typedef QTAILQ_HEAD(Qcow2CacheList, Qcow2CachedTable) Qcow2CacheList;
+typedef QTAILQ_HEAD(Qcow2GhostList, Qcow2CacheGhost) Qcow2GhostList;
+
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
+    void*                   table_array;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     table_size;
     bool                    depends_on_flush;
+
+    Qcow2CacheList          t1, t2, free;
+    Qcow2GhostList          b1, b2, free_ghosts;
+    int                     t1_len, t2_len, b1_len, b2_len;
+    int                     t1_target;
+    Qcow2CacheGhost*        ghosts;
+
+    /* Lookup by offset */
+    QLIST_HEAD(, Qcow2CachedTable) *table_hash;
+    QLIST_HEAD(, Qcow2CacheGhost) *ghost_hash;
+    unsigned                hash_mask;
+
+    /* Bumped whenever a table of this cache is written back or the cache is
+     * emptied, so that a table read without s->lock can be checked for
+     * having gone stale in the meantime */
+    uint64_t                generation;
+    QLIST_HEAD(, Qcow2CachePrefetch) prefetches;
+
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                evictions;
+    uint64_t                cleaned;
+    uint64_t                ghost_hits;
 };
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int i)
+{
+    return (uint8_t *) c->table_array + (size_t) i * c->table_size;
+}
+
+static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
+    int idx = table_offset / c->table_size;
+
+    assert(idx >= 0 && idx < c->size && table_offset % c->table_size == 0);
+    return idx;
+}
+
+static inline unsigned qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return (offset / c->table_size) & c->hash_mask;
+}
+
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size)
 {
-    BDRVQcowState *s = bs->opaque;
     Qcow2Cache *c;
+    unsigned nb_buckets;
     int i;
 
+    assert(num_tables > 0);
+    assert(is_power_of_2(table_size) && table_size >= BDRV_SECTOR_SIZE);
+
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->table_size = table_size;
+    QTAILQ_INIT(&c->t1);
+    QTAILQ_INIT(&c->t2);
+    QTAILQ_INIT(&c->free);
+    QTAILQ_INIT(&c->b1);
+    QTAILQ_INIT(&c->b2);
+    QTAILQ_INIT(&c->free_ghosts);
+    QLIST_INIT(&c->prefetches);
+
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
-    if (!c->entries) {
+    c->ghosts = g_try_new0(Qcow2CacheGhost, num_tables);
+    c->table_array = qemu_try_blockalign(bs->file,
+                                         (size_t) num_tables * table_size);
+    if (!c->entries || !c->ghosts || !c->table_array) {
         goto fail;
     }
 
+    nb_buckets = is_power_of_2(num_tables) ? num_tables
+                                           : pow2floor(num_tables) << 1;
+    c->hash_mask = nb_buckets - 1;
+    c->table_hash = g_new0(typeof(*c->table_hash), nb_buckets);
+    c->ghost_hash = g_new0(typeof(*c->ghost_hash), nb_buckets);
+
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_try_blockalign(bs->file, s->cluster_size);
-        if (c->entries[i].table == NULL) {
-            goto fail;
-        }
+        QTAILQ_INSERT_TAIL(&c->free, &c->entries[i], lru);
+        QTAILQ_INSERT_TAIL(&c->free_ghosts, &c->ghosts[i], lru);
     }
 
     return c;
 
 fail:
-    if (c->entries) {
-        for (i = 0; i < c->size; i++) {
-            qemu_vfree(c->entries[i].table);
-        }
-    }
+    qemu_vfree(c->table_array);
+    g_free(c->ghosts);
     g_free(c->entries);
     g_free(c);
     return NULL;
@@ -79,17 +173,115 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 {
     int i;
 
+    assert(QLIST_EMPTY(&c->prefetches));
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->table_array);
+    g_free(c->table_hash);
+    g_free(c->ghost_hash);
+    g_free(c->ghosts);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+static Qcow2CachedTable *qcow2_cache_find(Qcow2Cache *c, uint64_t offset)
+{
+    Qcow2CachedTable *t;
+
+    QLIST_FOREACH(t, &c->table_hash[qcow2_cache_hash(c, offset)], hash) {
+        if (t->offset == offset) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static Qcow2CacheGhost *qcow2_cache_find_ghost(Qcow2Cache *c, uint64_t offset)
+{
+    Qcow2CacheGhost *g;
+
+    QLIST_FOREACH(g, &c->ghost_hash[qcow2_cache_hash(c, offset)], hash) {
+        if (g->offset == offset) {
+            return g;
+        }
+    }
+    return NULL;
+}
+
+static void qcow2_cache_drop_ghost(Qcow2Cache *c, Qcow2CacheGhost *g)
+{
+    if (g->frequent) {
+        QTAILQ_REMOVE(&c->b2, g, lru);
+        c->b2_len--;
+    } else {
+        QTAILQ_REMOVE(&c->b1, g, lru);
+        c->b1_len--;
+    }
+    QLIST_REMOVE(g, hash);
+    QTAILQ_INSERT_HEAD(&c->free_ghosts, g, lru);
+}
+
+static void qcow2_cache_add_ghost(Qcow2Cache *c, uint64_t offset,
+                                  bool frequent)
+{
+    Qcow2CacheGhost *g = QTAILQ_FIRST(&c->free_ghosts);
+
+    if (g == NULL) {
+        /* Keep at most as many ghosts as tables */
+        if (c->b1_len > c->b2_len) {
+            g = QTAILQ_LAST(&c->b1, Qcow2GhostList);
+        } else {
+            g = QTAILQ_LAST(&c->b2, Qcow2GhostList);
+        }
+        qcow2_cache_drop_ghost(c, g);
+    }
+
+    QTAILQ_REMOVE(&c->free_ghosts, g, lru);
+    g->offset = offset;
+    g->frequent = frequent;
+    if (frequent) {
+        QTAILQ_INSERT_HEAD(&c->b2, g, lru);
+        c->b2_len++;
+    } else {
+        QTAILQ_INSERT_HEAD(&c->b1, g, lru);
+        c->b1_len++;
+    }
+    QLIST_INSERT_HEAD(&c->ghost_hash[qcow2_cache_hash(c, offset)], g, hash);
+}
+
+/* Takes a cached table off its list and out of the lookup table */
+static void qcow2_cache_unlink(Qcow2Cache *c, Qcow2CachedTable *t)
+{
+    if (t->frequent) {
+        QTAILQ_REMOVE(&c->t2, t, lru);
+        c->t2_len--;
+    } else {
+        QTAILQ_REMOVE(&c->t1, t, lru);
+        c->t1_len--;
+    }
+    QLIST_REMOVE(t, hash);
+    t->offset = 0;
+}
+
+static void qcow2_cache_insert(Qcow2Cache *c, Qcow2CachedTable *t,
+                               uint64_t offset, bool frequent)
+{
+    t->offset = offset;
+    t->frequent = frequent;
+    if (frequent) {
+        QTAILQ_INSERT_HEAD(&c->t2, t, lru);
+        c->t2_len++;
+    } else {
+        QTAILQ_INSERT_HEAD(&c->t1, t, lru);
+        c->t1_len++;
+    }
+    QLIST_INSERT_HEAD(&c->table_hash[qcow2_cache_hash(c, offset)], t, hash);
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -132,13 +324,13 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else if (c == s->l2_table_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else {
         ret = qcow2_pre_write_overlap_check(bs, 0,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     }
 
     if (ret < 0) {
@@ -151,13 +343,14 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+                      qcow2_cache_get_table_addr(c, i), c->table_size);
     if (ret < 0) {
         return ret;
     }
 
     c->entries[i].dirty = false;
+    c->generation++;
 
     return 0;
 }
@@ -218,106 +411,201 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 {
-    int ret, i;
+    Qcow2CachedTable *t, *next_t;
+    Qcow2CacheGhost *g, *next_g;
+    int ret;
 
     ret = qcow2_cache_flush(bs, c);
     if (ret < 0) {
         return ret;
     }
 
-    for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].cache_hits = 0;
+    QTAILQ_FOREACH_SAFE(t, &c->t1, lru, next_t) {
+        assert(t->ref == 0);
+        qcow2_cache_unlink(c, t);
+        QTAILQ_INSERT_TAIL(&c->free, t, lru);
     }
+    QTAILQ_FOREACH_SAFE(t, &c->t2, lru, next_t) {
+        assert(t->ref == 0);
+        qcow2_cache_unlink(c, t);
+        QTAILQ_INSERT_TAIL(&c->free, t, lru);
+    }
+    QTAILQ_FOREACH_SAFE(g, &c->b1, lru, next_g) {
+        qcow2_cache_drop_ghost(c, g);
+    }
+    QTAILQ_FOREACH_SAFE(g, &c->b2, lru, next_g) {
+        qcow2_cache_drop_ghost(c, g);
+    }
+    c->t1_target = 0;
+    c->generation++;
 
     return 0;
 }
 
-static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
+/*
+ * Drops all clean tables that haven't been looked up since the last call and
+ * gives their memory back to the host.
+ */
+void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
 {
+    size_t page_size = getpagesize();
     int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
-
 
     for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
+        Qcow2CachedTable *t = &c->entries[i];
+        uint8_t *table;
+        uintptr_t start, end;
+
+        if (!t->offset || t->ref || t->dirty) {
             continue;
         }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+        if (t->used) {
+            t->used = false;
+            continue;
         }
 
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
+        qcow2_cache_unlink(c, t);
+        QTAILQ_INSERT_TAIL(&c->free, t, lru);
+        c->cleaned++;
+
+        /* Only whole pages can be returned */
+        table = qcow2_cache_get_table_addr(c, i);
+        start = ROUND_UP((uintptr_t) table, page_size);
+        end = ((uintptr_t) table + c->table_size) & ~(page_size - 1);
+        if (end > start) {
+            qemu_madvise((void *) start, end - start, QEMU_MADV_DONTNEED);
+        }
     }
+}
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
+/*
+ * Picks the table to evict on a miss, following ARC's REPLACE: the least
+ * recently used table of t1 if t1 is above its target size (or equal to it
+ * and the new table was on b2), otherwise that of t2. Tables that are in use
+ * can't be evicted, so fall back to the other list if needed.
+ */
+static Qcow2CachedTable *qcow2_cache_find_entry_to_replace(Qcow2Cache *c,
+                                                           bool in_b2)
+{
+    Qcow2CacheList *lists[2] = { &c->t1, &c->t2 };
+    Qcow2CachedTable *t;
+    int first, i;
+
+    first = (c->t1_len > 0 &&
+             (c->t1_len > c->t1_target ||
+              (in_b2 && c->t1_len == c->t1_target))) ? 0 : 1;
+
+    for (i = 0; i < 2; i++) {
+        QTAILQ_FOREACH_REVERSE(t, lists[first ^ i], Qcow2CacheList, lru) {
+            if (!t->ref) {
+                return t;
+            }
+        }
     }
-    return min_index;
+
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *t;
+    Qcow2CacheGhost *g;
+    bool frequent;
     int i;
     int ret;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
+    assert((offset & (c->table_size - 1)) == 0);
+
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
+    t = qcow2_cache_find(c, offset);
+    if (t) {
+        c->hits++;
+        if (t->frequent) {
+            QTAILQ_REMOVE(&c->t2, t, lru);
+        } else {
+            QTAILQ_REMOVE(&c->t1, t, lru);
+            c->t1_len--;
+            c->t2_len++;
+            t->frequent = true;
         }
+        QTAILQ_INSERT_HEAD(&c->t2, t, lru);
+        i = t - c->entries;
+        goto found;
+    }
+
+    c->misses++;
+
+    /* Adapt the target size of t1 if we evicted this table too early */
+    g = qcow2_cache_find_ghost(c, offset);
+    frequent = g != NULL;
+    if (g) {
+        c->ghost_hits++;
+    }
+    if (g && !g->frequent) {
+        c->t1_target = MIN(c->size,
+                           c->t1_target + MAX(c->b2_len / c->b1_len, 1));
+    } else if (g) {
+        c->t1_target = MAX(0,
+                           c->t1_target - MAX(c->b1_len / c->b2_len, 1));
     }
 
-    /* If not, write a table back and replace it */
-    i = qcow2_cache_find_entry_to_replace(c);
-    trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
-                                        c == s->l2_table_cache, i);
-    if (i < 0) {
-        return i;
+    /* If the cache is full, write a table back and replace it */
+    t = QTAILQ_FIRST(&c->free);
+    if (t == NULL) {
+        t = qcow2_cache_find_entry_to_replace(c, g && g->frequent);
+        i = t - c->entries;
+        trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
+                                            c == s->l2_table_cache, i);
+
+        ret = qcow2_cache_entry_flush(bs, c, i);
+        if (ret < 0) {
+            return ret;
+        }
+
+        qcow2_cache_add_ghost(c, t->offset, t->frequent);
+        qcow2_cache_unlink(c, t);
+        c->evictions++;
+
+        /* Adding the ghost may have recycled ours */
+        g = qcow2_cache_find_ghost(c, offset);
+    } else {
+        QTAILQ_REMOVE(&c->free, t, lru);
+        i = t - c->entries;
     }
 
-    ret = qcow2_cache_entry_flush(bs, c, i);
-    if (ret < 0) {
-        return ret;
+    if (g) {
+        qcow2_cache_drop_ghost(c, g);
     }
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(c, i),
+                         c->table_size);
         if (ret < 0) {
+            QTAILQ_INSERT_HEAD(&c->free, t, lru);
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
-    c->entries[i].offset = offset;
+    qcow2_cache_insert(c, t, offset, frequent);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
-    c->entries[i].ref++;
-    *table = c->entries[i].table;
+    t->used = true;
+    t->ref++;
+    *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -337,18 +625,89 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
-int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
+/*
+ * Make sure that the table at offset is cached, reading it from the image
+ * with s->lock dropped if it isn't, so that a cache miss doesn't hold up
+ * requests that only need metadata which is already in memory.
+ *
+ * The caller must hold s->lock in coroutine context and must not have
+ * gathered any metadata state yet, because other requests may run while the
+ * lock is dropped. No reference is taken: the table may already have been
+ * evicted again when the caller gets to it, in which case the normal
+ * qcow2_cache_get() just reads it once more.
+ */
+int coroutine_fn qcow2_cache_prefetch(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset)
 {
-    int i;
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CachePrefetch prefetch, *p;
+    uint64_t generation;
+    void *buf, *table;
+    int ret;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
+    if (qcow2_cache_find(c, offset)) {
+        return 0;
+    }
+
+    /* Somebody is reading this table already, just wait for them */
+    QLIST_FOREACH(p, &c->prefetches, next) {
+        if (p->offset == offset) {
+            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_queue_wait(&p->waiters);
+            qemu_co_mutex_lock(&s->lock);
+            return 0;
         }
     }
-    return -ENOENT;
 
-found:
+    buf = qemu_try_blockalign(bs->file, c->table_size);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    trace_qcow2_cache_prefetch(qemu_coroutine_self(),
+                               c == s->l2_table_cache, offset);
+
+    prefetch.offset = offset;
+    qemu_co_queue_init(&prefetch.waiters);
+    QLIST_INSERT_HEAD(&c->prefetches, &prefetch, next);
+    generation = c->generation;
+
+    qemu_co_mutex_unlock(&s->lock);
+    if (c == s->l2_table_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+    }
+    ret = bdrv_pread(bs->file, offset, buf, c->table_size);
+    qemu_co_mutex_lock(&s->lock);
+
+    QLIST_REMOVE(&prefetch, next);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* If a table has been written back or this one has been cached (and
+     * maybe modified) by someone else, what we read may be stale already */
+    if (c->generation != generation || qcow2_cache_find(c, offset)) {
+        ret = 0;
+        goto out;
+    }
+
+    ret = qcow2_cache_get_empty(bs, c, offset, &table);
+    if (ret < 0) {
+        goto out;
+    }
+    memcpy(table, buf, c->table_size);
+    qcow2_cache_put(bs, c, &table);
+
+out:
+    qemu_co_queue_restart_all(&prefetch.waiters);
+    qemu_vfree(buf);
+    return ret;
+}
+
+int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
+{
+    int i = qcow2_cache_get_table_idx(c, *table);
+
     c->entries[i].ref--;
     *table = NULL;
 
@@ -358,15 +717,30 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
-
-found:
+    assert(c->entries[i].offset != 0);
     c->entries[i].dirty = true;
 }
+
+Qcow2CacheStats *qcow2_cache_get_stats(Qcow2Cache *c)
+{
+    Qcow2CacheStats *stats = g_new0(Qcow2CacheStats, 1);
+
+    *stats = (Qcow2CacheStats) {
+        .size       = c->size,
+        .entry_size = c->table_size,
+        .used       = c->t1_len + c->t2_len,
+        .hits       = c->hits,
+        .misses     = c->misses,
+        .evictions  = c->evictions,
+        .cleaned    = c->cleaned,
+        .recent     = c->t1_len,
+        .frequent   = c->t2_len,
+        .recent_ghosts   = c->b1_len,
+        .frequent_ghosts = c->b2_len,
+        .ghost_hits = c->ghost_hits,
+    };
+
+    return stats;
+}
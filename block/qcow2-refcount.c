@@ -26,6 +26,7 @@
 #include "block/block_int.h"
 #include "block/qcow2.h"
 #include "qemu/range.h"
+#include "qemu/bitmap.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
@@ -69,6 +70,9 @@ void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
     g_free(s->refcount_table);
+    g_free(s->cluster_map);
+    s->cluster_map = NULL;
+    s->cluster_map_size = 0;
 }
 
 
@@ -133,6 +137,150 @@ int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index)
     return refcount;
 }
 
+/*
+ * Builds the in-memory map of used clusters from the refcount blocks.
+ *
+ * As long as the map exists, every refcount update is mirrored into it and
+ * free clusters are found by scanning the map instead of the refcount blocks.
+ * Together with lazy refcounts this means that cluster allocation never waits
+ * for refcount blocks to be read or written; they are only written back when
+ * they are evicted from the cache, and an unclean shutdown is repaired by
+ * qcow2_check_refcounts() on the next open.
+ */
+int qcow2_cluster_map_init(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t nb_blocks, i, j;
+    uint16_t *refcount_block;
+    int ret;
+
+    g_free(s->cluster_map);
+    s->cluster_map = NULL;
+    s->cluster_map_size = 0;
+
+    /* The map only needs to cover the existing refcount blocks */
+    for (nb_blocks = s->refcount_table_size; nb_blocks > 0; nb_blocks--) {
+        if (s->refcount_table[nb_blocks - 1] & REFT_OFFSET_MASK) {
+            break;
+        }
+    }
+
+    s->cluster_map_size = MAX(nb_blocks, 1) << s->refcount_block_bits;
+    s->cluster_map = bitmap_try_new(s->cluster_map_size);
+    if (s->cluster_map == NULL) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    for (i = 0; i < nb_blocks; i++) {
+        uint64_t refcount_block_offset =
+            s->refcount_table[i] & REFT_OFFSET_MASK;
+
+        if (!refcount_block_offset) {
+            continue;
+        }
+
+        if (offset_into_cluster(s, refcount_block_offset)) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Refblock offset %#"
+                                    PRIx64 " unaligned (reftable index: %#"
+                                    PRIx64 ")", refcount_block_offset, i);
+            ret = -EIO;
+            goto fail;
+        }
+
+        ret = load_refcount_block(bs, refcount_block_offset,
+                                  (void**) &refcount_block);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        for (j = 0; j < s->refcount_block_size; j++) {
+            if (refcount_block[j]) {
+                set_bit((i << s->refcount_block_bits) + j, s->cluster_map);
+            }
+        }
+
+        ret = qcow2_cache_put(bs, s->refcount_block_cache,
+                              (void**) &refcount_block);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    g_free(s->cluster_map);
+    s->cluster_map = NULL;
+    s->cluster_map_size = 0;
+    return ret;
+}
+
+/*
+ * Marks clusters as used or free in the cluster map, if there is one. The
+ * map grows by whole refcount blocks as clusters beyond its end are used.
+ */
+static void cluster_map_update(BDRVQcowState *s, uint64_t cluster_index,
+                               uint64_t nb_clusters, bool used)
+{
+    uint64_t end = cluster_index + nb_clusters;
+
+    if (!s->cluster_map) {
+        return;
+    }
+
+    if (end > s->cluster_map_size) {
+        if (!used) {
+            /* Everything beyond the end of the map is free anyway */
+            if (cluster_index >= s->cluster_map_size) {
+                return;
+            }
+            end = s->cluster_map_size;
+        } else {
+            uint64_t new_size = ROUND_UP(end, s->refcount_block_size);
+
+            s->cluster_map = bitmap_zero_extend(s->cluster_map,
+                                                s->cluster_map_size, new_size);
+            s->cluster_map_size = new_size;
+        }
+    }
+
+    if (used) {
+        bitmap_set(s->cluster_map, cluster_index, end - cluster_index);
+    } else {
+        bitmap_clear(s->cluster_map, cluster_index, end - cluster_index);
+    }
+}
+
+static bool cluster_map_is_used(BDRVQcowState *s, uint64_t cluster_index)
+{
+    return cluster_index < s->cluster_map_size &&
+           test_bit(cluster_index, s->cluster_map);
+}
+
+/*
+ * Returns the index of the first cluster of a run of nb_clusters free
+ * clusters, starting the search at cluster_index.
+ */
+static uint64_t cluster_map_find_free(BDRVQcowState *s, uint64_t cluster_index,
+                                      uint64_t nb_clusters)
+{
+    while (cluster_index < s->cluster_map_size) {
+        uint64_t end, next_used;
+
+        cluster_index = find_next_zero_bit(s->cluster_map, s->cluster_map_size,
+                                           cluster_index);
+        end = MIN(cluster_index + nb_clusters, s->cluster_map_size);
+        next_used = find_next_bit(s->cluster_map, end, cluster_index);
+        if (next_used >= end) {
+            break;
+        }
+        cluster_index = next_used + 1;
+    }
+
+    return cluster_index;
+}
+
 /*
  * Rounds the refcount table size up to avoid growing the table for each single
  * refcount block that is allocated.
@@ -257,6 +405,7 @@ static int alloc_refcount_block(BlockDriverState *bs,
         int block_index = (new_block >> s->cluster_bits) &
             (s->refcount_block_size - 1);
         (*refcount_block)[block_index] = cpu_to_be16(1);
+        cluster_map_update(s, new_block >> s->cluster_bits, 1, true);
     } else {
         /* Described somewhere else. This can recurse at most twice before we
          * arrive at a block that describes itself. */
@@ -396,6 +545,8 @@ static int alloc_refcount_block(BlockDriverState *bs,
     if (ret < 0) {
         goto fail_table;
     }
+    cluster_map_update(s, meta_offset >> s->cluster_bits,
+                       table_clusters + blocks_clusters, true);
 
     /* Write refcount table to disk */
     for(i = 0; i < table_size; i++) {
@@ -592,6 +743,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
             s->free_cluster_index = cluster_index;
         }
         refcount_block[block_index] = cpu_to_be16(refcount);
+        cluster_map_update(s, cluster_index, 1, refcount != 0);
 
         if (refcount == 0 && s->discard_passthrough[type]) {
             update_refcount_discard(bs, cluster_offset, s->cluster_size);
@@ -666,15 +818,22 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
     int refcount;
 
     nb_clusters = size_to_clusters(s, size);
+    if (s->cluster_map) {
+        /* All used clusters are in the map, no need to read refcounts */
+        s->free_cluster_index =
+            cluster_map_find_free(s, s->free_cluster_index, nb_clusters) +
+            nb_clusters;
+    } else {
 retry:
-    for(i = 0; i < nb_clusters; i++) {
-        uint64_t next_cluster_index = s->free_cluster_index++;
-        refcount = qcow2_get_refcount(bs, next_cluster_index);
+        for(i = 0; i < nb_clusters; i++) {
+            uint64_t next_cluster_index = s->free_cluster_index++;
+            refcount = qcow2_get_refcount(bs, next_cluster_index);
 
-        if (refcount < 0) {
-            return refcount;
-        } else if (refcount != 0) {
-            goto retry;
+            if (refcount < 0) {
+                return refcount;
+            } else if (refcount != 0) {
+                goto retry;
+            }
         }
     }
 
@@ -733,7 +892,11 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
         /* Check how many clusters there are free */
         cluster_index = offset >> s->cluster_bits;
         for(i = 0; i < nb_clusters; i++) {
-            refcount = qcow2_get_refcount(bs, cluster_index++);
+            if (s->cluster_map) {
+                refcount = cluster_map_is_used(s, cluster_index++);
+            } else {
+                refcount = qcow2_get_refcount(bs, cluster_index++);
+            }
 
             if (refcount < 0) {
                 return refcount;
@@ -880,11 +1043,14 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     bool l1_allocated = false;
     int64_t old_offset, old_l2_offset;
     int i, j, l1_modified = 0, nb_csectors, refcount;
+    unsigned slice, slice_size2, n_slices;
     int ret;
 
     l2_table = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    n_slices = s->cluster_size / slice_size2;
 
     s->cache_discards = true;
 
@@ -926,93 +1092,100 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
+            for (slice = 0; slice < n_slices; slice++) {
+                ret = qcow2_cache_get(bs, s->l2_table_cache,
+                    l2_offset + slice * slice_size2, (void**) &l2_table);
+                if (ret < 0) {
+                    goto fail;
+                }
+
+                for (j = 0; j < s->l2_slice_size; j++) {
+                    uint64_t cluster_index;
+
+                    offset = be64_to_cpu(l2_table[j]);
+                    old_offset = offset;
+                    offset &= ~QCOW_OFLAG_COPIED;
+
+                    switch (qcow2_get_cluster_type(offset)) {
+                        case QCOW2_CLUSTER_COMPRESSED:
+                            nb_csectors = ((offset >> s->csize_shift) &
+                                           s->csize_mask) + 1;
+                            if (addend != 0) {
+                                ret = update_refcount(bs,
+                                    (offset & s->cluster_offset_mask) & ~511,
+                                    nb_csectors * 512, addend,
+                                    QCOW2_DISCARD_SNAPSHOT);
+                                if (ret < 0) {
+                                    goto fail;
+                                }
+                            }
+                            /* compressed clusters are never modified */
+                            refcount = 2;
+                            break;
 
-            for(j = 0; j < s->l2_size; j++) {
-                uint64_t cluster_index;
-
-                offset = be64_to_cpu(l2_table[j]);
-                old_offset = offset;
-                offset &= ~QCOW_OFLAG_COPIED;
-
-                switch (qcow2_get_cluster_type(offset)) {
-                    case QCOW2_CLUSTER_COMPRESSED:
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, addend,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
+                        case QCOW2_CLUSTER_NORMAL:
+                        case QCOW2_CLUSTER_ZERO:
+                            if (offset_into_cluster(s,
+                                    offset & L2E_OFFSET_MASK)) {
+                                qcow2_signal_corruption(bs, true, -1, -1,
+                                        "Data cluster offset %#llx unaligned "
+                                        "(L2 offset: %#" PRIx64 ", L2 index: "
+                                        "%#x)", offset & L2E_OFFSET_MASK,
+                                        l2_offset,
+                                        slice * s->l2_slice_size + j);
+                                ret = -EIO;
                                 goto fail;
                             }
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                        break;
-
-                    case QCOW2_CLUSTER_NORMAL:
-                    case QCOW2_CLUSTER_ZERO:
-                        if (offset_into_cluster(s, offset & L2E_OFFSET_MASK)) {
-                            qcow2_signal_corruption(bs, true, -1, -1, "Data "
-                                                    "cluster offset %#llx "
-                                                    "unaligned (L2 offset: %#"
-                                                    PRIx64 ", L2 index: %#x)",
-                                                    offset & L2E_OFFSET_MASK,
-                                                    l2_offset, j);
-                            ret = -EIO;
-                            goto fail;
-                        }
 
-                        cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
-                        if (!cluster_index) {
-                            /* unallocated */
-                            refcount = 0;
-                            break;
-                        }
-                        if (addend != 0) {
-                            refcount = qcow2_update_cluster_refcount(bs,
-                                    cluster_index, addend,
-                                    QCOW2_DISCARD_SNAPSHOT);
-                        } else {
-                            refcount = qcow2_get_refcount(bs, cluster_index);
-                        }
+                            cluster_index = (offset & L2E_OFFSET_MASK)
+                                            >> s->cluster_bits;
+                            if (!cluster_index) {
+                                /* unallocated */
+                                refcount = 0;
+                                break;
+                            }
+                            if (addend != 0) {
+                                refcount = qcow2_update_cluster_refcount(bs,
+                                        cluster_index, addend,
+                                        QCOW2_DISCARD_SNAPSHOT);
+                            } else {
+                                refcount = qcow2_get_refcount(bs,
+                                                              cluster_index);
+                            }
 
-                        if (refcount < 0) {
-                            ret = refcount;
-                            goto fail;
-                        }
-                        break;
+                            if (refcount < 0) {
+                                ret = refcount;
+                                goto fail;
+                            }
+                            break;
 
-                    case QCOW2_CLUSTER_UNALLOCATED:
-                        refcount = 0;
-                        break;
+                        case QCOW2_CLUSTER_UNALLOCATED:
+                            refcount = 0;
+                            break;
 
-                    default:
-                        abort();
-                }
+                        default:
+                            abort();
+                    }
 
-                if (refcount == 1) {
-                    offset |= QCOW_OFLAG_COPIED;
-                }
-                if (offset != old_offset) {
-                    if (addend > 0) {
-                        qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                            s->refcount_block_cache);
+                    if (refcount == 1) {
+                        offset |= QCOW_OFLAG_COPIED;
+                    }
+                    if (offset != old_offset) {
+                        if (addend > 0) {
+                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                s->refcount_block_cache);
+                        }
+                        l2_table[j] = cpu_to_be64(offset);
+                        qcow2_cache_entry_mark_dirty(s->l2_table_cache,
+                                                     l2_table);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
-                    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
                 }
-            }
 
-            ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
+                ret = qcow2_cache_put(bs, s->l2_table_cache,
+                                      (void**) &l2_table);
+                if (ret < 0) {
+                    goto fail;
+                }
             }
 
 
@@ -0,0 +1,263 @@
+/*
+ * Threaded data processing for the qcow2 image format
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * Compressing or decompressing a cluster takes far longer than the I/O for
+ * it, so the work is handed to the thread pool of the image's AioContext.
+ * The calling coroutine yields until its cluster is done, which lets
+ * several clusters be (de)compressed on different cores at the same time.
+ */
+
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "block/qcow2.h"
+
+/* Compression level used for zstd, its default */
+#define QCOW2_ZSTD_LEVEL 3
+
+/*
+ * Compression functions return the size of the compressed data, -ENOMEM if
+ * it would not fit into dest_size bytes and -EIO on any other error.
+ *
+ * Decompression functions fill all of the dest_size bytes and return 0, or
+ * -EIO if the data is corrupted. The compressed data may be followed by
+ * padding up to the end of its last sector.
+ */
+typedef ssize_t Qcow2CompressFunc(void *dest, size_t dest_size,
+                                  const void *src, size_t src_size);
+
+static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = dest_size - strm.avail_out;
+    } else {
+        ret = (ret == Z_OK || ret == Z_BUF_ERROR) ? -ENOMEM : -EIO;
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.next_in = (uint8_t *)src;
+    strm.avail_in = src_size;
+    strm.next_out = dest;
+    strm.avail_out = dest_size;
+
+    ret = inflateInit2(&strm, -12);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    ret = inflate(&strm, Z_FINISH);
+    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || strm.avail_out != 0) {
+        ret = -EIO;
+    } else {
+        ret = 0;
+    }
+
+    inflateEnd(&strm);
+    return ret;
+}
+
+#ifdef CONFIG_ZSTD
+static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    size_t ret;
+
+    ret = ZSTD_compress(dest, dest_size, src, src_size, QCOW2_ZSTD_LEVEL);
+    if (ZSTD_isError(ret)) {
+        /* Almost always a too small buffer; write the cluster uncompressed */
+        return -ENOMEM;
+    }
+
+    return ret;
+}
+
+static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    ZSTD_outBuffer output = { dest, dest_size, 0 };
+    ZSTD_inBuffer input = { src, src_size, 0 };
+    ZSTD_DStream *dstream;
+    size_t zret;
+    ssize_t ret = 0;
+
+    dstream = ZSTD_createDStream();
+    if (!dstream) {
+        return -EIO;
+    }
+
+    zret = ZSTD_initDStream(dstream);
+    if (ZSTD_isError(zret)) {
+        ret = -EIO;
+        goto out;
+    }
+
+    /* Stop at the end of the frame, not of the input, to skip the padding */
+    while (output.pos < output.size) {
+        size_t last_in_pos = input.pos;
+        size_t last_out_pos = output.pos;
+
+        zret = ZSTD_decompressStream(dstream, &output, &input);
+        if (ZSTD_isError(zret) || zret == 0) {
+            break;
+        }
+        if (input.pos == last_in_pos && output.pos == last_out_pos) {
+            /* Truncated input */
+            break;
+        }
+    }
+
+    if (ZSTD_isError(zret) || output.pos != output.size) {
+        ret = -EIO;
+    }
+
+out:
+    ZSTD_freeDStream(dstream);
+    return ret;
+}
+#endif
+
+typedef struct Qcow2CompressData {
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    Qcow2CompressFunc *func;
+    ssize_t ret;
+} Qcow2CompressData;
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = data->func(data->dest, data->dest_size,
+                           data->src, data->src_size);
+    return 0;
+}
+
+static ssize_t coroutine_fn
+qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                     const void *src, size_t src_size, Qcow2CompressFunc *func)
+{
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CompressData arg = {
+        .dest       = dest,
+        .dest_size  = dest_size,
+        .src        = src,
+        .src_size   = src_size,
+        .func       = func,
+    };
+
+    thread_pool_submit_co(pool, qcow2_compress_pool_func, &arg);
+    return arg.ret;
+}
+
+/*
+ * Compress src_size bytes from src into dest with the compression type of
+ * the image. Returns the compressed size, -ENOMEM if it is not smaller than
+ * dest_size (the cluster should then be written uncompressed), or -EIO.
+ */
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressFunc *func;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        func = qcow2_zlib_compress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        func = qcow2_zstd_compress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, func);
+}
+
+/*
+ * Decompress src into exactly dest_size bytes at dest. Returns 0 on success
+ * and -EIO if the compressed data is corrupted.
+ */
+ssize_t coroutine_fn qcow2_co_decompress(BlockDriverState *bs,
+                                         void *dest, size_t dest_size,
+                                         const void *src, size_t src_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressFunc *func;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        func = qcow2_zlib_decompress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        func = qcow2_zstd_decompress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, func);
+}
+
+/* Whether this build can read and write images of the compression type */
+bool qcow2_compression_type_supported(int compression_type)
+{
+    switch (compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return true;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
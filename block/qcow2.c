@@ -24,7 +24,6 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
-#include <zlib.h>
 #include "qemu/aes.h"
 #include "block/qcow2.h"
 #include "qemu/error-report.h"
@@ -61,6 +60,12 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_COMPRESSION_TYPE 0x636f6d70
+
+typedef struct {
+    uint8_t compression_type;
+    uint8_t reserved[7];
+} QEMU_PACKED Qcow2CompressionTypeExt;
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -159,6 +164,30 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_COMPRESSION_TYPE:
+        {
+            Qcow2CompressionTypeExt cext;
+
+            if (ext.len != sizeof(cext)) {
+                error_setg(errp, "ERROR: ext_compression_type: len=%" PRIu32
+                           " invalid (!=%zu)", ext.len, sizeof(cext));
+                return -EINVAL;
+            }
+            ret = bdrv_pread(bs->file, offset, &cext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: ext_compression_type: "
+                                 "Could not read compression type");
+                return ret;
+            }
+            if (!qcow2_compression_type_supported(cext.compression_type)) {
+                error_setg(errp, "Unsupported compression type %u",
+                           cext.compression_type);
+                return -ENOTSUP;
+            }
+            s->compression_type = cext.compression_type;
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -333,11 +362,20 @@ int qcow2_mark_consistent(BlockDriverState *bs)
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
                        BdrvCheckMode fix)
 {
+    BDRVQcowState *s = bs->opaque;
     int ret = qcow2_check_refcounts(bs, result, fix);
     if (ret < 0) {
         return ret;
     }
 
+    /* Repairs may have changed the refcounts behind the cluster map's back */
+    if (fix && s->cluster_map) {
+        ret = qcow2_cluster_map_init(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     if (fix && result->check_errors == 0 && result->corruptions == 0) {
         ret = qcow2_mark_clean(bs);
         if (ret < 0) {
@@ -383,6 +421,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Postpone refcount updates",
         },
+        {
+            .name = QCOW2_OPT_DEFERRED_REFCOUNTS,
+            .type = QEMU_OPT_BOOL,
+            .help = "Allocate clusters from an in-memory map and postpone "
+                    "all refcount updates (implies lazy-refcounts)",
+        },
         {
             .name = QCOW2_OPT_DISCARD_REQUEST,
             .type = QEMU_OPT_BOOL,
@@ -467,6 +511,16 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum refcount block cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of each entry in the L2 cache",
+        },
+        {
+            .name = QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Clean unused cache entries after this time (in seconds)",
+        },
         { /* end of list */ }
     },
 };
@@ -482,6 +536,52 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_INACTIVE_L2_BITNR]    = QCOW2_OPT_OVERLAP_INACTIVE_L2,
 };
 
+static void cache_clean_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+
+    qcow2_cache_clean_unused(bs, s->l2_table_cache);
+    qcow2_cache_clean_unused(bs, s->refcount_block_cache);
+    timer_mod(s->cache_clean_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+              (int64_t) s->cache_clean_interval * 1000);
+}
+
+static void cache_clean_timer_init(BlockDriverState *bs, AioContext *context)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->cache_clean_interval > 0) {
+        s->cache_clean_timer = aio_timer_new(context, QEMU_CLOCK_VIRTUAL,
+                                             SCALE_MS, cache_clean_timer_cb,
+                                             bs);
+        timer_mod(s->cache_clean_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+                  (int64_t) s->cache_clean_interval * 1000);
+    }
+}
+
+static void cache_clean_timer_del(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->cache_clean_timer) {
+        timer_del(s->cache_clean_timer);
+        timer_free(s->cache_clean_timer);
+        s->cache_clean_timer = NULL;
+    }
+}
+
+static void qcow2_detach_aio_context(BlockDriverState *bs)
+{
+    cache_clean_timer_del(bs);
+}
+
+static void qcow2_attach_aio_context(BlockDriverState *bs,
+                                     AioContext *new_context)
+{
+    cache_clean_timer_init(bs, new_context);
+}
+
 static void read_cache_sizes(QemuOpts *opts, uint64_t *l2_cache_size,
                              uint64_t *refcount_cache_size, Error **errp)
 {
@@ -550,7 +650,8 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     uint64_t l1_vm_state_index;
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
-    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    uint64_t cache_clean_interval;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -806,7 +907,21 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    l2_cache_size /= s->cluster_size;
+    l2_cache_entry_size = qemu_opt_get_size(opts,
+        QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+        MIN(s->cluster_size, DEFAULT_L2_CACHE_ENTRY_SIZE));
+    if (l2_cache_entry_size < (1 << MIN_CLUSTER_BITS) ||
+        l2_cache_entry_size > s->cluster_size ||
+        !is_power_of_2(l2_cache_entry_size)) {
+        error_setg(errp, QCOW2_OPT_L2_CACHE_ENTRY_SIZE " must be a power of "
+                   "two between %d and the cluster size (%d)",
+                   1 << MIN_CLUSTER_BITS, s->cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+
+    l2_cache_size /= l2_cache_entry_size;
     if (l2_cache_size < MIN_L2_CACHE_SIZE) {
         l2_cache_size = MIN_L2_CACHE_SIZE;
     }
@@ -826,25 +941,30 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    cache_clean_interval = qemu_opt_get_number(opts,
+                                               QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+                                               0);
+    if (cache_clean_interval > UINT_MAX) {
+        error_setg(errp, "Cache clean interval too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->cache_clean_interval = cache_clean_interval;
+
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
-    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_entry_size);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 s->cluster_size);
     if (s->l2_table_cache == NULL || s->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
         goto fail;
     }
 
-    s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_try_blockalign(bs->file, QCOW_MAX_CRYPT_CLUSTERS
-                                                    * s->cluster_size + 512);
-    if (s->cluster_data == NULL) {
-        error_setg(errp, "Could not allocate temporary cluster buffer");
-        ret = -ENOMEM;
-        goto fail;
-    }
+    cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
 
+    s->cluster_cache = g_malloc(s->cluster_size);
     s->cluster_cache_offset = -1;
     s->flags = flags;
 
@@ -865,6 +985,14 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    if (!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION) !=
+        (s->compression_type == QCOW2_COMPRESSION_TYPE_ZLIB)) {
+        error_setg(errp, "Compression type header extension and "
+                   "incompatible feature bit do not match");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* read the backing file name */
     if (header.backing_file_offset != 0) {
         len = header.backing_file_size;
@@ -921,6 +1049,18 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     s->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
 
+    /* With the cluster map, allocations don't read refcounts any more */
+    if (qemu_opt_get_bool(opts, QCOW2_OPT_DEFERRED_REFCOUNTS, false)) {
+        s->use_lazy_refcounts = true;
+        if (!bs->read_only) {
+            ret = qcow2_cluster_map_init(bs);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not build cluster map");
+                goto fail;
+            }
+        }
+    }
+
     s->discard_passthrough[QCOW2_DISCARD_NEVER] = false;
     s->discard_passthrough[QCOW2_DISCARD_ALWAYS] = true;
     s->discard_passthrough[QCOW2_DISCARD_REQUEST] =
@@ -991,6 +1131,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
  fail:
     qemu_opts_del(opts);
+    cache_clean_timer_del(bs);
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
@@ -1005,7 +1146,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         qcow2_cache_destroy(bs, s->refcount_block_cache);
     }
     g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
     return ret;
 }
 
@@ -1201,7 +1341,6 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
             ret = qcow2_decompress_cluster(bs, cluster_offset);
             if (ret < 0) {
                 goto fail;
@@ -1299,6 +1438,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
     s->cluster_cache_offset = -1; /* disable compressed cache */
+    s->cluster_cache_gen++;
 
     qemu_co_mutex_lock(&s->lock);
 
@@ -1423,6 +1563,8 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    cache_clean_timer_del(bs);
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -1454,7 +1596,6 @@ static void qcow2_close(BlockDriverState *bs)
     cleanup_unknown_header_ext(bs);
 
     g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -1630,6 +1771,22 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Compression type header extension */
+    if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        Qcow2CompressionTypeExt cext = {
+            .compression_type = s->compression_type,
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_COMPRESSION_TYPE,
+                             &cext, sizeof(cext), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Feature table */
     Qcow2Feature features[] = {
         {
@@ -1779,7 +1936,7 @@ static int preallocate(BlockDriverState *bs)
 static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
                          int flags, size_t cluster_size, PreallocMode prealloc,
-                         QemuOpts *opts, int version,
+                         QemuOpts *opts, int version, int compression_type,
                          Error **errp)
 {
     /* Calculate cluster_bits */
@@ -1964,6 +2121,19 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         }
     }
 
+    /* The default zlib compression needs no header extension */
+    if (compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        BDRVQcowState *s = bs->opaque;
+
+        s->compression_type = compression_type;
+        s->incompatible_features |= QCOW2_INCOMPAT_COMPRESSION;
+        ret = qcow2_update_header(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not set compression type");
+            goto out;
+        }
+    }
+
     /* And if we're supposed to preallocate metadata, do that now */
     if (prealloc != PREALLOC_MODE_OFF) {
         BDRVQcowState *s = bs->opaque;
@@ -2006,6 +2176,7 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
     size_t cluster_size = DEFAULT_CLUSTER_SIZE;
     PreallocMode prealloc;
     int version = 3;
+    int compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
     Error *local_err = NULL;
     int ret;
 
@@ -2046,6 +2217,25 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
         flags |= BLOCK_FLAG_LAZY_REFCOUNTS;
     }
 
+    g_free(buf);
+    buf = qemu_opt_get_del(opts, BLOCK_OPT_COMPRESSION_TYPE);
+    if (!buf || !strcmp(buf, "zlib")) {
+        compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    } else if (!strcmp(buf, "zstd")) {
+        compression_type = QCOW2_COMPRESSION_TYPE_ZSTD;
+    } else {
+        error_setg(errp, "Invalid compression type: '%s'", buf);
+        ret = -EINVAL;
+        goto finish;
+    }
+
+    if (!qcow2_compression_type_supported(compression_type)) {
+        error_setg(errp, "Compression type '%s' is not supported by this "
+                   "build", buf);
+        ret = -ENOTSUP;
+        goto finish;
+    }
+
     if (backing_file && prealloc != PREALLOC_MODE_OFF) {
         error_setg(errp, "Backing file and preallocation cannot be used at "
                    "the same time");
@@ -2060,8 +2250,17 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
         goto finish;
     }
 
+    if (version < 3 && compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_setg(errp, "Compression types other than zlib are only "
+                   "supported with compatibility level 1.1 and above "
+                   "(use compat=1.1 or greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
     ret = qcow2_create2(filename, size, backing_file, backing_fmt, flags,
-                        cluster_size, prealloc, opts, version, &local_err);
+                        cluster_size, prealloc, opts, version,
+                        compression_type, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
     }
@@ -2149,14 +2348,16 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+static coroutine_fn int qcow2_co_write_compressed(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  const uint8_t *buf,
+                                                  int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    ssize_t out_len;
     uint8_t *out_buf;
-    uint64_t cluster_offset;
+    uint64_t cluster_offset, l2_entry;
+    int ret;
 
     if (nb_sectors == 0) {
         /* align end of file to a sector boundary to ease reading with
@@ -2174,68 +2375,66 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
             uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
             memset(pad_buf, 0, s->cluster_size);
             memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
+            ret = qcow2_co_write_compressed(bs, sector_num,
+                                            pad_buf, s->cluster_sectors);
             qemu_vfree(pad_buf);
         }
         return ret;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+    out_buf = g_malloc(s->cluster_size);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
+    /* Runs in the thread pool, so other clusters can be compressed in
+     * parallel by other coroutines */
+    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+                                buf, s->cluster_size);
+    if (out_len == -ENOMEM) {
+        /* could not compress: write normal cluster */
+        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
+        goto fail;
+    } else if (out_len < 0) {
         ret = -EINVAL;
         goto fail;
     }
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
+    qemu_co_mutex_lock(&s->lock);
+    s->cluster_cache_gen++;
+    l2_entry = qcow2_alloc_compressed_cluster_offset(bs, sector_num << 9,
+                                                     out_len);
+    if (!l2_entry) {
+        qemu_co_mutex_unlock(&s->lock);
+        ret = -EIO;
         goto fail;
     }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
+    cluster_offset = l2_entry & s->cluster_offset_mask;
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-        if (ret < 0) {
-            goto fail;
-        }
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
-        }
-        cluster_offset &= s->cluster_offset_mask;
+    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        goto fail_free;
+    }
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+    if (ret < 0) {
+        goto fail_free;
+    }
 
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+    /* Only now that the data is written may the L2 entry point to it */
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_link_compressed_cluster(bs, sector_num << 9, l2_entry);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        goto fail;
     }
 
-    ret = 0;
+    g_free(out_buf);
+    return 0;
+
+fail_free:
+    qemu_co_mutex_lock(&s->lock);
+    qcow2_free_any_clusters(bs, l2_entry, 1, QCOW2_DISCARD_NEVER);
+    qemu_co_mutex_unlock(&s->lock);
 fail:
     g_free(out_buf);
     return ret;
@@ -2333,6 +2532,13 @@ static int make_completely_empty(BlockDriverState *bs)
     s->refcount_table = new_reftable;
     new_reftable = NULL;
 
+    if (s->cluster_map) {
+        ret = qcow2_cluster_map_init(bs);
+        if (ret < 0) {
+            goto fail_broken_refcounts;
+        }
+    }
+
     /* Now the in-memory refcount information again corresponds to the on-disk
      * information (reftable is empty and no refblocks (the refblock cache is
      * empty)); however, this means some clusters (e.g. the image header) are
@@ -2489,11 +2695,34 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
                                   QCOW2_INCOMPAT_CORRUPT,
             .has_corrupt        = true,
         };
+        if (s->compression_type == QCOW2_COMPRESSION_TYPE_ZSTD) {
+            spec_info->qcow2->compression_type = g_strdup("zstd");
+            spec_info->qcow2->has_compression_type = true;
+        }
     }
 
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    *stats = (BlockStatsSpecific){
+        .kind  = BLOCK_STATS_SPECIFIC_KIND_QCOW2,
+        {
+            .qcow2 = g_new(BlockStatsSpecificQcow2, 1),
+        },
+    };
+    *stats->qcow2 = (BlockStatsSpecificQcow2){
+        .l2_cache       = qcow2_cache_get_stats(s->l2_table_cache),
+        .refcount_cache = qcow2_cache_get_stats(s->refcount_block_cache),
+    };
+
+    return stats;
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -2685,6 +2914,10 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         } else if (!strcmp(desc->name, "lazy_refcounts")) {
             lazy_refcounts = qemu_opt_get_bool(opts, "lazy_refcounts",
                                                lazy_refcounts);
+        } else if (!strcmp(desc->name, "compression_type")) {
+            fprintf(stderr, "Changing the compression type is not "
+                    "supported.\n");
+            return -ENOTSUP;
         } else {
             /* if this assertion fails, this probably means a new option was
              * added without having it covered here */
@@ -2854,6 +3087,12 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Postpone refcount updates",
             .def_value_str = "off"
         },
+        {
+            .name = BLOCK_OPT_COMPRESSION_TYPE,
+            .type = QEMU_OPT_STRING,
+            .help = "Compression method used for compressed clusters "
+                    "(zlib, zstd)",
+        },
         { /* end of list */ }
     }
 };
@@ -2877,7 +3116,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
-    .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_co_write_compressed = qcow2_co_write_compressed,
     .bdrv_make_empty        = qcow2_make_empty,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
@@ -2887,6 +3126,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp = qcow2_snapshot_load_tmp,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -2897,6 +3137,9 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_refresh_limits        = qcow2_refresh_limits,
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
 
+    .bdrv_detach_aio_context    = qcow2_detach_aio_context,
+    .bdrv_attach_aio_context    = qcow2_attach_aio_context,
+
     .create_opts         = &qcow2_create_opts,
     .bdrv_check          = qcow2_check,
     .bdrv_amend_options  = qcow2_amend_options,
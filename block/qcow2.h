@@ -62,7 +62,8 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
-#define MIN_L2_CACHE_SIZE 1 /* cluster */
+/* Must be at least 2 so that l2_allocate() can copy between slices */
+#define MIN_L2_CACHE_SIZE 2 /* cache entries */
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define MIN_REFCOUNT_CACHE_SIZE 4 /* clusters */
@@ -75,6 +76,10 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* L2 tables of bigger clusters are cached in slices of this size by default,
+ * so that a lookup doesn't need to read (and keep) the whole table */
+#define DEFAULT_L2_CACHE_ENTRY_SIZE 65536
+
 
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -93,6 +98,9 @@
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
+#define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_DEFERRED_REFCOUNTS "deferred-refcounts"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -176,11 +184,20 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
+    QCOW2_INCOMPAT_COMPRESSION_BITNR = 2,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_COMPRESSION   = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
 
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+                                 | QCOW2_INCOMPAT_CORRUPT
+                                 | QCOW2_INCOMPAT_COMPRESSION,
+};
+
+/* Compression types, see the compression type header extension */
+enum {
+    QCOW2_COMPRESSION_TYPE_ZLIB = 0,
+    QCOW2_COMPRESSION_TYPE_ZSTD = 1,
 };
 
 /* Compatible feature bits */
@@ -219,6 +236,7 @@ typedef struct BDRVQcowState {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_slice_size; /* entries per L2 table slice in the cache */
     int l1_size;
     int l1_vm_state_index;
     int refcount_block_bits;
@@ -231,10 +249,13 @@ typedef struct BDRVQcowState {
 
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
+    QEMUTimer *cache_clean_timer;
+    unsigned cache_clean_interval;
 
     uint8_t *cluster_cache;
-    uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
+    /* bumped by writes, which may free and reuse compressed clusters */
+    uint64_t cluster_cache_gen;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -243,6 +264,10 @@ typedef struct BDRVQcowState {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /* In-memory map of used clusters, only with deferred-refcounts */
+    unsigned long *cluster_map;
+    uint64_t cluster_map_size; /* in clusters */
+
     CoMutex lock;
 
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
@@ -258,6 +283,7 @@ typedef struct BDRVQcowState {
     int qcow_version;
     bool use_lazy_refcounts;
     int refcount_order;
+    int compression_type;
 
     bool discard_passthrough[QCOW2_DISCARD_MAX];
 
@@ -422,6 +448,21 @@ static inline int offset_to_l2_index(BDRVQcowState *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+/* Index of the L2 entry for offset in its L2 table slice */
+static inline int offset_to_l2_slice_index(BDRVQcowState *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
+/* Offset of the L2 table slice for offset, relative to the start of the
+ * L2 table */
+static inline int64_t offset_to_l2_slice_offset(BDRVQcowState *s,
+                                                int64_t offset)
+{
+    return (int64_t)(offset_to_l2_index(s, offset) -
+                     offset_to_l2_slice_index(s, offset)) * sizeof(uint64_t);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -486,6 +527,7 @@ void qcow2_signal_corruption(BlockDriverState *bs, bool fatal, int64_t offset,
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
+int qcow2_cluster_map_init(BlockDriverState *bs);
 
 int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index);
 
@@ -520,7 +562,8 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t cluster_offset);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
@@ -533,6 +576,8 @@ int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
 uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                          uint64_t offset,
                                          int compressed_size);
+int qcow2_link_compressed_cluster(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t l2_entry);
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
@@ -558,8 +603,18 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-threads.c functions */
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size);
+ssize_t coroutine_fn qcow2_co_decompress(BlockDriverState *bs,
+                                         void *dest, size_t dest_size,
+                                         const void *src, size_t src_size);
+bool qcow2_compression_type_supported(int compression_type);
+
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
@@ -569,11 +624,15 @@ int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
 void qcow2_cache_depends_on_flush(Qcow2Cache *c);
 
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c);
+void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c);
+Qcow2CacheStats *qcow2_cache_get_stats(Qcow2Cache *c);
 
 int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
+int coroutine_fn qcow2_cache_prefetch(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
 
 #endif
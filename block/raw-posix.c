@@ -141,6 +141,10 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_uring;
+    void *uring_ctx;
+#endif
 #ifdef CONFIG_XFS
     bool is_xfs:1;
 #endif
@@ -156,6 +160,9 @@ typedef struct BDRVRawReopenState {
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_uring;
+#endif
 } BDRVRawReopenState;
 
 static int fd_open(BlockDriverState *bs);
@@ -313,25 +320,39 @@ static void raw_parse_flags(int bdrv_flags, int *open_flags)
 
 static void raw_detach_aio_context(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
 
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_detach_aio_context(s->aio_ctx, bdrv_get_aio_context(bs));
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_uring) {
+        luring_detach_aio_context(s->uring_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
 }
 
 static void raw_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
 
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_attach_aio_context(s->aio_ctx, new_context);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_uring) {
+        luring_attach_aio_context(s->uring_ctx, new_context);
+    }
+#endif
 }
 
 #ifdef CONFIG_LINUX_AIO
@@ -366,6 +387,30 @@ error:
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+static int raw_set_uring(void **uring_ctx, bool *use_uring, int bdrv_flags)
+{
+    /*
+     * Unlike Linux AIO, io_uring is asynchronous for buffered I/O too, so
+     * it does not depend on the cache mode.
+     */
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        /* if non-NULL, luring_init() has already been run */
+        if (*uring_ctx == NULL) {
+            *uring_ctx = luring_init();
+            if (!*uring_ctx) {
+                return -1;
+            }
+        }
+        *use_uring = true;
+    } else {
+        *use_uring = false;
+    }
+
+    return 0;
+}
+#endif
+
 static void raw_parse_filename(const char *filename, QDict *options,
                                Error **errp)
 {
@@ -438,6 +483,14 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (raw_set_uring(&s->uring_ctx, &s->use_uring, bdrv_flags)) {
+        qemu_close(fd);
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not set up io_uring");
+        goto fail;
+    }
+#endif
 
     s->has_discard = true;
     s->has_write_zeroes = true;
@@ -542,6 +595,15 @@ static int raw_reopen_prepare(BDRVReopenState *state,
         return -1;
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    raw_s->use_uring = s->use_uring;
+
+    /* like aio_ctx, uring_ctx is kept even if io_uring gets disabled */
+    if (raw_set_uring(&s->uring_ctx, &raw_s->use_uring, state->flags)) {
+        error_setg_errno(errp, errno, "Could not set up io_uring");
+        return -1;
+    }
+#endif
 
     if (s->type == FTYPE_FD || s->type == FTYPE_CD) {
         raw_s->open_flags |= O_NONBLOCK;
@@ -622,6 +684,19 @@ static void raw_reopen_commit(BDRVReopenState *state)
 #ifdef CONFIG_LINUX_AIO
     s->use_aio = raw_s->use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_uring != raw_s->use_uring) {
+        AioContext *ctx = bdrv_get_aio_context(state->bs);
+
+        if (s->use_uring) {
+            luring_detach_aio_context(s->uring_ctx, ctx);
+        }
+        s->use_uring = raw_s->use_uring;
+        if (s->use_uring) {
+            luring_attach_aio_context(s->uring_ctx, ctx);
+        }
+    }
+#endif
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -1102,38 +1177,66 @@ static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
         }
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_uring && !(type & QEMU_AIO_MISALIGNED)) {
+        return luring_submit(bs, s->uring_ctx, s->fd, sector_num, qiov,
+                             nb_sectors, cb, opaque, type);
+    }
+#endif
+
     return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
                        cb, opaque, type);
 }
 
 static void raw_aio_plug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_plug(bs, s->aio_ctx);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_uring) {
+        luring_io_plug(bs, s->uring_ctx);
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_unplug(bs, s->aio_ctx, true);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_uring) {
+        luring_io_unplug(bs, s->uring_ctx, true);
+    }
+#endif
 }
 
 static void raw_aio_flush_io_queue(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_unplug(bs, s->aio_ctx, false);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_uring) {
+        luring_io_unplug(bs, s->uring_ctx, false);
+    }
+#endif
 }
 
 static BlockAIOCB *raw_aio_readv(BlockDriverState *bs,
@@ -1160,6 +1263,13 @@ static BlockAIOCB *raw_aio_flush(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_uring) {
+        return luring_submit(bs, s->uring_ctx, s->fd, 0, NULL, 0,
+                             cb, opaque, QEMU_AIO_FLUSH);
+    }
+#endif
+
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
@@ -1173,6 +1283,11 @@ static void raw_close(BlockDriverState *bs)
     if (s->use_aio) {
         laio_cleanup(s->aio_ctx);
     }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->uring_ctx) {
+        luring_cleanup(s->uring_ctx);
+    }
 #endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
@@ -35,6 +35,7 @@
 #include "qemu/envlist.h"
 
 int singlestep;
+unsigned int tb_hot_threshold;
 #if defined(CONFIG_USE_GUEST_BASE)
 unsigned long mmap_min_addr;
 unsigned long guest_base;
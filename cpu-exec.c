@@ -24,6 +24,9 @@
 #include "qemu/atomic.h"
 #include "sysemu/qtest.h"
 #include "qemu/timer.h"
+#if !defined(CONFIG_USER_ONLY)
+#include "qemu/main-loop.h"
+#endif
 
 /* -icount align implementation. */
 
@@ -117,6 +120,24 @@ static void init_delay_params(SyncClocks *sc,
        of printed messages to NB_PRINT_MAX(currently 100) */
     print_delay(sc);
 }
+
+/* With -machine tcg-thread=multi guest code runs without the iothread
+ * mutex.  Delivering interrupts talks to the interrupt controller models,
+ * so take it around that; it is dropped again after a longjmp.
+ */
+static inline void cpu_exec_lock_iothread(void)
+{
+    if (qemu_tcg_mttcg_enabled() && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+    }
+}
+
+static inline void cpu_exec_unlock_iothread(void)
+{
+    if (qemu_tcg_mttcg_enabled() && qemu_mutex_iothread_locked()) {
+        qemu_mutex_unlock_iothread();
+    }
+}
 #else
 static void align_clocks(SyncClocks *sc, const CPUState *cpu)
 {
@@ -125,6 +146,14 @@ static void align_clocks(SyncClocks *sc, const CPUState *cpu)
 static void init_delay_params(SyncClocks *sc, const CPUState *cpu)
 {
 }
+
+static inline void cpu_exec_lock_iothread(void)
+{
+}
+
+static inline void cpu_exec_unlock_iothread(void)
+{
+}
 #endif /* CONFIG USER ONLY */
 
 void cpu_loop_exit(CPUState *cpu)
@@ -213,17 +242,21 @@ static void cpu_exec_nocache(CPUArchState *env, int max_cycles,
     if (max_cycles > CF_COUNT_MASK)
         max_cycles = CF_COUNT_MASK;
 
+    tb_lock();
     /* tb_gen_code can flush our orig_tb, invalidate it now */
     tb_phys_invalidate(orig_tb, -1);
     tb = tb_gen_code(cpu, pc, cs_base, flags,
                      max_cycles | CF_NOCACHE);
+    tb_unlock();
     cpu->current_tb = tb;
     /* execute the generated code */
     trace_exec_tb_nocache(tb, tb->pc);
     cpu_tb_exec(cpu, tb->tc_ptr);
     cpu->current_tb = NULL;
+    tb_lock();
     tb_phys_invalidate(tb, -1);
     tb_free(tb);
+    tb_unlock();
 }
 
 static TranslationBlock *tb_find_slow(CPUArchState *env,
@@ -232,52 +265,26 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
                                       uint64_t flags)
 {
     CPUState *cpu = ENV_GET_CPU(env);
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
+    TranslationBlock *tb;
 
     tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+    atomic_inc(&tcg_ctx.tb_ctx.tb_lookup_count);
 
     /* find translated block using physical mappings */
-    phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
-            } else {
-                goto found;
-            }
+    tb = tb_htable_lookup(cpu, pc, cs_base, flags);
+    if (!tb) {
+        /* Another thread may have translated the block or resized the
+           table since the lockless lookup; check again under the lock. */
+        tb_lock();
+        tb = tb_htable_lookup(cpu, pc, cs_base, flags);
+        if (!tb) {
+            atomic_inc(&tcg_ctx.tb_ctx.tb_lookup_miss_count);
+            /* if no translated code available, then translate it now */
+            tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
         }
-        ptb1 = &tb->phys_hash_next;
-    }
- not_found:
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
-
- found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tcg_ctx.tb_ctx.tb_phys_hash[h];
-        tcg_ctx.tb_ctx.tb_phys_hash[h] = tb;
+        tb_unlock();
     }
+
     /* we add the TB in the virtual pc hash table */
     cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
     return tb;
@@ -334,9 +341,6 @@ int cpu_exec(CPUArchState *env)
     uintptr_t next_tb;
     SyncClocks sc;
 
-    /* This must be volatile so it is not trashed by longjmp() */
-    volatile bool have_tb_lock = false;
-
     if (cpu->halted) {
         if (!cpu_has_work(cpu)) {
             return EXCP_HALTED;
@@ -393,7 +397,9 @@ int cpu_exec(CPUArchState *env)
                     cpu->exception_index = -1;
                     break;
 #else
+                    cpu_exec_lock_iothread();
                     cc->do_interrupt(cpu);
+                    cpu_exec_unlock_iothread();
                     cpu->exception_index = -1;
 #endif
                 }
@@ -403,6 +409,7 @@ int cpu_exec(CPUArchState *env)
             for(;;) {
                 interrupt_request = cpu->interrupt_request;
                 if (unlikely(interrupt_request)) {
+                    cpu_exec_lock_iothread();
                     if (unlikely(cpu->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -445,14 +452,19 @@ int cpu_exec(CPUArchState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+                    cpu_exec_unlock_iothread();
                 }
                 if (unlikely(cpu->exit_request)) {
                     cpu->exit_request = 0;
                     cpu->exception_index = EXCP_INTERRUPT;
                     cpu_loop_exit(cpu);
                 }
-                spin_lock(&tcg_ctx.tb_ctx.tb_lock);
-                have_tb_lock = true;
+#if defined(CONFIG_USER_ONLY)
+                /* tb_flush() does not stop the other threads in user mode
+                   and resets the tables and jump caches in place, so the
+                   lockless lookup is only safe with system emulation.  */
+                tb_lock();
+#endif
                 tb = tb_find_fast(env);
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
@@ -471,11 +483,14 @@ int cpu_exec(CPUArchState *env)
                    spans two pages, we cannot safely do a direct
                    jump. */
                 if (next_tb != 0 && tb->page_addr[1] == -1) {
+                    tb_lock();
                     tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
                                 next_tb & TB_EXIT_MASK, tb);
+                    tb_unlock();
                 }
-                have_tb_lock = false;
-                spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
+#if defined(CONFIG_USER_ONLY)
+                tb_unlock();
+#endif
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -499,6 +514,13 @@ int cpu_exec(CPUArchState *env)
                          */
                         tb = (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
                         next_tb = 0;
+                        if (tb_hot_threshold &&
+                            tb->exec_count == tb_hot_threshold) {
+                            /* the block just turned hot */
+                            tb_lock();
+                            tb_gen_superblock(cpu, tb);
+                            tb_unlock();
+                        }
                         break;
                     case TB_EXIT_ICOUNT_EXPIRED:
                     {
@@ -549,10 +571,8 @@ int cpu_exec(CPUArchState *env)
 #ifdef TARGET_I386
             x86_cpu = X86_CPU(cpu);
 #endif
-            if (have_tb_lock) {
-                spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
-                have_tb_lock = false;
-            }
+            tb_lock_reset();
+            cpu_exec_unlock_iothread();
         }
     } /* for(;;) */
 
@@ -39,6 +39,7 @@
 #include "qemu/main-loop.h"
 #include "qemu/bitmap.h"
 #include "qemu/seqlock.h"
+#include "qemu/error-report.h"
 #include "qapi-event.h"
 #include "hw/nmi.h"
 
@@ -68,6 +69,9 @@ static CPUState *next_cpu;
 int64_t max_delay;
 int64_t max_advance;
 
+/* Set by -machine tcg-thread=multi: one host thread per TCG vCPU */
+bool mttcg_enabled;
+
 bool cpu_is_stopped(CPUState *cpu)
 {
     return cpu->stopped || !runstate_is_running();
@@ -517,6 +521,10 @@ void configure_icount(QemuOpts *opts, Error **errp)
         }
         return;
     }
+    if (qemu_tcg_mttcg_enabled()) {
+        error_setg(errp, "icount is not supported with tcg-thread=multi");
+        return;
+    }
     icount_align_option = qemu_opt_get_bool(opts, "align", false);
     icount_warp_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL_RT,
                                      icount_warp_rt, NULL);
@@ -798,6 +806,16 @@ static QemuThread io_thread;
 static QemuThread *tcg_cpu_thread;
 static QemuCond *tcg_halt_cond;
 
+static DEFINE_TLS(bool, iothread_locked);
+
+/* With multi-threaded TCG, operations such as a deferred tb_flush() need
+ * every vCPU to be outside cpu_exec().  Same scheme as linux-user.
+ */
+static QemuMutex exclusive_lock;
+static QemuCond exclusive_cond;
+static QemuCond exclusive_resume;
+static int pending_cpus;
+
 /* cpu creation */
 static QemuCond qemu_cpu_cond;
 /* system init */
@@ -812,6 +830,9 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
     qemu_mutex_init(&qemu_global_mutex);
+    qemu_mutex_init(&exclusive_lock);
+    qemu_cond_init(&exclusive_cond);
+    qemu_cond_init(&exclusive_resume);
 
     qemu_thread_get_self(&io_thread);
 }
@@ -922,6 +943,15 @@ static void qemu_tcg_wait_io_event(void)
     }
 }
 
+static void qemu_tcg_mt_wait_io_event(CPUState *cpu)
+{
+    while (cpu_thread_is_idle(cpu)) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
 static void qemu_kvm_wait_io_event(CPUState *cpu)
 {
     while (cpu_thread_is_idle(cpu)) {
@@ -1054,6 +1084,122 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+static int tcg_cpu_exec(CPUArchState *env);
+
+/* Wait for pending exclusive operations to complete.  The exclusive lock
+   must be held.  */
+static void exclusive_idle(void)
+{
+    while (pending_cpus) {
+        qemu_cond_wait(&exclusive_resume, &exclusive_lock);
+    }
+}
+
+/* Start an exclusive operation.  Must be called from outside cpu_exec()
+   and without the iothread mutex, which running vCPUs may be waiting for. */
+static void start_exclusive(void)
+{
+    CPUState *other_cpu;
+
+    qemu_mutex_lock(&exclusive_lock);
+    exclusive_idle();
+
+    pending_cpus = 1;
+    /* Make all other cpus stop executing.  */
+    CPU_FOREACH(other_cpu) {
+        if (other_cpu->running) {
+            pending_cpus++;
+            cpu_exit(other_cpu);
+        }
+    }
+    while (pending_cpus > 1) {
+        qemu_cond_wait(&exclusive_cond, &exclusive_lock);
+    }
+}
+
+/* Finish an exclusive operation.  */
+static void end_exclusive(void)
+{
+    pending_cpus = 0;
+    qemu_cond_broadcast(&exclusive_resume);
+    qemu_mutex_unlock(&exclusive_lock);
+}
+
+/* Wait for exclusive ops to finish, and begin cpu execution.  */
+static void cpu_exec_start(CPUState *cpu)
+{
+    qemu_mutex_lock(&exclusive_lock);
+    exclusive_idle();
+    cpu->running = true;
+    qemu_mutex_unlock(&exclusive_lock);
+}
+
+/* Mark cpu as not executing, and release pending exclusive ops.  */
+static void cpu_exec_end(CPUState *cpu)
+{
+    qemu_mutex_lock(&exclusive_lock);
+    cpu->running = false;
+    if (pending_cpus > 1) {
+        pending_cpus--;
+        if (pending_cpus == 1) {
+            qemu_cond_signal(&exclusive_cond);
+        }
+    }
+    qemu_mutex_unlock(&exclusive_lock);
+}
+
+/* Perform a tb_flush() that was deferred because vCPUs were running */
+static void qemu_tcg_mt_flush_pending(CPUArchState *env)
+{
+    if (tb_flush_is_pending()) {
+        start_exclusive();
+        tb_flush_deferred(env);
+        end_exclusive();
+    }
+}
+
+/* Multi-threaded TCG: each vCPU has its own thread and runs guest code
+ * without the iothread mutex.  Device accesses, interrupt delivery and
+ * queued work take the mutex as needed.
+ */
+static void *qemu_tcg_mt_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    CPUArchState *env = cpu->env_ptr;
+    int r;
+
+    qemu_tcg_init_cpu_signals();
+    qemu_thread_get_self(cpu->thread);
+
+    qemu_mutex_lock_iothread();
+    cpu->thread_id = qemu_get_thread_id();
+    cpu->created = true;
+    cpu->can_do_io = 1;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            qemu_mutex_unlock_iothread();
+
+            /* A flush requested from outside the vCPU threads must be
+               done before any guest code runs again.  */
+            qemu_tcg_mt_flush_pending(env);
+            cpu_exec_start(cpu);
+            r = tcg_cpu_exec(env);
+            cpu_exec_end(cpu);
+            qemu_tcg_mt_flush_pending(env);
+
+            qemu_mutex_lock_iothread();
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(cpu);
+            }
+        }
+        qemu_tcg_mt_wait_io_event(cpu);
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -1096,6 +1242,11 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
+    if (tcg_enabled() && qemu_tcg_mttcg_enabled()) {
+        /* The vCPU thread polls exit_request between TBs */
+        cpu_exit(cpu);
+        return;
+    }
     if (!tcg_enabled() && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
@@ -1126,9 +1277,14 @@ static bool qemu_in_vcpu_thread(void)
     return current_cpu && qemu_cpu_is_self(current_cpu);
 }
 
+bool qemu_mutex_iothread_locked(void)
+{
+    return tls_var(iothread_locked);
+}
+
 void qemu_mutex_lock_iothread(void)
 {
-    if (!tcg_enabled()) {
+    if (!tcg_enabled() || qemu_tcg_mttcg_enabled()) {
         qemu_mutex_lock(&qemu_global_mutex);
     } else {
         iothread_requesting_mutex = true;
@@ -1139,10 +1295,12 @@ void qemu_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    tls_var(iothread_locked) = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    tls_var(iothread_locked) = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
@@ -1171,7 +1329,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !qemu_tcg_mttcg_enabled()) {
             CPU_FOREACH(cpu) {
                 cpu->stop = false;
                 cpu->stopped = true;
@@ -1214,6 +1372,29 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
 
     tcg_cpu_address_space_init(cpu, cpu->as);
 
+    if (qemu_tcg_mttcg_enabled()) {
+#if !defined(TARGET_SUPPORTS_MTTCG)
+        static bool warned;
+
+        if (!warned) {
+            error_report("warning: guest atomic operations of this target are "
+                         "not serialized between TCG vCPU threads");
+            warned = true;
+        }
+#endif
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/TCG",
+                 cpu->cpu_index);
+        qemu_thread_create(cpu->thread, thread_name, qemu_tcg_mt_cpu_thread_fn,
+                           cpu, QEMU_THREAD_JOINABLE);
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
+
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
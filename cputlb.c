@@ -29,6 +29,7 @@
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
 #include "tcg/tcg.h"
+#include "qemu/main-loop.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
@@ -48,10 +49,66 @@ int tlb_flush_count;
  * entries from the TLB at any time, so flushing more entries than
  * required is only an efficiency issue, not a correctness issue.
  */
+
+/* With -machine tcg-thread=multi a vCPU's TLB may only be modified by the
+ * thread executing that vCPU.  Requests targeting another vCPU are queued
+ * as asynchronous work and performed the next time it leaves cpu_exec().
+ */
+typedef struct TLBFlushRequest {
+    CPUState *cpu;
+    int flush_global;
+    target_ulong addr;
+} TLBFlushRequest;
+
+static bool tlb_flush_is_remote(CPUState *cpu)
+{
+    return qemu_tcg_mttcg_enabled() && cpu->created && !qemu_cpu_is_self(cpu);
+}
+
+static void tlb_queue_remote_flush(void (*func)(void *data),
+                                   TLBFlushRequest *req)
+{
+    bool need_lock = !qemu_mutex_iothread_locked();
+
+    /* The queued work list is protected by the iothread mutex */
+    if (need_lock) {
+        qemu_mutex_lock_iothread();
+    }
+    async_run_on_cpu(req->cpu, func, req);
+    if (need_lock) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+static void tlb_flush_async_work(void *data)
+{
+    TLBFlushRequest *req = data;
+
+    tlb_flush(req->cpu, req->flush_global);
+    g_free(req);
+}
+
+static void tlb_flush_page_async_work(void *data)
+{
+    TLBFlushRequest *req = data;
+
+    tlb_flush_page(req->cpu, req->addr);
+    g_free(req);
+}
+
 void tlb_flush(CPUState *cpu, int flush_global)
 {
     CPUArchState *env = cpu->env_ptr;
 
+    if (tlb_flush_is_remote(cpu)) {
+        TLBFlushRequest *req = g_new0(TLBFlushRequest, 1);
+
+        req->cpu = cpu;
+        req->flush_global = flush_global;
+        tlb_queue_remote_flush(tlb_flush_async_work, req);
+        return;
+    }
+
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
 #endif
@@ -87,6 +144,15 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     int i;
     int mmu_idx;
 
+    if (tlb_flush_is_remote(cpu)) {
+        TLBFlushRequest *req = g_new0(TLBFlushRequest, 1);
+
+        req->cpu = cpu;
+        req->addr = addr;
+        tlb_queue_remote_flush(tlb_flush_page_async_work, req);
+        return;
+    }
+
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
 #endif
@@ -1398,6 +1398,10 @@ static ram_addr_t ram_block_add(RAMBlock *new_block, Error **errp)
                 bitmap_zero_extend(ram_list.dirty_memory[i],
                                    old_ram_size, new_ram_size);
        }
+        ram_list.dirty_memory_summary =
+            bitmap_zero_extend(ram_list.dirty_memory_summary,
+                               BITS_TO_LONGS(old_ram_size),
+                               BITS_TO_LONGS(new_ram_size));
     }
     cpu_physical_memory_set_dirty_range(new_block->offset,
                                         new_block->used_length);
@@ -1718,11 +1722,33 @@ found:
     return block->mr;
 }
 
+/* Like qemu_ram_addr_from_host, but returns the name of the RAMBlock
+ * containing 'ptr' and the offset of 'ptr' within that block.  */
+const char *qemu_ram_get_block_name(void *ptr, ram_addr_t *offset)
+{
+    RAMBlock *block;
+    uint8_t *host = ptr;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (block->host == NULL) {
+            continue;
+        }
+        if (host - block->host < block->max_length) {
+            *offset = host - block->host;
+            return block->idstr;
+        }
+    }
+
+    return NULL;
+}
+
 static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
                                uint64_t val, unsigned size)
 {
     if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
+        tb_lock();
         tb_invalidate_phys_page_fast(ram_addr, size);
+        tb_unlock();
     }
     switch (size) {
     case 1:
@@ -1793,7 +1819,9 @@ static void check_watchpoint(int offset, int len, int flags)
                     cpu_loop_exit(cpu);
                 } else {
                     cpu_get_tb_cpu_state(env, &pc, &cs_base, &cpu_flags);
+                    tb_lock();
                     tb_gen_code(cpu, pc, cs_base, cpu_flags, 1);
+                    tb_unlock();
                     cpu_resume_from_signal(cpu, NULL);
                 }
             }
@@ -2157,7 +2185,9 @@ static void invalidate_and_set_dirty(hwaddr addr,
                                      hwaddr length)
 {
     if (cpu_physical_memory_range_includes_clean(addr, length)) {
+        tb_lock();
         tb_invalidate_phys_range(addr, addr + length, 0);
+        tb_unlock();
         cpu_physical_memory_set_dirty_range_nocode(addr, length);
     }
     xen_modified_memory(addr, length);
@@ -2750,7 +2780,9 @@ void stl_phys_notdirty(AddressSpace *as, hwaddr addr, uint32_t val)
         if (unlikely(in_migration)) {
             if (cpu_physical_memory_is_clean(addr1)) {
                 /* invalidate code */
+                tb_lock();
                 tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
+                tb_unlock();
                 /* set dirty bit */
                 cpu_physical_memory_set_dirty_range_nocode(addr1, 4);
             }
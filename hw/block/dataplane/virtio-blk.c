@@ -24,6 +24,24 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
+/* Per-virtqueue state.  Each queue has its own doorbell and irq, so guest
+ * vCPUs submitting to different queues do not contend on one ring.
+ */
+typedef struct VirtIOBlockVring {
+    VirtIOBlockDataPlane *s;
+    int index;
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+    QEMUBH *bh;                     /* bh for guest notification */
+
+    /* Note that this EventNotifier is assigned by value.  This is
+     * fine as long as you do not call event_notifier_cleanup on it
+     * (because you don't own the file descriptor or handle; you just
+     * use it).
+     */
+    EventNotifier host_notifier;    /* doorbell */
+} VirtIOBlockVring;
+
 struct VirtIOBlockDataPlane {
     bool started;
     bool starting;
@@ -33,19 +51,11 @@ struct VirtIOBlockDataPlane {
     VirtIOBlkConf *conf;
 
     VirtIODevice *vdev;
-    Vring vring;                    /* virtqueue vring */
-    EventNotifier *guest_notifier;  /* irq */
-    QEMUBH *bh;                     /* bh for guest notification */
+    VirtIOBlockVring *vrings;       /* conf->num_queues entries */
 
-    /* Note that these EventNotifiers are assigned by value.  This is
-     * fine as long as you do not call event_notifier_cleanup on them
-     * (because you don't own the file descriptor or handle; you just
-     * use it).
-     */
     IOThread *iothread;
     IOThread internal_iothread_obj;
     AioContext *ctx;
-    EventNotifier host_notifier;    /* doorbell */
 
     /* Operation blocker on BDS */
     Error *blocker;
@@ -54,29 +64,30 @@ struct VirtIOBlockDataPlane {
 };
 
 /* Raise an interrupt to signal guest, if necessary */
-static void notify_guest(VirtIOBlockDataPlane *s)
+static void notify_guest(VirtIOBlockVring *r)
 {
-    if (!vring_should_notify(s->vdev, &s->vring)) {
+    if (!vring_should_notify(r->s->vdev, &r->vring)) {
         return;
     }
 
-    event_notifier_set(s->guest_notifier);
+    event_notifier_set(r->guest_notifier);
 }
 
 static void notify_guest_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockVring *r = opaque;
 
-    notify_guest(s);
+    notify_guest(r);
 }
 
 static void complete_request_vring(VirtIOBlockReq *req, unsigned char status)
 {
     VirtIOBlockDataPlane *s = req->dev->dataplane;
+    VirtIOBlockVring *r = &s->vrings[virtio_get_queue_index(req->vq)];
+
     stb_p(&req->in->status, status);
 
-    vring_push(&req->dev->dataplane->vring, &req->elem,
-               req->qiov.size + sizeof(*req->in));
+    vring_push(&r->vring, &req->elem, req->in_len);
 
     /* Suppress notification to guest by BH and its scheduled
      * flag because requests are completed as a batch after io
@@ -84,34 +95,32 @@ static void complete_request_vring(VirtIOBlockReq *req, unsigned char status)
      * executed in dataplane aio context even after it is
      * stopped, so needn't worry about notification loss with BH.
      */
-    qemu_bh_schedule(s->bh);
+    qemu_bh_schedule(r->bh);
 }
 
-static void handle_notify(EventNotifier *e)
+static void process_vring(VirtIOBlockVring *r)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           host_notifier);
+    VirtIOBlockDataPlane *s = r->s;
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+    VirtQueue *vq = virtio_get_queue(s->vdev, r->index);
 
-    event_notifier_test_and_clear(&s->host_notifier);
     blk_io_plug(s->conf->conf.blk);
     for (;;) {
-        MultiReqBuffer mrb = {
-            .num_writes = 0,
-        };
+        MultiReqBuffer mrb = {};
         int ret;
 
         /* Disable guest->host notifies to avoid unnecessary vmexits */
-        vring_disable_notification(s->vdev, &s->vring);
+        vring_disable_notification(s->vdev, &r->vring);
 
         for (;;) {
             VirtIOBlockReq *req = virtio_blk_alloc_request(vblk);
 
-            ret = vring_pop(s->vdev, &s->vring, &req->elem);
+            ret = vring_pop(s->vdev, &r->vring, &req->elem);
             if (ret < 0) {
                 virtio_blk_free_request(req);
                 break; /* no more requests */
             }
+            req->vq = vq;
 
             trace_virtio_blk_data_plane_process_request(s, req->elem.out_num,
                                                         req->elem.in_num,
@@ -120,13 +129,13 @@ static void handle_notify(EventNotifier *e)
             virtio_blk_handle_request(req, &mrb);
         }
 
-        virtio_submit_multiwrite(s->conf->conf.blk, &mrb);
+        virtio_blk_submit_multireq(s->conf->conf.blk, &mrb);
 
         if (likely(ret == -EAGAIN)) { /* vring emptied */
             /* Re-enable guest->host notifies and stop processing the vring.
              * But if the guest has snuck in more descriptors, keep processing.
              */
-            if (vring_enable_notification(s->vdev, &s->vring)) {
+            if (vring_enable_notification(s->vdev, &r->vring)) {
                 break;
             }
         } else { /* fatal error */
@@ -136,6 +145,28 @@ static void handle_notify(EventNotifier *e)
     blk_io_unplug(s->conf->conf.blk);
 }
 
+static void handle_notify(EventNotifier *e)
+{
+    VirtIOBlockVring *r = container_of(e, VirtIOBlockVring, host_notifier);
+
+    event_notifier_test_and_clear(&r->host_notifier);
+    process_vring(r);
+}
+
+/* Pick up new requests without waiting for the guest's kick to arrive */
+static bool handle_notify_poll(void *opaque)
+{
+    EventNotifier *e = opaque;
+    VirtIOBlockVring *r = container_of(e, VirtIOBlockVring, host_notifier);
+
+    if (r->vring.broken || !vring_more_avail(&r->vring)) {
+        return false;
+    }
+
+    process_vring(r);
+    return true;
+}
+
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -145,6 +176,7 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     Error *local_err = NULL;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i;
 
     *dataplane = NULL;
 
@@ -190,7 +222,15 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
         s->iothread = &s->internal_iothread_obj;
     }
     s->ctx = iothread_get_aio_context(s->iothread);
-    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
+
+    s->vrings = g_new0(VirtIOBlockVring, conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        VirtIOBlockVring *r = &s->vrings[i];
+
+        r->s = s;
+        r->index = i;
+        r->bh = aio_bh_new(s->ctx, notify_guest_bh, r);
+    }
 
     error_setg(&s->blocker, "block device is in use by data plane");
     blk_op_block_all(conf->conf.blk, s->blocker);
@@ -214,6 +254,8 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
+    int i;
+
     if (!s) {
         return;
     }
@@ -222,7 +264,10 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     blk_op_unblock_all(s->conf->conf.blk, s->blocker);
     error_free(s->blocker);
     object_unref(OBJECT(s->iothread));
-    qemu_bh_delete(s->bh);
+    for (i = 0; i < s->conf->num_queues; i++) {
+        qemu_bh_delete(s->vrings[i].bh);
+    }
+    g_free(s->vrings);
     g_free(s);
 }
 
@@ -232,7 +277,8 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
-    VirtQueue *vq;
+    int nvqs = s->conf->num_queues;
+    int i, j;
     int r;
 
     if (s->started || s->disabled) {
@@ -245,27 +291,37 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 
     s->starting = true;
 
-    vq = virtio_get_queue(s->vdev, 0);
-    if (!vring_setup(&s->vring, s->vdev, 0)) {
-        goto fail_vring;
+    for (i = 0; i < nvqs; i++) {
+        if (!vring_setup(&s->vrings[i].vring, s->vdev, i)) {
+            goto fail_vring;
+        }
     }
 
-    /* Set up guest notifier (irq) */
-    r = k->set_guest_notifiers(qbus->parent, 1, true);
+    /* Set up guest notifiers (irq) */
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
     if (r != 0) {
         fprintf(stderr, "virtio-blk failed to set guest notifier (%d), "
                 "ensure -enable-kvm is set\n", r);
         goto fail_guest_notifiers;
     }
-    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
+    for (i = 0; i < nvqs; i++) {
+        VirtQueue *vq = virtio_get_queue(s->vdev, i);
+
+        s->vrings[i].guest_notifier = virtio_queue_get_guest_notifier(vq);
+    }
 
     /* Set up virtqueue notify */
-    r = k->set_host_notifier(qbus->parent, 0, true);
-    if (r != 0) {
-        fprintf(stderr, "virtio-blk failed to set host notifier (%d)\n", r);
-        goto fail_host_notifier;
+    for (j = 0; j < nvqs; j++) {
+        VirtQueue *vq = virtio_get_queue(s->vdev, j);
+
+        r = k->set_host_notifier(qbus->parent, j, true);
+        if (r != 0) {
+            fprintf(stderr, "virtio-blk failed to set host notifier (%d)\n",
+                    r);
+            goto fail_host_notifier;
+        }
+        s->vrings[j].host_notifier = *virtio_queue_get_host_notifier(vq);
     }
-    s->host_notifier = *virtio_queue_get_host_notifier(vq);
 
     s->saved_complete_request = vblk->complete_request;
     vblk->complete_request = complete_request_vring;
@@ -277,20 +333,32 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     blk_set_aio_context(s->conf->conf.blk, s->ctx);
 
     /* Kick right away to begin processing requests already in vring */
-    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    for (i = 0; i < nvqs; i++) {
+        VirtQueue *vq = virtio_get_queue(s->vdev, i);
+
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
 
     /* Get this show started by hooking up our callbacks */
     aio_context_acquire(s->ctx);
-    aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify);
+    for (i = 0; i < nvqs; i++) {
+        aio_set_event_notifier_poll(s->ctx, &s->vrings[i].host_notifier,
+                                    handle_notify, handle_notify_poll);
+    }
     aio_context_release(s->ctx);
     return;
 
   fail_host_notifier:
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    while (--j >= 0) {
+        k->set_host_notifier(qbus->parent, j, false);
+    }
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
   fail_guest_notifiers:
-    vring_teardown(&s->vring, s->vdev, 0);
     s->disabled = true;
   fail_vring:
+    while (--i >= 0) {
+        vring_teardown(&s->vrings[i].vring, s->vdev, i);
+    }
     s->starting = false;
 }
 
@@ -300,6 +368,8 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+    int nvqs = s->conf->num_queues;
+    int i;
 
 
     /* Better luck next time. */
@@ -317,22 +387,26 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     aio_context_acquire(s->ctx);
 
     /* Stop notifications for new requests from guest */
-    aio_set_event_notifier(s->ctx, &s->host_notifier, NULL);
+    for (i = 0; i < nvqs; i++) {
+        aio_set_event_notifier(s->ctx, &s->vrings[i].host_notifier, NULL);
+    }
 
     /* Drain and switch bs back to the QEMU main loop */
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context());
 
     aio_context_release(s->ctx);
 
-    /* Sync vring state back to virtqueue so that non-dataplane request
-     * processing can continue when we disable the host notifier below.
-     */
-    vring_teardown(&s->vring, s->vdev, 0);
+    for (i = 0; i < nvqs; i++) {
+        /* Sync vring state back to virtqueue so that non-dataplane request
+         * processing can continue when we disable the host notifier below.
+         */
+        vring_teardown(&s->vrings[i].vring, s->vdev, i);
 
-    k->set_host_notifier(qbus->parent, 0, false);
+        k->set_host_notifier(qbus->parent, i, false);
+    }
 
-    /* Clean up guest notifier (irq) */
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
 
     s->started = false;
     s->stopping = false;
@@ -31,6 +31,28 @@ static void machine_set_accel(Object *obj, const char *value, Error **errp)
     ms->accel = g_strdup(value);
 }
 
+static char *machine_get_tcg_thread(Object *obj, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    return g_strdup(ms->tcg_multithread ? "multi" : "single");
+}
+
+static void machine_set_tcg_thread(Object *obj, const char *value,
+                                   Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    if (strcmp(value, "single") == 0) {
+        ms->tcg_multithread = false;
+    } else if (strcmp(value, "multi") == 0) {
+        ms->tcg_multithread = true;
+    } else {
+        error_setg(errp, "Invalid tcg-thread value '%s', "
+                   "expected 'single' or 'multi'", value);
+    }
+}
+
 static bool machine_get_kernel_irqchip(Object *obj, Error **errp)
 {
     MachineState *ms = MACHINE(obj);
@@ -294,6 +316,13 @@ static void machine_initfn(Object *obj)
     object_property_set_description(obj, "accel",
                                     "Accelerator list",
                                     NULL);
+    object_property_add_str(obj, "tcg-thread",
+                            machine_get_tcg_thread, machine_set_tcg_thread,
+                            NULL);
+    object_property_set_description(obj, "tcg-thread",
+                                    "Run TCG vCPUs in a single thread or "
+                                    "one thread per vCPU (single|multi)",
+                                    NULL);
     object_property_add_bool(obj, "kernel-irqchip",
                              machine_get_kernel_irqchip,
                              machine_set_kernel_irqchip,
@@ -0,0 +1,323 @@
+/*
+ * Dedicated thread for virtio-net packet processing
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * The rx and tx virtqueues of all queue pairs are kicked through host
+ * notifiers and signal the guest through guest notifiers, both handled in
+ * the AioContext of an IOThread.  The backend of each queue pair polls its
+ * file descriptors in the same AioContext, so packets flow between the
+ * backend and the guest without taking the QEMU global mutex.  The control
+ * virtqueue stays in the main loop.
+ *
+ * As in virtio-blk, the rings are accessed with the vring.c accessors while
+ * the dataplane runs.  These do not update the dirty memory bitmap, so
+ * virtio-net stops the dataplane for the duration of live migration.
+ */
+
+#include "trace.h"
+#include "qemu/error-report.h"
+#include "hw/virtio/virtio-net.h"
+#include "hw/virtio/dataplane/vring.h"
+#include "virtio-net.h"
+#include "block/aio.h"
+#include "hw/virtio/virtio-bus.h"
+#include "net/net.h"
+#include "net/vhost_net.h"
+
+typedef struct VirtIONetVq {
+    VirtIONetDataPlane *s;
+    VirtQueue *vq;
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+
+    /* Note that this EventNotifier is assigned by value.  This is
+     * fine as long as you do not call event_notifier_cleanup on it
+     * (because you don't own the file descriptor or handle; you just
+     * use it).
+     */
+    EventNotifier host_notifier;    /* doorbell */
+} VirtIONetVq;
+
+struct VirtIONetDataPlane {
+    bool started;
+    bool starting;
+    bool stopping;
+    bool disabled;
+
+    VirtIODevice *vdev;
+    VirtIONetVq *vqs;               /* rx and tx of each queue pair */
+    int nvqs;                       /* number of vqs in use while started */
+
+    IOThread *iothread;
+    AioContext *ctx;
+};
+
+static void handle_notify(EventNotifier *e)
+{
+    VirtIONetVq *r = container_of(e, VirtIONetVq, host_notifier);
+
+    event_notifier_test_and_clear(&r->host_notifier);
+    virtio_net_handle_kick(VIRTIO_NET(r->s->vdev), r->vq);
+}
+
+/* Context: IOThread or QEMU global mutex held, dataplane started */
+Vring *virtio_net_data_plane_get_vring(VirtIONetDataPlane *s, VirtQueue *vq)
+{
+    return &s->vqs[virtio_get_queue_index(vq)].vring;
+}
+
+/* Raise an interrupt to signal guest, if necessary */
+void virtio_net_data_plane_notify(VirtIONetDataPlane *s, VirtQueue *vq)
+{
+    VirtIONetVq *r = &s->vqs[virtio_get_queue_index(vq)];
+
+    if (!vring_should_notify(s->vdev, &r->vring)) {
+        return;
+    }
+
+    event_notifier_set(r->guest_notifier);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_create(VirtIODevice *vdev, IOThread *iothread,
+                                  VirtIONetDataPlane **dataplane,
+                                  Error **errp)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetDataPlane *s;
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = MAX(n->nic_conf.peers.queues, 1);
+    int i;
+
+    *dataplane = NULL;
+
+    if (!iothread) {
+        return;
+    }
+
+    /* Don't try if transport does not support notifiers. */
+    if (!k->set_guest_notifiers || !k->set_host_notifier) {
+        error_setg(errp,
+                   "device is incompatible with iothread "
+                   "(transport does not support notifiers)");
+        return;
+    }
+
+    if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
+        error_setg(errp, "iothread is not supported with tx=timer");
+        return;
+    }
+
+    if (n->net_conf.rss_queues > 1) {
+        error_setg(errp, "iothread cannot be used together with rss-queues");
+        return;
+    }
+
+    if (n->net_conf.gro) {
+        error_setg(errp, "iothread cannot be used together with gro");
+        return;
+    }
+
+    for (i = 0; i < queues; i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+        if (!qemu_can_set_aio_context(peer)) {
+            error_setg(errp, "iothread needs a netdev that supports it, "
+                       "such as tap");
+            return;
+        }
+        if (get_vhost_net(peer)) {
+            error_setg(errp, "iothread cannot be used together with vhost");
+            return;
+        }
+    }
+
+    s = g_new0(VirtIONetDataPlane, 1);
+    s->vdev = vdev;
+    s->vqs = g_new0(VirtIONetVq, queues * 2);
+    for (i = 0; i < queues * 2; i++) {
+        s->vqs[i].s = s;
+    }
+    s->iothread = iothread;
+    object_ref(OBJECT(s->iothread));
+    s->ctx = iothread_get_aio_context(s->iothread);
+
+    *dataplane = s;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+
+    virtio_net_data_plane_stop(s);
+    object_unref(OBJECT(s->iothread));
+    g_free(s->vqs);
+    g_free(s);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_start(VirtIONetDataPlane *s)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIONet *n = VIRTIO_NET(s->vdev);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int nvqs = queues * 2;
+    int i, j;
+    int r;
+
+    if (s->started || s->disabled) {
+        return;
+    }
+
+    if (s->starting) {
+        return;
+    }
+
+    s->starting = true;
+
+    /* A packet still waiting in a backend was popped from the VirtQueue and
+     * must be pushed back there.
+     */
+    for (i = 0; i < queues; i++) {
+        virtio_net_tx_abort(&n->vqs[i]);
+    }
+
+    for (i = 0; i < nvqs; i++) {
+        s->vqs[i].vq = virtio_get_queue(s->vdev, i);
+        if (!vring_setup(&s->vqs[i].vring, s->vdev, i)) {
+            goto fail_vring;
+        }
+    }
+
+    /* Set up guest notifiers (irq) */
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifier (%d)", r);
+        goto fail_guest_notifiers;
+    }
+    for (i = 0; i < nvqs; i++) {
+        s->vqs[i].guest_notifier =
+            virtio_queue_get_guest_notifier(s->vqs[i].vq);
+    }
+
+    /* Set up virtqueue notify */
+    for (j = 0; j < nvqs; j++) {
+        r = k->set_host_notifier(qbus->parent, j, true);
+        if (r != 0) {
+            error_report("virtio-net failed to set host notifier (%d)", r);
+            goto fail_host_notifier;
+        }
+        s->vqs[j].host_notifier =
+            *virtio_queue_get_host_notifier(s->vqs[j].vq);
+    }
+
+    s->nvqs = nvqs;
+    n->dataplane_started = true;
+    s->starting = false;
+    s->started = true;
+    trace_virtio_net_data_plane_start(s);
+
+    /* Move transmission and the backends over to the IOThread */
+    aio_context_acquire(s->ctx);
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        qemu_bh_delete(q->tx_bh);
+        q->tx_bh = aio_bh_new(s->ctx, virtio_net_tx_bh, q);
+        qemu_set_aio_context(qemu_get_subqueue(n->nic, i)->peer, s->ctx);
+    }
+
+    /* Get this show started by hooking up our callbacks, and kick right
+     * away to pick up buffers and packets that are already in the rings.
+     */
+    for (i = 0; i < nvqs; i++) {
+        aio_set_event_notifier(s->ctx, &s->vqs[i].host_notifier,
+                               handle_notify);
+        event_notifier_set(&s->vqs[i].host_notifier);
+    }
+    aio_context_release(s->ctx);
+    return;
+
+  fail_host_notifier:
+    while (--j >= 0) {
+        k->set_host_notifier(qbus->parent, j, false);
+    }
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+  fail_guest_notifiers:
+    s->disabled = true;
+  fail_vring:
+    while (--i >= 0) {
+        vring_teardown(&s->vqs[i].vring, s->vdev, i);
+    }
+    s->starting = false;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIONet *n = VIRTIO_NET(s->vdev);
+    int i;
+
+    /* Better luck next time. */
+    if (s->disabled) {
+        s->disabled = false;
+        return;
+    }
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_net_data_plane_stop(s);
+
+    aio_context_acquire(s->ctx);
+
+    /* Stop notifications from the guest */
+    for (i = 0; i < s->nvqs; i++) {
+        aio_set_event_notifier(s->ctx, &s->vqs[i].host_notifier, NULL);
+    }
+
+    /* Give transmission and the backends back to the main loop.  A packet
+     * still waiting in a backend was popped from the vring and is pushed
+     * back there; the transmission is rescheduled by virtio_net_set_status().
+     */
+    for (i = 0; i < s->nvqs / 2; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        virtio_net_tx_abort(q);
+        qemu_set_aio_context(qemu_get_subqueue(n->nic, i)->peer, NULL);
+        qemu_bh_delete(q->tx_bh);
+        q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+    }
+
+    n->dataplane_started = false;
+    aio_context_release(s->ctx);
+
+    for (i = 0; i < s->nvqs; i++) {
+        /* Sync vring state back to virtqueue so that non-dataplane packet
+         * processing can continue when we disable the host notifier below.
+         */
+        vring_teardown(&s->vqs[i].vring, s->vdev, i);
+
+        k->set_host_notifier(qbus->parent, i, false);
+    }
+
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, s->nvqs, false);
+
+    s->started = false;
+    s->stopping = false;
+}
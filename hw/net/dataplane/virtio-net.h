@@ -0,0 +1,29 @@
+/*
+ * Dedicated thread for virtio-net packet processing
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HW_DATAPLANE_VIRTIO_NET_H
+#define HW_DATAPLANE_VIRTIO_NET_H
+
+#include "hw/virtio/virtio.h"
+#include "hw/virtio/dataplane/vring.h"
+#include "sysemu/iothread.h"
+
+typedef struct VirtIONetDataPlane VirtIONetDataPlane;
+
+void virtio_net_data_plane_create(VirtIODevice *vdev, IOThread *iothread,
+                                  VirtIONetDataPlane **dataplane,
+                                  Error **errp);
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s);
+void virtio_net_data_plane_start(VirtIONetDataPlane *s);
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s);
+Vring *virtio_net_data_plane_get_vring(VirtIONetDataPlane *s, VirtQueue *vq);
+void virtio_net_data_plane_notify(VirtIONetDataPlane *s, VirtQueue *vq);
+
+#endif /* HW_DATAPLANE_VIRTIO_NET_H */
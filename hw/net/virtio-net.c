@@ -15,6 +15,8 @@
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/eth.h"
+#include "net/gro.h"
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
@@ -24,10 +26,13 @@
 #include "qapi/qmp/qjson.h"
 #include "qapi-event.h"
 #include "hw/virtio/virtio-access.h"
+#include "migration/migration.h"
+#include "dataplane/virtio-net.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
 #define MAC_TABLE_ENTRIES    64
+#define MAC_HASH_SIZE        (2 * MAC_TABLE_ENTRIES)    /* power of two */
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
 /*
@@ -59,11 +64,223 @@ static VirtIONetQueue *virtio_net_get_subqueue(NetClientState *nc)
     return &n->vqs[nc->queue_index];
 }
 
+/* Number of queue pairs that have a queue of their own in the netdev */
+static int virtio_net_nic_queues(VirtIONet *n)
+{
+    return MAX(n->nic_conf.peers.queues, 1);
+}
+
+/*
+ * The netdev queue of a queue pair.  The queue pairs added with the
+ * rss-queues property share the only queue of the netdev.
+ */
+static NetClientState *virtio_net_queue_nc(VirtIONet *n, int index)
+{
+    if (index >= virtio_net_nic_queues(n)) {
+        index = 0;
+    }
+    return qemu_get_subqueue(n->nic, index);
+}
+
 static int vq2q(int queue_index)
 {
     return queue_index / 2;
 }
 
+/*
+ * The receive filter looks MAC addresses up in a small open addressing hash
+ * table over mac_table.macs instead of comparing against every entry.  It is
+ * rebuilt whenever the table changes, which only the guest does and rarely.
+ */
+static unsigned mac_hash(const uint8_t *mac)
+{
+    /* The last four bytes vary the most, even between multicast groups */
+    return (ldl_be_p(mac + 2) * 0x9e3779b1u) >> 25;
+}
+
+static void virtio_net_mac_hash_rebuild(VirtIONet *n)
+{
+    int i;
+
+    QEMU_BUILD_BUG_ON(MAC_HASH_SIZE != 1 << (32 - 25));
+
+    memset(n->mac_table.hash, 0, MAC_HASH_SIZE);
+    for (i = 0; i < n->mac_table.in_use; i++) {
+        unsigned h = mac_hash(&n->mac_table.macs[i * ETH_ALEN]);
+
+        while (n->mac_table.hash[h]) {
+            h = (h + 1) & (MAC_HASH_SIZE - 1);
+        }
+        n->mac_table.hash[h] = i + 1;
+    }
+}
+
+/* Is @mac in the entries from @start to @end - 1 of the MAC table? */
+static bool virtio_net_mac_lookup(VirtIONet *n, const uint8_t *mac,
+                                  int start, int end)
+{
+    unsigned h = mac_hash(mac);
+    int entry;
+
+    while ((entry = n->mac_table.hash[h]) != 0) {
+        entry--;
+        if (entry >= start && entry < end &&
+            !memcmp(mac, &n->mac_table.macs[entry * ETH_ALEN], ETH_ALEN)) {
+            return true;
+        }
+        h = (h + 1) & (MAC_HASH_SIZE - 1);
+    }
+    return false;
+}
+
+/* The default hash key of the Microsoft RSS specification */
+static const uint8_t rss_default_key[VIRTIO_NET_RSS_MAX_KEY_SIZE] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+/*
+ * Spread flows over all queue pairs in use until the guest configures
+ * receive side scaling itself.  The queue from the indirection table is
+ * always taken modulo the number of queue pairs in use.
+ */
+static void virtio_net_rss_reset(VirtIONet *n)
+{
+    int i;
+
+    n->rss.hash_types = VIRTIO_NET_RSS_SUPPORTED_HASHES;
+    n->rss.indirection_table_mask = VIRTIO_NET_RSS_MAX_TABLE_LEN - 1;
+    n->rss.unclassified_queue = 0;
+    for (i = 0; i < VIRTIO_NET_RSS_MAX_TABLE_LEN; i++) {
+        n->rss.indirection_table[i] = i;
+    }
+    memcpy(n->rss.key, rss_default_key, sizeof(n->rss.key));
+}
+
+/*
+ * Toeplitz hash of @len bytes of @input.  The key must be at least
+ * @len + 4 bytes long.
+ */
+static uint32_t toeplitz_hash(const uint8_t *key, const uint8_t *input,
+                              size_t len)
+{
+    uint32_t hash = 0;
+    uint32_t v = ldl_be_p(key);
+    size_t i;
+    int b;
+
+    for (i = 0; i < len; i++) {
+        for (b = 7; b >= 0; b--) {
+            if (input[i] & (1 << b)) {
+                hash ^= v;
+            }
+            v = (v << 1) | ((key[i + 4] >> b) & 1);
+        }
+    }
+    return hash;
+}
+
+/*
+ * Hash the addresses, and the ports if enabled and present, of the IPv4 or
+ * IPv6 packet in the Ethernet frame at @buf.  Returns false if the frame
+ * has no hash type that is enabled.
+ */
+static bool virtio_net_rss_hash(VirtIONet *n, const uint8_t *buf, size_t size,
+                                uint32_t *hash)
+{
+    uint32_t types = n->rss.hash_types;
+    uint8_t input[2 * 16 + 4];
+    size_t off = ETH_HLEN;
+    size_t len, l4off;
+    uint16_t proto;
+    uint8_t l4proto;
+    bool ports;
+
+    if (size < ETH_HLEN) {
+        return false;
+    }
+    proto = lduw_be_p(buf + 12);
+    if (proto == ETH_P_VLAN && size >= ETH_HLEN + 4) {
+        proto = lduw_be_p(buf + 16);
+        off += 4;
+    }
+
+    if (proto == ETH_P_IP) {
+        size_t ihl;
+
+        if (size < off + 20) {
+            return false;
+        }
+        ihl = (buf[off] & 0xf) * 4;
+        if (ihl < 20) {
+            return false;
+        }
+        l4proto = buf[off + 9];
+        l4off = off + ihl;
+        /* Only the first fragment has the ports, so hash none of them */
+        ports = !(lduw_be_p(buf + off + 6) & (IP_MF | IP_OFFMASK)) &&
+            ((l4proto == IP_PROTO_TCP &&
+              (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) ||
+             (l4proto == IP_PROTO_UDP &&
+              (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4)));
+        if (!ports && !(types & VIRTIO_NET_RSS_HASH_TYPE_IPv4)) {
+            return false;
+        }
+        memcpy(input, buf + off + 12, 8);
+        len = 8;
+    } else if (proto == ETH_P_IPV6) {
+        if (size < off + 40) {
+            return false;
+        }
+        /* Extension headers are not walked */
+        l4proto = buf[off + 6];
+        l4off = off + 40;
+        ports = (l4proto == IP_PROTO_TCP &&
+                 (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv6)) ||
+                (l4proto == IP_PROTO_UDP &&
+                 (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6));
+        if (!ports && !(types & VIRTIO_NET_RSS_HASH_TYPE_IPv6)) {
+            return false;
+        }
+        memcpy(input, buf + off + 8, 32);
+        len = 32;
+    } else {
+        return false;
+    }
+
+    if (ports && size >= l4off + 4) {
+        memcpy(input + len, buf + l4off, 4);
+        len += 4;
+    }
+
+    *hash = toeplitz_hash(n->rss.key, input, len);
+    return true;
+}
+
+/* The receive queue for a packet that arrived on @nc */
+static VirtIONetQueue *virtio_net_rx_queue(VirtIONet *n, NetClientState *nc,
+                                           const uint8_t *buf, size_t size)
+{
+    uint32_t hash;
+    int index;
+
+    if (!n->net_conf.rss || n->curr_queues == 1 || size < n->host_hdr_len) {
+        return virtio_net_get_subqueue(nc);
+    }
+
+    if (virtio_net_rss_hash(n, buf + n->host_hdr_len,
+                            size - n->host_hdr_len, &hash)) {
+        index = n->rss.indirection_table[hash &
+                                         n->rss.indirection_table_mask];
+    } else {
+        index = n->rss.unclassified_queue;
+    }
+    return &n->vqs[index % n->curr_queues];
+}
+
 /* TODO
  * - we could suppress RX interrupt if we were so inclined.
  */
@@ -155,6 +372,122 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
 }
 
+static void virtio_net_dataplane_status(VirtIONet *n, uint8_t status)
+{
+    NetClientState *nc = qemu_get_queue(n->nic);
+
+    if (!n->dataplane) {
+        return;
+    }
+
+    if (virtio_net_started(n, status) && !nc->peer->link_down) {
+        virtio_net_data_plane_start(n->dataplane);
+    } else {
+        virtio_net_data_plane_stop(n->dataplane);
+    }
+}
+
+/*
+ * While the dataplane runs, its IOThread accesses the rx and tx rings
+ * through the vring.c accessors, which do not need the global mutex.  The
+ * helpers below pick the accessors that match the current mode.
+ */
+static Vring *virtio_net_vring(VirtIONet *n, VirtQueue *vq)
+{
+    if (!n->dataplane_started) {
+        return NULL;
+    }
+    return virtio_net_data_plane_get_vring(n->dataplane, vq);
+}
+
+static int virtio_net_vq_pop(VirtIONet *n, VirtQueue *vq,
+                             VirtQueueElement *elem)
+{
+    Vring *vring = virtio_net_vring(n, vq);
+
+    if (vring) {
+        return vring_pop(VIRTIO_DEVICE(n), vring, elem) >= 0;
+    }
+    return virtqueue_pop(vq, elem);
+}
+
+static void virtio_net_vq_fill(VirtIONet *n, VirtQueue *vq,
+                               VirtQueueElement *elem, unsigned int len,
+                               unsigned int idx)
+{
+    Vring *vring = virtio_net_vring(n, vq);
+
+    if (vring) {
+        vring_fill(vring, elem, len, idx);
+    } else {
+        virtqueue_fill(vq, elem, len, idx);
+    }
+}
+
+static void virtio_net_vq_flush(VirtIONet *n, VirtQueue *vq,
+                                unsigned int count)
+{
+    Vring *vring = virtio_net_vring(n, vq);
+
+    if (vring) {
+        vring_flush(vring, count);
+    } else {
+        virtqueue_flush(vq, count);
+    }
+}
+
+static void virtio_net_vq_push(VirtIONet *n, VirtQueue *vq,
+                               VirtQueueElement *elem, unsigned int len)
+{
+    virtio_net_vq_fill(n, vq, elem, len, 0);
+    virtio_net_vq_flush(n, vq, 1);
+}
+
+static void virtio_net_vq_set_notification(VirtIONet *n, VirtQueue *vq,
+                                           int enable)
+{
+    Vring *vring = virtio_net_vring(n, vq);
+
+    if (!vring) {
+        virtio_queue_set_notification(vq, enable);
+    } else if (enable) {
+        vring_enable_notification(VIRTIO_DEVICE(n), vring);
+    } else {
+        vring_disable_notification(VIRTIO_DEVICE(n), vring);
+    }
+}
+
+static bool virtio_net_vq_empty(VirtIONet *n, VirtQueue *vq)
+{
+    Vring *vring = virtio_net_vring(n, vq);
+
+    if (vring) {
+        return !vring_more_avail(vring);
+    }
+    return virtio_queue_empty(vq);
+}
+
+static bool virtio_net_vq_avail_bytes(VirtIONet *n, VirtQueue *vq,
+                                      unsigned int in_bytes)
+{
+    Vring *vring = virtio_net_vring(n, vq);
+
+    if (vring) {
+        return vring_avail_bytes(vring, in_bytes);
+    }
+    return virtqueue_avail_bytes(vq, in_bytes, 0);
+}
+
+/* Raise an interrupt for a rx or tx queue */
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    if (n->dataplane_started) {
+        virtio_net_data_plane_notify(n->dataplane, vq);
+    } else {
+        virtio_notify(VIRTIO_DEVICE(n), vq);
+    }
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -163,6 +496,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     uint8_t queue_status;
 
     virtio_net_vhost_status(n, status);
+    virtio_net_dataplane_status(n, status);
 
     for (i = 0; i < n->max_queues; i++) {
         q = &n->vqs[i];
@@ -194,6 +528,42 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     }
 }
 
+/* Disable the dataplane during live migration since its ring accessors
+ * do not update the dirty memory bitmap.
+ */
+static void virtio_net_migration_state_changed(Notifier *notifier, void *data)
+{
+    VirtIONet *n = container_of(notifier, VirtIONet,
+                                migration_state_notifier);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    MigrationState *mig = data;
+    Error *err = NULL;
+
+    if (migration_in_setup(mig)) {
+        if (!n->dataplane) {
+            return;
+        }
+        virtio_net_data_plane_destroy(n->dataplane);
+        n->dataplane = NULL;
+    } else if (migration_has_finished(mig) ||
+               migration_has_failed(mig)) {
+        if (n->dataplane || !n->iothread) {
+            return;
+        }
+        virtio_net_data_plane_create(vdev, n->iothread, &n->dataplane, &err);
+        if (err != NULL) {
+            error_report("%s", error_get_pretty(err));
+            error_free(err);
+            return;
+        }
+    } else {
+        return;
+    }
+
+    /* Restart the dataplane, or transmission in the main loop */
+    virtio_net_set_status(vdev, vdev->status);
+}
+
 static void virtio_net_set_link_status(NetClientState *nc)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
@@ -322,6 +692,7 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
+    int i;
 
     /* Reset back to compatibility mode */
     n->promisc = 1;
@@ -342,6 +713,13 @@ static void virtio_net_reset(VirtIODevice *vdev)
     n->mac_table.multi_overflow = 0;
     n->mac_table.uni_overflow = 0;
     memset(n->mac_table.macs, 0, MAC_TABLE_ENTRIES * ETH_ALEN);
+    virtio_net_mac_hash_rebuild(n);
+    virtio_net_rss_reset(n);
+    for (i = 0; i < virtio_net_nic_queues(n); i++) {
+        if (n->vqs[i].gro) {
+            net_gro_set_offloads(n->vqs[i].gro, false, false);
+        }
+    }
     memcpy(&n->mac[0], &n->nic->conf->macaddr, sizeof(n->mac));
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
@@ -382,7 +760,7 @@ static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs)
     n->guest_hdr_len = n->mergeable_rx_bufs ?
         sizeof(struct virtio_net_hdr_mrg_rxbuf) : sizeof(struct virtio_net_hdr);
 
-    for (i = 0; i < n->max_queues; i++) {
+    for (i = 0; i < virtio_net_nic_queues(n); i++) {
         nc = qemu_get_subqueue(n->nic, i);
 
         if (peer_has_vnet_hdr(n) &&
@@ -395,8 +773,13 @@ static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs)
 
 static int peer_attach(VirtIONet *n, int index)
 {
-    NetClientState *nc = qemu_get_subqueue(n->nic, index);
+    NetClientState *nc;
 
+    if (index >= virtio_net_nic_queues(n)) {
+        return 0;
+    }
+
+    nc = qemu_get_subqueue(n->nic, index);
     if (!nc->peer) {
         return 0;
     }
@@ -410,8 +793,13 @@ static int peer_attach(VirtIONet *n, int index)
 
 static int peer_detach(VirtIONet *n, int index)
 {
-    NetClientState *nc = qemu_get_subqueue(n->nic, index);
+    NetClientState *nc;
+
+    if (index >= virtio_net_nic_queues(n)) {
+        return 0;
+    }
 
+    nc = qemu_get_subqueue(n->nic, index);
     if (!nc->peer) {
         return 0;
     }
@@ -454,9 +842,12 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
         features &= ~(0x1 << VIRTIO_NET_F_HOST_TSO6);
         features &= ~(0x1 << VIRTIO_NET_F_HOST_ECN);
 
-        features &= ~(0x1 << VIRTIO_NET_F_GUEST_CSUM);
-        features &= ~(0x1 << VIRTIO_NET_F_GUEST_TSO4);
-        features &= ~(0x1 << VIRTIO_NET_F_GUEST_TSO6);
+        /* Coalesced segments are passed on as TSO frames */
+        if (!n->net_conf.gro) {
+            features &= ~(0x1 << VIRTIO_NET_F_GUEST_CSUM);
+            features &= ~(0x1 << VIRTIO_NET_F_GUEST_TSO4);
+            features &= ~(0x1 << VIRTIO_NET_F_GUEST_TSO6);
+        }
         features &= ~(0x1 << VIRTIO_NET_F_GUEST_ECN);
     }
 
@@ -488,6 +879,20 @@ static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
 
 static void virtio_net_apply_guest_offloads(VirtIONet *n)
 {
+    if (!n->has_vnet_hdr) {
+        bool csum = n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_CSUM);
+        int i;
+
+        for (i = 0; i < virtio_net_nic_queues(n); i++) {
+            net_gro_set_offloads(n->vqs[i].gro,
+                csum && (n->curr_guest_offloads &
+                         (1ULL << VIRTIO_NET_F_GUEST_TSO4)),
+                csum && (n->curr_guest_offloads &
+                         (1ULL << VIRTIO_NET_F_GUEST_TSO6)));
+        }
+        return;
+    }
+
     qemu_set_offload(qemu_get_queue(n->nic)->peer,
             !!(n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_CSUM)),
             !!(n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_TSO4)),
@@ -523,13 +928,13 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
 
     virtio_net_set_mrg_rx_bufs(n, !!(features & (1 << VIRTIO_NET_F_MRG_RXBUF)));
 
-    if (n->has_vnet_hdr) {
+    if (n->has_vnet_hdr || n->vqs[0].gro) {
         n->curr_guest_offloads =
             virtio_net_guest_offloads_by_features(features);
         virtio_net_apply_guest_offloads(n);
     }
 
-    for (i = 0;  i < n->max_queues; i++) {
+    for (i = 0;  i < virtio_net_nic_queues(n); i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
         if (!get_vhost_net(nc->peer)) {
@@ -597,7 +1002,7 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
     if (cmd == VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET) {
         uint64_t supported_offloads;
 
-        if (!n->has_vnet_hdr) {
+        if (!n->has_vnet_hdr && !n->vqs[0].gro) {
             return VIRTIO_NET_ERR;
         }
 
@@ -701,6 +1106,7 @@ static int virtio_net_handle_mac(VirtIONet *n, uint8_t cmd,
     n->mac_table.uni_overflow = uni_overflow;
     n->mac_table.multi_overflow = multi_overflow;
     memcpy(n->mac_table.macs, macs, MAC_TABLE_ENTRIES * ETH_ALEN);
+    virtio_net_mac_hash_rebuild(n);
     g_free(macs);
     rxfilter_notify(nc);
 
@@ -757,6 +1163,88 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+static int virtio_net_handle_rss(VirtIONet *n,
+                                 struct iovec *iov, unsigned int iov_cnt)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    struct virtio_net_rss_config cfg;
+    uint16_t table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    uint16_t max_tx_vq;
+    uint8_t key_len;
+    size_t s;
+    int i, queues, table_len;
+
+    if (!n->net_conf.rss) {
+        return VIRTIO_NET_ERR;
+    }
+
+    s = iov_to_buf(iov, iov_cnt, 0, &cfg, sizeof(cfg));
+    if (s != sizeof(cfg)) {
+        return VIRTIO_NET_ERR;
+    }
+    iov_discard_front(&iov, &iov_cnt, s);
+    cfg.hash_types = virtio_ldl_p(vdev, &cfg.hash_types);
+    cfg.indirection_table_mask =
+        virtio_lduw_p(vdev, &cfg.indirection_table_mask);
+    cfg.unclassified_queue = virtio_lduw_p(vdev, &cfg.unclassified_queue);
+
+    table_len = cfg.indirection_table_mask + 1;
+    if (table_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        (table_len & cfg.indirection_table_mask) ||
+        (cfg.hash_types & ~VIRTIO_NET_RSS_SUPPORTED_HASHES)) {
+        return VIRTIO_NET_ERR;
+    }
+
+    s = iov_to_buf(iov, iov_cnt, 0, table, table_len * sizeof(table[0]));
+    if (s != table_len * sizeof(table[0])) {
+        return VIRTIO_NET_ERR;
+    }
+    iov_discard_front(&iov, &iov_cnt, s);
+
+    if (iov_to_buf(iov, iov_cnt, 0, &max_tx_vq, sizeof(max_tx_vq)) !=
+        sizeof(max_tx_vq)) {
+        return VIRTIO_NET_ERR;
+    }
+    iov_discard_front(&iov, &iov_cnt, sizeof(max_tx_vq));
+    if (iov_to_buf(iov, iov_cnt, 0, &key_len, sizeof(key_len)) !=
+        sizeof(key_len)) {
+        return VIRTIO_NET_ERR;
+    }
+    iov_discard_front(&iov, &iov_cnt, sizeof(key_len));
+
+    if (key_len > sizeof(key) ||
+        iov_to_buf(iov, iov_cnt, 0, key, key_len) != key_len) {
+        return VIRTIO_NET_ERR;
+    }
+    memset(key + key_len, 0, sizeof(key) - key_len);
+
+    /* Use enough queue pairs for transmission and for every receive queue */
+    queues = MAX(virtio_lduw_p(vdev, &max_tx_vq),
+                 cfg.unclassified_queue + 1);
+    for (i = 0; i < table_len; i++) {
+        table[i] = virtio_lduw_p(vdev, &table[i]);
+        queues = MAX(queues, table[i] + 1);
+    }
+    if (queues > n->max_queues || (queues > 1 && !n->multiqueue)) {
+        return VIRTIO_NET_ERR;
+    }
+
+    n->rss.hash_types = cfg.hash_types;
+    n->rss.indirection_table_mask = cfg.indirection_table_mask;
+    n->rss.unclassified_queue = cfg.unclassified_queue;
+    memcpy(n->rss.indirection_table, table, table_len * sizeof(table[0]));
+    memcpy(n->rss.key, key, sizeof(key));
+
+    if (queues != n->curr_queues) {
+        n->curr_queues = queues;
+        virtio_net_set_status(vdev, vdev->status);
+        virtio_net_set_queues(n);
+    }
+
+    return VIRTIO_NET_OK;
+}
+
 static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
                                 struct iovec *iov, unsigned int iov_cnt)
 {
@@ -765,6 +1253,10 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     size_t s;
     uint16_t queues;
 
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG) {
+        return virtio_net_handle_rss(n, iov, iov_cnt);
+    }
+
     s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
     if (s != sizeof(mq)) {
         return VIRTIO_NET_ERR;
@@ -797,10 +1289,20 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     struct virtio_net_ctrl_hdr ctrl;
     virtio_net_ctrl_ack status = VIRTIO_NET_ERR;
     VirtQueueElement elem;
+    AioContext *ctx = NULL;
     size_t s;
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
 
+    /* The control virtqueue stays in the main loop, but the commands change
+     * state that the dataplane uses.  A command may also stop the dataplane,
+     * so remember which context to release.
+     */
+    if (n->dataplane_started) {
+        ctx = iothread_get_aio_context(n->iothread);
+        aio_context_acquire(ctx);
+    }
+
     while (virtqueue_pop(vq, &elem)) {
         if (iov_size(elem.in_sg, elem.in_num) < sizeof(status) ||
             iov_size(elem.out_sg, elem.out_num) < sizeof(ctrl)) {
@@ -835,16 +1337,43 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         virtio_notify(vdev, vq);
         g_free(iov2);
     }
+
+    if (ctx) {
+        aio_context_release(ctx);
+    }
 }
 
 /* RX */
 
-static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_net_rx_flush(VirtIONet *n);
+
+/* Let the packets that wait for receive buffers in @nc through */
+static void virtio_net_flush_queued(VirtIONet *n, NetClientState *nc)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    /* Coalesced packets were received before those still queued */
+    if (q->gro) {
+        net_gro_flush(q->gro);
+        virtio_net_rx_flush(n);
+    }
+    qemu_flush_queued_packets(nc);
+}
+
+static void virtio_net_rx_kick(VirtIONet *n, VirtQueue *vq)
 {
-    VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    int i;
+
+    if (!n->net_conf.rss) {
+        virtio_net_flush_queued(n, virtio_net_queue_nc(n, queue_index));
+        return;
+    }
 
-    qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+    /* Packets for this queue may be waiting on any queue of the netdev */
+    for (i = 0; i < virtio_net_nic_queues(n); i++) {
+        virtio_net_flush_queued(n, qemu_get_subqueue(n->nic, i));
+    }
 }
 
 static int virtio_net_can_receive(NetClientState *nc)
@@ -872,23 +1401,23 @@ static int virtio_net_can_receive(NetClientState *nc)
 static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
 {
     VirtIONet *n = q->n;
-    if (virtio_queue_empty(q->rx_vq) ||
+    if (virtio_net_vq_empty(n, q->rx_vq) ||
         (n->mergeable_rx_bufs &&
-         !virtqueue_avail_bytes(q->rx_vq, bufsize, 0))) {
-        virtio_queue_set_notification(q->rx_vq, 1);
+         !virtio_net_vq_avail_bytes(n, q->rx_vq, bufsize))) {
+        virtio_net_vq_set_notification(n, q->rx_vq, 1);
 
         /* To avoid a race condition where the guest has made some buffers
          * available after the above check but before notification was
          * enabled, check for available buffers again.
          */
-        if (virtio_queue_empty(q->rx_vq) ||
+        if (virtio_net_vq_empty(n, q->rx_vq) ||
             (n->mergeable_rx_bufs &&
-             !virtqueue_avail_bytes(q->rx_vq, bufsize, 0))) {
+             !virtio_net_vq_avail_bytes(n, q->rx_vq, bufsize))) {
             return 0;
         }
     }
 
-    virtio_queue_set_notification(q->rx_vq, 0);
+    virtio_net_vq_set_notification(n, q->rx_vq, 0);
     return 1;
 }
 
@@ -928,6 +1457,7 @@ static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
 }
 
 static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
+                           const struct virtio_net_hdr *gro_hdr,
                            const void *buf, size_t size)
 {
     if (n->has_vnet_hdr) {
@@ -937,6 +1467,11 @@ static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
                                     size - n->host_hdr_len);
         virtio_net_hdr_swap(VIRTIO_DEVICE(n), wbuf);
         iov_from_buf(iov, iov_cnt, 0, buf, sizeof(struct virtio_net_hdr));
+    } else if (gro_hdr) {
+        struct virtio_net_hdr hdr = *gro_hdr;
+
+        virtio_net_hdr_swap(VIRTIO_DEVICE(n), &hdr);
+        iov_from_buf(iov, iov_cnt, 0, &hdr, sizeof hdr);
     } else {
         struct virtio_net_hdr hdr = {
             .flags = 0,
@@ -951,7 +1486,6 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     static const uint8_t bcast[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
     static const uint8_t vlan[] = {0x81, 0x00};
     uint8_t *ptr = (uint8_t *)buf;
-    int i;
 
     if (n->promisc)
         return 1;
@@ -971,12 +1505,9 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
             return 0;
         } else if (n->allmulti || n->mac_table.multi_overflow) {
             return 1;
-        }
-
-        for (i = n->mac_table.first_multi; i < n->mac_table.in_use; i++) {
-            if (!memcmp(ptr, &n->mac_table.macs[i * ETH_ALEN], ETH_ALEN)) {
-                return 1;
-            }
+        } else if (virtio_net_mac_lookup(n, ptr, n->mac_table.first_multi,
+                                         n->mac_table.in_use)) {
+            return 1;
         }
     } else { // unicast
         if (n->nouni) {
@@ -985,22 +1516,26 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
             return 1;
         } else if (!memcmp(ptr, n->mac, ETH_ALEN)) {
             return 1;
-        }
-
-        for (i = 0; i < n->mac_table.first_multi; i++) {
-            if (!memcmp(ptr, &n->mac_table.macs[i * ETH_ALEN], ETH_ALEN)) {
-                return 1;
-            }
+        } else if (virtio_net_mac_lookup(n, ptr, 0,
+                                         n->mac_table.first_multi)) {
+            return 1;
         }
     }
 
     return 0;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/*
+ * Copy one packet into its receive queue.  The used ring entries are filled
+ * after the rx_used ones already pending in that queue, and counted there;
+ * the caller flushes them with virtio_net_rx_flush().
+ */
+static ssize_t virtio_net_do_receive(NetClientState *nc,
+                                     const struct virtio_net_hdr *gro_hdr,
+                                     const uint8_t *buf, size_t size)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
-    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIONetQueue *q;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     struct iovec mhdr_sg[VIRTQUEUE_MAX_SIZE];
     struct virtio_net_hdr_mrg_rxbuf mhdr;
@@ -1011,6 +1546,8 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         return -1;
     }
 
+    q = virtio_net_rx_queue(n, nc, buf, size);
+
     /* hdr_len refers to the header we supply to the guest */
     if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - n->host_hdr_len)) {
         return 0;
@@ -1028,7 +1565,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
 
         total = 0;
 
-        if (virtqueue_pop(q->rx_vq, &elem) == 0) {
+        if (virtio_net_vq_pop(n, q->rx_vq, &elem) == 0) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -1053,7 +1590,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem.in_num, buf, size);
+            receive_header(n, sg, elem.in_num, gro_hdr, buf, size);
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1081,7 +1618,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, &elem, total, i++);
+        virtio_net_vq_fill(n, q->rx_vq, &elem, total, q->rx_used + i++);
     }
 
     if (mhdr_cnt) {
@@ -1091,29 +1628,152 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
-
+    q->rx_used += i;
     return size;
 }
 
+/* Publish the packets received since the last flush, one interrupt per queue */
+static void virtio_net_rx_flush(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->curr_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (q->rx_used) {
+            virtio_net_vq_flush(n, q->rx_vq, q->rx_used);
+            q->rx_used = 0;
+            virtio_net_notify(n, q->rx_vq);
+        }
+    }
+}
+
+static ssize_t virtio_net_gro_deliver(void *opaque,
+                                      const struct virtio_net_hdr *hdr,
+                                      const uint8_t *buf, size_t size)
+{
+    VirtIONetQueue *q = opaque;
+
+    return virtio_net_do_receive(virtio_net_queue_nc(q->n, q - q->n->vqs),
+                                 hdr, buf, size);
+}
+
+static void virtio_net_gro_flushed(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    virtio_net_rx_flush(q->n);
+}
+
+/*
+ * Hand the segments held back to the guest when the VM stops, so that they
+ * are in guest memory when migration saves it.  This handler is registered
+ * after the one of virtio_init(), so it runs first and the device still
+ * counts as running.
+ */
+static void virtio_net_gro_vm_state_change(void *opaque, int running,
+                                           RunState state)
+{
+    VirtIONet *n = opaque;
+    int i;
+
+    if (running) {
+        return;
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        if (n->vqs[i].gro) {
+            net_gro_flush(n->vqs[i].gro);
+        }
+    }
+    virtio_net_rx_flush(n);
+}
+
+/* Receive a packet from the netdev, through the coalescing stage if any */
+static ssize_t virtio_net_receive_one(NetClientState *nc, const uint8_t *buf,
+                                      size_t size)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (q->gro) {
+        return net_gro_receive(q->gro, buf, size);
+    }
+    return virtio_net_do_receive(nc, NULL, buf, size);
+}
+
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    ssize_t ret;
+
+    ret = virtio_net_receive_one(nc, buf, size);
+    virtio_net_rx_flush(n);
+
+    return ret;
+}
+
+/*
+ * Receive as many of the packets as there are buffers for, then publish
+ * them all with one used ring update and a single interrupt per queue.
+ */
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const struct iovec *pkts, int count)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (virtio_net_receive_one(nc, pkts[i].iov_base,
+                                   pkts[i].iov_len) == 0) {
+            break;
+        }
+    }
+
+    virtio_net_rx_flush(n);
+
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
-    virtqueue_push(q->tx_vq, &q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_vq_push(n, q->tx_vq, &q->async_tx.elem, 0);
+    virtio_net_notify(n, q->tx_vq);
 
     q->async_tx.elem.out_num = q->async_tx.len = 0;
 
-    virtio_queue_set_notification(q->tx_vq, 1);
+    if (q->tx_aborting) {
+        return;
+    }
+
+    virtio_net_vq_set_notification(n, q->tx_vq, 1);
     virtio_net_flush_tx(q);
 }
 
+/*
+ * Drop the packet that still waits in the netdev, if any.  An element has
+ * to be pushed with the ring accessors it was popped with, so the dataplane
+ * calls this before it switches them.  Transmission resumes from the ring
+ * when the tx bottom half runs again.
+ */
+void virtio_net_tx_abort(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+
+    if (!q->async_tx.elem.out_num) {
+        return;
+    }
+
+    q->tx_aborting = true;
+    qemu_purge_queued_packets(virtio_net_queue_nc(n, q - n->vqs));
+    q->tx_aborting = false;
+    q->tx_waiting = 1;
+}
+
 /* TX */
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
@@ -1122,16 +1782,18 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
     VirtQueueElement elem;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *nc = virtio_net_queue_nc(n, queue_index);
+    bool shared_nc = queue_index >= virtio_net_nic_queues(n);
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
 
     if (q->async_tx.elem.out_num) {
-        virtio_queue_set_notification(q->tx_vq, 0);
+        virtio_net_vq_set_notification(n, q->tx_vq, 0);
         return num_packets;
     }
 
-    while (virtqueue_pop(q->tx_vq, &elem)) {
+    while (virtio_net_vq_pop(n, q->tx_vq, &elem)) {
         ssize_t ret, len;
         unsigned int out_num = elem.out_num;
         struct iovec *out_sg = &elem.out_sg[0];
@@ -1169,10 +1831,21 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
         len = n->guest_hdr_len;
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
+        /* virtio_net_tx_complete() could not tell which queue pair a packet
+         * on a shared netdev queue came from.  Let the netdev copy or drop
+         * such packets instead of waiting for them.
+         *
+         * Otherwise the element stays mapped in async_tx until the packet
+         * is sent, so a queued packet can refer to guest memory directly.
+         */
+        if (shared_nc) {
+            ret = qemu_sendv_packet_async(nc, out_sg, out_num, NULL);
+        } else {
+            ret = qemu_sendv_packet_async_nocopy(nc, out_sg, out_num,
+                                                 virtio_net_tx_complete);
+        }
+        if (ret == 0 && !shared_nc) {
+            virtio_net_vq_set_notification(n, q->tx_vq, 0);
             q->async_tx.elem = elem;
             q->async_tx.len  = len;
             return -EBUSY;
@@ -1180,8 +1853,8 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
         len += ret;
 
-        virtqueue_push(q->tx_vq, &elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        virtio_net_vq_push(n, q->tx_vq, &elem, 0);
+        virtio_net_notify(n, q->tx_vq);
 
         if (++num_packets >= n->tx_burst) {
             break;
@@ -1202,7 +1875,7 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
     }
 
     if (q->tx_waiting) {
-        virtio_queue_set_notification(vq, 1);
+        virtio_net_vq_set_notification(n, vq, 1);
         timer_del(q->tx_timer);
         q->tx_waiting = 0;
         virtio_net_flush_tx(q);
@@ -1210,13 +1883,13 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
         timer_mod(q->tx_timer,
                        qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
         q->tx_waiting = 1;
-        virtio_queue_set_notification(vq, 0);
+        virtio_net_vq_set_notification(n, vq, 0);
     }
 }
 
-static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_net_tx_kick(VirtIONet *n, VirtQueue *vq)
 {
-    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
     if (unlikely(q->tx_waiting)) {
@@ -1227,10 +1900,51 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
     if (!vdev->vm_running) {
         return;
     }
-    virtio_queue_set_notification(vq, 0);
+    virtio_net_vq_set_notification(n, vq, 0);
     qemu_bh_schedule(q->tx_bh);
 }
 
+/*
+ * Kicks are handled in the dataplane's IOThread.  Without ioeventfd, as
+ * with TCG, they still arrive in the main loop, so pass them on there.
+ */
+static bool virtio_net_forward_kick(VirtIONet *n, VirtQueue *vq)
+{
+    if (!n->dataplane_started) {
+        return false;
+    }
+    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    return true;
+}
+
+static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+
+    if (!virtio_net_forward_kick(n, vq)) {
+        virtio_net_rx_kick(n, vq);
+    }
+}
+
+static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+
+    if (!virtio_net_forward_kick(n, vq)) {
+        virtio_net_tx_kick(n, vq);
+    }
+}
+
+/* Context: the dataplane's IOThread */
+void virtio_net_handle_kick(VirtIONet *n, VirtQueue *vq)
+{
+    if (virtio_get_queue_index(vq) % 2 == 0) {
+        virtio_net_rx_kick(n, vq);
+    } else {
+        virtio_net_tx_kick(n, vq);
+    }
+}
+
 static void virtio_net_tx_timer(void *opaque)
 {
     VirtIONetQueue *q = opaque;
@@ -1250,11 +1964,11 @@ static void virtio_net_tx_timer(void *opaque)
         return;
     }
 
-    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_vq_set_notification(n, q->tx_vq, 1);
     virtio_net_flush_tx(q);
 }
 
-static void virtio_net_tx_bh(void *opaque)
+void virtio_net_tx_bh(void *opaque)
 {
     VirtIONetQueue *q = opaque;
     VirtIONet *n = q->n;
@@ -1291,9 +2005,9 @@ static void virtio_net_tx_bh(void *opaque)
     /* If less than a full burst, re-enable notification and flush
      * anything that may have come in while we weren't looking.  If
      * we find something, assume the guest is still active and reschedule */
-    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_vq_set_notification(n, q->tx_vq, 1);
     if (virtio_net_flush_tx(q) > 0) {
-        virtio_queue_set_notification(q->tx_vq, 0);
+        virtio_net_vq_set_notification(n, q->tx_vq, 0);
         qemu_bh_schedule(q->tx_bh);
         q->tx_waiting = 1;
     }
@@ -1381,6 +2095,16 @@ static void virtio_net_save_device(VirtIODevice *vdev, QEMUFile *f)
     if ((1 << VIRTIO_NET_F_CTRL_GUEST_OFFLOADS) & vdev->guest_features) {
         qemu_put_be64(f, n->curr_guest_offloads);
     }
+
+    if (n->net_conf.rss) {
+        qemu_put_be32(f, n->rss.hash_types);
+        qemu_put_be16(f, n->rss.indirection_table_mask);
+        qemu_put_be16(f, n->rss.unclassified_queue);
+        for (i = 0; i < VIRTIO_NET_RSS_MAX_TABLE_LEN; i++) {
+            qemu_put_be16(f, n->rss.indirection_table[i]);
+        }
+        qemu_put_buffer(f, n->rss.key, sizeof(n->rss.key));
+    }
 }
 
 static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
@@ -1492,7 +2216,25 @@ static int virtio_net_load_device(VirtIODevice *vdev, QEMUFile *f,
         n->curr_guest_offloads = virtio_net_supported_guest_offloads(n);
     }
 
-    if (peer_has_vnet_hdr(n)) {
+    if (n->net_conf.rss) {
+        n->rss.hash_types = qemu_get_be32(f);
+        n->rss.indirection_table_mask = qemu_get_be16(f);
+        n->rss.unclassified_queue = qemu_get_be16(f);
+        for (i = 0; i < VIRTIO_NET_RSS_MAX_TABLE_LEN; i++) {
+            n->rss.indirection_table[i] = qemu_get_be16(f);
+        }
+        qemu_get_buffer(f, n->rss.key, sizeof(n->rss.key));
+
+        if (n->rss.indirection_table_mask >= VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+            (n->rss.indirection_table_mask &
+             (n->rss.indirection_table_mask + 1))) {
+            error_report("virtio-net: invalid RSS indirection table mask %x",
+                         n->rss.indirection_table_mask);
+            return -1;
+        }
+    }
+
+    if (peer_has_vnet_hdr(n) || n->vqs[0].gro) {
         virtio_net_apply_guest_offloads(n);
     }
 
@@ -1505,11 +2247,12 @@ static int virtio_net_load_device(VirtIODevice *vdev, QEMUFile *f,
         }
     }
     n->mac_table.first_multi = i;
+    virtio_net_mac_hash_rebuild(n);
 
     /* nc.link_down can't be migrated, so infer link_down according
      * to link status bit in n->status */
     link_down = (n->status & VIRTIO_NET_S_LINK_UP) == 0;
-    for (i = 0; i < n->max_queues; i++) {
+    for (i = 0; i < virtio_net_nic_queues(n); i++) {
         qemu_get_subqueue(n->nic, i)->link_down = link_down;
     }
 
@@ -1527,6 +2270,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
@@ -1580,11 +2324,42 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIONet *n = VIRTIO_NET(dev);
     NetClientState *nc;
+    Error *err = NULL;
     int i;
 
+    /* vhost receives packets in the kernel, without steering them */
+    if (n->net_conf.rss && get_vhost_net(n->nic_conf.peers.ncs[0])) {
+        error_setg(errp, "rss cannot be used together with vhost");
+        return;
+    }
+    if (n->net_conf.rss_queues > 1) {
+        if (!n->net_conf.rss) {
+            error_setg(errp, "rss-queues requires rss=on");
+            return;
+        }
+        if (n->nic_conf.peers.queues > 1) {
+            error_setg(errp, "rss-queues cannot be used with a netdev "
+                       "that has more than one queue");
+            return;
+        }
+        if (n->net_conf.rss_queues * 2 + 1 > VIRTIO_PCI_QUEUE_MAX) {
+            error_setg(errp, "rss-queues must be at most %d",
+                       (VIRTIO_PCI_QUEUE_MAX - 1) / 2);
+            return;
+        }
+    }
+
+    virtio_net_data_plane_create(vdev, n->iothread, &n->dataplane, &err);
+    if (err != NULL) {
+        error_propagate(errp, err);
+        return;
+    }
+    n->migration_state_notifier.notify = virtio_net_migration_state_changed;
+    add_migration_state_change_notifier(&n->migration_state_notifier);
+
     virtio_init(vdev, "virtio-net", VIRTIO_ID_NET, n->config_size);
 
-    n->max_queues = MAX(n->nic_conf.peers.queues, 1);
+    n->max_queues = MAX(virtio_net_nic_queues(n), n->net_conf.rss_queues);
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
     n->vqs[0].rx_vq = virtio_add_queue(vdev, 256, virtio_net_handle_rx);
     n->curr_queues = 1;
@@ -1629,7 +2404,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     peer_test_vnet_hdr(n);
     if (peer_has_vnet_hdr(n)) {
-        for (i = 0; i < n->max_queues; i++) {
+        for (i = 0; i < virtio_net_nic_queues(n); i++) {
             qemu_using_vnet_hdr(qemu_get_subqueue(n->nic, i)->peer, true);
         }
         n->host_hdr_len = sizeof(struct virtio_net_hdr);
@@ -1637,6 +2412,18 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         n->host_hdr_len = 0;
     }
 
+    /* The netdev offloads large receives itself if it has vnet headers */
+    if (n->net_conf.gro && !peer_has_vnet_hdr(n)) {
+        for (i = 0; i < virtio_net_nic_queues(n); i++) {
+            n->vqs[i].n = n;
+            n->vqs[i].gro = net_gro_new(n->net_conf.gro_timeout,
+                                        virtio_net_gro_deliver,
+                                        virtio_net_gro_flushed, &n->vqs[i]);
+        }
+        n->gro_vmstate = qemu_add_vm_change_state_handler(
+                                    virtio_net_gro_vm_state_change, n);
+    }
+
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->nic_conf.macaddr.a);
 
     n->vqs[0].tx_waiting = 0;
@@ -1645,6 +2432,8 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     n->promisc = 1; /* for compatibility */
 
     n->mac_table.macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
+    n->mac_table.hash = g_malloc0(MAC_HASH_SIZE);
+    virtio_net_rss_reset(n);
 
     n->vlans = g_malloc0(MAX_VLAN >> 3);
 
@@ -1665,6 +2454,10 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
 
+    remove_migration_state_change_notifier(&n->migration_state_notifier);
+    virtio_net_data_plane_destroy(n->dataplane);
+    n->dataplane = NULL;
+
     unregister_savevm(dev, "virtio-net", n);
 
     g_free(n->netclient_name);
@@ -1673,13 +2466,20 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     n->netclient_type = NULL;
 
     g_free(n->mac_table.macs);
+    g_free(n->mac_table.hash);
     g_free(n->vlans);
 
+    if (n->gro_vmstate) {
+        qemu_del_vm_change_state_handler(n->gro_vmstate);
+        n->gro_vmstate = NULL;
+    }
+
     for (i = 0; i < n->max_queues; i++) {
         VirtIONetQueue *q = &n->vqs[i];
-        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+        NetClientState *nc = virtio_net_queue_nc(n, i);
 
         qemu_purge_queued_packets(nc);
+        net_gro_free(q->gro);
 
         if (q->tx_timer) {
             timer_del(q->tx_timer);
@@ -1705,6 +2505,10 @@ static void virtio_net_instance_init(Object *obj)
      * Can be overriden with virtio_net_set_config_size.
      */
     n->config_size = sizeof(struct virtio_net_config);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&n->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
     device_add_bootindex_property(obj, &n->nic_conf.bootindex,
                                   "bootindex", "/ethernet-phy@0",
                                   DEVICE(n), NULL);
@@ -1716,6 +2520,11 @@ static Property virtio_net_properties[] = {
                                                TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_BOOL("rss", VirtIONet, net_conf.rss, false),
+    DEFINE_PROP_UINT16("rss-queues", VirtIONet, net_conf.rss_queues, 0),
+    DEFINE_PROP_BOOL("gro", VirtIONet, net_conf.gro, false),
+    DEFINE_PROP_UINT32("gro-timeout", VirtIONet, net_conf.gro_timeout,
+                       GRO_TIMEOUT),
     DEFINE_PROP_END_OF_LIST(),
 };
 
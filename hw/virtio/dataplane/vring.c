@@ -403,15 +403,90 @@ out:
     return ret;
 }
 
-/* After we've used one of their buffers, we tell them about it.
+/* Count the device-writable bytes of an indirect descriptor table, mapping
+ * one descriptor at a time like get_indirect() does.
+ */
+static unsigned int get_indirect_in_bytes(struct vring_desc *indirect)
+{
+    unsigned int count = indirect->len / sizeof(struct vring_desc);
+    unsigned int i, bytes = 0;
+
+    for (i = 0; i < count; i++) {
+        struct vring_desc *desc_ptr;
+        MemoryRegion *mr;
+
+        desc_ptr = vring_map(&mr, indirect->addr + i * sizeof(*desc_ptr),
+                             sizeof(*desc_ptr), false);
+        if (!desc_ptr) {
+            break;
+        }
+        if (desc_ptr->flags & VRING_DESC_F_WRITE) {
+            bytes += desc_ptr->len;
+        }
+        memory_region_unref(mr);
+    }
+    return bytes;
+}
+
+/* Do the available buffers have room for at least @in_bytes?
  *
- * Stolen from linux/drivers/vhost/vhost.c.
+ * Like virtqueue_avail_bytes() for the device-writable side, without
+ * consuming any buffer.  Malformed chains end the count early; vring_pop()
+ * reports them.
  */
-void vring_push(Vring *vring, VirtQueueElement *elem, int len)
+bool vring_avail_bytes(Vring *vring, unsigned int in_bytes)
+{
+    unsigned int num = vring->vr.num;
+    unsigned int total = 0;
+    uint16_t idx, avail_idx;
+
+    if (vring->broken) {
+        return false;
+    }
+
+    avail_idx = vring->vr.avail->idx;
+    if (unlikely((uint16_t)(avail_idx - vring->last_avail_idx) > num)) {
+        return false;
+    }
+
+    /* Only get avail ring entries after they have been exposed by guest. */
+    smp_rmb();
+
+    for (idx = vring->last_avail_idx; idx != avail_idx; idx++) {
+        unsigned int i = vring->vr.avail->ring[idx % num];
+        unsigned int found = 0;
+        struct vring_desc desc;
+
+        do {
+            if (unlikely(i >= num || ++found > num)) {
+                return false;
+            }
+            desc = vring->vr.desc[i];
+
+            /* Ensure descriptor is loaded before accessing fields */
+            barrier();
+
+            if (desc.flags & VRING_DESC_F_INDIRECT) {
+                total += get_indirect_in_bytes(&desc);
+            } else if (desc.flags & VRING_DESC_F_WRITE) {
+                total += desc.len;
+            }
+            if (total >= in_bytes) {
+                return true;
+            }
+            i = desc.next;
+        } while (desc.flags & VRING_DESC_F_NEXT);
+    }
+    return false;
+}
+
+/* Put a buffer we have used into the used ring, @idx entries after the
+ * last one made visible.  The guest sees it after vring_flush().
+ */
+void vring_fill(Vring *vring, VirtQueueElement *elem, int len, int idx)
 {
     struct vring_used_elem *used;
     unsigned int head = elem->index;
-    uint16_t new;
 
     vring_unmap_element(elem);
 
@@ -422,15 +497,38 @@ void vring_push(Vring *vring, VirtQueueElement *elem, int len)
 
     /* The virtqueue contains a ring of used buffers.  Get a pointer to the
      * next entry in that used ring. */
-    used = &vring->vr.used->ring[vring->last_used_idx % vring->vr.num];
+    used = &vring->vr.used->ring[(vring->last_used_idx + idx) %
+                                 vring->vr.num];
     used->id = head;
     used->len = len;
+}
+
+/* Tell the guest about the @count buffers filled since the last flush */
+void vring_flush(Vring *vring, int count)
+{
+    uint16_t old, new;
+
+    if (vring->broken) {
+        return;
+    }
 
     /* Make sure buffer is written before we update index. */
     smp_wmb();
 
-    new = vring->vr.used->idx = ++vring->last_used_idx;
-    if (unlikely((int16_t)(new - vring->signalled_used) < (uint16_t)1)) {
+    old = vring->last_used_idx;
+    new = vring->vr.used->idx = vring->last_used_idx = old + count;
+    if (unlikely((int16_t)(new - vring->signalled_used) <
+                 (uint16_t)(new - old))) {
         vring->signalled_used_valid = false;
     }
 }
+
+/* After we've used one of their buffers, we tell them about it.
+ *
+ * Stolen from linux/drivers/vhost/vhost.c.
+ */
+void vring_push(Vring *vring, VirtQueueElement *elem, int len)
+{
+    vring_fill(vring, elem, len, 0);
+    vring_flush(vring, 1);
+}
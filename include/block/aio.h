@@ -47,6 +47,7 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -82,19 +83,52 @@ struct AioContext {
     /* Used for aio_notify.  */
     EventNotifier notifier;
 
+    /* Set by aio_notify() so that polling notices it without a syscall */
+    bool notified;
+
     /* GPollFDs for aio_poll() */
     GArray *pollfds;
 
+    /* With many handlers, aio_poll() waits on an epoll file descriptor that
+     * keeps the set of polled fds, instead of passing them all to ppoll().
+     */
+    int epollfd;
+    bool epoll_enabled;     /* epollfd holds every handler */
+    bool epoll_available;   /* epoll can be enabled once there are enough */
+
     /* Thread pool for performing work and receiving completion callbacks */
     struct ThreadPool *thread_pool;
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
+
+    /* Adaptive polling, see aio_context_set_poll_params() */
+    int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
+    int64_t poll_ns;        /* current polling time in nanoseconds */
+    int64_t poll_grow;      /* polling time growth factor */
+    int64_t poll_shrink;    /* polling time shrink factor */
+
+    /* Number of handlers without an io_poll callback; if any, the event
+     * loop does not poll because their events would be delayed.
+     */
+    int poll_disable_cnt;
+
+    /* Statistics: blocking aio_poll() calls that found work while polling,
+     * and that went to sleep in ppoll() after polling in vain.
+     */
+    uint64_t poll_hits;
+    uint64_t poll_misses;
 };
 
 /* Used internally to synchronize aio_poll against qemu_bh_schedule.  */
 void aio_set_dispatching(AioContext *ctx, bool dispatching);
 
+/* Used internally to set up and tear down the host-specific parts of an
+ * AioContext, such as the epoll file descriptor.
+ */
+void aio_context_setup(AioContext *ctx);
+void aio_context_destroy(AioContext *ctx);
+
 /**
  * aio_context_new: Allocate a new AioContext.
  *
@@ -158,6 +192,15 @@ QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque);
  */
 void aio_notify(AioContext *ctx);
 
+/**
+ * aio_notify_accept: Acknowledge receiving an aio_notify.
+ *
+ * Clear the EventNotifier of @ctx, but only if aio_notify() was called
+ * since the last time.  aio_poll() uses this once it has finished polling
+ * or sleeping, so that the same notification does not wake it up again.
+ */
+void aio_notify_accept(AioContext *ctx);
+
 /**
  * aio_bh_poll: Poll bottom halves for an AioContext.
  *
@@ -255,6 +298,20 @@ void aio_set_fd_handler(AioContext *ctx,
                         IOHandler *io_write,
                         void *opaque);
 
+/* Like aio_set_fd_handler, but also register an @io_poll callback.
+ *
+ * Before blocking, aio_poll() may busy-wait for a short while by calling
+ * @io_poll of every handler instead of sleeping in ppoll().  @io_poll must
+ * be cheap (for example, check an index in shared memory), process any
+ * work that it finds and return true if it made progress.
+ */
+void aio_set_fd_handler_poll(AioContext *ctx,
+                             int fd,
+                             IOHandler *io_read,
+                             IOHandler *io_write,
+                             AioPollFn *io_poll,
+                             void *opaque);
+
 /* Register an event notifier and associated callbacks.  Behaves very similarly
  * to event_notifier_set_handler.  Unlike event_notifier_set_handler, these callbacks
  * will be invoked when using aio_poll().
@@ -266,6 +323,14 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read);
 
+/* Like aio_set_event_notifier, with an @io_poll callback as described for
+ * aio_set_fd_handler_poll.  The callback receives @notifier as its opaque.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 EventNotifierHandler *io_read,
+                                 AioPollFn *io_poll);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -325,4 +390,21 @@ static inline void aio_timer_init(AioContext *ctx,
  */
 int64_t aio_compute_timeout(AioContext *ctx);
 
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds
+ * @grow: polling time growth factor
+ * @shrink: polling time shrink factor
+ *
+ * Poll mode can be disabled by setting poll_max_ns to 0.  The polling time
+ * adapts to the workload between 0 and @max_ns: it is multiplied by @grow
+ * (default 2) when an event arrives shortly after polling gave up, and
+ * divided by @shrink (default: reset to 0) when events take longer than
+ * @max_ns to arrive.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
 #endif
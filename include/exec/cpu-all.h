@@ -328,6 +328,11 @@ typedef struct RAMList {
     QemuMutex mutex;
     /* Protected by the iothread lock.  */
     unsigned long *dirty_memory[DIRTY_MEMORY_NUM];
+    /* One bit per word of dirty_memory[DIRTY_MEMORY_MIGRATION], set when
+     * the word may have become nonzero.  Lets migration skip clean RAM
+     * without scanning the whole bitmap.  Protected by the iothread lock.
+     */
+    unsigned long *dirty_memory_summary;
     RAMBlock *mru_block;
     /* Protected by the ramlist lock.  */
     QTAILQ_HEAD(, RAMBlock) blocks;
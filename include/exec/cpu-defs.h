@@ -69,7 +69,16 @@ typedef uint64_t target_ulong;
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
 #if !defined(CONFIG_USER_ONLY)
+/* Targets with large working sets can ask for a bigger TLB by defining
+   TARGET_TLB_BITS.  The ARM, MIPS, PPC, ia64 and s390 backends limit the
+   TLB index or its offset from env, so only x86 and aarch64 hosts honour
+   the request.  */
+#if defined(TARGET_TLB_BITS) && \
+    (defined(__i386__) || defined(__x86_64__) || defined(__aarch64__))
+#define CPU_TLB_BITS TARGET_TLB_BITS
+#else
 #define CPU_TLB_BITS 8
+#endif
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
 /* use a fully associative victim tlb of 8 entries */
 #define CPU_VTLB_SIZE 8
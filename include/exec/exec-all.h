@@ -88,6 +88,7 @@ void QEMU_NORETURN cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
+void tb_gen_superblock(CPUState *cpu, TranslationBlock *head);
 void cpu_exec_init(CPUArchState *env);
 void QEMU_NORETURN cpu_loop_exit(CPUState *cpu);
 int page_unprotect(target_ulong address, uintptr_t pc, void *puc);
@@ -116,8 +117,13 @@ static inline void tlb_flush(CPUState *cpu, int flush_global)
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+/* initial size of the TB hash table; it is doubled whenever the average
+   chain length would exceed TB_HASH_MAX_LOAD */
+#define CODE_GEN_PHYS_HASH_BITS     12
+#define TB_HASH_MAX_LOAD            2
+
+/* maximum number of blocks merged into one superblock */
+#define TB_SUPERBLOCK_MAX_BLOCKS    8
 
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
@@ -148,6 +154,8 @@ struct TranslationBlock {
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
+#define CF_SUPERBLOCK  0x40000 /* Hot trace made of several blocks */
+#define CF_INVALID     0x80000 /* Removed by tb_phys_invalidate() */
 
     void *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
@@ -171,23 +179,75 @@ struct TranslationBlock {
        jmp_first */
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
+    /* number of executions, only counted when superblocks are enabled */
+    uint32_t exec_count;
+    /* blocks making up a CF_SUPERBLOCK translation */
+    struct TBSuperblock *superblock;
+};
+
+/* Description of a superblock: the guest blocks it was built from, in
+   execution order, and which goto_tb slot of each block continues into
+   the next one.  The slot of the last block may loop back to an earlier
+   block.  It is kept so that the superblock can be retranslated for
+   cpu_restore_state().  */
+typedef struct TBSuperblock TBSuperblock;
+
+struct TBSuperblock {
+    int nb_blocks;
+    target_ulong pc[TB_SUPERBLOCK_MAX_BLOCKS];
+    uint16_t size[TB_SUPERBLOCK_MAX_BLOCKS];
+    int8_t next_slot[TB_SUPERBLOCK_MAX_BLOCKS];
+    int8_t loop_to;
+    TBSuperblock *next;
 };
 
 #include "exec/spinlock.h"
+#include "qemu/thread.h"
+
+/* Hash table of the translated blocks, keyed on physical PC, virtual PC,
+ * cs_base and flags.  Lookups do not take tb_lock: chains are published
+ * with write barriers, an unlinked TB keeps a valid phys_hash_next until
+ * the next tb_flush(), and tables replaced by a resize are only freed by
+ * tb_flush() too.  Insertion, removal and resizing require tb_lock.
+ * In user mode tb_flush() is not exclusive, so lookups take tb_lock too.
+ */
+typedef struct TBHashTable TBHashTable;
+
+struct TBHashTable {
+    unsigned int bits;
+    unsigned int mask;
+    TBHashTable *retired_next;
+    TranslationBlock *buckets[];
+};
 
 typedef struct TBContext TBContext;
 
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+    TBHashTable *tb_phys_hash;
+    /* tables replaced by a resize, freed at the next flush */
+    TBHashTable *tb_phys_hash_retired;
+    /* superblock descriptions, freed at the next flush */
+    TBSuperblock *superblocks;
+    int tb_phys_hash_count;
     int nb_tbs;
     /* any access to the tbs or the page table must use this lock */
+#if defined(CONFIG_USER_ONLY)
     spinlock_t tb_lock;
+#else
+    QemuMutex tb_lock;
+#endif
+    /* tb_flush() was requested while vCPUs were running (MTTCG) */
+    bool tb_flush_pending;
 
     /* statistics */
     int tb_flush_count;
     int tb_phys_invalidate_count;
+    int tb_phys_hash_resize_count;
+    int tb_superblock_count;
+    uint64_t tb_lookup_count;
+    uint64_t tb_lookup_miss_count;
 
     int tb_invalidated_flag;
 };
@@ -207,13 +267,35 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+static inline unsigned int tb_hash_func(tb_page_addr_t phys_pc,
+                                        target_ulong pc,
+                                        target_ulong cs_base,
+                                        uint64_t flags)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t h;
+
+    h = (uint64_t)phys_pc ^ ((uint64_t)pc * 0x9e3779b97f4a7c15ULL)
+        ^ ((uint64_t)cs_base * 0xc2b2ae3d27d4eb4fULL)
+        ^ (flags * 0x165667b19e3779f9ULL);
+    /* final mix so that the low bits depend on all the input bits */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
 }
 
+TranslationBlock *tb_htable_lookup(CPUState *cpu, target_ulong pc,
+                                   target_ulong cs_base, uint64_t flags);
+
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
+#if !defined(CONFIG_USER_ONLY)
+bool tb_flush_is_pending(void);
+void tb_flush_deferred(CPUArchState *env);
+#endif
+void tb_lock(void);
+void tb_unlock(void);
+void tb_lock_reset(void);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
 #if defined(USE_DIRECT_JUMP)
@@ -294,9 +376,14 @@ static inline void tb_set_jmp_target(TranslationBlock *tb,
 
 #endif
 
+/* Must be called with tb_lock held.  Either TB may have been invalidated
+   since it was looked up; chaining it then would resurrect it.  */
 static inline void tb_add_jump(TranslationBlock *tb, int n,
                                TranslationBlock *tb_next)
 {
+    if ((tb->cflags | tb_next->cflags) & CF_INVALID) {
+        return;
+    }
     /* NOTE: this test is only needed for thread safety */
     if (!tb->jmp_next[n]) {
         /* patch the native jump address */
@@ -360,6 +447,8 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr);
 
 /* vl.c */
 extern int singlestep;
+/* execution count that turns a block into a superblock head, 0 = off */
+extern unsigned int tb_hot_threshold;
 
 /* cpu-exec.c */
 extern volatile sig_atomic_t exit_request;
@@ -21,6 +21,25 @@ static inline void gen_tb_start(TranslationBlock *tb)
     tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
     tcg_temp_free_i32(flag);
 
+    if (tb_hot_threshold && tb->cflags == 0) {
+        /* Count executions; once the block turns hot, leave through the
+           exit request path so that cpu_exec() can build a superblock.  */
+        TCGv_ptr ptr = tcg_const_ptr(&tb->exec_count);
+        TCGv_i32 hits = tcg_temp_new_i32();
+
+        /* the counter is in the TB array, which the TB cache maps at the
+           same address in every run, so it does not stop caching */
+        tcg_ctx.host_ptr_consts = false;
+
+        tcg_gen_ld_i32(hits, ptr, 0);
+        tcg_gen_addi_i32(hits, hits, 1);
+        tcg_gen_st_i32(hits, ptr, 0);
+        tcg_gen_brcondi_i32(TCG_COND_EQ, hits, tb_hot_threshold,
+                            exitreq_label);
+        tcg_temp_free_i32(hits);
+        tcg_temp_free_ptr(ptr);
+    }
+
     if (!(tb->cflags & CF_USE_ICOUNT))
         return;
 
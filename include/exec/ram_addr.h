@@ -96,11 +96,27 @@ static inline bool cpu_physical_memory_range_includes_clean(ram_addr_t start,
     return vga || code || migration;
 }
 
+static inline void cpu_physical_memory_set_dirty_summary(unsigned long page,
+                                                         unsigned long end)
+{
+    unsigned long first = BIT_WORD(page);
+
+    if (end > page) {
+        bitmap_set(ram_list.dirty_memory_summary, first,
+                   BIT_WORD(end - 1) - first + 1);
+    }
+}
+
 static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
                                                       unsigned client)
 {
+    unsigned long page = addr >> TARGET_PAGE_BITS;
+
     assert(client < DIRTY_MEMORY_NUM);
-    set_bit(addr >> TARGET_PAGE_BITS, ram_list.dirty_memory[client]);
+    set_bit(page, ram_list.dirty_memory[client]);
+    if (client == DIRTY_MEMORY_MIGRATION) {
+        set_bit(BIT_WORD(page), ram_list.dirty_memory_summary);
+    }
 }
 
 static inline void cpu_physical_memory_set_dirty_range_nocode(ram_addr_t start,
@@ -111,6 +127,7 @@ static inline void cpu_physical_memory_set_dirty_range_nocode(ram_addr_t start,
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
     bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION], page, end - page);
+    cpu_physical_memory_set_dirty_summary(page, end);
     bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_VGA], page, end - page);
 }
 
@@ -122,6 +139,7 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
     bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION], page, end - page);
+    cpu_physical_memory_set_dirty_summary(page, end);
     bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_VGA], page, end - page);
     bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_CODE], page, end - page);
     xen_modified_memory(start, length);
@@ -151,6 +169,7 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
                 unsigned long temp = leul_to_cpu(bitmap[k]);
 
                 ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION][page + k] |= temp;
+                set_bit(page + k, ram_list.dirty_memory_summary);
                 ram_list.dirty_memory[DIRTY_MEMORY_VGA][page + k] |= temp;
                 ram_list.dirty_memory[DIRTY_MEMORY_CODE][page + k] |= temp;
             }
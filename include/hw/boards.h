@@ -124,6 +124,7 @@ struct MachineState {
     /*< public >*/
 
     char *accel;
+    bool tcg_multithread;
     bool kernel_irqchip;
     int kvm_shadow_mem;
     char *dtb;
@@ -16,6 +16,7 @@
 
 #include "hw/virtio/virtio.h"
 #include "hw/pci/pci.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -67,16 +68,27 @@
  * and latency. */
 #define TX_BURST 256
 
+/* Longest time that received TCP segments are held back to be coalesced */
+#define GRO_TIMEOUT 50000 /* 50 us */
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    bool rss;
+    uint16_t rss_queues;
+    bool gro;
+    uint32_t gro_timeout;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 << 10))
 
+/* Receive side scaling limits, see VIRTIO_NET_CTRL_MQ_RSS_CONFIG */
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE     40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN    128
+
 struct virtio_net_config
 {
     /* The config defining mac address ($ETH_ALEN bytes) */
@@ -153,6 +165,9 @@ typedef struct VirtIONetQueue {
         VirtQueueElement elem;
         ssize_t len;
     } async_tx;
+    bool tx_aborting;   /* async_tx is being dropped by virtio_net_tx_abort */
+    unsigned rx_used;   /* rx used ring entries filled but not flushed */
+    struct NetGro *gro; /* coalesces the segments from the netdev queue */
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -183,6 +198,7 @@ typedef struct VirtIONet {
         uint8_t multi_overflow;
         uint8_t uni_overflow;
         uint8_t *macs;
+        uint8_t *hash;  /* open addressing index of macs, entry + 1 or 0 */
     } mac_table;
     uint32_t *vlans;
     virtio_net_conf net_conf;
@@ -197,6 +213,18 @@ typedef struct VirtIONet {
     uint64_t curr_guest_offloads;
     QEMUTimer *announce_timer;
     int announce_counter;
+    IOThread *iothread;
+    struct VirtIONetDataPlane *dataplane;
+    bool dataplane_started;
+    Notifier migration_state_notifier;
+    VMChangeStateEntry *gro_vmstate;
+    struct {
+        uint32_t hash_types;
+        uint16_t indirection_table_mask;
+        uint16_t unclassified_queue;
+        uint16_t indirection_table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+        uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    } rss;
 } VirtIONet;
 
 #define VIRTIO_NET_CTRL_MAC    1
@@ -248,6 +276,46 @@ struct virtio_net_ctrl_mq {
  #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN        1
  #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX        0x8000
 
+/*
+ * Receive side scaling
+ *
+ * With the rss property, received packets are steered to the receive queue
+ * that the indirection table gives for the Toeplitz hash of their addresses
+ * and ports.  The command VIRTIO_NET_CTRL_MQ_RSS_CONFIG replaces the hash
+ * key, the hash types and the indirection table.  It takes a struct
+ * virtio_net_rss_config whose indirection table has
+ * indirection_table_mask + 1 entries, followed by:
+ *
+ *     u16 max_tx_vq;
+ *     u8 hash_key_length;
+ *     u8 hash_key_data[hash_key_length];
+ *
+ * The device then uses as many queue pairs as needed for max_tx_vq and for
+ * the receive queues in the table.
+ */
+struct virtio_net_rss_config {
+    uint32_t hash_types;
+    uint16_t indirection_table_mask;
+    uint16_t unclassified_queue;
+    uint16_t indirection_table[];
+};
+
+ #define VIRTIO_NET_CTRL_MQ_RSS_CONFIG          1
+
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv4          (1 << 0)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv4         (1 << 1)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv4         (1 << 2)
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv6          (1 << 3)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv6         (1 << 4)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv6         (1 << 5)
+
+#define VIRTIO_NET_RSS_SUPPORTED_HASHES (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv6)
+
 /*
  * Control network offloads
  *
@@ -289,5 +357,8 @@ struct virtio_net_ctrl_mq {
 void virtio_net_set_config_size(VirtIONet *n, uint32_t host_features);
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
                                    const char *type);
+void virtio_net_tx_bh(void *opaque);
+void virtio_net_tx_abort(VirtIONetQueue *q);
+void virtio_net_handle_kick(VirtIONet *n, VirtQueue *vq);
 
 #endif
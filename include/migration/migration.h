@@ -18,6 +18,7 @@
 #include "qemu-common.h"
 #include "qemu/thread.h"
 #include "qemu/notify.h"
+#include "qemu/event_notifier.h"
 #include "qapi/error.h"
 #include "migration/vmstate.h"
 #include "qapi-types.h"
@@ -33,14 +34,54 @@
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_POSTCOPY_PACKAGE     0x06
 
 struct MigrationParams {
     bool blk;
     bool shared;
 };
 
+/* Messages sent on the return path from destination to source */
+enum mig_rp_message_type {
+    MIG_RP_MSG_INVALID = 0,  /* Must be 0 */
+    MIG_RP_MSG_SHUT,         /* sibling will not send any more RP messages */
+    MIG_RP_MSG_REQ_PAGES,    /* data (start: be64, len: be32, id: string) */
+
+    MIG_RP_MSG_MAX
+};
+
 typedef struct MigrationState MigrationState;
 
+/* State for the incoming migration */
+typedef struct MigrationIncomingState {
+    QEMUFile *file;
+
+    /*
+     * Set once the source has switched us to postcopy, cleared by the
+     * listen thread when it is done; use atomic_read/atomic_set.
+     */
+    bool postcopy;
+
+    /* Messages from here back to the source, taken by fault/listen threads */
+    QEMUFile *return_path;
+    QemuMutex rp_mutex;
+
+    int userfault_fd;
+    EventNotifier userfault_quit;
+    QemuThread fault_thread;
+    QemuThread listen_thread;
+
+    /*
+     * Main loop only: once the listen thread is started it owns 'file'
+     * and 'return_path', and listen_bh closes them after it finished.
+     */
+    bool have_listen_thread;
+    QEMUBH *listen_bh;
+    int listen_ret;
+} MigrationIncomingState;
+
+MigrationIncomingState *migration_incoming_get_current(void);
+
 struct MigrationState
 {
     int64_t bandwidth_limit;
@@ -62,6 +103,22 @@ struct MigrationState
     int64_t xbzrle_cache_size;
     int64_t setup_time;
     int64_t dirty_sync_count;
+    int64_t dirty_sync_time;
+    int64_t dirty_sync_total_time;
+    int compress_level;
+    int compress_thread_count;
+    int decompress_thread_count;
+
+    /* Set by migrate-start-postcopy, read by the migration thread */
+    bool start_postcopy;
+
+    /* State related to the return path */
+    struct {
+        QEMUFile *file;
+        QemuThread thread;
+        bool error;
+        bool shut;
+    } rp_state;
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -105,12 +162,21 @@ void remove_migration_state_change_notifier(Notifier *notify);
 bool migration_in_setup(MigrationState *);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
+bool migration_in_postcopy(MigrationState *);
 MigrationState *migrate_get_current(void);
 
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
 void free_xbzrle_decoded_buf(void);
+void migrate_decompress_threads_join(void);
+int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len);
+int ram_postcopy_iterate(QEMUFile *f);
+int ram_load_postcopy(QEMUFile *f);
+
+void migrate_send_rp_shut(MigrationIncomingState *mis, uint32_t value);
+void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                               ram_addr_t start, size_t len);
 
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
 
@@ -125,6 +191,10 @@ uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
+uint64_t compress_mig_pages_transferred(void);
+uint64_t compress_mig_busy(void);
+uint64_t compress_mig_bytes_transferred(void);
+double compress_mig_rate(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
@@ -146,6 +216,7 @@ bool migrate_rdma_pin_all(void);
 bool migrate_zero_blocks(void);
 
 bool migrate_auto_converge(void);
+bool migrate_postcopy_ram(void);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
@@ -154,6 +225,11 @@ int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
 
+bool migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+
 int64_t xbzrle_cache_resize(int64_t new_size);
 
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
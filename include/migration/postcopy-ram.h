@@ -0,0 +1,49 @@
+/*
+ * Postcopy migration for RAM
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_POSTCOPY_RAM_H
+#define QEMU_POSTCOPY_RAM_H
+
+#include "migration/migration.h"
+
+/* Return true if the host supports everything we need to do postcopy-ram */
+bool postcopy_ram_supported_by_host(void);
+
+/*
+ * Discard the contents of 'length' bytes from 'host' so that the next
+ * access faults; used on pages that the source will send again.
+ */
+int postcopy_ram_discard_range(void *host, size_t length);
+
+/*
+ * Open the userfaultfd and register all of guest RAM with it; from then
+ * on an access to a missing page blocks until it has been placed.
+ */
+int postcopy_ram_incoming_init(MigrationIncomingState *mis);
+
+/*
+ * Start the thread that turns faults into page requests to the source,
+ * and the thread that reads the rest of the stream from 'mis->file'.
+ */
+int postcopy_ram_incoming_start(MigrationIncomingState *mis);
+
+/*
+ * Unregister guest RAM (waking anything still blocked on it) and stop
+ * the fault thread.
+ */
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis);
+
+/*
+ * Atomically fill the page at 'host' with the contents of 'from' (or with
+ * zeroes) and wake anyone waiting on it.
+ */
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from);
+int postcopy_place_zero_page(MigrationIncomingState *mis, void *host);
+
+#endif
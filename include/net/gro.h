@@ -0,0 +1,51 @@
+/*
+ * Receive segment coalescing for userspace network backends
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_NET_GRO_H
+#define QEMU_NET_GRO_H
+
+#include "qemu-common.h"
+#include "net/tap.h"
+
+typedef struct NetGro NetGro;
+
+/*
+ * Hand a frame to the NIC.  @hdr describes a frame made of coalesced TCP
+ * segments and is NULL for frames that are passed on as they came.  Returns
+ * like NetClientInfo.receive: the size if the frame was taken or dropped,
+ * 0 if the NIC has no room for it yet and -1 if it cannot receive at all.
+ */
+typedef ssize_t (NetGroDeliver)(void *opaque, const struct virtio_net_hdr *hdr,
+                                const uint8_t *buf, size_t size);
+
+/* Called after the timeout handed the frames it held to the NIC */
+typedef void (NetGroFlushed)(void *opaque);
+
+NetGro *net_gro_new(int64_t timeout_ns, NetGroDeliver *deliver,
+                    NetGroFlushed *flushed, void *opaque);
+void net_gro_free(NetGro *gro);
+
+/*
+ * Only TCP segments over the IP versions enabled here are coalesced; the
+ * NIC must be able to pass TSO frames with a partial checksum to the guest.
+ */
+void net_gro_set_offloads(NetGro *gro, bool tcp4, bool tcp6);
+
+ssize_t net_gro_receive(NetGro *gro, const uint8_t *buf, size_t size);
+
+/*
+ * Hand every frame held back to the NIC.  Returns false if the NIC had no
+ * room for some of them; those stay held until the next flush.
+ */
+bool net_gro_flush(NetGro *gro);
+
+/* Drop every frame held back */
+void net_gro_purge(NetGro *gro);
+
+#endif /* QEMU_NET_GRO_H */
@@ -33,6 +33,10 @@ typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
+/* The sender keeps the buffers of the packet valid until its sent callback
+ * is called, so a queued packet refers to them instead of a copy.
+ */
+#define QEMU_NET_PACKET_FLAG_NOCOPY  (1<<1)
 
 NetQueue *qemu_new_net_queue(void *opaque);
 
@@ -52,6 +56,7 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+bool qemu_net_queue_idle(NetQueue *queue);
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
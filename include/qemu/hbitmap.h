@@ -98,6 +98,19 @@ uint64_t hbitmap_count(const HBitmap *hb);
  */
 void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count);
 
+/**
+ * hbitmap_set_word:
+ * @hb: HBitmap to operate on.
+ * @pos: Index of the word to modify, i.e. the first bit it covers divided
+ * by BITS_PER_LONG.  Must be 0 for bitmaps with a nonzero granularity.
+ * @val: Bits to set in the word.
+ *
+ * Set the bits of @val in the @pos-th word of a granularity-0 HBitmap.
+ * This is cheaper than hbitmap_set when merging another bitmap word by
+ * word.  Return the number of bits that were not set before.
+ */
+uint64_t hbitmap_set_word(HBitmap *hb, uint64_t pos, unsigned long val);
+
 /**
  * hbitmap_reset:
  * @hb: HBitmap to operate on.
@@ -299,6 +299,21 @@ void qemu_mutex_lock_iothread(void);
  */
 void qemu_mutex_unlock_iothread(void);
 
+/**
+ * qemu_mutex_iothread_locked: Return lock status of the main loop mutex.
+ *
+ * The main loop mutex is the coarsest lock in QEMU, and as such it
+ * must always be taken outside other locks.  This function helps
+ * functions take different paths depending on whether the current
+ * thread is running within the main loop mutex.  It is mostly useful
+ * for vCPU threads under multi-threaded TCG, which run guest code
+ * without the mutex and only take it around device accesses.
+ *
+ * NOTE: tools currently are single-threaded and qemu_mutex_iothread_locked
+ * always returns true there.
+ */
+bool qemu_mutex_iothread_locked(void);
+
 /* internal interfaces */
 
 void qemu_fd_register(int fd);
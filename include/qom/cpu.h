@@ -223,6 +223,8 @@ struct kvm_run;
  * @opaque: User data.
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @mem_io_vaddr: Target virtual address at which the memory was accessed.
+ * @tlb_victim_hits: Number of softmmu TLB misses refilled from the victim TLB.
+ * @tlb_full_walks: Number of softmmu TLB misses that needed a tlb_fill().
  * @kvm_fd: vCPU file descriptor for KVM.
  *
  * State of one CPU core or thread.
@@ -280,6 +282,9 @@ struct CPUState {
     uintptr_t mem_io_pc;
     vaddr mem_io_vaddr;
 
+    uint64_t tlb_victim_hits;
+    uint64_t tlb_full_walks;
+
     int kvm_fd;
     bool kvm_vcpu_dirty;
     struct KVMState *kvm_state;
@@ -313,6 +318,20 @@ extern struct CPUTailQ cpus;
 DECLARE_TLS(CPUState *, current_cpu);
 #define current_cpu tls_var(current_cpu)
 
+/* cpus.c */
+extern bool mttcg_enabled;
+
+/**
+ * qemu_tcg_mttcg_enabled:
+ *
+ * Check whether each TCG vCPU runs in its own host thread
+ * (-machine tcg-thread=multi) rather than sharing a single
+ * round-robin thread.
+ *
+ * Returns: %true in multi-threaded TCG mode, %false otherwise.
+ */
+#define qemu_tcg_mttcg_enabled() (mttcg_enabled)
+
 /**
  * cpu_paging_enabled:
  * @cpu: The CPU whose state is to be inspected.
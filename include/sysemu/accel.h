@@ -56,6 +56,7 @@ typedef struct AccelClass {
     OBJECT_GET_CLASS(AccelClass, (obj), TYPE_ACCEL)
 
 extern int tcg_tb_size;
+extern const char *tcg_tb_cache_file;
 
 int configure_accelerator(MachineState *ms);
 
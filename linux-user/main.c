@@ -37,6 +37,7 @@
 char *exec_path;
 
 int singlestep;
+unsigned int tb_hot_threshold;
 const char *filename;
 const char *argv0;
 int gdbstub_port;
@@ -3626,6 +3627,11 @@ static void handle_arg_singlestep(const char *arg)
     singlestep = 1;
 }
 
+static void handle_arg_superblock(const char *arg)
+{
+    tb_hot_threshold = strtoul(arg, NULL, 0);
+}
+
 static void handle_arg_strace(const char *arg)
 {
     do_strace = 1;
@@ -3681,6 +3687,8 @@ static const struct qemu_argument arg_table[] = {
      "pagesize",   "set the host page size to 'pagesize'"},
     {"singlestep", "QEMU_SINGLESTEP",  false, handle_arg_singlestep,
      "",           "run in singlestep mode"},
+    {"superblock", "QEMU_SUPERBLOCK",  true,  handle_arg_superblock,
+     "threshold",  "build superblocks from blocks run 'threshold' times"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
     {"seed",       "QEMU_RAND_SEED",   true,  handle_arg_randseed,
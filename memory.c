@@ -19,6 +19,8 @@
 #include "qapi/visitor.h"
 #include "qemu/bitops.h"
 #include "qom/object.h"
+#include "qom/cpu.h"
+#include "qemu/main-loop.h"
 #include "trace.h"
 #include <assert.h>
 
@@ -1995,15 +1997,41 @@ void address_space_destroy(AddressSpace *as)
     g_free(as->ioeventfds);
 }
 
+/* Multi-threaded TCG vCPUs run guest code without the iothread mutex;
+ * device models still expect it to be held, so take it here.
+ */
+static bool io_mem_lock(void)
+{
+    if (qemu_tcg_mttcg_enabled() && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        return true;
+    }
+    return false;
+}
+
 bool io_mem_read(MemoryRegion *mr, hwaddr addr, uint64_t *pval, unsigned size)
 {
-    return memory_region_dispatch_read(mr, addr, pval, size);
+    bool locked = io_mem_lock();
+    bool ret;
+
+    ret = memory_region_dispatch_read(mr, addr, pval, size);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return ret;
 }
 
 bool io_mem_write(MemoryRegion *mr, hwaddr addr,
                   uint64_t val, unsigned size)
 {
-    return memory_region_dispatch_write(mr, addr, val, size);
+    bool locked = io_mem_lock();
+    bool ret;
+
+    ret = memory_region_dispatch_write(mr, addr, val, size);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return ret;
 }
 
 typedef struct MemoryRegionList MemoryRegionList;
@@ -16,6 +16,7 @@
 #include "qemu-common.h"
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "monitor/monitor.h"
 #include "migration/qemu-file.h"
 #include "sysemu/sysemu.h"
@@ -33,6 +34,7 @@ enum {
     MIG_STATE_CANCELLING,
     MIG_STATE_CANCELLED,
     MIG_STATE_ACTIVE,
+    MIG_STATE_POSTCOPY_ACTIVE,
     MIG_STATE_COMPLETED,
 };
 
@@ -46,6 +48,12 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Defaults for the compress capability */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT 2
+#define MAX_MIGRATE_COMPRESS_THREAD_COUNT 255
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -60,11 +68,75 @@ MigrationState *migrate_get_current(void)
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
         .mbps = -1,
+        .compress_level = DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .compress_thread_count = DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT,
+        .decompress_thread_count = DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
     };
 
     return &current_migration;
 }
 
+MigrationIncomingState *migration_incoming_get_current(void)
+{
+    static MigrationIncomingState current_incoming = {
+        .userfault_fd = -1,
+    };
+    static bool once;
+
+    if (!once) {
+        qemu_mutex_init(&current_incoming.rp_mutex);
+        once = true;
+    }
+    return &current_incoming;
+}
+
+/*
+ * Send a message on the return channel back to the source
+ * of the migration.
+ */
+static void migrate_send_rp_message(MigrationIncomingState *mis,
+                                    enum mig_rp_message_type message_type,
+                                    uint16_t len, void *data)
+{
+    trace_migrate_send_rp_message((int)message_type, len);
+    qemu_mutex_lock(&mis->rp_mutex);
+    qemu_put_be16(mis->return_path, (unsigned int)message_type);
+    qemu_put_be16(mis->return_path, len);
+    qemu_put_buffer(mis->return_path, data, len);
+    qemu_fflush(mis->return_path);
+    qemu_mutex_unlock(&mis->rp_mutex);
+}
+
+/*
+ * Send a 'SHUT' message on the return channel with the given value
+ * to indicate that we've finished with the RP.  Non-0 value indicates
+ * error.
+ */
+void migrate_send_rp_shut(MigrationIncomingState *mis, uint32_t value)
+{
+    uint32_t buf;
+
+    buf = cpu_to_be32(value);
+    migrate_send_rp_message(mis, MIG_RP_MSG_SHUT, sizeof(buf), &buf);
+}
+
+/*
+ * Request 'len' bytes of the RAMBlock 'rbname' from 'start' onwards.
+ */
+void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                               ram_addr_t start, size_t len)
+{
+    uint8_t bufc[8 + 4 + 1 + 255]; /* start, len, rbname length and name */
+    size_t rbname_len = strlen(rbname);
+
+    assert(rbname_len < 256);
+    stq_be_p(bufc, start);
+    stl_be_p(bufc + 8, len);
+    bufc[12] = rbname_len;
+    memcpy(bufc + 13, rbname, rbname_len);
+    migrate_send_rp_message(mis, MIG_RP_MSG_REQ_PAGES, 13 + rbname_len, bufc);
+}
+
 void qemu_start_incoming_migration(const char *uri, Error **errp)
 {
     const char *p;
@@ -91,12 +163,19 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
 static void process_incoming_migration_co(void *opaque)
 {
     QEMUFile *f = opaque;
+    MigrationIncomingState *mis = migration_incoming_get_current();
     Error *local_err = NULL;
     int ret;
 
+    mis->file = f;
     ret = qemu_loadvm_state(f);
-    qemu_fclose(f);
+    if (!mis->have_listen_thread) {
+        /* Otherwise it belongs to the postcopy listen thread */
+        qemu_fclose(f);
+        mis->file = NULL;
+    }
     free_xbzrle_decoded_buf();
+    migrate_decompress_threads_join();
     if (ret < 0) {
         error_report("load of migration failed: %s", strerror(-ret));
         exit(EXIT_FAILURE);
@@ -178,6 +257,18 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
     }
 }
 
+static void get_compression_stats(MigrationInfo *info)
+{
+    if (migrate_use_compression()) {
+        info->has_compression = true;
+        info->compression = g_malloc0(sizeof(*info->compression));
+        info->compression->pages = compress_mig_pages_transferred();
+        info->compression->busy = compress_mig_busy();
+        info->compression->compressed_size = compress_mig_bytes_transferred();
+        info->compression->compression_rate = compress_mig_rate();
+    }
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -194,8 +285,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIG_STATE_ACTIVE:
     case MIG_STATE_CANCELLING:
+    case MIG_STATE_POSTCOPY_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        info->status = g_strdup(s->state == MIG_STATE_POSTCOPY_ACTIVE ?
+                                "postcopy-active" : "active");
         info->has_total_time = true;
         info->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME)
             - s->total_time;
@@ -216,6 +309,8 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->dirty_sync_time = s->dirty_sync_time;
+        info->ram->dirty_sync_total_time = s->dirty_sync_total_time;
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -226,9 +321,11 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
 
         info->has_status = true;
         info->status = g_strdup("completed");
@@ -250,6 +347,8 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->dirty_sync_time = s->dirty_sync_time;
+        info->ram->dirty_sync_total_time = s->dirty_sync_total_time;
         break;
     case MIG_STATE_ERROR:
         info->has_status = true;
@@ -270,16 +369,104 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     MigrationState *s = migrate_get_current();
     MigrationCapabilityStatusList *cap;
 
-    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
 
+    for (cap = params; cap; cap = cap->next) {
+        if (cap->value->capability == MIGRATION_CAPABILITY_POSTCOPY_RAM &&
+            cap->value->state && !postcopy_ram_supported_by_host()) {
+            error_setg(errp, "Postcopy is not supported by this host");
+            return;
+        }
+    }
+
     for (cap = params; cap; cap = cap->next) {
         s->enabled_capabilities[cap->value->capability] = cap->value->state;
     }
 }
 
+void qmp_migrate_set_parameters(bool has_compress_level,
+                                int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (has_compress_level && (compress_level < 0 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress_level",
+                  "is invalid, it should be in the range of 0 to 9");
+        return;
+    }
+    if (has_compress_threads &&
+        (compress_threads < 1 ||
+         compress_threads > MAX_MIGRATE_COMPRESS_THREAD_COUNT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress_threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_decompress_threads &&
+        (decompress_threads < 1 ||
+         decompress_threads > MAX_MIGRATE_COMPRESS_THREAD_COUNT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress_threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (has_compress_level) {
+        s->compress_level = compress_level;
+    }
+    if (has_compress_threads) {
+        s->compress_thread_count = compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->decompress_thread_count = decompress_threads;
+    }
+}
+
+void qmp_migrate_start_postcopy(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_postcopy_ram()) {
+        error_setg(errp, "Enable postcopy with migrate_set_capability before"
+                         " the start of migration");
+        return;
+    }
+
+    if (s->state == MIG_STATE_NONE) {
+        error_setg(errp, "Postcopy must be started after migration has been"
+                         " started");
+        return;
+    }
+    /*
+     * we don't error if migration has finished since that would be racy
+     * with issuing this command.
+     */
+    atomic_set(&s->start_postcopy, true);
+}
+
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    MigrationParameters *params = g_malloc0(sizeof(*params));
+
+    params->compress_level = s->compress_level;
+    params->compress_threads = s->compress_thread_count;
+    params->decompress_threads = s->decompress_thread_count;
+
+    return params;
+}
+
 /* shared migration helpers */
 
 static void migrate_set_state(MigrationState *s, int old_state, int new_state)
@@ -367,12 +554,20 @@ bool migration_has_failed(MigrationState *s)
             s->state == MIG_STATE_ERROR);
 }
 
+bool migration_in_postcopy(MigrationState *s)
+{
+    return s->state == MIG_STATE_POSTCOPY_ACTIVE;
+}
+
 static MigrationState *migrate_init(const MigrationParams *params)
 {
     MigrationState *s = migrate_get_current();
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int compress_level = s->compress_level;
+    int compress_thread_count = s->compress_thread_count;
+    int decompress_thread_count = s->decompress_thread_count;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
@@ -382,6 +577,9 @@ static MigrationState *migrate_init(const MigrationParams *params)
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    s->compress_level = compress_level;
+    s->compress_thread_count = compress_thread_count;
+    s->decompress_thread_count = decompress_thread_count;
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
@@ -416,7 +614,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     params.shared = has_inc && inc;
 
     if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
-        s->state == MIG_STATE_CANCELLING) {
+        s->state == MIG_STATE_CANCELLING ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -435,6 +634,17 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (strstart(uri, "rdma:", &p) && migrate_use_compression()) {
+        error_setg(errp, "The compress capability is not supported with RDMA");
+        return;
+    }
+
+    if (migrate_postcopy_ram() &&
+        !strstart(uri, "tcp:", &p) && !strstart(uri, "unix:", &p)) {
+        error_setg(errp, "Postcopy needs a tcp: or unix: migration URI");
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -546,6 +756,15 @@ bool migrate_auto_converge(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
 }
 
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
+}
+
 bool migrate_zero_blocks(void)
 {
     MigrationState *s;
@@ -573,6 +792,188 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+bool migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_thread_count;
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->decompress_thread_count;
+}
+
+/* return path support */
+
+static void mark_source_rp_bad(MigrationState *s)
+{
+    s->rp_state.error = true;
+}
+
+/*
+ * Handles messages sent on the return path towards the source VM
+ */
+static void *source_return_path_thread(void *opaque)
+{
+    MigrationState *ms = opaque;
+    QEMUFile *rp = ms->rp_state.file;
+    uint16_t header_len, header_type;
+    uint8_t buf[8 + 4 + 1 + 256];
+    ram_addr_t start;
+    uint32_t tmp32;
+    int res;
+
+    trace_source_return_path_thread_entry();
+    while (!ms->rp_state.error && !qemu_file_get_error(rp)) {
+        trace_source_return_path_thread_loop_top();
+        header_type = qemu_get_be16(rp);
+        header_len = qemu_get_be16(rp);
+
+        if (header_len >= sizeof(buf)) {
+            error_report("RP: Received message 0x%04x with bad length %u",
+                         header_type, header_len);
+            mark_source_rp_bad(ms);
+            goto out;
+        }
+
+        res = qemu_get_buffer(rp, buf, header_len);
+        if (res != header_len) {
+            /* The destination went away, or we were told to stop */
+            break;
+        }
+
+        switch (header_type) {
+        case MIG_RP_MSG_SHUT:
+            if (header_len != sizeof(tmp32)) {
+                goto bad_len;
+            }
+            tmp32 = ldl_be_p(buf);
+            trace_source_return_path_thread_shut(tmp32);
+            if (tmp32) {
+                error_report("RP: Sibling indicated error %d", tmp32);
+                mark_source_rp_bad(ms);
+            }
+            ms->rp_state.shut = true;
+            goto out;
+
+        case MIG_RP_MSG_REQ_PAGES:
+            if (header_len < 13 || header_len != 13 + buf[12]) {
+                goto bad_len;
+            }
+            start = ldq_be_p(buf);
+            tmp32 = ldl_be_p(buf + 8);
+            buf[header_len] = '\0';
+            trace_source_return_path_thread_req_pages((char *)buf + 13,
+                                                      start, tmp32);
+            if (ram_save_queue_pages((char *)buf + 13, start, tmp32)) {
+                mark_source_rp_bad(ms);
+            }
+            break;
+
+        default:
+            error_report("RP: Received invalid message 0x%04x length 0x%04x",
+                         header_type, header_len);
+            mark_source_rp_bad(ms);
+            goto out;
+        }
+    }
+    if (qemu_file_get_error(rp)) {
+        trace_source_return_path_thread_bad_end();
+        mark_source_rp_bad(ms);
+    }
+    goto out;
+
+bad_len:
+    error_report("RP: Received '%s' message (0x%04x) with incorrect length %u",
+                 header_type == MIG_RP_MSG_SHUT ? "SHUT" : "REQ_PAGES",
+                 header_type, header_len);
+    mark_source_rp_bad(ms);
+out:
+    trace_source_return_path_thread_end();
+    return NULL;
+}
+
+static int open_return_path_on_source(MigrationState *ms)
+{
+    ms->rp_state.file = qemu_file_get_return_path(ms->file);
+    if (!ms->rp_state.file) {
+        return -1;
+    }
+
+    qemu_thread_create(&ms->rp_state.thread, "return path",
+                       source_return_path_thread, ms, QEMU_THREAD_JOINABLE);
+    return 0;
+}
+
+/* Returns 0 if the RP was ok, otherwise there was an error on the RP */
+static int await_return_path_close_on_source(MigrationState *ms)
+{
+    qemu_thread_join(&ms->rp_state.thread);
+    qemu_fclose(ms->rp_state.file);
+    ms->rp_state.file = NULL;
+    return ms->rp_state.error;
+}
+
+/*
+ * Switch from normal iteration to postcopy: stop the guest, tell the
+ * destination which pages it has to get from us and send it the device
+ * state, after which it can run the guest.
+ * Returns non-0 on error
+ */
+static int postcopy_start(MigrationState *ms, bool *old_vm_running)
+{
+    int ret;
+
+    trace_postcopy_start();
+    qemu_mutex_lock_iothread();
+    migrate_set_state(ms, MIG_STATE_ACTIVE, MIG_STATE_POSTCOPY_ACTIVE);
+    if (ms->state != MIG_STATE_POSTCOPY_ACTIVE) {
+        /* Cancelled under our feet */
+        qemu_mutex_unlock_iothread();
+        return -ECANCELED;
+    }
+
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    *old_vm_running = runstate_is_running();
+    ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    if (ret < 0) {
+        qemu_mutex_unlock_iothread();
+        return ret;
+    }
+
+    qemu_file_set_rate_limit(ms->file, INT64_MAX);
+    ret = qemu_savevm_state_postcopy_complete(ms->file);
+    trace_postcopy_start_set_run();
+    qemu_mutex_unlock_iothread();
+
+    return ret;
+}
+
 /* migration thread support */
 
 static void *migration_thread(void *opaque)
@@ -583,7 +984,15 @@ static void *migration_thread(void *opaque)
     int64_t initial_bytes = 0;
     int64_t max_size = 0;
     int64_t start_time = initial_time;
+    int64_t postcopy_downtime = 0;
     bool old_vm_running = false;
+    bool entered_postcopy = false;
+
+    if (migrate_postcopy_ram() && open_return_path_on_source(s)) {
+        error_report("Unable to open return-path for postcopy");
+        migrate_set_state(s, MIG_STATE_SETUP, MIG_STATE_ERROR);
+        goto out;
+    }
 
     qemu_savevm_state_begin(s->file, &s->params);
 
@@ -597,7 +1006,18 @@ static void *migration_thread(void *opaque)
         if (!qemu_file_rate_limit(s->file)) {
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             trace_migrate_pending(pending_size, max_size);
-            if (pending_size && pending_size >= max_size) {
+            if (pending_size && migrate_postcopy_ram() &&
+                atomic_read(&s->start_postcopy)) {
+                start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+                entered_postcopy = true;
+                if (postcopy_start(s, &old_vm_running)) {
+                    migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE,
+                                      MIG_STATE_ERROR);
+                }
+                postcopy_downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                                    start_time;
+                break;
+            } else if (pending_size && pending_size >= max_size) {
                 qemu_savevm_state_iterate(s->file);
             } else {
                 int ret;
@@ -658,19 +1078,48 @@ static void *migration_thread(void *opaque)
         }
     }
 
+    /*
+     * The destination is running the guest now; keep pushing the pages it
+     * hasn't got, serving its requests first, until it says it is done.
+     */
+    while (s->state == MIG_STATE_POSTCOPY_ACTIVE) {
+        int ret = ram_postcopy_iterate(s->file);
+
+        if (ret < 0 || qemu_file_get_error(s->file)) {
+            migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE, MIG_STATE_ERROR);
+        } else if (ret > 0) {
+            if (await_return_path_close_on_source(s)) {
+                migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE,
+                                  MIG_STATE_ERROR);
+            } else {
+                migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE,
+                                  MIG_STATE_COMPLETED);
+            }
+        }
+    }
+
+out:
+    if (s->rp_state.file) {
+        /* Nothing more is coming on it, kick the thread out of its read */
+        qemu_file_shutdown(s->rp_state.file);
+        await_return_path_close_on_source(s);
+    }
+
     qemu_mutex_lock_iothread();
     if (s->state == MIG_STATE_COMPLETED) {
         int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         uint64_t transferred_bytes = qemu_ftell(s->file);
         s->total_time = end_time - s->total_time;
-        s->downtime = end_time - start_time;
+        s->downtime = entered_postcopy ? postcopy_downtime
+                                       : end_time - start_time;
         if (s->total_time) {
             s->mbps = (((double) transferred_bytes * 8.0) /
                        ((double) s->total_time)) / 1000;
         }
         runstate_set(RUN_STATE_POSTMIGRATE);
     } else {
-        if (old_vm_running) {
+        /* After the switch the guest may already be running elsewhere */
+        if (old_vm_running && !entered_postcopy) {
             vm_start();
         }
     }
@@ -0,0 +1,421 @@
+/*
+ * Postcopy migration for RAM
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * Postcopy is a migration technique where the execution flips from the
+ * source to the destination before all the data has been copied.
+ *
+ * Guest RAM on the destination is registered with userfaultfd; a thread
+ * reads the faults and asks the source for the missing pages over the
+ * return path, while a second thread keeps loading the pages that the
+ * source streams in the background and places them atomically.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "migration/postcopy-ram.h"
+#include "qemu/error-report.h"
+#include "qemu/sockets.h"
+#include "qemu/main-loop.h"
+#include "qemu/atomic.h"
+#include "exec/cpu-common.h"
+#include "sysemu/sysemu.h"
+#include "trace.h"
+
+#ifdef CONFIG_USERFAULTFD
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+bool postcopy_ram_supported_by_host(void)
+{
+    struct uffdio_api api_struct;
+    uint64_t ioctl_mask = (__u64)1 << _UFFDIO_REGISTER |
+                          (__u64)1 << _UFFDIO_UNREGISTER;
+    int ufd;
+    bool ret = false;
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (ufd == -1) {
+        error_report("%s: userfaultfd not available: %s", __func__,
+                     strerror(errno));
+        return false;
+    }
+
+    api_struct.api = UFFD_API;
+    api_struct.features = 0;
+    if (ioctl(ufd, UFFDIO_API, &api_struct)) {
+        error_report("%s: UFFDIO_API failed: %s", __func__, strerror(errno));
+        goto out;
+    }
+
+    if ((api_struct.ioctls & ioctl_mask) != ioctl_mask) {
+        error_report("%s: Missing userfault features: %" PRIx64, __func__,
+                     (uint64_t)(~api_struct.ioctls & ioctl_mask));
+        goto out;
+    }
+    ret = true;
+
+out:
+    close(ufd);
+    return ret;
+}
+
+int postcopy_ram_discard_range(void *host, size_t length)
+{
+    trace_postcopy_ram_discard_range(host, length);
+    if (madvise(host, length, MADV_DONTNEED)) {
+        error_report("%s MADV_DONTNEED: %s", __func__, strerror(errno));
+        return -errno;
+    }
+
+    return 0;
+}
+
+static void ram_block_register(void *host_addr, ram_addr_t offset,
+                               ram_addr_t length, void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    struct uffdio_register reg_struct;
+
+    if (mis->userfault_fd == -1) {
+        /* An earlier block failed */
+        return;
+    }
+
+    reg_struct.range.start = (uintptr_t)host_addr;
+    reg_struct.range.len = length;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
+
+    if (ioctl(mis->userfault_fd, UFFDIO_REGISTER, &reg_struct)) {
+        error_report("%s userfault register: %s", __func__, strerror(errno));
+        close(mis->userfault_fd);
+        mis->userfault_fd = -1;
+        return;
+    }
+    if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_COPY))) {
+        error_report("%s userfault: Region doesn't support COPY", __func__);
+        close(mis->userfault_fd);
+        mis->userfault_fd = -1;
+    }
+}
+
+static void ram_block_unregister(void *host_addr, ram_addr_t offset,
+                                 ram_addr_t length, void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    struct uffdio_range range_struct;
+
+    range_struct.start = (uintptr_t)host_addr;
+    range_struct.len = length;
+
+    if (ioctl(mis->userfault_fd, UFFDIO_UNREGISTER, &range_struct)) {
+        error_report("%s: userfault unregister %s", __func__, strerror(errno));
+    }
+}
+
+int postcopy_ram_incoming_init(MigrationIncomingState *mis)
+{
+    struct uffdio_api api_struct;
+
+    mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (mis->userfault_fd == -1) {
+        error_report("%s: Failed to open userfault fd: %s", __func__,
+                     strerror(errno));
+        return -errno;
+    }
+
+    api_struct.api = UFFD_API;
+    api_struct.features = 0;
+    if (ioctl(mis->userfault_fd, UFFDIO_API, &api_struct)) {
+        error_report("%s: UFFDIO_API failed: %s", __func__, strerror(errno));
+        close(mis->userfault_fd);
+        mis->userfault_fd = -1;
+        return -EINVAL;
+    }
+
+    qemu_ram_foreach_block(ram_block_register, mis);
+    if (mis->userfault_fd == -1) {
+        return -EINVAL;
+    }
+
+    trace_postcopy_ram_incoming_init();
+    return 0;
+}
+
+/*
+ * Handle faults detected by the USERFAULT markings
+ */
+static void *postcopy_ram_fault_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    struct uffd_msg msg;
+    struct pollfd pfd[2];
+    size_t pagesize = getpagesize();
+    int ret;
+
+    trace_postcopy_ram_fault_thread_entry();
+    while (true) {
+        ram_addr_t rb_offset;
+        const char *rbname;
+        void *host;
+
+        pfd[0].fd = mis->userfault_fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = event_notifier_get_fd(&mis->userfault_quit);
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        if (poll(pfd, 2, -1 /* Wait forever */) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: userfault poll: %s", __func__, strerror(errno));
+            break;
+        }
+
+        if (pfd[1].revents) {
+            break;
+        }
+
+        ret = read(mis->userfault_fd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (errno == EAGAIN || errno == EINTR) {
+                /* Someone else woke the faulting thread up already */
+                continue;
+            }
+            error_report("%s: Failed to read full userfault message: %s",
+                         __func__, strerror(errno));
+            break;
+        }
+
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            error_report("%s: Read unexpected event %u from userfaultfd",
+                         __func__, msg.event);
+            continue;
+        }
+
+        host = (void *)(uintptr_t)(msg.arg.pagefault.address &
+                                   ~(uint64_t)(pagesize - 1));
+        rbname = qemu_ram_get_block_name(host, &rb_offset);
+        if (!rbname) {
+            error_report("%s: Fault on unknown address %p", __func__, host);
+            continue;
+        }
+
+        trace_postcopy_ram_fault_thread_request(host, rbname, rb_offset);
+        migrate_send_rp_req_pages(mis, rbname, rb_offset, pagesize);
+    }
+    trace_postcopy_ram_fault_thread_exit();
+    return NULL;
+}
+
+/*
+ * Runs in the main loop once the listen thread finished; the streams
+ * belonged to that thread until now.
+ */
+static void postcopy_ram_listen_bh(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+
+    qemu_bh_delete(mis->listen_bh);
+    mis->listen_bh = NULL;
+    mis->have_listen_thread = false;
+
+    qemu_fclose(mis->return_path);
+    mis->return_path = NULL;
+    qemu_fclose(mis->file);
+    mis->file = NULL;
+
+    if (mis->listen_ret < 0) {
+        /*
+         * The source no longer has a runnable guest either, and ours
+         * can't run without the memory that never arrived.
+         */
+        error_report("postcopy migration failed: %s",
+                     strerror(-mis->listen_ret));
+        vm_stop(RUN_STATE_INTERNAL_ERROR);
+    }
+}
+
+/*
+ * Load the pages that the source keeps streaming after the switch;
+ * once it says it has sent everything, drop the userfault registration
+ * and tell it that we're done.
+ */
+static void *postcopy_ram_listen_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    int ret;
+
+    ret = ram_load_postcopy(mis->file);
+    if (ret < 0) {
+        error_report("%s: Failed to load postcopy RAM: %s", __func__,
+                     strerror(-ret));
+    }
+
+    postcopy_ram_incoming_cleanup(mis);
+    atomic_set(&mis->postcopy, false);
+    migrate_send_rp_shut(mis, ret < 0 ? 1 : 0);
+
+    mis->listen_ret = ret;
+    trace_postcopy_ram_listen_thread_exit();
+    qemu_bh_schedule(mis->listen_bh);
+    return NULL;
+}
+
+int postcopy_ram_incoming_start(MigrationIncomingState *mis)
+{
+    mis->return_path = qemu_file_get_return_path(mis->file);
+    if (!mis->return_path) {
+        error_report("%s: Postcopy needs a return path", __func__);
+        return -EINVAL;
+    }
+
+    /* The main loop won't read this stream any more; the listen thread
+     * is happy to block on it.
+     */
+    qemu_set_block(qemu_get_fd(mis->file));
+
+    if (event_notifier_init(&mis->userfault_quit, false)) {
+        error_report("%s: Opening userfault_quit failed", __func__);
+        return -EINVAL;
+    }
+
+    atomic_set(&mis->postcopy, true);
+    mis->have_listen_thread = true;
+    mis->listen_bh = qemu_bh_new(postcopy_ram_listen_bh, mis);
+    qemu_thread_create(&mis->fault_thread, "postcopy/fault",
+                       postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
+    qemu_thread_create(&mis->listen_thread, "postcopy/listen",
+                       postcopy_ram_listen_thread, mis, QEMU_THREAD_DETACHED);
+    return 0;
+}
+
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
+{
+    trace_postcopy_ram_incoming_cleanup_entry();
+
+    if (mis->userfault_fd == -1) {
+        return 0;
+    }
+
+    /* Anyone still blocked on a page is woken up by the unregister */
+    qemu_ram_foreach_block(ram_block_unregister, mis);
+
+    if (atomic_read(&mis->postcopy)) {
+        event_notifier_set(&mis->userfault_quit);
+        qemu_thread_join(&mis->fault_thread);
+        event_notifier_cleanup(&mis->userfault_quit);
+    }
+
+    close(mis->userfault_fd);
+    mis->userfault_fd = -1;
+
+    trace_postcopy_ram_incoming_cleanup_exit();
+    return 0;
+}
+
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
+{
+    struct uffdio_copy copy_struct;
+
+    copy_struct.dst = (uintptr_t)host;
+    copy_struct.src = (uintptr_t)from;
+    copy_struct.len = getpagesize();
+    copy_struct.mode = 0;
+
+    /* copy also acks to the kernel waking the stalled thread up */
+    if (ioctl(mis->userfault_fd, UFFDIO_COPY, &copy_struct)) {
+        int e = errno;
+
+        /* A page we asked for twice, or one the source sent again */
+        if (e == EEXIST) {
+            return 0;
+        }
+        error_report("%s: %s copy host: %p from: %p", __func__,
+                     strerror(e), host, from);
+        return -e;
+    }
+
+    return 0;
+}
+
+int postcopy_place_zero_page(MigrationIncomingState *mis, void *host)
+{
+    struct uffdio_zeropage zero_struct;
+
+    zero_struct.range.start = (uintptr_t)host;
+    zero_struct.range.len = getpagesize();
+    zero_struct.mode = 0;
+
+    if (ioctl(mis->userfault_fd, UFFDIO_ZEROPAGE, &zero_struct)) {
+        int e = errno;
+
+        if (e == EEXIST) {
+            return 0;
+        }
+        error_report("%s: %s zero host: %p", __func__, strerror(e), host);
+        return -e;
+    }
+
+    return 0;
+}
+
+#else
+/* No target OS support, stubs just fail */
+bool postcopy_ram_supported_by_host(void)
+{
+    error_report("%s: No OS support", __func__);
+    return false;
+}
+
+int postcopy_ram_discard_range(void *host, size_t length)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_ram_incoming_init(MigrationIncomingState *mis)
+{
+    error_report("postcopy_ram_incoming_init: No OS support");
+    return -1;
+}
+
+int postcopy_ram_incoming_start(MigrationIncomingState *mis)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
+{
+    return 0;
+}
+
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_place_zero_page(MigrationIncomingState *mis, void *host)
+{
+    assert(0);
+    return -1;
+}
+#endif
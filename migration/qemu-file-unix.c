@@ -27,6 +27,10 @@
 #include "block/coroutine.h"
 #include "migration/qemu-file.h"
 
+#ifdef _WIN32
+#define SHUT_RDWR SD_BOTH
+#endif
+
 typedef struct QEMUFileSocket {
     int fd;
     QEMUFile *file;
@@ -84,6 +88,32 @@ static int socket_close(void *opaque)
     return 0;
 }
 
+/*
+ * Sockets are bidirectional, so the return path is just a second
+ * QEMUFile on a duplicate of the same descriptor.
+ */
+static QEMUFile *socket_get_return_path(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    int fd;
+
+    fd = dup(s->fd);
+    if (fd < 0) {
+        return NULL;
+    }
+    return qemu_fopen_socket(fd, qemu_file_is_writable(s->file) ? "rb" : "wb");
+}
+
+static int socket_shutdown(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+
+    if (shutdown(s->fd, SHUT_RDWR)) {
+        return -socket_error();
+    }
+    return 0;
+}
+
 static ssize_t unix_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
                                   int64_t pos)
 {
@@ -194,13 +224,17 @@ QEMUFile *qemu_fdopen(int fd, const char *mode)
 static const QEMUFileOps socket_read_ops = {
     .get_fd =     socket_get_fd,
     .get_buffer = socket_get_buffer,
-    .close =      socket_close
+    .close =      socket_close,
+    .get_return_path = socket_get_return_path,
+    .shut_down =  socket_shutdown
 };
 
 static const QEMUFileOps socket_write_ops = {
     .get_fd =     socket_get_fd,
     .writev_buffer = socket_writev_buffer,
-    .close =      socket_close
+    .close =      socket_close,
+    .get_return_path = socket_get_return_path,
+    .shut_down =  socket_shutdown
 };
 
 QEMUFile *qemu_fopen_socket(int fd, const char *mode)
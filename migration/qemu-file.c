@@ -213,6 +213,30 @@ int qemu_get_fd(QEMUFile *f)
     return -1;
 }
 
+/*
+ * Open a QEMUFile on the same transport that carries data in the opposite
+ * direction, or NULL if the transport can't do that.
+ */
+QEMUFile *qemu_file_get_return_path(QEMUFile *f)
+{
+    if (!f->ops->get_return_path) {
+        return NULL;
+    }
+    return f->ops->get_return_path(f->opaque);
+}
+
+/*
+ * Stop a file from being read/written - not all backing files can do this
+ * typically only sockets can.
+ */
+int qemu_file_shutdown(QEMUFile *f)
+{
+    if (!f->ops->shut_down) {
+        return -ENOSYS;
+    }
+    return f->ops->shut_down(f->opaque);
+}
+
 void qemu_update_position(QEMUFile *f, size_t size)
 {
     f->pos += size;
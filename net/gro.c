@@ -0,0 +1,411 @@
+/*
+ * Receive segment coalescing for userspace network backends
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Backends without vnet headers, such as socket, l2tpv3 or a tap device
+ * without offloads, hand each TCP segment to the NIC on its own.  Here,
+ * consecutive segments of a flow are merged into one large frame that the
+ * NIC passes to the guest as a TSO frame, so a bulk transfer costs the guest
+ * one descriptor and one interrupt per 64k instead of per segment.
+ *
+ * As in Linux, only segments whose headers match but for the sequence number
+ * are merged, so the guest can segment the frame again without losing
+ * anything.  A flow is handed to the NIC when a segment does not fit, when a
+ * segment is short or pushed, and at the latest after the timeout.  Frames
+ * live outside guest memory while they are held back, so the NIC flushes
+ * them before the VM stops and migration saves its state.
+ */
+
+#include "net/gro.h"
+#include "net/eth.h"
+#include "net/checksum.h"
+#include "qemu/timer.h"
+
+/* Flows coalesced at the same time, as in Linux */
+#define NET_GRO_MAX_FLOWS   8
+
+/* The length fields of the IP headers limit the size of a merged packet */
+#define NET_GRO_MAX_IP_LEN  0xffff
+
+#define NET_GRO_ETH_HLEN    sizeof(struct eth_header)
+#define NET_GRO_IP4_HLEN    sizeof(struct ip_header)
+#define NET_GRO_IP6_HLEN    sizeof(struct ip6_header)
+#define NET_GRO_TCP_HLEN    sizeof(struct tcp_header)
+
+typedef struct NetGroSegment {
+    const uint8_t *buf;
+    size_t size;            /* without Ethernet padding */
+    size_t l4_off;
+    size_t hdr_len;         /* Ethernet, IP and TCP headers */
+    bool ipv6;
+} NetGroSegment;
+
+typedef struct NetGroFlow {
+    uint8_t *buf;           /* headers of the first segment, then payloads */
+    size_t size;            /* 0 while the flow is unused */
+    size_t l4_off;
+    size_t hdr_len;
+    bool ipv6;
+    uint16_t mss;           /* payload size of the first segment */
+    uint32_t next_seq;
+    int segs;
+    uint64_t age;
+} NetGroFlow;
+
+struct NetGro {
+    NetGroFlow flows[NET_GRO_MAX_FLOWS];
+    uint64_t age;
+    bool tcp4;
+    bool tcp6;
+    bool blocked;           /* the NIC had no room for a held frame */
+    QEMUTimer *timer;
+    int64_t timeout;
+    NetGroDeliver *deliver;
+    NetGroFlushed *flushed;
+    void *opaque;
+};
+
+/* Check that @buf is a TCP segment with valid checksums that may be merged */
+static bool net_gro_parse(NetGro *gro, const uint8_t *buf, size_t size,
+                          NetGroSegment *seg)
+{
+    uint8_t *ip = (uint8_t *)buf + NET_GRO_ETH_HLEN;
+    uint8_t *tcp;
+    size_t l3_len, l4_len, tcp_hlen;
+    uint32_t csum;
+
+    if (size < NET_GRO_ETH_HLEN) {
+        return false;
+    }
+
+    switch (lduw_be_p(&PKT_GET_ETH_HDR(buf)->h_proto)) {
+    case ETH_P_IP:
+        /* No options and no fragments */
+        if (!gro->tcp4 || size < NET_GRO_ETH_HLEN + NET_GRO_IP4_HLEN ||
+            ip[0] != 0x45 || ip[9] != IP_PROTO_TCP ||
+            (lduw_be_p(ip + 6) & (IP_MF | IP_OFFMASK))) {
+            return false;
+        }
+        l3_len = lduw_be_p(ip + 2);
+        if (l3_len < NET_GRO_IP4_HLEN || l3_len > size - NET_GRO_ETH_HLEN ||
+            net_raw_checksum(ip, NET_GRO_IP4_HLEN) != 0) {
+            return false;
+        }
+        seg->ipv6 = false;
+        seg->l4_off = NET_GRO_ETH_HLEN + NET_GRO_IP4_HLEN;
+        l4_len = l3_len - NET_GRO_IP4_HLEN;
+        csum = eth_calc_pseudo_hdr_csum((struct ip_header *)ip, l4_len);
+        break;
+    case ETH_P_IPV6:
+        /* No extension headers */
+        if (!gro->tcp6 || size < NET_GRO_ETH_HLEN + NET_GRO_IP6_HLEN ||
+            (ip[0] >> 4) != IP_HEADER_VERSION_6 || ip[6] != IP_PROTO_TCP) {
+            return false;
+        }
+        l4_len = lduw_be_p(ip + 4);
+        if (l4_len > size - NET_GRO_ETH_HLEN - NET_GRO_IP6_HLEN ||
+            l4_len > NET_GRO_MAX_IP_LEN - NET_GRO_IP6_HLEN) {
+            return false;
+        }
+        seg->ipv6 = true;
+        seg->l4_off = NET_GRO_ETH_HLEN + NET_GRO_IP6_HLEN;
+        /* Pseudo header: both addresses, the length and the next header */
+        csum = net_checksum_add(32, ip + 8) + l4_len + IP_PROTO_TCP;
+        break;
+    default:
+        return false;
+    }
+
+    tcp = (uint8_t *)buf + seg->l4_off;
+    if (l4_len < NET_GRO_TCP_HLEN) {
+        return false;
+    }
+    tcp_hlen = (tcp[12] >> 4) * 4;
+    if (tcp_hlen < NET_GRO_TCP_HLEN || tcp_hlen > l4_len) {
+        return false;
+    }
+
+    /* The guest is told that the checksum of merged frames is fine */
+    csum += net_checksum_add(l4_len, tcp);
+    if (net_checksum_finish(csum) != 0) {
+        return false;
+    }
+
+    seg->buf = buf;
+    seg->size = seg->l4_off + l4_len;
+    seg->hdr_len = seg->l4_off + tcp_hlen;
+    return true;
+}
+
+/* The flow of @seg: same Ethernet header, addresses and ports */
+static NetGroFlow *net_gro_lookup(NetGro *gro, const NetGroSegment *seg)
+{
+    size_t addr_off = NET_GRO_ETH_HLEN + (seg->ipv6 ? 8 : 12);
+    size_t addr_len = seg->ipv6 ? 32 : 8;
+    int i;
+
+    for (i = 0; i < NET_GRO_MAX_FLOWS; i++) {
+        NetGroFlow *flow = &gro->flows[i];
+
+        if (flow->size && flow->ipv6 == seg->ipv6 &&
+            !memcmp(flow->buf, seg->buf, NET_GRO_ETH_HLEN) &&
+            !memcmp(flow->buf + addr_off, seg->buf + addr_off, addr_len) &&
+            !memcmp(flow->buf + flow->l4_off, seg->buf + seg->l4_off, 4)) {
+            return flow;
+        }
+    }
+    return NULL;
+}
+
+/* Whether @seg is the next segment of @flow and carries the same headers */
+static bool net_gro_can_merge(NetGroFlow *flow, const NetGroSegment *seg)
+{
+    const uint8_t *ip = seg->buf + NET_GRO_ETH_HLEN;
+    const uint8_t *flow_ip = flow->buf + NET_GRO_ETH_HLEN;
+    const uint8_t *tcp = seg->buf + seg->l4_off;
+    const uint8_t *flow_tcp = flow->buf + flow->l4_off;
+    size_t payload = seg->size - seg->hdr_len;
+
+    if (seg->hdr_len != flow->hdr_len || payload == 0 || payload > flow->mss ||
+        ldl_be_p(tcp + 4) != flow->next_seq ||
+        (tcp[13] & ~TH_PUSH) != TH_ACK ||
+        flow->size - NET_GRO_ETH_HLEN + payload > NET_GRO_MAX_IP_LEN) {
+        return false;
+    }
+
+    if (seg->ipv6) {
+        /* Traffic class, flow label and hop limit */
+        if (memcmp(ip, flow_ip, 4) || ip[7] != flow_ip[7]) {
+            return false;
+        }
+    } else {
+        /* Type of service, don't fragment and time to live */
+        if (ip[1] != flow_ip[1] || ip[8] != flow_ip[8] ||
+            (lduw_be_p(ip + 6) & IP_DF) != (lduw_be_p(flow_ip + 6) & IP_DF)) {
+            return false;
+        }
+    }
+
+    /* Acknowledgment number, window and options */
+    return !memcmp(tcp + 8, flow_tcp + 8, 4) &&
+           !memcmp(tcp + 14, flow_tcp + 14, 2) &&
+           !memcmp(tcp + NET_GRO_TCP_HLEN, flow_tcp + NET_GRO_TCP_HLEN,
+                   seg->hdr_len - seg->l4_off - NET_GRO_TCP_HLEN);
+}
+
+/* Hand the frame of @flow to the NIC, and free the flow if it was taken */
+static ssize_t net_gro_deliver_flow(NetGro *gro, NetGroFlow *flow)
+{
+    struct virtio_net_hdr hdr;
+    uint8_t *ip = flow->buf + NET_GRO_ETH_HLEN;
+    uint8_t *tcp = flow->buf + flow->l4_off;
+    size_t l4_len = flow->size - flow->l4_off;
+    uint32_t csum;
+    ssize_t ret;
+
+    if (flow->segs == 1) {
+        ret = gro->deliver(gro->opaque, NULL, flow->buf, flow->size);
+    } else {
+        /* Fix up the lengths, the guest completes the TCP checksum */
+        memset(&hdr, 0, sizeof(hdr));
+        if (flow->ipv6) {
+            stw_be_p(ip + 4, l4_len);
+            csum = net_checksum_add(32, ip + 8) + l4_len + IP_PROTO_TCP;
+            hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+        } else {
+            stw_be_p(ip + 2, flow->size - NET_GRO_ETH_HLEN);
+            eth_fix_ip4_checksum(ip, NET_GRO_IP4_HLEN);
+            csum = eth_calc_pseudo_hdr_csum((struct ip_header *)ip, l4_len);
+            hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        }
+        stw_be_p(tcp + offsetof(struct tcp_header, th_sum),
+                 ~net_checksum_finish(csum));
+
+        hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr.hdr_len = flow->hdr_len;
+        hdr.gso_size = flow->mss;
+        hdr.csum_start = flow->l4_off;
+        hdr.csum_offset = offsetof(struct tcp_header, th_sum);
+        ret = gro->deliver(gro->opaque, &hdr, flow->buf, flow->size);
+    }
+
+    if (ret == 0) {
+        gro->blocked = true;
+    } else {
+        flow->size = 0;
+    }
+    return ret;
+}
+
+/* Start a flow with @seg, or return NULL if the NIC has no room for now */
+static NetGroFlow *net_gro_start_flow(NetGro *gro, const NetGroSegment *seg)
+{
+    NetGroFlow *flow = &gro->flows[0];
+    int i;
+
+    /* Take a free flow, or make room by handing over the oldest one */
+    for (i = 0; i < NET_GRO_MAX_FLOWS; i++) {
+        if (!gro->flows[i].size) {
+            flow = &gro->flows[i];
+            break;
+        }
+        if (gro->flows[i].age < flow->age) {
+            flow = &gro->flows[i];
+        }
+    }
+    if (flow->size && net_gro_deliver_flow(gro, flow) == 0) {
+        return NULL;
+    }
+
+    if (!flow->buf) {
+        flow->buf = g_malloc(NET_GRO_ETH_HLEN + NET_GRO_MAX_IP_LEN);
+    }
+    memcpy(flow->buf, seg->buf, seg->size);
+    flow->size = seg->size;
+    flow->l4_off = seg->l4_off;
+    flow->hdr_len = seg->hdr_len;
+    flow->ipv6 = seg->ipv6;
+    flow->mss = seg->size - seg->hdr_len;
+    flow->next_seq = ldl_be_p(seg->buf + seg->l4_off + 4) + flow->mss;
+    flow->segs = 1;
+    flow->age = gro->age++;
+    return flow;
+}
+
+ssize_t net_gro_receive(NetGro *gro, const uint8_t *buf, size_t size)
+{
+    NetGroSegment seg;
+    NetGroFlow *flow;
+    const uint8_t *tcp;
+
+    /* Frames held back go first */
+    if (gro->blocked && !net_gro_flush(gro)) {
+        return 0;
+    }
+
+    if (!net_gro_parse(gro, buf, size, &seg)) {
+        return gro->deliver(gro->opaque, NULL, buf, size);
+    }
+    tcp = buf + seg.l4_off;
+
+    flow = net_gro_lookup(gro, &seg);
+    if (flow && net_gro_can_merge(flow, &seg)) {
+        size_t payload = seg.size - seg.hdr_len;
+
+        memcpy(flow->buf + flow->size, buf + seg.hdr_len, payload);
+        flow->size += payload;
+        flow->next_seq += payload;
+        flow->segs++;
+
+        /* A short or pushed segment ends the burst */
+        if (payload < flow->mss || (tcp[13] & TH_PUSH)) {
+            flow->buf[flow->l4_off + 13] |= tcp[13] & TH_PUSH;
+            net_gro_deliver_flow(gro, flow);
+        }
+        return size;
+    }
+
+    /* Keep the segments of a flow in order */
+    if (flow && net_gro_deliver_flow(gro, flow) == 0) {
+        return 0;
+    }
+
+    /* Only bulk data is held back */
+    if (tcp[13] != TH_ACK || seg.size == seg.hdr_len) {
+        return gro->deliver(gro->opaque, NULL, buf, size);
+    }
+
+    if (!net_gro_start_flow(gro, &seg)) {
+        return 0;
+    }
+    if (!timer_pending(gro->timer)) {
+        timer_mod(gro->timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + gro->timeout);
+    }
+    return size;
+}
+
+bool net_gro_flush(NetGro *gro)
+{
+    int i;
+
+    gro->blocked = false;
+    for (i = 0; i < NET_GRO_MAX_FLOWS; i++) {
+        if (gro->flows[i].size &&
+            net_gro_deliver_flow(gro, &gro->flows[i]) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void net_gro_purge(NetGro *gro)
+{
+    int i;
+
+    for (i = 0; i < NET_GRO_MAX_FLOWS; i++) {
+        gro->flows[i].size = 0;
+    }
+    gro->blocked = false;
+    timer_del(gro->timer);
+}
+
+void net_gro_set_offloads(NetGro *gro, bool tcp4, bool tcp6)
+{
+    /* The guest may not understand the frames held back anymore */
+    if ((gro->tcp4 && !tcp4) || (gro->tcp6 && !tcp6)) {
+        net_gro_purge(gro);
+    }
+    gro->tcp4 = tcp4;
+    gro->tcp6 = tcp6;
+}
+
+static void net_gro_timer(void *opaque)
+{
+    NetGro *gro = opaque;
+
+    /* Try again later if the NIC had no room for everything */
+    if (!net_gro_flush(gro)) {
+        timer_mod(gro->timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + gro->timeout);
+    }
+    if (gro->flushed) {
+        gro->flushed(gro->opaque);
+    }
+}
+
+NetGro *net_gro_new(int64_t timeout_ns, NetGroDeliver *deliver,
+                    NetGroFlushed *flushed, void *opaque)
+{
+    NetGro *gro = g_new0(NetGro, 1);
+
+    gro->timeout = timeout_ns;
+    gro->deliver = deliver;
+    gro->flushed = flushed;
+    gro->opaque = opaque;
+    gro->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, net_gro_timer, gro);
+
+    return gro;
+}
+
+void net_gro_free(NetGro *gro)
+{
+    int i;
+
+    if (!gro) {
+        return;
+    }
+
+    timer_del(gro->timer);
+    timer_free(gro->timer);
+    for (i = 0; i < NET_GRO_MAX_FLOWS; i++) {
+        g_free(gro->flows[i].buf);
+    }
+    g_free(gro);
+}
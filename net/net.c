@@ -452,6 +452,23 @@ void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
     nc->info->set_vnet_hdr_len(nc, len);
 }
 
+bool qemu_can_set_aio_context(NetClientState *nc)
+{
+    return nc && nc->info->set_aio_context;
+}
+
+/*
+ * Poll the backend in @ctx instead of the main loop, or in the main loop
+ * again if @ctx is NULL.  All of its packets are then sent and received
+ * in the thread that runs @ctx.
+ */
+void qemu_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    assert(qemu_can_set_aio_context(nc));
+
+    nc->info->set_aio_context(nc, ctx);
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     int vm_running = runstate_is_running();
@@ -567,6 +584,46 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+/*
+ * Send @count packets, each of them contiguous and described by one entry
+ * of @pkts.  If the peer has a receive_batch handler and nothing is queued
+ * for it, the packets are handed over with a single call; whatever it does
+ * not take goes through the queue one by one.  Every queued packet gets
+ * @sent_cb, so that a full queue does not drop it; the caller must stop
+ * sending until @sent_cb is called if fewer than @count packets are
+ * returned as sent.
+ */
+int qemu_send_packet_batch_async(NetClientState *sender,
+                                 const struct iovec *pkts, int count,
+                                 NetPacketSent *sent_cb)
+{
+    NetClientState *peer = sender->peer;
+    int sent = 0;
+    int i = 0;
+
+    if (sender->link_down || !peer) {
+        return count;
+    }
+
+    if (peer->info->receive_batch && !peer->link_down &&
+        qemu_net_queue_idle(peer->incoming_queue) &&
+        qemu_can_send_packet(sender)) {
+        sent = i = peer->info->receive_batch(peer, pkts, count);
+    }
+
+    for (; i < count; i++) {
+        ssize_t ret;
+
+        ret = qemu_send_packet_async(sender, pkts[i].iov_base,
+                                     pkts[i].iov_len, sent_cb);
+        if (ret != 0) {
+            sent++;
+        }
+    }
+
+    return sent;
+}
+
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     qemu_send_packet_async(nc, buf, size, NULL);
@@ -636,6 +693,30 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                    iov, iovcnt, sent_cb);
 }
 
+/*
+ * Like qemu_sendv_packet_async(), but if the packet has to be queued, the
+ * queue refers to the buffers in @iov instead of copying them.  They must
+ * stay valid and unchanged until @sent_cb is called.
+ */
+ssize_t qemu_sendv_packet_async_nocopy(NetClientState *sender,
+                                       const struct iovec *iov, int iovcnt,
+                                       NetPacketSent *sent_cb)
+{
+    NetQueue *queue;
+
+    assert(sent_cb);
+
+    if (sender->link_down || !sender->peer) {
+        return iov_size(iov, iovcnt);
+    }
+
+    queue = sender->peer->incoming_queue;
+
+    return qemu_net_queue_send_iov(queue, sender,
+                                   QEMU_NET_PACKET_FLAG_NOCOPY,
+                                   iov, iovcnt, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
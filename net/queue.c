@@ -23,6 +23,7 @@
 
 #include "net/queue.h"
 #include "qemu/queue.h"
+#include "qemu/iov.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -37,6 +38,10 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * A packet sent with QEMU_NET_PACKET_FLAG_NOCOPY and a sent callback is
+ * queued without copying its data; the sender's buffers are used until the
+ * callback has been invoked.
  */
 
 struct NetPacket {
@@ -44,8 +49,10 @@ struct NetPacket {
     NetClientState *sender;
     unsigned flags;
     int size;
+    int iovcnt;
     NetPacketSent *sent_cb;
-    uint8_t data[0];
+    struct iovec *iov;      /* the sender's buffers, for NOCOPY packets */
+    uint8_t data[0];        /* the packet, or the iovec array iov points to */
 };
 
 struct NetQueue {
@@ -103,7 +110,9 @@ static void qemu_net_queue_append(NetQueue *queue,
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
+    packet->iovcnt = 0;
     packet->sent_cb = sent_cb;
+    packet->iov = NULL;
     memcpy(packet->data, buf, size);
 
     queue->nq_count++;
@@ -124,6 +133,23 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
+
+    if ((flags & QEMU_NET_PACKET_FLAG_NOCOPY) && sent_cb) {
+        /* Only the iovec array is copied, the data stays where it is */
+        packet = g_malloc(sizeof(NetPacket) + iovcnt * sizeof(*iov));
+        packet->sender = sender;
+        packet->sent_cb = sent_cb;
+        packet->flags = flags;
+        packet->size = iov_size(iov, iovcnt);
+        packet->iovcnt = iovcnt;
+        packet->iov = (struct iovec *)packet->data;
+        memcpy(packet->iov, iov, iovcnt * sizeof(*iov));
+
+        queue->nq_count++;
+        QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+        return;
+    }
+
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
@@ -133,6 +159,8 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
     packet->sent_cb = sent_cb;
     packet->flags = flags;
     packet->size = 0;
+    packet->iovcnt = 0;
+    packet->iov = NULL;
 
     for (i = 0; i < iovcnt; i++) {
         size_t len = iov[i].iov_len;
@@ -175,6 +203,12 @@ static ssize_t qemu_net_queue_deliver_iov(NetQueue *queue,
     return ret;
 }
 
+/* Whether a packet could be delivered now without overtaking queued ones */
+bool qemu_net_queue_idle(NetQueue *queue)
+{
+    return !queue->delivering && QTAILQ_EMPTY(&queue->packets);
+}
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
                             unsigned flags,
@@ -251,11 +285,19 @@ bool qemu_net_queue_flush(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         queue->nq_count--;
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
+        if (packet->iov) {
+            ret = qemu_net_queue_deliver_iov(queue,
+                                             packet->sender,
+                                             packet->flags,
+                                             packet->iov,
+                                             packet->iovcnt);
+        } else {
+            ret = qemu_net_queue_deliver(queue,
+                                         packet->sender,
+                                         packet->flags,
+                                         packet->data,
+                                         packet->size);
+        }
         if (ret == 0) {
             queue->nq_count++;
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
@@ -33,6 +33,9 @@
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 
+/* Packets in more pieces than this get their iovec array from the heap */
+#define NET_SOCKET_LOCAL_IOV 16
+
 typedef struct NetSocketState {
     NetClientState nc;
     int listen_fd;
@@ -89,31 +92,41 @@ static void net_socket_writable(void *opaque)
     qemu_flush_queued_packets(&s->nc);
 }
 
-static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+static ssize_t net_socket_receive_iov(NetClientState *nc,
+                                      const struct iovec *iov, int iovcnt)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    size_t size = iov_size(iov, iovcnt);
     uint32_t len = htonl(size);
-    struct iovec iov[] = {
-        {
-            .iov_base = &len,
-            .iov_len  = sizeof(len),
-        }, {
-            .iov_base = (void *)buf,
-            .iov_len  = size,
-        },
-    };
+    struct iovec local_iov[NET_SOCKET_LOCAL_IOV];
+    struct iovec *iov_len = local_iov;
     size_t remaining;
     ssize_t ret;
+    int err = 0;
 
-    remaining = iov_size(iov, 2) - s->send_index;
-    ret = iov_send(s->fd, iov, 2, s->send_index, remaining);
+    /* Send the length and the packet without copying the packet */
+    if (iovcnt + 1 > ARRAY_SIZE(local_iov)) {
+        iov_len = g_new(struct iovec, iovcnt + 1);
+    }
+    iov_len[0].iov_base = &len;
+    iov_len[0].iov_len = sizeof(len);
+    memcpy(&iov_len[1], iov, iovcnt * sizeof(*iov));
 
-    if (ret == -1 && errno == EAGAIN) {
+    remaining = sizeof(len) + size - s->send_index;
+    ret = iov_send(s->fd, iov_len, iovcnt + 1, s->send_index, remaining);
+    if (ret == -1) {
+        err = errno;
+    }
+    if (iov_len != local_iov) {
+        g_free(iov_len);
+    }
+
+    if (ret == -1 && err == EAGAIN) {
         ret = 0; /* handled further down */
     }
     if (ret == -1) {
         s->send_index = 0;
-        return -errno;
+        return -err;
     }
     if (ret < (ssize_t)remaining) {
         s->send_index += ret;
@@ -124,6 +137,16 @@ static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t
     return size;
 }
 
+static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len  = size,
+    };
+
+    return net_socket_receive_iov(nc, &iov, 1);
+}
+
 static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
@@ -425,6 +448,7 @@ static NetClientInfo net_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive,
+    .receive_iov = net_socket_receive_iov,
     .cleanup = net_socket_cleanup,
 };
 
@@ -39,17 +39,24 @@
 #include "sysemu/sysemu.h"
 #include "qemu-common.h"
 #include "qemu/error-report.h"
+#include "block/aio.h"
 
 #include "net/tap.h"
 
 #include "net/vhost_net.h"
 
+/* Number of frames read before they are handed to the peer together */
+#define TAP_BATCH_SIZE 16
+
+/* Maximum number of frames read per tap_send() callback */
+#define TAP_MAX_PACKETS 50
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[NET_BUFSIZE];
+    uint8_t *buf[TAP_BATCH_SIZE];   /* allocated when first needed */
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
@@ -57,6 +64,7 @@ typedef struct TAPState {
     bool enabled;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
+    AioContext *ctx;    /* NULL when polled by the main loop */
 } TAPState;
 
 static int launch_script(const char *setup_script, const char *ifname, int fd);
@@ -67,6 +75,15 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
+    if (s->ctx) {
+        /* There is no can_read callback here, see tap_send() */
+        aio_set_fd_handler(s->ctx, s->fd,
+                           s->read_poll && s->enabled ? tap_send : NULL,
+                           s->write_poll && s->enabled ? tap_writable : NULL,
+                           s);
+        return;
+    }
+
     qemu_set_fd_handler2(s->fd,
                          s->read_poll && s->enabled ? tap_can_send : NULL,
                          s->read_poll && s->enabled ? tap_send     : NULL,
@@ -185,16 +202,26 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
-static void tap_send(void *opaque)
+/*
+ * Read up to @max frames into s->buf and describe them in @pkts, with the
+ * vnet header stripped if the peer does not use it.  Returns the number of
+ * frames read.  A buffer is only allocated once a batch grows that long, so
+ * a queue that sees one frame at a time does not pay for the other ones.
+ */
+static int tap_read_batch(TAPState *s, struct iovec *pkts, int max)
 {
-    TAPState *s = opaque;
-    int size;
-    int packets = 0;
+    int n;
+
+    for (n = 0; n < max; n++) {
+        uint8_t *buf;
+        int size;
 
-    while (qemu_can_send_packet(&s->nc)) {
-        uint8_t *buf = s->buf;
+        if (!s->buf[n]) {
+            s->buf[n] = g_malloc(NET_BUFSIZE);
+        }
+        buf = s->buf[n];
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
+        size = tap_read_packet(s->fd, buf, NET_BUFSIZE);
         if (size <= 0) {
             break;
         }
@@ -204,11 +231,39 @@ static void tap_send(void *opaque)
             size -= s->host_vnet_hdr_len;
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
-            tap_read_poll(s, false);
+        pkts[n].iov_base = buf;
+        pkts[n].iov_len = size;
+    }
+
+    return n;
+}
+
+/*
+ * In the main loop this is only called if tap_can_send() is true.  An
+ * AioContext has no such check, so the first batch is read regardless; if
+ * the peer cannot take it, it is queued and reading stops until
+ * tap_send_completed().
+ */
+static void tap_send(void *opaque)
+{
+    TAPState *s = opaque;
+    struct iovec pkts[TAP_BATCH_SIZE];
+    int packets = 0;
+
+    do {
+        int max = MIN(TAP_BATCH_SIZE, TAP_MAX_PACKETS - packets);
+        int n, sent;
+
+        n = tap_read_batch(s, pkts, max);
+        if (n == 0) {
             break;
-        } else if (size < 0) {
+        }
+
+        /* Queued frames are copied, so s->buf can be reused right away */
+        sent = qemu_send_packet_batch_async(&s->nc, pkts, n,
+                                            tap_send_completed);
+        if (sent < n) {
+            tap_read_poll(s, false);
             break;
         }
 
@@ -218,11 +273,11 @@ static void tap_send(void *opaque)
          * packets that are processed per tap_send() callback to prevent
          * stalling the guest.
          */
-        packets++;
-        if (packets >= 50) {
+        packets += n;
+        if (n < max || packets >= TAP_MAX_PACKETS) {
             break;
         }
-    }
+    } while (qemu_can_send_packet(&s->nc));
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -288,6 +343,7 @@ static void tap_set_offload(NetClientState *nc, int csum, int tso4,
 static void tap_cleanup(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int i;
 
     if (s->vhost_net) {
         vhost_net_cleanup(s->vhost_net);
@@ -303,6 +359,11 @@ static void tap_cleanup(NetClientState *nc)
     tap_write_poll(s, false);
     close(s->fd);
     s->fd = -1;
+
+    for (i = 0; i < TAP_BATCH_SIZE; i++) {
+        g_free(s->buf[i]);
+        s->buf[i] = NULL;
+    }
 }
 
 static void tap_poll(NetClientState *nc, bool enable)
@@ -312,6 +373,22 @@ static void tap_poll(NetClientState *nc, bool enable)
     tap_write_poll(s, enable);
 }
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_TAP);
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, NULL, NULL, NULL);
+    } else {
+        qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+    }
+
+    s->ctx = ctx;
+    tap_update_fd_handler(s);
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -335,6 +412,7 @@ static NetClientInfo net_tap_info = {
     .using_vnet_hdr = tap_using_vnet_hdr,
     .set_offload = tap_set_offload,
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
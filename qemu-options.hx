@@ -32,6 +32,8 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                selects emulated machine ('-machine help' for list)\n"
     "                property accel=accel1[:accel2[:...]] selects accelerator\n"
     "                supported accelerators are kvm, xen, tcg (default: tcg)\n"
+    "                tcg-thread=single|multi runs TCG vCPUs in one shared thread\n"
+    "                or one host thread each (default: single)\n"
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                vmport=on|off|auto controls emulation of vmport (default: auto)\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
@@ -50,6 +52,12 @@ This is used to enable an accelerator. Depending on the target architecture,
 kvm, xen, or tcg can be available. By default, tcg is used. If there is more
 than one accelerator specified, the next one is used if the previous one fails
 to initialize.
+@item tcg-thread=single|multi
+Controls how TCG vCPUs are mapped onto host threads. With @code{single}
+(the default) all vCPUs are executed round-robin by one host thread. With
+@code{multi} every vCPU gets its own host thread and guest code runs
+without holding the global I/O lock, so SMP guests can use several host
+cores. This mode is incompatible with @option{-icount}.
 @item kernel_irqchip=on|off
 Enables in-kernel irqchip support for the chosen accelerator when available.
 @item vmport=on|off|auto
@@ -434,7 +442,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native|uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -476,7 +484,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.  Native Linux AIO is only used with @option{cache=none} or @option{cache=directsync}; io_uring also handles buffered I/O and flushes.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -3167,6 +3175,37 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("tb-cache", HAS_ARG, QEMU_OPTION_tb_cache, \
+    "-tb-cache file  keep translated code in file for the next run\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-cache @var{file}
+@findex -tb-cache
+Map the TCG translation buffer from @var{file} instead of anonymous memory,
+so that code translated by one run is reused by the next one instead of
+being translated again.  A translation is only reused if the guest code it
+was generated from is unchanged; code that the guest modifies is dropped
+from the cache.  The file is only valid for the same QEMU executable, target,
+CPU model and @option{-tb-size}, and only if it can be mapped at the same
+host address; otherwise it is silently recreated.  Since host addresses are
+part of the cached code, this works best with a non-PIE build.  The cache is
+written back when QEMU exits normally and ignored after a crash.
+ETEXI
+
+DEF("superblock", HAS_ARG, QEMU_OPTION_superblock, \
+    "-superblock threshold\n"
+    "                build superblocks from blocks run 'threshold' times\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -superblock @var{threshold}
+@findex -superblock
+Count how often each translated block runs.  When a block has run
+@var{threshold} times, translate it again together with the most frequently
+executed blocks it jumps to, as a single superblock, so that the code
+generator can optimize the hot path as one unit.  Blocks are only merged
+while they stay on the same guest page.  The default, 0, disables counting.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming p     prepare for incoming migration, listen on port p\n",
     QEMU_ARCH_ALL)
@@ -660,6 +660,28 @@ Example:
 -> { "execute": "migrate_cancel" }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch an ongoing migration to postcopy mode.  The postcopy-ram capability
+must have been enabled before the migration was started.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
 EQMP
 {
         .name       = "migrate-set-cache-size",
@@ -2261,10 +2283,30 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "rd_merged": number of read requests that have been merged into
+                   another request (json-int)
+    - "wr_merged": number of write requests that have been merged into
+                   another request (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
             (json-object, optional)
+- "driver-specific": Statistics specific to the block driver, if it has any
+                     (json-object, optional). For qcow2 ("type": "qcow2"):
+    - "l2-cache", "refcount-cache": json-objects describing the two
+      metadata caches, each containing:
+        - "size": number of entries (json-int)
+        - "entry-size": size of an entry in bytes (json-int)
+        - "used": number of entries holding a table (json-int)
+        - "hits": lookups served from the cache (json-int)
+        - "misses": tables read from the image or created (json-int)
+        - "evictions": tables dropped to make room for another (json-int)
+        - "cleaned": unused tables dropped by cache-clean-interval (json-int)
+        - "recent", "frequent": cached tables looked up once, and more than
+          once (json-int)
+        - "recent-ghosts", "frequent-ghosts": remembered offsets of tables
+          evicted from "recent" and "frequent" (json-int)
+        - "ghost-hits": misses on a remembered offset (json-int)
 
 Example:
 
@@ -2413,6 +2455,11 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum polling time in ns, 0 if disabled (json-int)
+- "poll-grow": polling time growth factor, 0 for the default (json-int)
+- "poll-shrink": polling time shrink divisor, 0 for the default (json-int)
+- "poll-hits": times polling found work before sleeping (json-int)
+- "poll-misses": times polling timed out and the thread slept (json-int)
 
 Example:
 
@@ -2421,11 +2468,21 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-hits":5210,
+            "poll-misses":42
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-hits":0,
+            "poll-misses":0
          }
       ]
    }
@@ -3012,7 +3069,8 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "setup", "active", "completed", "failed", "cancelled"
+     - Possible values: "setup", "active", "postcopy-active", "completed",
+       "failed", "cancelled"
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
                 time (json-int)
@@ -3043,6 +3101,10 @@ The main json-object contains the following:
             but this way upper levels don't need to care about page
             size (json-int)
          - "dirty-sync-count": times that dirty ram was synchronized (json-int)
+         - "dirty-sync-time": duration of the last dirty ram synchronization
+            in microseconds (json-int)
+         - "dirty-sync-total-time": time spent synchronizing dirty ram in
+            microseconds (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3059,6 +3121,13 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+- "compression": only present if the compress capability is active.
+  It is a json-object with the following compression information:
+         - "pages": number of pages sent compressed
+         - "busy": number of times a page waited for a busy compression
+           thread
+         - "compressed-size": number of bytes sent for compressed pages
+         - "compression-rate": uncompressed to compressed size ratio
 
 Examples:
 
@@ -3187,6 +3256,8 @@ Enable/Disable migration capabilities
 - "rdma-pin-all": pin all pages when using RDMA during migration
 - "auto-converge": throttle down guest to help convergence of migration
 - "zero-blocks": compress zero blocks during block migration
+- "compress": compress RAM pages in multiple threads
+- "postcopy-ram": allow switching to postcopy with migrate-start-postcopy
 
 Arguments:
 
@@ -3214,6 +3285,8 @@ Query current migration capabilities
          - "rdma-pin-all" : RDMA Pin Page state (json-bool)
          - "auto-converge" : Auto Converge state (json-bool)
          - "zero-blocks" : Zero Blocks state (json-bool)
+         - "compress" : Multi-threaded compression state (json-bool)
+         - "postcopy-ram" : Postcopy state (json-bool)
 
 Arguments:
 
@@ -3230,6 +3303,63 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate_capabilities,
     },
 
+SQMP
+migrate-set-parameters
+----------------------
+
+Set migration parameters
+
+- "compress-level": zlib compression level (json-int)
+- "compress-threads": number of compression threads (json-int)
+- "decompress-threads": number of decompression threads (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "migrate-set-parameters" , "arguments":
+      { "compress-level": 1 } }
+
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  =
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+SQMP
+query-migrate-parameters
+------------------------
+
+Query current migration parameters
+
+- "parameters": migration parameters value
+         - "compress-level" : zlib compression level (json-int)
+         - "compress-threads" : number of compression threads (json-int)
+         - "decompress-threads" : number of decompression threads (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- {
+      "return": {
+         "decompress-threads": 2,
+         "compress-threads": 8,
+         "compress-level": 1
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
 SQMP
 query-balloon
 -------------
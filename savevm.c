@@ -33,8 +33,10 @@
 #include "qemu/timer.h"
 #include "audio/audio.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "qemu/sockets.h"
 #include "qemu/queue.h"
+#include "qemu/atomic.h"
 #include "sysemu/cpus.h"
 #include "exec/memory.h"
 #include "qmp-commands.h"
@@ -690,15 +692,11 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-void qemu_savevm_state_complete(QEMUFile *f)
+static int qemu_savevm_state_complete_live(QEMUFile *f)
 {
     SaveStateEntry *se;
     int ret;
 
-    trace_savevm_state_complete();
-
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
@@ -717,9 +715,15 @@ void qemu_savevm_state_complete(QEMUFile *f)
         trace_savevm_section_end(se->idstr, se->section_id);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
-            return;
+            return ret;
         }
     }
+    return 0;
+}
+
+static void qemu_savevm_state_complete_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
@@ -743,11 +747,65 @@ void qemu_savevm_state_complete(QEMUFile *f)
         vmstate_save(f, se);
         trace_savevm_section_end(se->idstr, se->section_id);
     }
+}
+
+void qemu_savevm_state_complete(QEMUFile *f)
+{
+    trace_savevm_state_complete();
+
+    cpu_synchronize_all_states();
+
+    if (qemu_savevm_state_complete_live(f) < 0) {
+        return;
+    }
+    qemu_savevm_state_complete_devices(f);
 
     qemu_put_byte(f, QEMU_VM_EOF);
     qemu_fflush(f);
 }
 
+/*
+ * Switch to postcopy: complete the live sections (for RAM that only tells
+ * the destination which pages are still to come), then send the device
+ * state as a single package.  The destination loads the package while
+ * the rest of RAM keeps arriving on f after it.
+ */
+int qemu_savevm_state_postcopy_complete(QEMUFile *f)
+{
+    const QEMUSizedBuffer *qsb;
+    QEMUFile *pkg;
+    uint8_t *buf;
+    size_t len;
+
+    trace_savevm_state_complete();
+
+    cpu_synchronize_all_states();
+
+    if (qemu_savevm_state_complete_live(f) < 0) {
+        return qemu_file_get_error(f);
+    }
+
+    pkg = qemu_bufopen("w", NULL);
+    qemu_savevm_state_complete_devices(pkg);
+    qemu_put_byte(pkg, QEMU_VM_EOF);
+
+    qsb = qemu_buf_get(pkg);
+    len = qsb_get_length(qsb);
+    buf = g_malloc(len);
+    qsb_get_buffer(qsb, 0, len, buf);
+
+    trace_savevm_send_postcopy_package(len);
+    qemu_put_byte(f, QEMU_VM_POSTCOPY_PACKAGE);
+    qemu_put_be32(f, len);
+    qemu_put_buffer(f, buf, len);
+    qemu_fflush(f);
+
+    g_free(buf);
+    qemu_fclose(pkg);
+
+    return qemu_file_get_error(f);
+}
+
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
 {
     SaveStateEntry *se;
@@ -878,33 +936,70 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntry_Head;
+
+static int qemu_loadvm_state_main(QEMUFile *f,
+                                  LoadStateEntry_Head *loadvm_handlers);
+
+/*
+ * The device state that the source sent when switching to postcopy.
+ * Start the postcopy threads first, so that devices touching guest RAM
+ * while loading can fault pages in, then load it from a buffer; the rest
+ * of f belongs to the listen thread.
+ */
+static int loadvm_postcopy_handle_package(QEMUFile *f,
+                                          LoadStateEntry_Head *loadvm_handlers)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
-    LoadStateEntry *le, *new_le;
-    uint8_t section_type;
-    unsigned int v;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    QEMUSizedBuffer *qsb;
+    QEMUFile *packf;
+    uint8_t *buffer;
+    uint32_t length;
     int ret;
 
-    if (qemu_savevm_state_blocked(NULL)) {
+    if (atomic_read(&mis->postcopy) || mis->userfault_fd == -1) {
+        error_report("Unexpected postcopy package");
         return -EINVAL;
     }
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC) {
-        return -EINVAL;
+    length = qemu_get_be32(f);
+    trace_loadvm_postcopy_handle_package(length);
+
+    buffer = g_malloc(length);
+    ret = qemu_get_buffer(f, buffer, length);
+    if (ret != (int)length) {
+        g_free(buffer);
+        error_report("Postcopy package: read %d of %u bytes", ret, length);
+        return ret < 0 ? ret : -EAGAIN;
     }
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
+    qsb = qsb_create(buffer, length);
+    g_free(buffer);
+    if (!qsb) {
+        error_report("Unable to create qsb");
+        return -ENOMEM;
     }
-    if (v != QEMU_VM_FILE_VERSION) {
-        return -ENOTSUP;
+    packf = qemu_bufopen("r", qsb);
+
+    ret = postcopy_ram_incoming_start(mis);
+    if (ret < 0) {
+        qemu_fclose(packf);
+        return ret;
     }
 
+    ret = qemu_loadvm_state_main(packf, loadvm_handlers);
+    qemu_fclose(packf);
+
+    return ret;
+}
+
+static int qemu_loadvm_state_main(QEMUFile *f,
+                                  LoadStateEntry_Head *loadvm_handlers)
+{
+    LoadStateEntry *le;
+    uint8_t section_type;
+    int ret;
+
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
         SaveStateEntry *se;
@@ -926,16 +1021,14 @@ int qemu_loadvm_state(QEMUFile *f)
             se = find_se(idstr, instance_id);
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Add entry */
@@ -944,55 +1037,89 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(loadvm_handlers, le, entry);
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, loadvm_handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
             }
             break;
+        case QEMU_VM_POSTCOPY_PACKAGE:
+            /* The package carries its own EOF, and whatever follows it in
+             * f is read by the postcopy listen thread.
+             */
+            return loadvm_postcopy_handle_package(f, loadvm_handlers);
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
-    cpu_synchronize_all_post_init();
+    return 0;
+}
 
-    ret = 0;
+int qemu_loadvm_state(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    LoadStateEntry_Head loadvm_handlers =
+        QLIST_HEAD_INITIALIZER(loadvm_handlers);
+    LoadStateEntry *le, *new_le;
+    unsigned int v;
+    int ret;
+
+    if (qemu_savevm_state_blocked(NULL)) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION) {
+        return -ENOTSUP;
+    }
+
+    ret = qemu_loadvm_state_main(f, &loadvm_handlers);
+    if (ret == 0) {
+        cpu_synchronize_all_post_init();
+    }
 
-out:
     QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
         QLIST_REMOVE(le, entry);
         g_free(le);
     }
 
-    if (ret == 0) {
+    /* In postcopy f now belongs to the listen thread */
+    if (ret == 0 && !mis->have_listen_thread) {
         ret = qemu_file_get_error(f);
     }
 
@@ -0,0 +1,82 @@
+#!/usr/bin/env python
+#
+# Compare the AIO backends of the file protocol with qemu-img bench
+#
+# Usage: ./qemu-img-aio-bench.py [-c COUNT] [-d LIST] [-s SIZE] QEMU-IMG IMAGE
+#
+# For each AIO mode (threads, native, uring), request type (read, write) and
+# queue depth in LIST, "qemu-img bench" is run on IMAGE and the requests per
+# second and the 99th percentile latency are printed, in the manner of fio.
+# IMAGE must be a raw file or block device; its contents are overwritten.
+#
+# Runs use cache=none, because aio=native falls back to the thread pool for
+# buffered I/O.  With --buffered, threads and uring are also compared with
+# the host page cache.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+import optparse
+import re
+import subprocess
+import sys
+
+AIO_MODES = ['threads', 'native', 'uring']
+
+RESULT_RE = re.compile(r'([0-9]+) IOPS')
+LATENCY_RE = re.compile(r'p50 ([0-9.]+), p99 ([0-9.]+)')
+
+def bench(qemu_img, image, aio, cache, write, depth, count, size):
+    args = [qemu_img, 'bench', '-f', 'raw', '-i', aio, '-t', cache,
+            '-c', str(count), '-d', str(depth), '-s', size]
+    if write:
+        args.append('-w')
+    args.append(image)
+    out = subprocess.check_output(args).decode()
+    iops = int(RESULT_RE.search(out).group(1))
+    p50, p99 = LATENCY_RE.search(out).groups()
+    return iops, float(p50), float(p99)
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] QEMU-IMG IMAGE')
+    parser.add_option('-c', '--count', type='int', default=100000,
+                      help='requests per run (default: %default)')
+    parser.add_option('-d', '--depth', default='1,4,16,64',
+                      help='comma separated queue depths (default: %default)')
+    parser.add_option('-s', '--size', default='4k',
+                      help='request size (default: %default)')
+    parser.add_option('--buffered', action='store_true', default=False,
+                      help='also run threads and uring with cache=writeback')
+    opts, args = parser.parse_args()
+    if len(args) != 2:
+        parser.error('expected a qemu-img binary and an image')
+
+    qemu_img, image = args
+    depths = [int(d) for d in opts.depth.split(',')]
+
+    runs = [(aio, 'none') for aio in AIO_MODES]
+    if opts.buffered:
+        runs += [('threads', 'writeback'), ('uring', 'writeback')]
+
+    sys.stdout.write('%-8s %-10s %-5s %5s %10s %10s %10s\n' %
+                     ('aio', 'cache', 'rw', 'depth', 'IOPS',
+                      'p50 (us)', 'p99 (us)'))
+    for write in (False, True):
+        for depth in depths:
+            for aio, cache in runs:
+                try:
+                    iops, p50, p99 = bench(qemu_img, image, aio, cache,
+                                           write, depth, opts.count,
+                                           opts.size)
+                except subprocess.CalledProcessError:
+                    sys.stdout.write('%-8s %-10s %-5s %5d %10s\n' %
+                                     (aio, cache, 'write' if write else 'read',
+                                      depth, 'failed'))
+                    continue
+                sys.stdout.write('%-8s %-10s %-5s %5d %10d %10.1f %10.1f\n' %
+                                 (aio, cache, 'write' if write else 'read',
+                                  depth, iops, p50, p99))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
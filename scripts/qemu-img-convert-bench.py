@@ -0,0 +1,93 @@
+#!/usr/bin/env python
+#
+# Measure qemu-img convert throughput for a range of parallel requests
+#
+# Usage: ./qemu-img-convert-bench.py [-s SIZE] [-d DIR] [-m LIST] QEMU-IMG
+#
+# Every combination of source and target backend is converted once for each
+# number of coroutines in LIST (-m), with in-order and out-of-order (-W)
+# writes.  The backends are:
+#
+#   null-co   the null-co block driver, which completes every request at once
+#             and therefore shows the overhead of qemu-img itself
+#   file      a fully allocated raw file in DIR (default: the current
+#             directory); its contents are random, so no range is skipped
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+import json
+import optparse
+import os
+import subprocess
+import sys
+import time
+
+def null_co(size):
+    return 'json:' + json.dumps({'driver': 'null-co', 'size': size})
+
+def make_file(path, size):
+    chunk = 1024 * 1024
+    with open(path, 'wb') as f:
+        left = size
+        while left > 0:
+            n = min(chunk, left)
+            f.write(os.urandom(n))
+            left -= n
+
+def convert(qemu_img, src, dst, coroutines, out_of_order):
+    args = [qemu_img, 'convert', '-n', '-f', 'raw', '-O', 'raw',
+            '-m', str(coroutines)]
+    if out_of_order:
+        args.append('-W')
+    args += [src, dst]
+    start = time.time()
+    subprocess.check_call(args)
+    return time.time() - start
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] QEMU-IMG')
+    parser.add_option('-s', '--size', type='int', default=1024,
+                      help='image size in MB (default: %default)')
+    parser.add_option('-d', '--dir', default='.',
+                      help='directory for the file backend images '
+                           '(default: %default)')
+    parser.add_option('-m', '--coroutines', default='1,2,4,8,16',
+                      help='comma separated numbers of coroutines '
+                           '(default: %default)')
+    opts, args = parser.parse_args()
+    if len(args) != 1:
+        parser.error('missing qemu-img binary')
+
+    qemu_img = args[0]
+    size = opts.size * 1024 * 1024
+    coroutines = [int(m) for m in opts.coroutines.split(',')]
+
+    src_file = os.path.join(opts.dir, 'convert-bench-src.raw')
+    dst_file = os.path.join(opts.dir, 'convert-bench-dst.raw')
+    make_file(src_file, size)
+    make_file(dst_file, size)
+
+    backends = [('null-co', null_co(size), null_co(size)),
+                ('file', src_file, dst_file)]
+
+    sys.stdout.write('%-8s %-8s %4s %-5s %10s\n' %
+                     ('source', 'target', '-m', 'order', 'MB/s'))
+    try:
+        for src_name, src, _ in backends:
+            for dst_name, _, dst in backends:
+                for m in coroutines:
+                    for out_of_order in (False, True):
+                        elapsed = convert(qemu_img, src, dst, m,
+                                          out_of_order)
+                        sys.stdout.write('%-8s %-8s %4d %-5s %10.1f\n' %
+                                         (src_name, dst_name, m,
+                                          'any' if out_of_order else 'seq',
+                                          opts.size / elapsed))
+    finally:
+        os.unlink(src_file)
+        os.unlink(dst_file)
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,86 @@
+#!/usr/bin/env python
+#
+# Measure boot-to-login time with a cold and a warm TB cache
+#
+# Usage: ./tb-cache-bench.py [-n RUNS] [-p PATTERN] CACHE-FILE QEMU [ARGS...]
+#
+# QEMU is started with "-tb-cache CACHE-FILE -display none -serial stdio
+# -monitor none" appended to ARGS.  The time until PATTERN (default
+# "login:") appears on the serial console is measured, then QEMU is asked
+# to quit with SIGTERM so that the cache gets written back.  The first run
+# starts with an empty cache, the following ones reuse it.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+import os
+import re
+import signal
+import subprocess
+import sys
+import time
+import optparse
+
+def boot(qemu_args, pattern, timeout):
+    proc = subprocess.Popen(qemu_args, stdin=subprocess.PIPE,
+                            stdout=subprocess.PIPE)
+    start = time.time()
+    seen = ''
+    elapsed = None
+    while True:
+        c = proc.stdout.read(1)
+        if not c:
+            break
+        seen = (seen + c.decode('latin-1'))[-4096:]
+        if pattern.search(seen):
+            elapsed = time.time() - start
+            break
+        if time.time() - start > timeout:
+            break
+    proc.send_signal(signal.SIGTERM)
+    proc.wait()
+    return elapsed
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] CACHE-FILE QEMU '
+                                         '[ARGS...]')
+    parser.add_option('-n', '--runs', type='int', default=3,
+                      help='number of warm runs (default: %default)')
+    parser.add_option('-p', '--pattern', default='login:',
+                      help='regular expression that ends the boot '
+                           '(default: %default)')
+    parser.add_option('-t', '--timeout', type='int', default=600,
+                      help='seconds to wait for the pattern '
+                           '(default: %default)')
+    parser.disable_interspersed_args()
+    opts, args = parser.parse_args()
+    if len(args) < 2:
+        parser.error('missing cache file or QEMU binary')
+
+    cache = args[0]
+    qemu_args = args[1:] + ['-tb-cache', cache, '-display', 'none',
+                            '-serial', 'stdio', '-monitor', 'none']
+    pattern = re.compile(opts.pattern)
+
+    if os.path.exists(cache):
+        os.unlink(cache)
+
+    results = []
+    for i in range(opts.runs + 1):
+        kind = 'cold' if i == 0 else 'warm'
+        elapsed = boot(qemu_args, pattern, opts.timeout)
+        if elapsed is None:
+            sys.stderr.write('run %d (%s): pattern not seen\n' % (i, kind))
+            return 1
+        sys.stdout.write('run %d (%s): %.2fs\n' % (i, kind, elapsed))
+        results.append(elapsed)
+
+    warm = results[1:]
+    if warm:
+        avg = sum(warm) / len(warm)
+        sys.stdout.write('cold %.2fs, warm avg %.2fs, speedup %.2fx\n' %
+                         (results[0], avg, results[0] / avg))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
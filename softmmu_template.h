@@ -137,6 +137,11 @@
             break;                                                            \
         }                                                                     \
     }                                                                         \
+    if (vidx >= 0) {                                                          \
+        ENV_GET_CPU(env)->tlb_victim_hits++;                                  \
+    } else {                                                                  \
+        ENV_GET_CPU(env)->tlb_full_walks++;                                   \
+    }                                                                         \
     /* return true when there is a vtlb hit, i.e. vidx >=0 */                 \
     vidx >= 0;                                                                \
 })
@@ -5048,6 +5048,84 @@ static const uint8_t neon_2rm_sizes[] = {
     [NEON_2RM_VCVT_UF] = 0x4,
 };
 
+/* Three register same length operations that map onto TCG vector ops.
+   Return true if the instruction has been translated.  */
+static bool gen_neon_3same_vec(int op, int u, int size, int q,
+                               int rd, int rn, int rm)
+{
+    uint32_t oprsz = q ? 16 : 8;
+    long d = vfp_reg_offset(1, rd);
+    long n = vfp_reg_offset(1, rn);
+    long m = vfp_reg_offset(1, rm);
+
+    switch (op) {
+    case NEON_3R_VADD_VSUB:
+        if (!u) {
+            tcg_gen_add_vec(size, oprsz, cpu_env, d, n, m);
+        } else {
+            tcg_gen_sub_vec(size, oprsz, cpu_env, d, n, m);
+        }
+        return true;
+    case NEON_3R_VTST_VCEQ:
+        if (!u || size == 3) {
+            return false;
+        }
+        tcg_gen_cmpeq_vec(size, oprsz, cpu_env, d, n, m);
+        return true;
+    case NEON_3R_LOGIC:
+        switch ((u << 2) | size) {
+        case 0: /* VAND */
+            tcg_gen_and_vec(oprsz, cpu_env, d, n, m);
+            return true;
+        case 1: /* BIC */
+            tcg_gen_andc_vec(oprsz, cpu_env, d, n, m);
+            return true;
+        case 2: /* VORR */
+            tcg_gen_or_vec(oprsz, cpu_env, d, n, m);
+            return true;
+        case 4: /* VEOR */
+            tcg_gen_xor_vec(oprsz, cpu_env, d, n, m);
+            return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+/* VSHR and VSHL by immediate.  SHIFT is negative for right shifts, as
+   computed by disas_neon_data_insn.  */
+static bool gen_neon_shifti_vec(int op, int u, int size, int q,
+                                int rd, int rm, int shift)
+{
+    uint32_t oprsz = q ? 16 : 8;
+    long d = vfp_reg_offset(1, rd);
+    long m = vfp_reg_offset(1, rm);
+    int esize = 8 << size;
+
+    switch (op) {
+    case 0: /* VSHR */
+        shift = -shift;
+        if (!u) {
+            tcg_gen_sari_vec(size, oprsz, cpu_env, d, m,
+                             MIN(shift, esize - 1));
+        } else if (shift == esize) {
+            tcg_gen_xor_vec(oprsz, cpu_env, d, m, m);
+        } else {
+            tcg_gen_shri_vec(size, oprsz, cpu_env, d, m, shift);
+        }
+        return true;
+    case 5: /* VSHL */
+        if (u) {
+            return false;
+        }
+        tcg_gen_shli_vec(size, oprsz, cpu_env, d, m, shift);
+        return true;
+    default:
+        return false;
+    }
+}
+
 /* Translate a NEON data processing instruction.  Return nonzero if the
    instruction is invalid.
    We process data in a mixture of 32-bit and 64-bit chunks.
@@ -5142,6 +5220,9 @@ static int disas_neon_data_insn(DisasContext *s, uint32_t insn)
             tcg_temp_free_i32(tmp3);
             return 0;
         }
+        if (gen_neon_3same_vec(op, u, size, q, rd, rn, rm)) {
+            return 0;
+        }
         if (size == 3 && op != NEON_3R_LOGIC) {
             /* 64-bit element instructions. */
             for (pass = 0; pass < (q ? 2 : 1); pass++) {
@@ -5628,6 +5709,9 @@ static int disas_neon_data_insn(DisasContext *s, uint32_t insn)
                    element size in bits.  */
                 if (op <= 4)
                     shift = shift - (1 << (size + 3));
+                if (gen_neon_shifti_vec(op, u, size, q, rd, rm, shift)) {
+                    return 0;
+                }
                 if (size == 3) {
                     count = q + 1;
                 } else {
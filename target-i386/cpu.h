@@ -39,6 +39,9 @@
 
 #define TARGET_HAS_ICE 1
 
+/* server workloads touch far more pages than 256 TLB entries can map */
+#define TARGET_TLB_BITS 10
+
 #ifdef TARGET_X86_64
 #define ELF_MACHINE     EM_X86_64
 #define ELF_MACHINE_UNAME "x86_64"
@@ -2975,6 +2975,78 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+/* Integer MMX/SSE2 operations that map onto TCG vector ops.  D is both
+   the destination and the first source; the MMX forms work on 64 bits.  */
+static bool gen_sse_vec(int b, int is_xmm, int d, int op2)
+{
+    uint32_t oprsz = is_xmm ? 16 : 8;
+
+    switch (b) {
+    case 0xfc ... 0xfe: /* paddb, paddw, paddl */
+        tcg_gen_add_vec(b - 0xfc, oprsz, cpu_env, d, d, op2);
+        break;
+    case 0xd4: /* paddq */
+        tcg_gen_add_vec(MO_64, oprsz, cpu_env, d, d, op2);
+        break;
+    case 0xf8 ... 0xfb: /* psubb, psubw, psubl, psubq */
+        tcg_gen_sub_vec(b - 0xf8, oprsz, cpu_env, d, d, op2);
+        break;
+    case 0x74 ... 0x76: /* pcmpeqb, pcmpeqw, pcmpeql */
+        tcg_gen_cmpeq_vec(b - 0x74, oprsz, cpu_env, d, d, op2);
+        break;
+    case 0x54: /* andps, andpd */
+    case 0xdb: /* pand */
+        tcg_gen_and_vec(oprsz, cpu_env, d, d, op2);
+        break;
+    case 0x55: /* andnps, andnpd */
+    case 0xdf: /* pandn */
+        tcg_gen_andc_vec(oprsz, cpu_env, d, op2, d);
+        break;
+    case 0x56: /* orps, orpd */
+    case 0xeb: /* por */
+        tcg_gen_or_vec(oprsz, cpu_env, d, d, op2);
+        break;
+    case 0x57: /* xorps, xorpd */
+    case 0xef: /* pxor */
+        tcg_gen_xor_vec(oprsz, cpu_env, d, d, op2);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+/* Shifts by immediate of group 0x71-0x73 (OP is the modrm reg field).
+   Logical shifts by more than the lane size clear the lanes, arithmetic
+   ones fill them with the sign bit.  */
+static bool gen_sse_shifti_vec(int b, int op, int is_xmm, int d, int val)
+{
+    uint32_t oprsz = is_xmm ? 16 : 8;
+    unsigned vece = MO_16 + (b & 3) - 1;
+    int bits = 8 << vece;
+
+    switch (op) {
+    case 2: /* psrlw, psrld, psrlq */
+    case 6: /* psllw, pslld, psllq */
+        if (val >= bits) {
+            tcg_gen_xor_vec(oprsz, cpu_env, d, d, d);
+        } else if (op == 2) {
+            tcg_gen_shri_vec(vece, oprsz, cpu_env, d, d, val);
+        } else {
+            tcg_gen_shli_vec(vece, oprsz, cpu_env, d, d, val);
+        }
+        return true;
+    case 4: /* psraw, psrad */
+        if (vece == MO_64) {
+            return false;
+        }
+        tcg_gen_sari_vec(vece, oprsz, cpu_env, d, d, MIN(val, bits - 1));
+        return true;
+    default:
+        return false;
+    }
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -3378,6 +3450,17 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
 	        goto illegal_op;
             }
             val = cpu_ldub_code(env, s->pc++);
+            if (is_xmm) {
+                rm = (modrm & 7) | REX_B(s);
+                op2_offset = offsetof(CPUX86State,xmm_regs[rm]);
+            } else {
+                rm = (modrm & 7);
+                op2_offset = offsetof(CPUX86State,fpregs[rm].mmx);
+            }
+            if (gen_sse_shifti_vec(b, (modrm >> 3) & 7, is_xmm,
+                                   op2_offset, val)) {
+                break;
+            }
             if (is_xmm) {
                 tcg_gen_movi_tl(cpu_T[0], val);
                 tcg_gen_st32_tl(cpu_T[0], cpu_env, offsetof(CPUX86State,xmm_t0.XMM_L(0)));
@@ -3396,13 +3479,6 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             if (!sse_fn_epp) {
                 goto illegal_op;
             }
-            if (is_xmm) {
-                rm = (modrm & 7) | REX_B(s);
-                op2_offset = offsetof(CPUX86State,xmm_regs[rm]);
-            } else {
-                rm = (modrm & 7);
-                op2_offset = offsetof(CPUX86State,fpregs[rm].mmx);
-            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op2_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op1_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -4390,6 +4466,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_vec(b, is_xmm, op1_offset, op2_offset)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
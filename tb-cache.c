@@ -0,0 +1,477 @@
+/*
+ * Persistent translation block cache
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The code generation buffer and the TranslationBlock array are mapped
+ * from a file instead of anonymous memory, so whatever was translated
+ * during one run is still there at the next one.  Host code produced by
+ * TCG is not position independent (it embeds the address of its
+ * TranslationBlock, of the prologue and of helpers), so the cache is only
+ * reused when the file can be mapped at the address it was created at
+ * and the QEMU executable is the same and is loaded at the same address.
+ * Otherwise it is silently reset, which only costs the warm start.
+ *
+ * Blocks found in the file start out dormant: they are in no hash table
+ * and no page list.  When tb_gen_code() is about to translate, it first
+ * asks tb_cache_find() for a dormant block with the same pc, cs_base,
+ * flags, cflags and physical pages whose guest source bytes hash to the
+ * value recorded when it was translated; such a block is linked like a
+ * freshly generated one.  A block that gets invalidated while live (from
+ * tb_invalidate_phys_page_range() and friends) is dropped from the file,
+ * and guest code that changed between runs fails the content check, so
+ * stale translations are never adopted.  Blocks that embed a pointer to
+ * host heap memory (tcg_const_ptr()) are never recorded, and the whole
+ * file is dropped if the vCPU model or any of its properties changed.
+ *
+ * The file holds code that is mapped executable, so it must be a regular
+ * file owned by the user running QEMU and not accessible to anybody else.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "tcg.h"
+#include "qemu/error-report.h"
+#include "sysemu/accel.h"
+#include "sysemu/sysemu.h"
+#include "tb-cache.h"
+
+#define TB_CACHE_MAGIC      "QEMUTBC"
+#define TB_CACHE_VERSION    2
+#define TB_CACHE_HDR_SIZE   4096
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t clean;
+    char target[32];
+    char qemu_version[32];
+    char cpu_type[64];
+    uint64_t cpu_props_hash;
+    uint64_t exe_size;
+    uint64_t exe_mtime;
+    uint64_t text_addr;
+    uint64_t data_addr;
+    uint64_t map_addr;
+    uint64_t buffer_size;
+    uint64_t max_blocks;
+    uint64_t nb_tbs;
+    uint64_t code_gen_used;
+    uint64_t hot_threshold;
+} TBCacheHeader;
+
+typedef struct TBCacheEntry {
+    uint64_t src_hash;
+    uint32_t valid;
+    uint32_t pad;
+} TBCacheEntry;
+
+typedef struct TBCache {
+    TBCacheHeader *hdr;
+    size_t map_size;
+    TBCacheEntry *entries;
+    /* tb_hash_func() value -> GSList of dormant TBs */
+    GHashTable *dormant;
+    bool cpu_checked;
+    Notifier exit_notifier;
+
+    /* statistics */
+    int dormant_count;
+    int adopted_count;
+    int recorded_count;
+} TBCache;
+
+static TBCache tb_cache;
+
+static bool tb_cache_active(void)
+{
+    return tb_cache.hdr != NULL;
+}
+
+static void tb_cache_fill_identity(TBCacheHeader *hdr)
+{
+#ifdef __linux__
+    struct stat st;
+
+    if (stat("/proc/self/exe", &st) == 0) {
+        hdr->exe_size = st.st_size;
+        hdr->exe_mtime = st.st_mtime;
+    }
+#endif
+    pstrcpy(hdr->target, sizeof(hdr->target), TARGET_NAME);
+    pstrcpy(hdr->qemu_version, sizeof(hdr->qemu_version), QEMU_VERSION);
+    hdr->text_addr = (uintptr_t)tb_gen_code;
+    hdr->data_addr = (uintptr_t)&tcg_ctx;
+    /* compiled into the execution counters of every block */
+    hdr->hot_threshold = tb_hot_threshold;
+}
+
+void *tb_cache_alloc(size_t buffer_size, int max_blocks,
+                     TranslationBlock **ptbs)
+{
+    TBCacheHeader *hdr, id, old;
+    struct stat st;
+    size_t tbs_offset, entries_offset, map_size;
+    void *hint = NULL, *buf;
+    int fd, flags = MAP_SHARED;
+    bool reuse;
+
+    if (!tcg_tb_cache_file) {
+        return NULL;
+    }
+
+    tbs_offset = TB_CACHE_HDR_SIZE + buffer_size;
+    tbs_offset = QEMU_ALIGN_UP(tbs_offset, sizeof(uint64_t));
+    entries_offset = tbs_offset + max_blocks * sizeof(TranslationBlock);
+    map_size = entries_offset + max_blocks * sizeof(TBCacheEntry);
+
+    fd = qemu_open(tcg_tb_cache_file, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        error_report("Could not open TB cache '%s': %s",
+                     tcg_tb_cache_file, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_uid != geteuid() || (st.st_mode & (S_IRWXG | S_IRWXO))) {
+        error_report("TB cache '%s' must be a regular file owned by the "
+                     "current user and not accessible by others",
+                     tcg_tb_cache_file);
+        close(fd);
+        return NULL;
+    }
+
+    memset(&id, 0, sizeof(id));
+    tb_cache_fill_identity(&id);
+    id.buffer_size = buffer_size;
+    id.max_blocks = max_blocks;
+
+    reuse = st.st_size == map_size &&
+            pread(fd, &old, sizeof(old), 0) == sizeof(old) &&
+            !memcmp(old.magic, TB_CACHE_MAGIC, sizeof(TB_CACHE_MAGIC)) &&
+            old.version == TB_CACHE_VERSION && old.clean &&
+            !strcmp(old.target, id.target) &&
+            !strcmp(old.qemu_version, id.qemu_version) &&
+            old.exe_size == id.exe_size &&
+            old.exe_mtime == id.exe_mtime &&
+            old.text_addr == id.text_addr &&
+            old.data_addr == id.data_addr &&
+            old.hot_threshold == id.hot_threshold &&
+            old.buffer_size == id.buffer_size &&
+            old.max_blocks == id.max_blocks;
+    if (reuse) {
+        hint = (void *)(uintptr_t)old.map_addr;
+    }
+
+    if (!reuse) {
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, map_size) < 0) {
+            error_report("Could not resize TB cache '%s': %s",
+                         tcg_tb_cache_file, strerror(errno));
+            close(fd);
+            return NULL;
+        }
+#if defined(__x86_64__) && defined(MAP_32BIT) && \
+    !defined(__PIE__) && !defined(__PIC__)
+        /* same placement as alloc_code_gen_buffer() */
+        flags |= MAP_32BIT;
+#endif
+    }
+
+    buf = mmap(hint, map_size, PROT_WRITE | PROT_READ | PROT_EXEC,
+               flags, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        error_report("Could not map TB cache '%s': %s",
+                     tcg_tb_cache_file, strerror(errno));
+        return NULL;
+    }
+
+    hdr = buf;
+    if (reuse && buf != hint) {
+        /* the old address is taken, the code in the file is unusable */
+        memset(buf + entries_offset, 0, max_blocks * sizeof(TBCacheEntry));
+        reuse = false;
+    }
+    if (!reuse) {
+        memcpy(hdr, &id, sizeof(id));
+        memcpy(hdr->magic, TB_CACHE_MAGIC, sizeof(TB_CACHE_MAGIC));
+        hdr->version = TB_CACHE_VERSION;
+        hdr->map_addr = (uintptr_t)buf;
+    }
+    /* marked clean again by a regular exit only */
+    hdr->clean = 0;
+    msync(hdr, TB_CACHE_HDR_SIZE, MS_SYNC);
+
+    tb_cache.hdr = hdr;
+    tb_cache.map_size = map_size;
+    tb_cache.entries = buf + entries_offset;
+    *ptbs = buf + tbs_offset;
+    return buf + TB_CACHE_HDR_SIZE;
+}
+
+#define TB_CACHE_FNV_INIT   0xcbf29ce484222325ULL
+
+/* FNV-1a */
+static uint64_t tb_cache_fnv(uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Hash of the printable properties of the vCPU, which covers the feature
+   flags that -cpu and the machine type can change */
+static uint64_t tb_cache_cpu_props_hash(CPUState *cpu)
+{
+    uint64_t hash = TB_CACHE_FNV_INIT;
+    ObjectProperty *prop;
+    char *value;
+
+    QTAILQ_FOREACH(prop, &OBJECT(cpu)->properties, node) {
+        if (!prop->get || strstart(prop->type, "child<", NULL) ||
+            strstart(prop->type, "link<", NULL)) {
+            continue;
+        }
+        value = object_property_print(OBJECT(cpu), prop->name, false, NULL);
+        if (!value) {
+            continue;
+        }
+        /* include the terminating NULs to separate the strings */
+        hash = tb_cache_fnv(hash, prop->name, strlen(prop->name) + 1);
+        hash = tb_cache_fnv(hash, value, strlen(value) + 1);
+        g_free(value);
+    }
+    return hash;
+}
+
+static void tb_cache_save(Notifier *n, void *data)
+{
+    TBCacheHeader *hdr = tb_cache.hdr;
+
+    hdr->nb_tbs = tcg_ctx.tb_ctx.nb_tbs;
+    hdr->code_gen_used = tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer;
+    memset(hdr->cpu_type, 0, sizeof(hdr->cpu_type));
+    hdr->cpu_props_hash = 0;
+    if (first_cpu) {
+        pstrcpy(hdr->cpu_type, sizeof(hdr->cpu_type),
+                object_get_typename(OBJECT(first_cpu)));
+        hdr->cpu_props_hash = tb_cache_cpu_props_hash(first_cpu);
+    }
+    /* the data must be on disk before the header says it is valid */
+    msync(tb_cache.hdr, tb_cache.map_size, MS_SYNC);
+    hdr->clean = 1;
+    msync(hdr, TB_CACHE_HDR_SIZE, MS_SYNC);
+}
+
+static unsigned int tb_cache_key(TranslationBlock *tb)
+{
+    tb_page_addr_t phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
+
+    return tb_hash_func(phys_pc, tb->pc, tb->cs_base, tb->flags);
+}
+
+static void tb_cache_drop_dormant(void)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    if (!tb_cache.dormant) {
+        return;
+    }
+    g_hash_table_iter_init(&iter, tb_cache.dormant);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_slist_free(value);
+    }
+    g_hash_table_destroy(tb_cache.dormant);
+    tb_cache.dormant = NULL;
+    tb_cache.dormant_count = 0;
+}
+
+/* Called once the prologue has been generated: take over the blocks that
+   the previous run left in the buffer.  */
+void tb_cache_init(void)
+{
+    TBCacheHeader *hdr = tb_cache.hdr;
+    TranslationBlock *tb;
+    gpointer key;
+    int i;
+
+    if (!tb_cache_active()) {
+        return;
+    }
+    tb_cache.exit_notifier.notify = tb_cache_save;
+    qemu_add_exit_notifier(&tb_cache.exit_notifier);
+
+    if (hdr->nb_tbs == 0) {
+        return;
+    }
+    tcg_ctx.tb_ctx.nb_tbs = hdr->nb_tbs;
+    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer + hdr->code_gen_used;
+
+    tb_cache.dormant = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
+        if (!tb_cache.entries[i].valid) {
+            continue;
+        }
+        tb = &tcg_ctx.tb_ctx.tbs[i];
+        key = GUINT_TO_POINTER(tb_cache_key(tb));
+        g_hash_table_insert(tb_cache.dormant, key,
+            g_slist_prepend(g_hash_table_lookup(tb_cache.dormant, key), tb));
+        tb_cache.dormant_count++;
+    }
+}
+
+static uint64_t tb_cache_hash_source(CPUState *cpu, TranslationBlock *tb)
+{
+    uint64_t hash = TB_CACHE_FNV_INIT;
+    uint8_t buf[256];
+    target_ulong addr = tb->pc;
+    int len, left = tb->size;
+
+    /* hash the guest bytes the block was translated from */
+    while (left > 0) {
+        len = MIN(left, sizeof(buf));
+        if (cpu_memory_rw_debug(cpu, addr, buf, len, 0) < 0) {
+            return 0;
+        }
+        hash = tb_cache_fnv(hash, buf, len);
+        addr += len;
+        left -= len;
+    }
+    return hash;
+}
+
+static bool tb_cache_usable(CPUState *cpu, int cflags)
+{
+    /* Breakpoints and single-stepping are compiled into the code, and
+       cflags other than icount describe one-off translations.  */
+    return !singlestep && !cpu->singlestep_enabled &&
+           QTAILQ_EMPTY(&cpu->breakpoints) &&
+           !(cflags & ~CF_USE_ICOUNT);
+}
+
+TranslationBlock *tb_cache_find(CPUState *cpu, target_ulong pc,
+                                target_ulong cs_base, int flags, int cflags)
+{
+    CPUArchState *env = cpu->env_ptr;
+    TranslationBlock *tb;
+    tb_page_addr_t phys_pc, phys_page2;
+    target_ulong virt_page2;
+    gpointer key;
+    GSList *list, *l;
+
+    if (!tb_cache.dormant || !tb_cache_usable(cpu, cflags)) {
+        return NULL;
+    }
+    if (!tb_cache.cpu_checked) {
+        tb_cache.cpu_checked = true;
+        if (strcmp(tb_cache.hdr->cpu_type, object_get_typename(OBJECT(cpu))) ||
+            tb_cache.hdr->cpu_props_hash != tb_cache_cpu_props_hash(cpu)) {
+            tb_cache_drop_dormant();
+            return NULL;
+        }
+    }
+
+    phys_pc = get_page_addr_code(env, pc);
+    key = GUINT_TO_POINTER(tb_hash_func(phys_pc, pc, cs_base, flags));
+    list = g_hash_table_lookup(tb_cache.dormant, key);
+    for (l = list; l != NULL; l = l->next) {
+        tb = l->data;
+        if (tb->pc != pc || tb->cs_base != cs_base || tb->flags != flags ||
+            tb->cflags != cflags ||
+            tb->page_addr[0] != (phys_pc & TARGET_PAGE_MASK)) {
+            continue;
+        }
+        if (tb->page_addr[1] != -1) {
+            virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
+            phys_page2 = get_page_addr_code(env, virt_page2);
+            if (tb->page_addr[1] != phys_page2) {
+                continue;
+            }
+        }
+        if (tb_cache_hash_source(cpu, tb) !=
+            tb_cache.entries[tb - tcg_ctx.tb_ctx.tbs].src_hash) {
+            continue;
+        }
+
+        list = g_slist_delete_link(list, l);
+        if (list) {
+            g_hash_table_insert(tb_cache.dormant, key, list);
+        } else {
+            g_hash_table_remove(tb_cache.dormant, key);
+        }
+        tb_cache.dormant_count--;
+        tb_cache.adopted_count++;
+        return tb;
+    }
+    return NULL;
+}
+
+void tb_cache_record(CPUState *cpu, TranslationBlock *tb)
+{
+    TBCacheEntry *e;
+
+    if (!tb_cache_active() || !tb_cache_usable(cpu, tb->cflags)) {
+        return;
+    }
+    e = &tb_cache.entries[tb - tcg_ctx.tb_ctx.tbs];
+    if (tcg_ctx.host_ptr_consts) {
+        /* the pointer is only meaningful in this process */
+        e->valid = 0;
+        return;
+    }
+    e->src_hash = tb_cache_hash_source(cpu, tb);
+    e->valid = e->src_hash != 0;
+    tb_cache.recorded_count++;
+}
+
+void tb_cache_invalidate(TranslationBlock *tb)
+{
+    if (tb_cache_active()) {
+        tb_cache.entries[tb - tcg_ctx.tb_ctx.tbs].valid = 0;
+    }
+}
+
+/* Called by tb_flush() before the buffer is reused.  */
+void tb_cache_flush(void)
+{
+    if (!tb_cache_active()) {
+        return;
+    }
+    tb_cache_drop_dormant();
+    memset(tb_cache.entries, 0,
+           tcg_ctx.tb_ctx.nb_tbs * sizeof(TBCacheEntry));
+}
+
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    if (!tb_cache_active()) {
+        return;
+    }
+    cpu_fprintf(f, "TB cache            %s\n", tcg_tb_cache_file);
+    cpu_fprintf(f, "TB cache blocks     %d adopted, %d dormant, %d recorded\n",
+                tb_cache.adopted_count, tb_cache.dormant_count,
+                tb_cache.recorded_count);
+}
@@ -0,0 +1,72 @@
+/*
+ * Persistent translation block cache
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TB_CACHE_H
+#define TB_CACHE_H
+
+#if !defined(CONFIG_USER_ONLY) && defined(CONFIG_POSIX)
+
+/* tb-cache.c */
+void *tb_cache_alloc(size_t buffer_size, int max_blocks,
+                     TranslationBlock **ptbs);
+void tb_cache_init(void);
+TranslationBlock *tb_cache_find(CPUState *cpu, target_ulong pc,
+                                target_ulong cs_base, int flags, int cflags);
+void tb_cache_record(CPUState *cpu, TranslationBlock *tb);
+void tb_cache_invalidate(TranslationBlock *tb);
+void tb_cache_flush(void);
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf);
+
+#else
+
+static inline void *tb_cache_alloc(size_t buffer_size, int max_blocks,
+                                   TranslationBlock **ptbs)
+{
+    return NULL;
+}
+
+static inline void tb_cache_init(void)
+{
+}
+
+static inline TranslationBlock *tb_cache_find(CPUState *cpu, target_ulong pc,
+                                              target_ulong cs_base, int flags,
+                                              int cflags)
+{
+    return NULL;
+}
+
+static inline void tb_cache_record(CPUState *cpu, TranslationBlock *tb)
+{
+}
+
+static inline void tb_cache_invalidate(TranslationBlock *tb)
+{
+}
+
+static inline void tb_cache_flush(void)
+{
+}
+
+static inline void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+}
+
+#endif
+
+#endif /* TB_CACHE_H */
@@ -280,6 +280,11 @@ typedef enum {
     I3312_LDRSHX    = 0x38000000 | LDST_LD_S_X << 22 | MO_16 << 30,
     I3312_LDRSWX    = 0x38000000 | LDST_LD_S_X << 22 | MO_32 << 30,
 
+    I3312_LDRVD     = 0x3c000000 | LDST_LD << 22 | MO_64 << 30,
+    I3312_STRVD     = 0x3c000000 | LDST_ST << 22 | MO_64 << 30,
+    I3312_LDRVQ     = 0x3c000000 | 3 << 22 | 0 << 30,
+    I3312_STRVQ     = 0x3c000000 | 2 << 22 | 0 << 30,
+
     I3312_TO_I3310  = 0x00206800,
     I3312_TO_I3313  = 0x01000000,
 
@@ -359,6 +364,20 @@ typedef enum {
     I3510_EOR       = 0x4a000000,
     I3510_EON       = 0x4a200000,
     I3510_ANDS      = 0x6a000000,
+
+    /* AdvSIMD shift by immediate.  */
+    I3614_SSHR      = 0x0f000400,
+    I3614_SHL       = 0x0f005400,
+    I3614_USHR      = 0x2f000400,
+
+    /* AdvSIMD three same.  */
+    I3616_ADD       = 0x0e208400,
+    I3616_AND       = 0x0e201c00,
+    I3616_BIC       = 0x0e601c00,
+    I3616_EOR       = 0x2e201c00,
+    I3616_ORR       = 0x0ea01c00,
+    I3616_SUB       = 0x2e208400,
+    I3616_CMEQ      = 0x2e208c00,
 } AArch64Insn;
 
 static inline uint32_t tcg_in32(TCGContext *s)
@@ -495,6 +514,18 @@ static void tcg_out_insn_3509(TCGContext *s, AArch64Insn insn, TCGType ext,
     tcg_out32(s, insn | ext << 31 | rm << 16 | ra << 10 | rn << 5 | rd);
 }
 
+static void tcg_out_insn_3614(TCGContext *s, AArch64Insn insn, bool q,
+                              int rd, int rn, unsigned immhb)
+{
+    tcg_out32(s, insn | q << 30 | immhb << 16 | rn << 5 | rd);
+}
+
+static void tcg_out_insn_3616(TCGContext *s, AArch64Insn insn, bool q,
+                              unsigned size, int rd, int rn, int rm)
+{
+    tcg_out32(s, insn | q << 30 | size << 22 | rm << 16 | rn << 5 | rd);
+}
+
 static void tcg_out_insn_3310(TCGContext *s, AArch64Insn insn,
                               TCGReg rd, TCGReg base, TCGReg regoff)
 {
@@ -659,6 +690,11 @@ static void tcg_out_ldst(TCGContext *s, AArch64Insn insn,
 {
     TCGMemOp size = (uint32_t)insn >> 30;
 
+    /* 128-bit SIMD&FP registers are encoded as size 0 with opc<1> set.  */
+    if (size == 0 && (insn & 0x04800000) == 0x04800000) {
+        size = 4;
+    }
+
     /* If the offset is naturally aligned and in range, then we can
        use the scaled uimm12 encoding */
     if (offset >= 0 && !(offset & ((1 << size) - 1))) {
@@ -1235,6 +1271,81 @@ static void tcg_out_qemu_st(TCGContext *s, TCGReg data_reg, TCGReg addr_reg,
 
 static tcg_insn_unit *tb_ret_addr;
 
+/* Vector ops work on the memory operands through v0 and v1, which are
+   never allocated to TCG temps.  */
+#define TCG_VEC_TMP0  0
+#define TCG_VEC_TMP1  1
+
+static void tcg_out_vec_op(TCGContext *s, TCGOpcode opc, const TCGArg *args)
+{
+    TCGReg base = args[0];
+    unsigned vece = TCG_VEC_ECE(args[4]);
+    unsigned esize = 8 << vece;
+    bool q = TCG_VEC_OPRSZ(args[4]) == 16;
+    AArch64Insn ld = q ? I3312_LDRVQ : I3312_LDRVD;
+    AArch64Insn st = q ? I3312_STRVQ : I3312_STRVD;
+
+    tcg_out_ldst(s, ld, TCG_VEC_TMP0, base, args[2]);
+
+    switch (opc) {
+    case INDEX_op_shli_vec:
+        tcg_out_insn(s, 3614, SHL, q, TCG_VEC_TMP0, TCG_VEC_TMP0,
+                     esize + args[3]);
+        break;
+    /* Right shifts by zero cannot be encoded; they are just a move.  */
+    case INDEX_op_shri_vec:
+        if (args[3]) {
+            tcg_out_insn(s, 3614, USHR, q, TCG_VEC_TMP0, TCG_VEC_TMP0,
+                         2 * esize - args[3]);
+        }
+        break;
+    case INDEX_op_sari_vec:
+        if (args[3]) {
+            tcg_out_insn(s, 3614, SSHR, q, TCG_VEC_TMP0, TCG_VEC_TMP0,
+                         2 * esize - args[3]);
+        }
+        break;
+
+    default:
+        tcg_out_ldst(s, ld, TCG_VEC_TMP1, base, args[3]);
+        switch (opc) {
+        case INDEX_op_add_vec:
+            tcg_out_insn(s, 3616, ADD, q, vece,
+                         TCG_VEC_TMP0, TCG_VEC_TMP0, TCG_VEC_TMP1);
+            break;
+        case INDEX_op_sub_vec:
+            tcg_out_insn(s, 3616, SUB, q, vece,
+                         TCG_VEC_TMP0, TCG_VEC_TMP0, TCG_VEC_TMP1);
+            break;
+        case INDEX_op_cmpeq_vec:
+            tcg_out_insn(s, 3616, CMEQ, q, vece,
+                         TCG_VEC_TMP0, TCG_VEC_TMP0, TCG_VEC_TMP1);
+            break;
+        case INDEX_op_and_vec:
+            tcg_out_insn(s, 3616, AND, q, 0,
+                         TCG_VEC_TMP0, TCG_VEC_TMP0, TCG_VEC_TMP1);
+            break;
+        case INDEX_op_or_vec:
+            tcg_out_insn(s, 3616, ORR, q, 0,
+                         TCG_VEC_TMP0, TCG_VEC_TMP0, TCG_VEC_TMP1);
+            break;
+        case INDEX_op_xor_vec:
+            tcg_out_insn(s, 3616, EOR, q, 0,
+                         TCG_VEC_TMP0, TCG_VEC_TMP0, TCG_VEC_TMP1);
+            break;
+        case INDEX_op_andc_vec:
+            tcg_out_insn(s, 3616, BIC, q, 0,
+                         TCG_VEC_TMP0, TCG_VEC_TMP0, TCG_VEC_TMP1);
+            break;
+        default:
+            tcg_abort();
+        }
+        break;
+    }
+
+    tcg_out_ldst(s, st, TCG_VEC_TMP0, base, args[1]);
+}
+
 static void tcg_out_op(TCGContext *s, TCGOpcode opc,
                        const TCGArg args[TCG_MAX_OP_ARGS],
                        const int const_args[TCG_MAX_OP_ARGS])
@@ -1591,6 +1702,19 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
         tcg_out_insn(s, 3508, SMULH, TCG_TYPE_I64, a0, a1, a2);
         break;
 
+    case INDEX_op_add_vec:
+    case INDEX_op_sub_vec:
+    case INDEX_op_and_vec:
+    case INDEX_op_or_vec:
+    case INDEX_op_xor_vec:
+    case INDEX_op_andc_vec:
+    case INDEX_op_cmpeq_vec:
+    case INDEX_op_shli_vec:
+    case INDEX_op_shri_vec:
+    case INDEX_op_sari_vec:
+        tcg_out_vec_op(s, opc, args);
+        break;
+
     case INDEX_op_mov_i32:  /* Always emitted via tcg_out_mov.  */
     case INDEX_op_mov_i64:
     case INDEX_op_movi_i32: /* Always emitted via tcg_out_movi.  */
@@ -1713,6 +1837,17 @@ static const TCGTargetOpDef aarch64_op_defs[] = {
     { INDEX_op_muluh_i64, { "r", "r", "r" } },
     { INDEX_op_mulsh_i64, { "r", "r", "r" } },
 
+    { INDEX_op_add_vec, { "r" } },
+    { INDEX_op_sub_vec, { "r" } },
+    { INDEX_op_and_vec, { "r" } },
+    { INDEX_op_or_vec, { "r" } },
+    { INDEX_op_xor_vec, { "r" } },
+    { INDEX_op_andc_vec, { "r" } },
+    { INDEX_op_cmpeq_vec, { "r" } },
+    { INDEX_op_shli_vec, { "r" } },
+    { INDEX_op_shri_vec, { "r" } },
+    { INDEX_op_sari_vec, { "r" } },
+
     { -1 },
 };
 
@@ -133,6 +133,10 @@ static bool have_movbe;
    it there.  Therefore we always define the variable.  */
 bool have_bmi1;
 
+/* SSE2 is part of x86_64; for 32-bit it is probed at runtime.  It is
+   also used in tcg-target.h, so always define the variable.  */
+bool have_sse2;
+
 #if defined(CONFIG_CPUID_H) && defined(bit_BMI2)
 static bool have_bmi2;
 #else
@@ -333,6 +337,28 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_MOVSLQ	(0x63 | P_REXW)
 #define OPC_MOVZBL	(0xb6 | P_EXT)
 #define OPC_MOVZWL	(0xb7 | P_EXT)
+#define OPC_MOVDQU_VxWx (0x6f | P_EXT | P_SIMDF3)
+#define OPC_MOVDQU_WxVx (0x7f | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_VqWq   (0x7e | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_WqVq   (0xd6 | P_EXT | P_DATA16)
+#define OPC_PADDB       (0xfc | P_EXT | P_DATA16)
+#define OPC_PADDW       (0xfd | P_EXT | P_DATA16)
+#define OPC_PADDD       (0xfe | P_EXT | P_DATA16)
+#define OPC_PADDQ       (0xd4 | P_EXT | P_DATA16)
+#define OPC_PAND        (0xdb | P_EXT | P_DATA16)
+#define OPC_PANDN       (0xdf | P_EXT | P_DATA16)
+#define OPC_PCMPEQB     (0x74 | P_EXT | P_DATA16)
+#define OPC_PCMPEQW     (0x75 | P_EXT | P_DATA16)
+#define OPC_PCMPEQD     (0x76 | P_EXT | P_DATA16)
+#define OPC_POR         (0xeb | P_EXT | P_DATA16)
+#define OPC_PSHIFTW_Ib  (0x71 | P_EXT | P_DATA16) /* /2 srl, /4 sra, /6 sll */
+#define OPC_PSHIFTD_Ib  (0x72 | P_EXT | P_DATA16)
+#define OPC_PSHIFTQ_Ib  (0x73 | P_EXT | P_DATA16)
+#define OPC_PSUBB       (0xf8 | P_EXT | P_DATA16)
+#define OPC_PSUBW       (0xf9 | P_EXT | P_DATA16)
+#define OPC_PSUBD       (0xfa | P_EXT | P_DATA16)
+#define OPC_PSUBQ       (0xfb | P_EXT | P_DATA16)
+#define OPC_PXOR        (0xef | P_EXT | P_DATA16)
 #define OPC_POP_r32	(0x58)
 #define OPC_PUSH_r32	(0x50)
 #define OPC_PUSH_Iv	(0x68)
@@ -428,6 +454,9 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
         assert((opc & P_REXW) == 0);
         tcg_out8(s, 0x66);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    }
     if (opc & P_ADDR32) {
         tcg_out8(s, 0x67);
     }
@@ -465,6 +494,9 @@ static void tcg_out_opc(TCGContext *s, int opc)
     if (opc & P_DATA16) {
         tcg_out8(s, 0x66);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    }
     if (opc & (P_EXT | P_EXT38)) {
         tcg_out8(s, 0x0f);
         if (opc & P_EXT38) {
@@ -1714,6 +1746,86 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, bool is64)
 #endif
 }
 
+/* Vector ops work on the memory operands through %xmm0 and %xmm1, which
+   are never allocated to TCG temps.  Loads and stores are unaligned, as
+   the guest registers in env are not necessarily 16-byte aligned.  */
+#define TCG_TMP_XMM0  0
+#define TCG_TMP_XMM1  1
+
+static void tcg_out_vec_op(TCGContext *s, TCGOpcode opc, const TCGArg *args)
+{
+    static const int add_insn[4] = {
+        OPC_PADDB, OPC_PADDW, OPC_PADDD, OPC_PADDQ
+    };
+    static const int sub_insn[4] = {
+        OPC_PSUBB, OPC_PSUBW, OPC_PSUBD, OPC_PSUBQ
+    };
+    static const int cmpeq_insn[3] = {
+        OPC_PCMPEQB, OPC_PCMPEQW, OPC_PCMPEQD
+    };
+    static const int shift_insn[4] = {
+        0, OPC_PSHIFTW_Ib, OPC_PSHIFTD_Ib, OPC_PSHIFTQ_Ib
+    };
+    TCGReg base = args[0];
+    int vece = TCG_VEC_ECE(args[4]);
+    int ld = TCG_VEC_OPRSZ(args[4]) == 16 ? OPC_MOVDQU_VxWx : OPC_MOVQ_VqWq;
+    int st = TCG_VEC_OPRSZ(args[4]) == 16 ? OPC_MOVDQU_WxVx : OPC_MOVQ_WqVq;
+    int insn, ret = TCG_TMP_XMM0;
+
+    tcg_out_modrm_offset(s, ld, TCG_TMP_XMM0, base, args[2]);
+
+    switch (opc) {
+    case INDEX_op_shli_vec:
+        tcg_out_modrm(s, shift_insn[vece], 6, TCG_TMP_XMM0);
+        tcg_out8(s, args[3]);
+        break;
+    case INDEX_op_shri_vec:
+        tcg_out_modrm(s, shift_insn[vece], 2, TCG_TMP_XMM0);
+        tcg_out8(s, args[3]);
+        break;
+    case INDEX_op_sari_vec:
+        tcg_out_modrm(s, shift_insn[vece], 4, TCG_TMP_XMM0);
+        tcg_out8(s, args[3]);
+        break;
+
+    case INDEX_op_andc_vec:
+        /* pandn inverts its destination operand.  */
+        tcg_out_modrm_offset(s, ld, TCG_TMP_XMM1, base, args[3]);
+        tcg_out_modrm(s, OPC_PANDN, TCG_TMP_XMM1, TCG_TMP_XMM0);
+        ret = TCG_TMP_XMM1;
+        break;
+
+    default:
+        switch (opc) {
+        case INDEX_op_add_vec:
+            insn = add_insn[vece];
+            break;
+        case INDEX_op_sub_vec:
+            insn = sub_insn[vece];
+            break;
+        case INDEX_op_cmpeq_vec:
+            insn = cmpeq_insn[vece];
+            break;
+        case INDEX_op_and_vec:
+            insn = OPC_PAND;
+            break;
+        case INDEX_op_or_vec:
+            insn = OPC_POR;
+            break;
+        case INDEX_op_xor_vec:
+            insn = OPC_PXOR;
+            break;
+        default:
+            tcg_abort();
+        }
+        tcg_out_modrm_offset(s, ld, TCG_TMP_XMM1, base, args[3]);
+        tcg_out_modrm(s, insn, TCG_TMP_XMM0, TCG_TMP_XMM1);
+        break;
+    }
+
+    tcg_out_modrm_offset(s, st, ret, base, args[1]);
+}
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -2055,6 +2167,19 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         break;
 
+    case INDEX_op_add_vec:
+    case INDEX_op_sub_vec:
+    case INDEX_op_and_vec:
+    case INDEX_op_or_vec:
+    case INDEX_op_xor_vec:
+    case INDEX_op_andc_vec:
+    case INDEX_op_cmpeq_vec:
+    case INDEX_op_shli_vec:
+    case INDEX_op_shri_vec:
+    case INDEX_op_sari_vec:
+        tcg_out_vec_op(s, opc, args);
+        break;
+
     case INDEX_op_mov_i32:  /* Always emitted via tcg_out_mov.  */
     case INDEX_op_mov_i64:
     case INDEX_op_movi_i32: /* Always emitted via tcg_out_movi.  */
@@ -2193,6 +2318,17 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_qemu_ld_i64, { "r", "r", "L", "L" } },
     { INDEX_op_qemu_st_i64, { "L", "L", "L", "L" } },
 #endif
+
+    { INDEX_op_add_vec, { "r" } },
+    { INDEX_op_sub_vec, { "r" } },
+    { INDEX_op_and_vec, { "r" } },
+    { INDEX_op_or_vec, { "r" } },
+    { INDEX_op_xor_vec, { "r" } },
+    { INDEX_op_andc_vec, { "r" } },
+    { INDEX_op_cmpeq_vec, { "r" } },
+    { INDEX_op_shli_vec, { "r" } },
+    { INDEX_op_shri_vec, { "r" } },
+    { INDEX_op_sari_vec, { "r" } },
     { -1 },
 };
 
@@ -2298,6 +2434,9 @@ static void tcg_target_init(TCGContext *s)
         /* MOVBE is only available on Intel Atom and Haswell CPUs, so we
            need to probe for it.  */
         have_movbe = (c & bit_MOVBE) != 0;
+#endif
+#ifdef bit_SSE2
+        have_sse2 = (d & bit_SSE2) != 0;
 #endif
     }
 
@@ -2313,6 +2452,10 @@ static void tcg_target_init(TCGContext *s)
     }
 #endif
 
+    if (TCG_TARGET_REG_BITS == 64) {
+        have_sse2 = true;
+    }
+
     if (TCG_TARGET_REG_BITS == 64) {
         tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I32], 0, 0xffff);
         tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I64], 0, 0xffff);
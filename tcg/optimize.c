@@ -51,6 +51,61 @@ struct tcg_temp_info {
 
 static struct tcg_temp_info temps[TCG_MAX_TEMPS];
 
+/* A label that is the target of a single branch and cannot be reached by
+   falling through from the previous op starts with the state the temps
+   had at that branch, instead of knowing nothing.  This lets constants
+   and copies flow into the next block of a superblock.  */
+static uint8_t label_refs[TCG_MAX_LABELS];
+
+/* Fields of env whose value is known to be held in a temp, because the
+   temp was last stored to or loaded from the field in this basic block.
+   LD_OP is the load that the temp can replace.  */
+#define MAX_ENV_SLOTS 16
+
+struct tcg_env_slot {
+    intptr_t ofs;
+    int size;
+    TCGOpcode ld_op;
+    TCGArg temp;
+};
+
+static struct tcg_env_slot env_slots[MAX_ENV_SLOTS];
+static int nb_env_slots;
+
+/* What is known at the single branch to a label: the temps and the env
+   fields they hold.  */
+struct tcg_label_state {
+    struct tcg_env_slot env_slots[MAX_ENV_SLOTS];
+    int nb_env_slots;
+    struct tcg_temp_info temps[];
+};
+
+static struct tcg_label_state *label_state[TCG_MAX_LABELS];
+
+/* Ranges of env that are overwritten further down the basic block before
+   anything can read them, used when looking for dead stores.  */
+struct tcg_env_range {
+    intptr_t ofs;
+    int size;
+};
+
+static struct tcg_env_range env_ranges[MAX_ENV_SLOTS];
+static int nb_env_ranges;
+
+/* Forget the env fields that TEMP holds.  */
+static void forget_env_temp(TCGArg temp)
+{
+    int i;
+
+    for (i = 0; i < nb_env_slots; ) {
+        if (env_slots[i].temp == temp) {
+            env_slots[i] = env_slots[--nb_env_slots];
+        } else {
+            i++;
+        }
+    }
+}
+
 /* Reset TEMP's state to TCG_TEMP_UNDEF.  If TEMP only had one copy, remove
    the copy flag from the left temp.  */
 static void reset_temp(TCGArg temp)
@@ -65,6 +120,7 @@ static void reset_temp(TCGArg temp)
     }
     temps[temp].state = TCG_TEMP_UNDEF;
     temps[temp].mask = -1;
+    forget_env_temp(temp);
 }
 
 /* Reset all temporaries, given that there are NB_TEMPS of them.  */
@@ -75,6 +131,175 @@ static void reset_all_temps(int nb_temps)
         temps[i].state = TCG_TEMP_UNDEF;
         temps[i].mask = -1;
     }
+    nb_env_slots = 0;
+}
+
+/* Return the label OP branches to, or -1.  */
+static int branch_label(TCGOpcode op, const TCGArg *args)
+{
+    switch (op) {
+    case INDEX_op_br:
+        return args[0];
+    case INDEX_op_brcond_i32:
+    case INDEX_op_brcond_i64:
+        return args[3];
+    case INDEX_op_brcond2_i32:
+        return args[5];
+    default:
+        return -1;
+    }
+}
+
+static void count_label_refs(TCGContext *s, uint16_t *tcg_opc_ptr,
+                             const TCGArg *args, TCGOpDef *tcg_op_defs)
+{
+    uint16_t *opc;
+    int label;
+
+    memset(label_refs, 0, s->nb_labels);
+    for (opc = s->gen_opc_buf; opc < tcg_opc_ptr; opc++) {
+        const TCGOpDef *def = &tcg_op_defs[*opc];
+
+        label = branch_label(*opc, args);
+        if (label >= 0 && label_refs[label] < 2) {
+            label_refs[label]++;
+        }
+        if (*opc == INDEX_op_call) {
+            args += 1 + (args[0] >> 16) + (args[0] & 0xffff) + def->nb_cargs;
+        } else {
+            args += def->nb_args;
+        }
+    }
+}
+
+static struct tcg_label_state *save_label_state(int nb_temps)
+{
+    struct tcg_label_state *state;
+
+    state = g_malloc(sizeof(*state) + nb_temps * sizeof(temps[0]));
+    memcpy(state->env_slots, env_slots, nb_env_slots * sizeof(env_slots[0]));
+    state->nb_env_slots = nb_env_slots;
+    memcpy(state->temps, temps, nb_temps * sizeof(temps[0]));
+    return state;
+}
+
+/* Enter a block through its single branch: temps other than globals and
+   local temps are dead at the end of the previous block, and so are the
+   env fields they held.  The env slots of the previous block do not
+   apply here.  */
+static void restore_label_state(TCGContext *s, struct tcg_label_state *state,
+                                int nb_temps)
+{
+    int i;
+
+    memcpy(temps, state->temps, nb_temps * sizeof(temps[0]));
+    memcpy(env_slots, state->env_slots,
+           state->nb_env_slots * sizeof(env_slots[0]));
+    nb_env_slots = state->nb_env_slots;
+    for (i = s->nb_globals; i < nb_temps; i++) {
+        if (!s->temps[i].temp_local) {
+            reset_temp(i);
+        }
+    }
+}
+
+/* Drop the states of labels whose branch was folded away.  */
+static void free_label_states(TCGContext *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_labels; i++) {
+        g_free(label_state[i]);
+        label_state[i] = NULL;
+    }
+}
+
+/* Return the number of bytes read by host load OP, or 0.  */
+static int ld_size(TCGOpcode op)
+{
+    switch (op) {
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld8s):
+        return 1;
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(ld16s):
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+/* Return the number of bytes written by host store OP, or 0.  */
+static int st_size(TCGOpcode op)
+{
+    switch (op) {
+    CASE_OP_32_64(st8):
+        return 1;
+    CASE_OP_32_64(st16):
+        return 2;
+    case INDEX_op_st_i32:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_st_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static bool is_env_base(TCGContext *s, TCGArg arg)
+{
+    return s->temps[arg].fixed_reg && s->temps[arg].reg == TCG_AREG0;
+}
+
+static bool ranges_overlap(intptr_t ofs1, int size1, intptr_t ofs2, int size2)
+{
+    return ofs1 < ofs2 + size2 && ofs2 < ofs1 + size1;
+}
+
+static struct tcg_env_slot *find_env_slot(intptr_t ofs, TCGOpcode ld_op)
+{
+    int i;
+
+    for (i = 0; i < nb_env_slots; i++) {
+        if (env_slots[i].ofs == ofs && env_slots[i].ld_op == ld_op) {
+            return &env_slots[i];
+        }
+    }
+    return NULL;
+}
+
+/* A store to [OFS, OFS + SIZE) makes the temps of overlapping fields
+   stale.  */
+static void forget_env_slots(intptr_t ofs, int size)
+{
+    int i;
+
+    for (i = 0; i < nb_env_slots; ) {
+        if (ranges_overlap(env_slots[i].ofs, env_slots[i].size, ofs, size)) {
+            env_slots[i] = env_slots[--nb_env_slots];
+        } else {
+            i++;
+        }
+    }
+}
+
+static void remember_env_slot(intptr_t ofs, int size, TCGOpcode ld_op,
+                              TCGArg temp)
+{
+    if (nb_env_slots < MAX_ENV_SLOTS && !find_env_slot(ofs, ld_op)) {
+        env_slots[nb_env_slots].ofs = ofs;
+        env_slots[nb_env_slots].size = size;
+        env_slots[nb_env_slots].ld_op = ld_op;
+        env_slots[nb_env_slots].temp = temp;
+        nb_env_slots++;
+    }
 }
 
 static int op_bits(TCGOpcode op)
@@ -547,6 +772,7 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
     nb_temps = s->nb_temps;
     nb_globals = s->nb_globals;
     reset_all_temps(nb_temps);
+    count_label_refs(s, tcg_opc_ptr, args, tcg_op_defs);
 
     nb_ops = tcg_opc_ptr - s->gen_opc_buf;
     gen_args = args;
@@ -554,8 +780,10 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
         TCGOpcode op = s->gen_opc_buf[op_index];
         const TCGOpDef *def = &tcg_op_defs[op];
         tcg_target_ulong mask, partmask, affected;
-        int nb_oargs, nb_iargs, nb_args, i;
-        TCGArg tmp;
+        int nb_oargs, nb_iargs, nb_args, i, label, env_size;
+        bool env_store;
+        TCGOpcode env_ld_op;
+        TCGArg tmp, env_ofs, env_temp;
 
         if (op == INDEX_op_call) {
             *gen_args++ = tmp = *args++;
@@ -575,6 +803,65 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             }
         }
 
+        /* Branches have no outputs, so this is the state at the target */
+        label = branch_label(op, args);
+        if (label >= 0 && label_refs[label] == 1) {
+            label_state[label] = save_label_state(nb_temps);
+        }
+
+        /* Replace a load from env with a copy of the temp that was last
+           stored to or loaded from the same field.  The field accessed by
+           other loads and stores is recorded once the op is done.  */
+        env_size = 0;
+        env_store = false;
+        env_ld_op = INDEX_op_nop;
+        env_ofs = env_temp = 0;
+        if (ld_size(op) && is_env_base(s, args[1])) {
+            struct tcg_env_slot *slot = find_env_slot(args[2], op);
+
+            if (slot) {
+                tmp = slot->temp;
+                if (temps[tmp].state == TCG_TEMP_CONST) {
+                    tcg_opt_gen_movi(s, op_index, gen_args, op, args[0],
+                                     temps[tmp].val);
+                    gen_args += 2;
+                } else if (temps_are_copies(args[0], tmp)) {
+                    s->gen_opc_buf[op_index] = INDEX_op_nop;
+                } else {
+                    tcg_opt_gen_mov(s, op_index, gen_args, op, args[0], tmp);
+                    gen_args += 2;
+                }
+                args += 3;
+#ifdef CONFIG_PROFILER
+                s->env_ld_fwd_count++;
+#endif
+                continue;
+            }
+            env_size = ld_size(op);
+            env_ld_op = op;
+            env_ofs = args[2];
+            env_temp = args[0];
+        } else if (st_size(op)) {
+            if (is_env_base(s, args[1])) {
+                env_size = st_size(op);
+                env_store = true;
+                if (op == INDEX_op_st_i32) {
+                    env_ld_op = INDEX_op_ld_i32;
+                } else if (op == INDEX_op_st_i64) {
+                    env_ld_op = INDEX_op_ld_i64;
+                }
+                env_ofs = args[2];
+                env_temp = args[0];
+            } else {
+                /* Stores through other pointers may alias env.  */
+                nb_env_slots = 0;
+            }
+        } else if (def->flags & (TCG_OPF_CALL_CLOBBER | TCG_OPF_VECTOR)) {
+            /* Helpers, the slow path of guest memory accesses and vector
+               ops may read or write any part of env.  */
+            nb_env_slots = 0;
+        }
+
         /* For commutative operations make constant second argument */
         switch (op) {
         CASE_OP_32_64(add):
@@ -1348,6 +1635,22 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             args += 6;
             break;
 
+        case INDEX_op_set_label:
+            label = args[0];
+            if (label_state[label] && op_index > 0 &&
+                (s->gen_opc_buf[op_index - 1] == INDEX_op_br ||
+                 s->gen_opc_buf[op_index - 1] == INDEX_op_exit_tb)) {
+                restore_label_state(s, label_state[label], nb_temps);
+            } else {
+                reset_all_temps(nb_temps);
+            }
+            g_free(label_state[label]);
+            label_state[label] = NULL;
+            gen_args[0] = args[0];
+            gen_args += 1;
+            args += 1;
+            break;
+
         case INDEX_op_call:
             if (!(args[nb_oargs + nb_iargs + 1]
                   & (TCG_CALL_NO_READ_GLOBALS | TCG_CALL_NO_WRITE_GLOBALS))) {
@@ -1384,15 +1687,104 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             gen_args += nb_args;
             break;
         }
+
+        /* The output of a load has been reset by now, so it can be
+           recorded as holding the field.  */
+        if (env_size) {
+            if (env_store) {
+                forget_env_slots(env_ofs, env_size);
+            }
+            if (env_ld_op != INDEX_op_nop) {
+                remember_env_slot(env_ofs, env_size, env_ld_op, env_temp);
+            }
+        }
     }
 
+    free_label_states(s);
     return gen_args;
 }
 
+/* Return true if all of [OFS, OFS + SIZE) is overwritten later on.  */
+static bool env_range_dead(intptr_t ofs, int size)
+{
+    int i;
+
+    for (i = 0; i < nb_env_ranges; i++) {
+        if (env_ranges[i].ofs <= ofs
+            && ofs + size <= env_ranges[i].ofs + env_ranges[i].size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void forget_env_ranges(intptr_t ofs, int size)
+{
+    int i;
+
+    for (i = 0; i < nb_env_ranges; ) {
+        if (ranges_overlap(env_ranges[i].ofs, env_ranges[i].size, ofs, size)) {
+            env_ranges[i] = env_ranges[--nb_env_ranges];
+        } else {
+            i++;
+        }
+    }
+}
+
+/* Remove stores to env that are overwritten by a later store in the same
+   basic block, with no load of the field, helper call or guest memory
+   access (which could fault and leave the TB) in between.  The ops are
+   walked backwards like in the liveness analysis; ARGS points to the end
+   of the arguments.  */
+static void tcg_env_dead_stores(TCGContext *s, uint16_t *tcg_opc_ptr,
+                                TCGArg *args, TCGOpDef *tcg_op_defs)
+{
+    int op_index, size;
+
+    nb_env_ranges = 0;
+    for (op_index = tcg_opc_ptr - s->gen_opc_buf - 1; op_index >= 0;
+         op_index--) {
+        TCGOpcode op = s->gen_opc_buf[op_index];
+        const TCGOpDef *def = &tcg_op_defs[op];
+
+        if (op == INDEX_op_call || op == INDEX_op_nopn) {
+            args -= args[-1];
+        } else {
+            args -= def->nb_args;
+        }
+
+        size = st_size(op);
+        if (size && is_env_base(s, args[1])) {
+            if (env_range_dead(args[2], size)) {
+                s->gen_opc_buf[op_index] = INDEX_op_nop3;
+#ifdef CONFIG_PROFILER
+                s->env_st_del_count++;
+#endif
+            } else if (nb_env_ranges < MAX_ENV_SLOTS) {
+                env_ranges[nb_env_ranges].ofs = args[2];
+                env_ranges[nb_env_ranges].size = size;
+                nb_env_ranges++;
+            }
+            continue;
+        }
+
+        size = ld_size(op);
+        if (size && is_env_base(s, args[1])) {
+            forget_env_ranges(args[2], size);
+        } else if (size || (def->flags & (TCG_OPF_BB_END
+                                          | TCG_OPF_CALL_CLOBBER
+                                          | TCG_OPF_SIDE_EFFECTS
+                                          | TCG_OPF_VECTOR))) {
+            nb_env_ranges = 0;
+        }
+    }
+}
+
 TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr,
         TCGArg *args, TCGOpDef *tcg_op_defs)
 {
     TCGArg *res;
     res = tcg_constant_folding(s, tcg_opc_ptr, args, tcg_op_defs);
+    tcg_env_dead_stores(s, tcg_opc_ptr, res, tcg_op_defs);
     return res;
 }
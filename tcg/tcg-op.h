@@ -2456,6 +2456,37 @@ static inline void tcg_gen_muls2_i64(TCGv_i64 rl, TCGv_i64 rh,
     }
 }
 
+/* Vector operations on OPRSZ (8 or 16) bytes at BASE + offset, split
+   into lanes of (1 << VECE) bytes.  Shift counts must be smaller than
+   the lane size in bits.  Hosts without vector ops get an expansion into
+   64-bit or per-lane operations.  */
+void tcg_gen_add_vec(unsigned vece, uint32_t oprsz, TCGv_ptr base,
+                     tcg_target_long dofs, tcg_target_long aofs,
+                     tcg_target_long bofs);
+void tcg_gen_sub_vec(unsigned vece, uint32_t oprsz, TCGv_ptr base,
+                     tcg_target_long dofs, tcg_target_long aofs,
+                     tcg_target_long bofs);
+void tcg_gen_cmpeq_vec(unsigned vece, uint32_t oprsz, TCGv_ptr base,
+                       tcg_target_long dofs, tcg_target_long aofs,
+                       tcg_target_long bofs);
+void tcg_gen_and_vec(uint32_t oprsz, TCGv_ptr base, tcg_target_long dofs,
+                     tcg_target_long aofs, tcg_target_long bofs);
+void tcg_gen_or_vec(uint32_t oprsz, TCGv_ptr base, tcg_target_long dofs,
+                    tcg_target_long aofs, tcg_target_long bofs);
+void tcg_gen_xor_vec(uint32_t oprsz, TCGv_ptr base, tcg_target_long dofs,
+                     tcg_target_long aofs, tcg_target_long bofs);
+void tcg_gen_andc_vec(uint32_t oprsz, TCGv_ptr base, tcg_target_long dofs,
+                      tcg_target_long aofs, tcg_target_long bofs);
+void tcg_gen_shli_vec(unsigned vece, uint32_t oprsz, TCGv_ptr base,
+                      tcg_target_long dofs, tcg_target_long aofs,
+                      unsigned shift);
+void tcg_gen_shri_vec(unsigned vece, uint32_t oprsz, TCGv_ptr base,
+                      tcg_target_long dofs, tcg_target_long aofs,
+                      unsigned shift);
+void tcg_gen_sari_vec(unsigned vece, uint32_t oprsz, TCGv_ptr base,
+                      tcg_target_long dofs, tcg_target_long aofs,
+                      unsigned shift);
+
 /***************************************/
 /* QEMU specific operations. Their type depend on the QEMU CPU
    type. */
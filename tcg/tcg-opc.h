@@ -176,6 +176,23 @@ DEF(muls2_i64, 2, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_muls2_i64))
 DEF(muluh_i64, 1, 2, 0, IMPL(TCG_TARGET_HAS_muluh_i64))
 DEF(mulsh_i64, 1, 2, 0, IMPL(TCG_TARGET_HAS_mulsh_i64))
 
+/* vector ops on memory: base; dest, src1 and src2 (or shift count)
+   offsets; desc */
+#define IMPLVEC  TCG_OPF_VECTOR | IMPL(TCG_TARGET_HAS_vec)
+
+DEF(add_vec, 0, 1, 4, IMPLVEC)
+DEF(sub_vec, 0, 1, 4, IMPLVEC)
+DEF(and_vec, 0, 1, 4, IMPLVEC)
+DEF(or_vec, 0, 1, 4, IMPLVEC)
+DEF(xor_vec, 0, 1, 4, IMPLVEC)
+DEF(andc_vec, 0, 1, 4, IMPLVEC)
+DEF(cmpeq_vec, 0, 1, 4, IMPLVEC)
+DEF(shli_vec, 0, 1, 4, IMPLVEC)
+DEF(shri_vec, 0, 1, 4, IMPLVEC)
+DEF(sari_vec, 0, 1, 4, IMPLVEC)
+
+#undef IMPLVEC
+
 /* QEMU specific */
 #if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
 DEF(debug_insn_start, 0, 0, 2, TCG_OPF_NOT_PRESENT)
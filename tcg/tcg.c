@@ -417,6 +417,7 @@ void tcg_func_start(TCGContext *s)
 
     s->gen_opc_ptr = s->gen_opc_buf;
     s->gen_opparam_ptr = s->gen_opparam_buf;
+    s->host_ptr_consts = false;
 
     s->be = tcg_malloc(sizeof(TCGBackendData));
 }
@@ -1007,6 +1008,287 @@ void tcg_gen_qemu_st_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGMemOp memop)
     *tcg_ctx.gen_opparam_ptr++ = idx;
 }
 
+/* Return true if the host can do vector op OPC on this shape.  Vectors
+   of a single 64-bit lane are better done with the i64 ops; SSE2 lacks
+   byte shifts, 64-bit compares and 64-bit arithmetic right shifts.  */
+static bool tcg_vec_op_ok(TCGOpcode opc, unsigned vece, uint32_t oprsz)
+{
+    if (!TCG_TARGET_HAS_vec || (vece == MO_64 && oprsz == 8)) {
+        return false;
+    }
+    switch (opc) {
+    case INDEX_op_cmpeq_vec:
+        return vece != MO_64;
+    case INDEX_op_shli_vec:
+    case INDEX_op_shri_vec:
+        return vece != MO_8;
+    case INDEX_op_sari_vec:
+        return vece == MO_16 || vece == MO_32;
+    default:
+        return true;
+    }
+}
+
+static void tcg_gen_vec_op(TCGOpcode opc, unsigned vece, uint32_t oprsz,
+                           TCGv_ptr base, tcg_target_long dofs,
+                           tcg_target_long aofs, TCGArg arg)
+{
+    *tcg_ctx.gen_opc_ptr++ = opc;
+    *tcg_ctx.gen_opparam_ptr++ = GET_TCGV_PTR(base);
+    *tcg_ctx.gen_opparam_ptr++ = dofs;
+    *tcg_ctx.gen_opparam_ptr++ = aofs;
+    *tcg_ctx.gen_opparam_ptr++ = arg;
+    *tcg_ctx.gen_opparam_ptr++ = TCG_VEC_DESC(vece, oprsz);
+}
+
+/* Replicate the lane-sized constant C across 64 bits.  */
+static uint64_t tcg_vec_dup(unsigned vece, uint64_t c)
+{
+    switch (vece) {
+    case MO_8:
+        return 0x0101010101010101ull * (uint8_t)c;
+    case MO_16:
+        return 0x0001000100010001ull * (uint16_t)c;
+    case MO_32:
+        return 0x0000000100000001ull * (uint32_t)c;
+    default:
+        return c;
+    }
+}
+
+/* Expand a vector op into operations on 64-bit chunks, treating lanes
+   narrower than 64 bits SIMD-within-a-register style: additions keep
+   the carry out of the top bit of each lane, shifts mask the bits that
+   cross into the neighbouring lane.  */
+static void tcg_gen_vec_chunks(TCGOpcode opc, unsigned vece, uint32_t oprsz,
+                               TCGv_ptr base, tcg_target_long dofs,
+                               tcg_target_long aofs, TCGArg arg)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    uint64_t m = tcg_vec_dup(vece, 1ull << ((8 << vece) - 1));
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, base, aofs + i);
+        if (opc != INDEX_op_shli_vec && opc != INDEX_op_shri_vec
+            && opc != INDEX_op_sari_vec) {
+            tcg_gen_ld_i64(t1, base, arg + i);
+        }
+        switch (opc) {
+        case INDEX_op_add_vec:
+            if (vece == MO_64) {
+                tcg_gen_add_i64(t0, t0, t1);
+            } else {
+                tcg_gen_xor_i64(t2, t0, t1);
+                tcg_gen_andi_i64(t2, t2, m);
+                tcg_gen_andi_i64(t0, t0, ~m);
+                tcg_gen_andi_i64(t1, t1, ~m);
+                tcg_gen_add_i64(t0, t0, t1);
+                tcg_gen_xor_i64(t0, t0, t2);
+            }
+            break;
+        case INDEX_op_sub_vec:
+            if (vece == MO_64) {
+                tcg_gen_sub_i64(t0, t0, t1);
+            } else {
+                tcg_gen_eqv_i64(t2, t0, t1);
+                tcg_gen_andi_i64(t2, t2, m);
+                tcg_gen_ori_i64(t0, t0, m);
+                tcg_gen_andi_i64(t1, t1, ~m);
+                tcg_gen_sub_i64(t0, t0, t1);
+                tcg_gen_xor_i64(t0, t0, t2);
+            }
+            break;
+        case INDEX_op_and_vec:
+            tcg_gen_and_i64(t0, t0, t1);
+            break;
+        case INDEX_op_or_vec:
+            tcg_gen_or_i64(t0, t0, t1);
+            break;
+        case INDEX_op_xor_vec:
+            tcg_gen_xor_i64(t0, t0, t1);
+            break;
+        case INDEX_op_andc_vec:
+            tcg_gen_andc_i64(t0, t0, t1);
+            break;
+        case INDEX_op_cmpeq_vec:
+            assert(vece == MO_64);
+            tcg_gen_setcond_i64(TCG_COND_EQ, t0, t0, t1);
+            tcg_gen_neg_i64(t0, t0);
+            break;
+        case INDEX_op_shli_vec:
+            tcg_gen_shli_i64(t0, t0, arg);
+            if (vece != MO_64) {
+                tcg_gen_andi_i64(t0, t0,
+                                 tcg_vec_dup(vece, ((2ull << ((8 << vece) - 1))
+                                                    - 1) << arg));
+            }
+            break;
+        case INDEX_op_shri_vec:
+            tcg_gen_shri_i64(t0, t0, arg);
+            if (vece != MO_64) {
+                tcg_gen_andi_i64(t0, t0,
+                                 tcg_vec_dup(vece, ((2ull << ((8 << vece) - 1))
+                                                    - 1) >> arg));
+            }
+            break;
+        case INDEX_op_sari_vec:
+            assert(vece == MO_64);
+            tcg_gen_sari_i64(t0, t0, arg);
+            break;
+        default:
+            tcg_abort();
+        }
+        tcg_gen_st_i64(t0, base, dofs + i);
+    }
+
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+/* Expand a compare or arithmetic right shift on lanes of up to 32 bits
+   one lane at a time.  */
+static void tcg_gen_vec_lanes(TCGOpcode opc, unsigned vece, uint32_t oprsz,
+                              TCGv_ptr base, tcg_target_long dofs,
+                              tcg_target_long aofs, TCGArg arg)
+{
+    TCGv_i32 t0 = tcg_temp_new_i32();
+    TCGv_i32 t1 = tcg_temp_new_i32();
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 1 << vece) {
+        switch (vece) {
+        case MO_8:
+            tcg_gen_ld8s_i32(t0, base, aofs + i);
+            break;
+        case MO_16:
+            tcg_gen_ld16s_i32(t0, base, aofs + i);
+            break;
+        default:
+            tcg_gen_ld_i32(t0, base, aofs + i);
+            break;
+        }
+        if (opc == INDEX_op_cmpeq_vec) {
+            switch (vece) {
+            case MO_8:
+                tcg_gen_ld8s_i32(t1, base, arg + i);
+                break;
+            case MO_16:
+                tcg_gen_ld16s_i32(t1, base, arg + i);
+                break;
+            default:
+                tcg_gen_ld_i32(t1, base, arg + i);
+                break;
+            }
+            tcg_gen_setcond_i32(TCG_COND_EQ, t0, t0, t1);
+            tcg_gen_neg_i32(t0, t0);
+        } else {
+            tcg_gen_sari_i32(t0, t0, arg);
+        }
+        switch (vece) {
+        case MO_8:
+            tcg_gen_st8_i32(t0, base, dofs + i);
+            break;
+        case MO_16:
+            tcg_gen_st16_i32(t0, base, dofs + i);
+            break;
+        default:
+            tcg_gen_st_i32(t0, base, dofs + i);
+            break;
+        }
+    }
+
+    tcg_temp_free_i32(t0);
+    tcg_temp_free_i32(t1);
+}
+
+static void tcg_gen_vec(TCGOpcode opc, unsigned vece, uint32_t oprsz,
+                        TCGv_ptr base, tcg_target_long dofs,
+                        tcg_target_long aofs, TCGArg arg)
+{
+    assert(oprsz == 8 || oprsz == 16);
+    if (tcg_vec_op_ok(opc, vece, oprsz)) {
+        tcg_gen_vec_op(opc, vece, oprsz, base, dofs, aofs, arg);
+    } else if (vece != MO_64
+               && (opc == INDEX_op_cmpeq_vec || opc == INDEX_op_sari_vec)) {
+        tcg_gen_vec_lanes(opc, vece, oprsz, base, dofs, aofs, arg);
+    } else {
+        tcg_gen_vec_chunks(opc, vece, oprsz, base, dofs, aofs, arg);
+    }
+}
+
+void tcg_gen_add_vec(unsigned vece, uint32_t oprsz, TCGv_ptr base,
+                     tcg_target_long dofs, tcg_target_long aofs,
+                     tcg_target_long bofs)
+{
+    tcg_gen_vec(INDEX_op_add_vec, vece, oprsz, base, dofs, aofs, bofs);
+}
+
+void tcg_gen_sub_vec(unsigned vece, uint32_t oprsz, TCGv_ptr base,
+                     tcg_target_long dofs, tcg_target_long aofs,
+                     tcg_target_long bofs)
+{
+    tcg_gen_vec(INDEX_op_sub_vec, vece, oprsz, base, dofs, aofs, bofs);
+}
+
+void tcg_gen_cmpeq_vec(unsigned vece, uint32_t oprsz, TCGv_ptr base,
+                       tcg_target_long dofs, tcg_target_long aofs,
+                       tcg_target_long bofs)
+{
+    tcg_gen_vec(INDEX_op_cmpeq_vec, vece, oprsz, base, dofs, aofs, bofs);
+}
+
+void tcg_gen_and_vec(uint32_t oprsz, TCGv_ptr base, tcg_target_long dofs,
+                     tcg_target_long aofs, tcg_target_long bofs)
+{
+    tcg_gen_vec(INDEX_op_and_vec, MO_64, oprsz, base, dofs, aofs, bofs);
+}
+
+void tcg_gen_or_vec(uint32_t oprsz, TCGv_ptr base, tcg_target_long dofs,
+                    tcg_target_long aofs, tcg_target_long bofs)
+{
+    tcg_gen_vec(INDEX_op_or_vec, MO_64, oprsz, base, dofs, aofs, bofs);
+}
+
+void tcg_gen_xor_vec(uint32_t oprsz, TCGv_ptr base, tcg_target_long dofs,
+                     tcg_target_long aofs, tcg_target_long bofs)
+{
+    tcg_gen_vec(INDEX_op_xor_vec, MO_64, oprsz, base, dofs, aofs, bofs);
+}
+
+void tcg_gen_andc_vec(uint32_t oprsz, TCGv_ptr base, tcg_target_long dofs,
+                      tcg_target_long aofs, tcg_target_long bofs)
+{
+    tcg_gen_vec(INDEX_op_andc_vec, MO_64, oprsz, base, dofs, aofs, bofs);
+}
+
+void tcg_gen_shli_vec(unsigned vece, uint32_t oprsz, TCGv_ptr base,
+                      tcg_target_long dofs, tcg_target_long aofs,
+                      unsigned shift)
+{
+    assert(shift < (8u << vece));
+    tcg_gen_vec(INDEX_op_shli_vec, vece, oprsz, base, dofs, aofs, shift);
+}
+
+void tcg_gen_shri_vec(unsigned vece, uint32_t oprsz, TCGv_ptr base,
+                      tcg_target_long dofs, tcg_target_long aofs,
+                      unsigned shift)
+{
+    assert(shift < (8u << vece));
+    tcg_gen_vec(INDEX_op_shri_vec, vece, oprsz, base, dofs, aofs, shift);
+}
+
+void tcg_gen_sari_vec(unsigned vece, uint32_t oprsz, TCGv_ptr base,
+                      tcg_target_long dofs, tcg_target_long aofs,
+                      unsigned shift)
+{
+    assert(shift < (8u << vece));
+    tcg_gen_vec(INDEX_op_sari_vec, vece, oprsz, base, dofs, aofs, shift);
+}
+
 static void tcg_reg_alloc_start(TCGContext *s)
 {
     int i;
@@ -2453,6 +2735,15 @@ static inline int tcg_gen_code_common(TCGContext *s,
 
 #ifdef CONFIG_PROFILER
     s->la_time += profile_getclock();
+    if (search_pc < 0) {
+        for (op_index = 0; s->gen_opc_buf + op_index < s->gen_opc_ptr;
+             op_index++) {
+            def = &tcg_op_defs[s->gen_opc_buf[op_index]];
+            if (!(def->flags & TCG_OPF_NOT_PRESENT)) {
+                s->opt_op_count++;
+            }
+        }
+    }
 #endif
 
 #ifdef DEBUG_DISAS
@@ -2600,6 +2891,12 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "deleted ops/TB      %0.2f\n",
                 s->tb_count ? 
                 (double)s->del_op_count / s->tb_count : 0);
+    cpu_fprintf(f, "optimized ops/TB    %0.1f\n",
+                s->tb_count ? (double)s->opt_op_count / s->tb_count : 0);
+    cpu_fprintf(f, "env loads fwd/TB    %0.2f\n",
+                s->tb_count ? (double)s->env_ld_fwd_count / s->tb_count : 0);
+    cpu_fprintf(f, "env stores del/TB   %0.2f\n",
+                s->tb_count ? (double)s->env_st_del_count / s->tb_count : 0);
     cpu_fprintf(f, "avg temps/TB        %0.2f max=%d\n",
                 s->tb_count ? 
                 (double)s->temp_count / s->tb_count : 0,
@@ -493,6 +493,9 @@ struct TCGContext {
     int64_t temp_count;
     int temp_count_max;
     int64_t del_op_count;
+    int64_t opt_op_count; /* ops left after optimization */
+    int64_t env_ld_fwd_count;
+    int64_t env_st_del_count;
     int64_t code_in_len;
     int64_t code_out_len;
     int64_t interm_time;
@@ -508,6 +511,9 @@ struct TCGContext {
     int goto_tb_issue_mask;
 #endif
 
+    /* the ops being generated embed a host pointer (tcg_const_ptr) */
+    bool host_ptr_consts;
+
     uint16_t gen_opc_buf[OPC_BUF_SIZE];
     TCGArg gen_opparam_buf[OPPARAM_BUF_SIZE];
 
@@ -641,8 +647,17 @@ enum {
     /* Instruction is optional and not implemented by the host, or insn
        is generic and should not be implemened by the host.  */
     TCG_OPF_NOT_PRESENT  = 0x10,
+    /* Instruction operates on vectors in memory, at constant offsets
+       from its base register operand.  */
+    TCG_OPF_VECTOR       = 0x20,
 };
 
+/* The last constant argument of the vector ops: the lane size as a
+   TCGMemOp size, and whether the vector is 64 or 128 bits wide.  */
+#define TCG_VEC_DESC(vece, oprsz)  ((vece) | ((oprsz) == 16 ? 4 : 0))
+#define TCG_VEC_ECE(desc)          ((desc) & 3)
+#define TCG_VEC_OPRSZ(desc)        ((desc) & 4 ? 16 : 8)
+
 typedef struct TCGOpDef {
     const char *name;
     uint8_t nb_oargs, nb_iargs, nb_cargs, nb_args;
@@ -683,7 +698,9 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I32(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I32(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i32((intptr_t)(V)))
+#define tcg_const_ptr(V) \
+    (tcg_ctx.host_ptr_consts = true, \
+     TCGV_NAT_TO_PTR(tcg_const_i32((intptr_t)(V))))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i32((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
@@ -694,7 +711,9 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I64(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I64(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i64((intptr_t)(V)))
+#define tcg_const_ptr(V) \
+    (tcg_ctx.host_ptr_consts = true, \
+     TCGV_NAT_TO_PTR(tcg_const_i64((intptr_t)(V))))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i64((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
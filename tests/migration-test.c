@@ -0,0 +1,450 @@
+/*
+ * QTest testcase for migration
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+#include "libqtest.h"
+#include "qemu/osdep.h"
+
+static const char *tmpfs;
+
+/*
+ * A simple PC boot sector that modifies memory (1-100MB) quickly
+ * outputing a 'B' every so often if it's still running.
+ *
+ *   start:
+ *     cli
+ *     lgdt gdtdesc
+ *     mov $1, %eax
+ *     mov %eax, %cr0
+ *     ljmpl $8, $pm
+ *   .code32
+ *   pm:
+ *     mov $16, %eax          # data segments
+ *     mov %eax, %ds
+ *     mov %eax, %es
+ *     mov %eax, %ss
+ *     inb $0x92, %al         # A20 on
+ *     or $2, %al
+ *     outb %al, $0x92
+ *     mov $0x3f8, %dx
+ *     mov $'A', %al
+ *     outb %al, %dx
+ *     xor %bl, %bl
+ *   mainloop:
+ *     mov $(1024 * 1024), %eax
+ *   innerloop:
+ *     incb (%eax)
+ *     add $4096, %eax
+ *     cmp $(100 * 1024 * 1024), %eax
+ *     jl innerloop
+ *     inc %bl
+ *     jnz mainloop
+ *     mov $'B', %al
+ *     outb %al, %dx
+ *     jmp mainloop
+ *
+ *   gdt: a null descriptor, then flat 4GB code and data segments
+ */
+static unsigned char bootsect[512] = {
+    0xfa, 0x0f, 0x01, 0x16, 0x68, 0x7c, 0x66, 0xb8,
+    0x01, 0x00, 0x00, 0x00, 0x0f, 0x22, 0xc0, 0x66,
+    0xea, 0x17, 0x7c, 0x00, 0x00, 0x08, 0x00, 0xb8,
+    0x10, 0x00, 0x00, 0x00, 0x8e, 0xd8, 0x8e, 0xc0,
+    0x8e, 0xd0, 0xe4, 0x92, 0x0c, 0x02, 0xe6, 0x92,
+    0x66, 0xba, 0xf8, 0x03, 0xb0, 0x41, 0xee, 0x30,
+    0xdb, 0xb8, 0x00, 0x00, 0x10, 0x00, 0xfe, 0x00,
+    0x05, 0x00, 0x10, 0x00, 0x00, 0x3d, 0x00, 0x00,
+    0x40, 0x06, 0x7c, 0xf2, 0xfe, 0xc3, 0x75, 0xe9,
+    0xb0, 0x42, 0xee, 0xeb, 0xe4, 0x8d, 0x76, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xff, 0xff, 0x00, 0x00, 0x00, 0x9a, 0xcf, 0x00,
+    0xff, 0xff, 0x00, 0x00, 0x00, 0x92, 0xcf, 0x00,
+    0x17, 0x00, 0x50, 0x7c, 0x00, 0x00, 0x00, 0x00,
+    [510] = 0x55, [511] = 0xaa,
+};
+
+static void init_bootfile(const char *bootpath)
+{
+    FILE *bootfile = fopen(bootpath, "wb");
+
+    g_assert(bootfile);
+    g_assert_cmpint(fwrite(bootsect, sizeof(bootsect), 1, bootfile), ==, 1);
+    fclose(bootfile);
+}
+
+static bool ufd_version_check(void)
+{
+#ifdef __NR_userfaultfd
+    int ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+
+    if (ufd == -1) {
+        g_test_message("Skipping test: userfaultfd not available");
+        return false;
+    }
+    close(ufd);
+    return true;
+#else
+    g_test_message("Skipping test: userfaultfd syscall not known");
+    return false;
+#endif
+}
+
+/*
+ * Wait for some output in the serial output file,
+ * we get an 'A' followed by an endless string of 'B's
+ * but on the destination we won't have the A.
+ */
+static void wait_for_serial(const char *side)
+{
+    char *serialpath = g_strdup_printf("%s/%s", tmpfs, side);
+    FILE *serialfile = fopen(serialpath, "r");
+
+    do {
+        int readvalue = fgetc(serialfile);
+
+        switch (readvalue) {
+        case 'A':
+            /* Fine */
+            break;
+
+        case 'B':
+            /* It's alive! */
+            fclose(serialfile);
+            g_free(serialpath);
+            return;
+
+        case EOF:
+            fseek(serialfile, 0, SEEK_SET);
+            g_usleep(1000);
+            break;
+
+        default:
+            fprintf(stderr, "Unexpected %d on %s serial\n", readvalue, side);
+            g_assert_not_reached();
+        }
+    } while (true);
+}
+
+/*
+ * Events can get in the way of responses we are actually waiting for.
+ */
+static QDict *wait_command(QTestState *who, const char *command, ...)
+{
+    va_list ap;
+    QDict *response;
+
+    va_start(ap, command);
+    response = qtest_qmpv(who, command, ap);
+    va_end(ap);
+
+    while (qdict_haskey(response, "event")) {
+        QDECREF(response);
+        response = qtest_qmp_receive(who);
+    }
+    g_assert(!qdict_haskey(response, "error"));
+    g_assert(qdict_haskey(response, "return"));
+    return response;
+}
+
+/*
+ * Return the "status" of query-migrate, freed by the caller.
+ */
+static char *migrate_query_status(QTestState *who)
+{
+    QDict *rsp, *rsp_return;
+    char *status;
+
+    rsp = wait_command(who, "{ 'execute': 'query-migrate' }");
+    rsp_return = qdict_get_qdict(rsp, "return");
+    status = g_strdup(qdict_get_try_str(rsp_return, "status"));
+    QDECREF(rsp);
+    return status;
+}
+
+static void wait_for_migration_status(QTestState *who, const char *goal)
+{
+    while (true) {
+        char *status = migrate_query_status(who);
+        bool done = !strcmp(status, goal);
+
+        g_assert(strcmp(status, "failed"));
+        g_free(status);
+        if (done) {
+            return;
+        }
+        g_usleep(1000);
+    }
+}
+
+static void migrate_set_capability(QTestState *who, const char *capability,
+                                   bool value)
+{
+    QDict *rsp;
+
+    rsp = qtest_qmp(who, "{ 'execute': 'migrate-set-capabilities',"
+                         "  'arguments': { 'capabilities': ["
+                         "    { 'capability': %s, 'state': %i } ] } }",
+                    capability, value);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+}
+
+/*
+ * The guest keeps bumping one byte in every page from the bottom up, so
+ * on a consistent copy all the bytes are equal except for a single step
+ * down by one where the loop had got to.
+ */
+static void check_guests_ram(QTestState *who)
+{
+    unsigned address;
+    uint8_t first_byte;
+    uint8_t last_byte;
+    bool hit_edge = false;
+
+    first_byte = qtest_readb(who, 1024 * 1024);
+    last_byte = first_byte;
+
+    for (address = 1024 * 1024 + 4096; address < 100 * 1024 * 1024;
+         address += 4096) {
+        uint8_t b = qtest_readb(who, address);
+
+        if (b != last_byte) {
+            if (((b + 1) % 256) == last_byte && !hit_edge) {
+                hit_edge = true;
+            } else {
+                fprintf(stderr, "Memory content inconsistency at %x"
+                                " first_byte = %x last_byte = %x current = %x"
+                                " hit_edge = %x\n",
+                                address, first_byte, last_byte, b, hit_edge);
+                g_assert_not_reached();
+            }
+        }
+        last_byte = b;
+    }
+}
+
+static void cleanup(const char *filename)
+{
+    char *path = g_strdup_printf("%s/%s", tmpfs, filename);
+
+    unlink(path);
+    g_free(path);
+}
+
+/*
+ * Return the "dirty-sync-count" of query-migrate, or 0 while there are no
+ * RAM statistics yet.
+ */
+static int64_t migrate_query_dirty_sync_count(QTestState *who)
+{
+    QDict *rsp, *rsp_return, *rsp_ram;
+    int64_t count = 0;
+
+    rsp = wait_command(who, "{ 'execute': 'query-migrate' }");
+    rsp_return = qdict_get_qdict(rsp, "return");
+    if (qdict_haskey(rsp_return, "ram")) {
+        rsp_ram = qdict_get_qdict(rsp_return, "ram");
+        count = qdict_get_try_int(rsp_ram, "dirty-sync-count", 0);
+    }
+    QDECREF(rsp);
+    return count;
+}
+
+static void test_migrate_start(QTestState **from, QTestState **to,
+                               const char *uri)
+{
+    char *bootpath = g_strdup_printf("%s/bootsect", tmpfs);
+    char *cmd;
+
+    init_bootfile(bootpath);
+
+    cmd = g_strdup_printf("-machine accel=tcg -m 150M"
+                          " -serial file:%s/src_serial"
+                          " -drive file=%s,format=raw",
+                          tmpfs, bootpath);
+    *from = qtest_init(cmd);
+    g_free(cmd);
+
+    cmd = g_strdup_printf("-machine accel=tcg -m 150M"
+                          " -serial file:%s/dest_serial"
+                          " -drive file=%s,format=raw"
+                          " -incoming %s",
+                          tmpfs, bootpath, uri);
+    *to = qtest_init(cmd);
+    g_free(cmd);
+    g_free(bootpath);
+}
+
+static void test_migrate_end(QTestState *from, QTestState *to)
+{
+    qtest_quit(from);
+    qtest_quit(to);
+
+    cleanup("bootsect");
+    cleanup("migsocket");
+    cleanup("src_serial");
+    cleanup("dest_serial");
+}
+
+static void test_postcopy(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *from, *to;
+    QDict *rsp;
+
+    test_migrate_start(&from, &to, uri);
+
+    migrate_set_capability(from, "postcopy-ram", true);
+    migrate_set_capability(to, "postcopy-ram", true);
+
+    /*
+     * We want to pick a speed slow enough that the test completes
+     * quickly, but that it doesn't complete precopy even on a slow
+     * machine, so also set the downtime.
+     */
+    rsp = wait_command(from, "{ 'execute': 'migrate_set_speed',"
+                             "'arguments': { 'value': 100000000 } }");
+    QDECREF(rsp);
+
+    rsp = wait_command(from, "{ 'execute': 'migrate_set_downtime',"
+                             "'arguments': { 'value': 0.001 } }");
+    QDECREF(rsp);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    rsp = wait_command(from, "{ 'execute': 'migrate',"
+                             "'arguments': { 'uri': %s } }", uri);
+    QDECREF(rsp);
+
+    wait_for_migration_status(from, "active");
+
+    rsp = wait_command(from, "{ 'execute': 'migrate-start-postcopy' }");
+    QDECREF(rsp);
+
+    wait_for_migration_status(from, "completed");
+
+    /* The guest only carries on running on the destination */
+    wait_for_serial("dest_serial");
+
+    rsp = wait_command(to, "{ 'execute': 'stop' }");
+    QDECREF(rsp);
+
+    check_guests_ram(to);
+
+    test_migrate_end(from, to);
+    g_free(uri);
+}
+
+/*
+ * Precopy with XBZRLE and compression together.  The guest dirties its
+ * pages all the time, so after the bulk stage some pages are sent XBZRLE
+ * encoded against the copy cached when they were last sent, and others
+ * that miss the cache go through the compression threads.  Any mismatch
+ * between what was sent and what was cached shows up as corrupted RAM.
+ */
+static void test_xbzrle_compress(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *from, *to;
+    QDict *rsp;
+
+    test_migrate_start(&from, &to, uri);
+
+    migrate_set_capability(from, "xbzrle", true);
+    migrate_set_capability(to, "xbzrle", true);
+    migrate_set_capability(from, "compress", true);
+    migrate_set_capability(to, "compress", true);
+
+    rsp = wait_command(from, "{ 'execute': 'migrate-set-parameters',"
+                             "'arguments': { 'compress-threads': 4 } }");
+    QDECREF(rsp);
+    rsp = wait_command(from, "{ 'execute': 'migrate-set-cache-size',"
+                             "'arguments': { 'value': 33554432 } }");
+    QDECREF(rsp);
+
+    /* Slow enough for several passes over RAM */
+    rsp = wait_command(from, "{ 'execute': 'migrate_set_speed',"
+                             "'arguments': { 'value': 100000000 } }");
+    QDECREF(rsp);
+    rsp = wait_command(from, "{ 'execute': 'migrate_set_downtime',"
+                             "'arguments': { 'value': 0.001 } }");
+    QDECREF(rsp);
+
+    wait_for_serial("src_serial");
+
+    rsp = wait_command(from, "{ 'execute': 'migrate',"
+                             "'arguments': { 'uri': %s } }", uri);
+    QDECREF(rsp);
+
+    wait_for_migration_status(from, "active");
+    while (migrate_query_dirty_sync_count(from) < 4) {
+        g_usleep(1000);
+    }
+
+    /* Let it converge */
+    rsp = wait_command(from, "{ 'execute': 'migrate_set_downtime',"
+                             "'arguments': { 'value': 60 } }");
+    QDECREF(rsp);
+    rsp = wait_command(from, "{ 'execute': 'migrate_set_speed',"
+                             "'arguments': { 'value': 10000000000 } }");
+    QDECREF(rsp);
+
+    wait_for_migration_status(from, "completed");
+    wait_for_serial("dest_serial");
+
+    rsp = wait_command(to, "{ 'execute': 'stop' }");
+    QDECREF(rsp);
+
+    check_guests_ram(to);
+
+    test_migrate_end(from, to);
+    g_free(uri);
+}
+
+int main(int argc, char **argv)
+{
+    char template[] = "/tmp/migration-test-XXXXXX";
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    tmpfs = mkdtemp(template);
+    if (!tmpfs) {
+        g_test_message("mkdtemp on path (%s): %s\n", template,
+                       strerror(errno));
+    }
+    g_assert(tmpfs);
+
+    if (ufd_version_check()) {
+        qtest_add_func("/migration/postcopy", test_postcopy);
+    }
+    qtest_add_func("/migration/xbzrle-compress", test_xbzrle_compress);
+
+    ret = g_test_run();
+
+    g_assert_cmpint(ret, ==, 0);
+
+    ret = rmdir(tmpfs);
+    if (ret != 0) {
+        g_test_message("unable to rmdir: path (%s): %s\n",
+                       tmpfs, strerror(errno));
+    }
+
+    return ret;
+}
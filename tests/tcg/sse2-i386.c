@@ -0,0 +1,62 @@
+/*
+ *  x86 SSE2 integer speed test - runs loops of the packed integer
+ *  instructions that TCG lowers to vector ops (padd, psub, pcmpeq, the
+ *  bitwise ops and shifts by immediate) and prints a checksum.
+ *
+ *  Run this on real hardware, then under QEMU, and diff the outputs; the
+ *  'run-sse2-i386' make target does this, and 'speed-sse2' times it.
+ *
+ *  Copyright (c) 2015 QEMU contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <emmintrin.h>
+
+#define NB_VECS     256
+#define NB_ROUNDS   20000
+
+static __m128i buf[NB_VECS];
+
+int main(int argc, char **argv)
+{
+    __m128i acc = _mm_setzero_si128();
+    __m128i k = _mm_set1_epi32(0x9e3779b9);
+    uint32_t sum[4];
+    int i, r;
+
+    for (i = 0; i < NB_VECS; i++) {
+        buf[i] = _mm_set_epi32(i * 4 + 3, i * 4 + 2, i * 4 + 1, i * 4);
+    }
+
+    for (r = 0; r < NB_ROUNDS; r++) {
+        for (i = 0; i < NB_VECS; i++) {
+            __m128i v = buf[i];
+
+            v = _mm_add_epi32(v, k);
+            v = _mm_xor_si128(v, _mm_slli_epi32(v, 7));
+            v = _mm_sub_epi16(v, _mm_srli_epi16(v, 3));
+            v = _mm_add_epi8(v, _mm_srai_epi16(acc, 2));
+            v = _mm_or_si128(_mm_and_si128(v, k), _mm_andnot_si128(k, acc));
+            acc = _mm_add_epi64(acc, _mm_cmpeq_epi8(v, acc));
+            acc = _mm_xor_si128(acc, v);
+            buf[i] = v;
+        }
+    }
+
+    _mm_storeu_si128((__m128i *)sum, acc);
+    printf("SSE2=%08x%08x%08x%08x\n", sum[3], sum[2], sum[1], sum[0]);
+    return 0;
+}
@@ -15,6 +15,9 @@
 #include "qemu/timer.h"
 #include "qemu/sockets.h"
 #include "qemu/error-report.h"
+#ifdef CONFIG_POSIX
+#include <sys/resource.h>
+#endif
 
 static AioContext *ctx;
 
@@ -376,6 +379,156 @@ static void test_flush_event_notifier(void)
     event_notifier_cleanup(&data.e);
 }
 
+#ifdef CONFIG_POSIX
+static bool poll_ready_cb(void *opaque)
+{
+    EventNotifierTestData *data = container_of(opaque, EventNotifierTestData,
+                                               e);
+    if (data->active == 0) {
+        return false;
+    }
+    data->active--;
+    data->n++;
+    return true;
+}
+
+static void test_poll_event_notifier(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 0 };
+    event_notifier_init(&data.e, false);
+    aio_context_set_poll_params(ctx, SCALE_MS * 1000LL, 0, 0, NULL);
+    aio_set_event_notifier_poll(ctx, &data.e, event_ready_cb, poll_ready_cb);
+    g_assert(!aio_poll(ctx, false));
+
+    /* A quick wakeup starts polling for the next aio_poll() */
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(ctx->poll_ns, >, 0);
+
+    /* Work found by io_poll is handled without the file descriptor */
+    data.active = 1;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 2);
+    g_assert_cmpint(data.active, ==, 0);
+    g_assert_cmpint(ctx->poll_hits, ==, 1);
+
+    aio_set_event_notifier(ctx, &data.e, NULL);
+    aio_context_set_poll_params(ctx, 0, 0, 0, NULL);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&data.e);
+}
+
+/* Enough handlers for aio_poll() to switch to epoll where available */
+#define MANY_NOTIFIERS 100
+
+static void test_many_event_notifiers(void)
+{
+    EventNotifierTestData *data = g_new0(EventNotifierTestData,
+                                         MANY_NOTIFIERS);
+    int i;
+
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_cb);
+    }
+    g_assert(!aio_poll(ctx, false));
+
+    /* Only the notifiers that were set are dispatched */
+    for (i = 0; i < MANY_NOTIFIERS; i += 7) {
+        data[i].active = 1;
+        event_notifier_set(&data[i].e);
+    }
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        wait_until_inactive(&data[i]);
+    }
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        g_assert_cmpint(data[i].n, ==, i % 7 == 0);
+    }
+    g_assert(!aio_poll(ctx, false));
+
+    /* Removed notifiers are not dispatched anymore */
+    for (i = 1; i < MANY_NOTIFIERS; i += 2) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+        event_notifier_set(&data[i].e);
+    }
+    g_assert(!aio_poll(ctx, false));
+
+    data[0].active = 1;
+    event_notifier_set(&data[0].e);
+    wait_until_inactive(&data[0]);
+    g_assert_cmpint(data[0].n, ==, 2);
+    g_assert_cmpint(data[1].n, ==, 0);
+
+    for (i = 0; i < MANY_NOTIFIERS; i += 2) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+    }
+    g_assert(!aio_poll(ctx, false));
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        event_notifier_cleanup(&data[i].e);
+    }
+    g_free(data);
+}
+
+/*
+ * Dispatch benchmark: cost of an aio_poll() that finds one ready event
+ * notifier among @opaque registered handlers.
+ */
+static void perf_dispatch(gconstpointer opaque)
+{
+    int handlers = GPOINTER_TO_INT(opaque);
+    AioContext *perf_ctx;
+    EventNotifierTestData *data;
+    unsigned int i, max;
+    struct rlimit rlim;
+    double duration;
+
+    /* Each notifier takes up to two file descriptors */
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 &&
+        rlim.rlim_cur < 2 * handlers + 64) {
+        rlim.rlim_cur = MIN(rlim.rlim_max, 2 * handlers + 64);
+        setrlimit(RLIMIT_NOFILE, &rlim);
+        if (rlim.rlim_cur < 2 * handlers + 64) {
+            g_test_message("Skipping %d handlers: file descriptor limit",
+                           handlers);
+            return;
+        }
+    }
+
+    /* A context of its own, so that epoll use by earlier tests or runs
+     * with more handlers does not carry over.
+     */
+    perf_ctx = aio_context_new(&error_abort);
+    data = g_new0(EventNotifierTestData, handlers);
+    for (i = 0; i < handlers; i++) {
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(perf_ctx, &data[i].e, event_ready_cb);
+    }
+    while (aio_poll(perf_ctx, false));
+
+    max = 100000;
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        event_notifier_set(&data[i % handlers].e);
+        aio_poll(perf_ctx, true);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Dispatch with %d handlers (%s): %u iterations %f s, "
+                   "%.0f ns per aio_poll()",
+                   handlers, perf_ctx->epoll_enabled ? "epoll" : "ppoll",
+                   max, duration, duration * 1e9 / max);
+
+    for (i = 0; i < handlers; i++) {
+        aio_set_event_notifier(perf_ctx, &data[i].e, NULL);
+        event_notifier_cleanup(&data[i].e);
+    }
+    g_free(data);
+    aio_context_unref(perf_ctx);
+}
+#endif
+
 static void test_wait_event_notifier_noflush(void)
 {
     EventNotifierTestData data = { .n = 0 };
@@ -843,6 +996,10 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+#ifdef CONFIG_POSIX
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
+    g_test_add_func("/aio/event/many",              test_many_event_notifiers);
+#endif
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio-gsource/notify",                  test_source_notify);
@@ -859,5 +1016,15 @@ int main(int argc, char **argv)
     g_test_add_func("/aio-gsource/event/wait/no-flush-cb",  test_source_wait_event_notifier_noflush);
     g_test_add_func("/aio-gsource/event/flush",             test_source_flush_event_notifier);
     g_test_add_func("/aio-gsource/timer/schedule",          test_source_timer_schedule);
+#ifdef CONFIG_POSIX
+    if (g_test_perf()) {
+        g_test_add_data_func("/aio/perf/dispatch/1", GINT_TO_POINTER(1),
+                             perf_dispatch);
+        g_test_add_data_func("/aio/perf/dispatch/64", GINT_TO_POINTER(64),
+                             perf_dispatch);
+        g_test_add_data_func("/aio/perf/dispatch/1024", GINT_TO_POINTER(1024),
+                             perf_dispatch);
+    }
+#endif
     return g_test_run();
 }
@@ -369,6 +369,27 @@ static void test_hbitmap_iter_granularity(TestHBitmapData *data,
     g_assert_cmpint(hbitmap_iter_next(&hbi), <, 0);
 }
 
+static void test_hbitmap_set_word(TestHBitmapData *data,
+                                  const void *unused)
+{
+    uint64_t pos = L2 / BITS_PER_LONG;
+
+    hbitmap_test_init(data, 2 * L2, 0);
+    hbitmap_test_set(data, L2 + 3, 1);
+
+    g_assert_cmpint(hbitmap_set_word(data->hb, 1, 0x81), ==, 2);
+    data->bits[1] |= 0x81;
+    hbitmap_test_check(data, 0);
+
+    g_assert_cmpint(hbitmap_set_word(data->hb, pos, 0xc), ==, 1);
+    data->bits[pos] |= 0xc;
+    hbitmap_test_check(data, 0);
+
+    g_assert_cmpint(hbitmap_set_word(data->hb, pos, 0x8), ==, 0);
+    g_assert_cmpint(hbitmap_set_word(data->hb, pos + 1, 0), ==, 0);
+    hbitmap_test_check(data, 0);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -392,6 +413,7 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/set/general", test_hbitmap_set);
     hbitmap_test_add("/hbitmap/set/twice", test_hbitmap_set_twice);
     hbitmap_test_add("/hbitmap/set/overlap", test_hbitmap_set_overlap);
+    hbitmap_test_add("/hbitmap/set/word", test_hbitmap_set_word);
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
@@ -0,0 +1,146 @@
+/*
+ * qcow2 allocating write + flush tests
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <unistd.h>
+#include "qemu-common.h"
+#include "block/block.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+#include "qemu/main-loop.h"
+
+#define CLUSTER_SIZE    65536
+#define NB_CLUSTERS     1024
+#define IMG_SIZE        ((int64_t)NB_CLUSTERS * CLUSTER_SIZE)
+#define WRITE_SIZE      4096
+
+static char img_file[] = "/tmp/qcow2-flush.XXXXXX";
+
+static void create_img(void)
+{
+    Error *local_err = NULL;
+    char opts[] = "compat=1.1,cluster_size=65536";
+
+    bdrv_img_create(img_file, "qcow2", NULL, NULL, opts, IMG_SIZE, 0,
+                    &local_err, true);
+    g_assert(!local_err);
+}
+
+/* @refcounts is the qcow2 option to turn on, or NULL for the defaults */
+static BlockDriverState *open_img(const char *refcounts)
+{
+    BlockDriverState *bs = NULL;
+    Error *local_err = NULL;
+    QDict *options = qdict_new();
+    int ret;
+
+    qdict_put(options, "driver", qstring_from_str("qcow2"));
+    if (refcounts) {
+        qdict_put(options, refcounts, qstring_from_str("on"));
+    }
+    ret = bdrv_open(&bs, img_file, NULL, options,
+                    BDRV_O_RDWR | BDRV_O_CACHE_WB, NULL, &local_err);
+    g_assert(!local_err);
+    g_assert_cmpint(ret, ==, 0);
+    return bs;
+}
+
+/* Write to the start of each of the first @n clusters and flush each time */
+static void write_and_flush(BlockDriverState *bs, int n, uint8_t *buf)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        memset(buf, i & 0xff, WRITE_SIZE);
+        g_assert_cmpint(bdrv_pwrite(bs, (int64_t)i * CLUSTER_SIZE, buf,
+                                    WRITE_SIZE), ==, WRITE_SIZE);
+        g_assert_cmpint(bdrv_flush(bs), ==, 0);
+    }
+}
+
+static void test_deferred_refcounts(void)
+{
+    BlockDriverState *bs;
+    BdrvCheckResult result = {};
+    uint8_t *buf = g_malloc(WRITE_SIZE);
+    int i, j;
+
+    create_img();
+    bs = open_img("deferred-refcounts");
+    write_and_flush(bs, 64, buf);
+    bdrv_unref(bs);
+
+    /* A clean close leaves consistent refcounts behind */
+    bs = open_img(NULL);
+    for (i = 0; i < 64; i++) {
+        g_assert_cmpint(bdrv_pread(bs, (int64_t)i * CLUSTER_SIZE, buf,
+                                   WRITE_SIZE), ==, WRITE_SIZE);
+        for (j = 0; j < WRITE_SIZE; j++) {
+            g_assert_cmpint(buf[j], ==, i & 0xff);
+        }
+    }
+    g_assert_cmpint(bdrv_check(bs, &result, 0), ==, 0);
+    g_assert_cmpint(result.corruptions, ==, 0);
+    g_assert_cmpint(result.leaks, ==, 0);
+    bdrv_unref(bs);
+
+    g_free(buf);
+}
+
+static void perf_write_flush(gconstpointer opaque)
+{
+    const char *refcounts = opaque;
+    BlockDriverState *bs;
+    uint8_t *buf = g_malloc(WRITE_SIZE);
+    double duration;
+
+    create_img();
+    bs = open_img(refcounts);
+
+    g_test_timer_start();
+    write_and_flush(bs, NB_CLUSTERS, buf);
+    duration = g_test_timer_elapsed();
+
+    bdrv_unref(bs);
+    g_free(buf);
+
+    g_test_message("%s: %d allocating writes, each followed by a flush: "
+                   "%f s, %f ms per write\n",
+                   refcounts ? refcounts : "default refcounts", NB_CLUSTERS,
+                   duration, duration * 1000 / NB_CLUSTERS);
+}
+
+int main(int argc, char **argv)
+{
+    int fd, ret;
+
+    g_test_init(&argc, &argv, NULL);
+    qemu_init_main_loop(&error_abort);
+    bdrv_init();
+
+    fd = mkstemp(img_file);
+    g_assert(fd >= 0);
+    close(fd);
+
+    g_test_add_func("/qcow2/flush/deferred-refcounts",
+                    test_deferred_refcounts);
+    if (g_test_perf()) {
+        g_test_add_data_func("/qcow2/perf/flush/default", NULL,
+                             perf_write_flush);
+        g_test_add_data_func("/qcow2/perf/flush/lazy", "lazy-refcounts",
+                             perf_write_flush);
+        g_test_add_data_func("/qcow2/perf/flush/deferred",
+                             "deferred-refcounts", perf_write_flush);
+    }
+    ret = g_test_run();
+
+    unlink(img_file);
+    return ret;
+}
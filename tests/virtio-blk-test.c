@@ -31,6 +31,7 @@
 #define QVIRTIO_BLK_F_WCE           0x00000200
 #define QVIRTIO_BLK_F_TOPOLOGY      0x00000400
 #define QVIRTIO_BLK_F_CONFIG_WCE    0x00000800
+#define QVIRTIO_BLK_F_MQ            0x00001000
 
 #define QVIRTIO_BLK_T_IN            0
 #define QVIRTIO_BLK_T_OUT           1
@@ -47,6 +48,9 @@
 
 #define PCI_SLOT_HP             0x06
 
+/* Offset of num_queues in struct virtio_blk_config */
+#define QVIRTIO_BLK_CONFIG_NUM_QUEUES   34
+
 typedef struct QVirtioBlkReq {
     uint32_t type;
     uint32_t ioprio;
@@ -55,9 +59,14 @@ typedef struct QVirtioBlkReq {
     uint8_t status;
 } QVirtioBlkReq;
 
-static QPCIBus *test_start(void)
+/*
+ * @debug_path is a blkdebug script to put under drive0, which then stops the
+ * VM on write errors; NULL for a plain image.
+ */
+static QPCIBus *test_start_with(const char *debug_path)
 {
     char *cmdline;
+    char *drive0;
     char tmp_path[] = "/tmp/qtest.XXXXXX";
     int fd, ret;
 
@@ -68,18 +77,31 @@ static QPCIBus *test_start(void)
     g_assert_cmpint(ret, ==, 0);
     close(fd);
 
+    if (debug_path) {
+        drive0 = g_strdup_printf("blkdebug:%s:%s,werror=stop",
+                                 debug_path, tmp_path);
+    } else {
+        drive0 = g_strdup(tmp_path);
+    }
+
     cmdline = g_strdup_printf("-drive if=none,id=drive0,file=%s,format=raw "
-                              "-drive if=none,id=drive1,file=/dev/null,format=raw "
+                              "-drive if=none,id=drive1,file=%s,format=raw "
                               "-device virtio-blk-pci,id=drv0,drive=drive0,"
                               "addr=%x.%x",
-                              tmp_path, PCI_SLOT, PCI_FN);
+                              drive0, tmp_path, PCI_SLOT, PCI_FN);
     qtest_start(cmdline);
     unlink(tmp_path);
     g_free(cmdline);
+    g_free(drive0);
 
     return qpci_init_pc();
 }
 
+static QPCIBus *test_start(void)
+{
+    return test_start_with(NULL);
+}
+
 static void test_end(void)
 {
     qtest_end();
@@ -663,6 +685,348 @@ static void hotplug(void)
     test_end();
 }
 
+static void pci_mq(void)
+{
+    QPCIBus *bus;
+    QVirtioPCIDevice *dev;
+    QVirtQueuePCI *vqpci[4];
+    QGuestAllocator *alloc;
+    QVirtioBlkReq req;
+    QVirtQueue *vq;
+    uint64_t req_addr;
+    uint32_t features;
+    uint32_t free_head;
+    uint8_t status;
+    char *data;
+    void *addr;
+    int i;
+
+    bus = test_start();
+
+    qpci_plug_device_test("virtio-blk-pci", "drv1", PCI_SLOT_HP,
+                          "'drive': 'drive1', 'num-queues': 4");
+
+    dev = virtio_blk_init(bus, PCI_SLOT_HP);
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    g_assert_cmphex(features & QVIRTIO_BLK_F_MQ, !=, 0);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    QVIRTIO_F_RING_INDIRECT_DESC | QVIRTIO_F_RING_EVENT_IDX |
+                            QVIRTIO_BLK_F_SCSI);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+
+    /* MSI-X is not enabled */
+    addr = dev->addr + QVIRTIO_DEVICE_SPECIFIC_NO_MSIX;
+    g_assert_cmpint(qvirtio_config_readw(&qvirtio_pci, &dev->vdev,
+                                         addr + QVIRTIO_BLK_CONFIG_NUM_QUEUES),
+                    ==, 4);
+
+    alloc = pc_alloc_init();
+    for (i = 0; i < 4; i++) {
+        vqpci[i] = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                                     alloc, i);
+    }
+
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* Requests on a queue other than the first one must complete as well */
+    vq = &vqpci[2]->vq;
+
+    /* Write request */
+    req.type = QVIRTIO_BLK_T_OUT;
+    req.ioprio = 1;
+    req.sector = 0;
+    req.data = g_malloc0(512);
+    strcpy(req.data, "TEST");
+
+    req_addr = virtio_blk_request(alloc, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(vq, req_addr, 528, false, true);
+    qvirtqueue_add(vq, req_addr + 528, 1, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, vq, free_head);
+
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, vq,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+
+    guest_free(alloc, req_addr);
+
+    /* Read request, on yet another queue */
+    vq = &vqpci[3]->vq;
+
+    req.type = QVIRTIO_BLK_T_IN;
+    req.ioprio = 1;
+    req.sector = 0;
+    req.data = g_malloc0(512);
+
+    req_addr = virtio_blk_request(alloc, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(vq, req_addr, 16, false, true);
+    qvirtqueue_add(vq, req_addr + 16, 513, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, vq, free_head);
+
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, vq,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+
+    data = g_malloc0(512);
+    memread(req_addr + 16, data, 512);
+    g_assert_cmpstr(data, ==, "TEST");
+    g_free(data);
+
+    guest_free(alloc, req_addr);
+
+    /* End test */
+    for (i = 0; i < 4; i++) {
+        guest_free(alloc, vqpci[i]->vq.desc);
+    }
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+
+    qpci_unplug_acpi_device_test("drv1", PCI_SLOT_HP);
+    test_end();
+}
+
+/* Make a descriptor chain available to the device without notifying it */
+static void virtqueue_add_avail(QVirtQueue *vq, uint32_t free_head)
+{
+    /* vq->avail->idx */
+    uint16_t idx = readw(vq->avail + 2);
+
+    /* vq->avail->ring[idx % vq->size] */
+    writew(vq->avail + 4 + (2 * (idx % vq->size)), free_head);
+    /* vq->avail->idx */
+    writew(vq->avail + 2, idx + 1);
+}
+
+/* Length reported in the used ring for descriptor chain @head */
+static uint32_t virtqueue_used_len(QVirtQueue *vq, uint32_t head)
+{
+    /* vq->used->idx */
+    uint16_t idx = readw(vq->used + 2);
+    uint16_t i;
+
+    for (i = 0; i < idx; i++) {
+        /* vq->used->ring[i % vq->size] */
+        uint64_t elem = vq->used + 4 + 8 * (i % vq->size);
+
+        if (readl(elem) == head) {
+            return readl(elem + 4);
+        }
+    }
+    g_assert_not_reached();
+}
+
+static void prepare_blkdebug_script(const char *debug_fn, const char *event)
+{
+    FILE *debug_file = fopen(debug_fn, "w");
+    int ret;
+
+    fprintf(debug_file, "[inject-error]\n");
+    fprintf(debug_file, "event = \"%s\"\n", event);
+    fprintf(debug_file, "errno = \"5\"\n");
+    fprintf(debug_file, "state = \"1\"\n");
+    fprintf(debug_file, "immediately = \"off\"\n");
+    fprintf(debug_file, "once = \"on\"\n");
+
+    fprintf(debug_file, "[set-state]\n");
+    fprintf(debug_file, "event = \"%s\"\n", event);
+    fprintf(debug_file, "new_state = \"2\"\n");
+    fflush(debug_file);
+    g_assert(!ferror(debug_file));
+
+    ret = fclose(debug_file);
+    g_assert(ret == 0);
+}
+
+static void check_merged_stats(const char *device, int64_t rd_merged,
+                               int64_t wr_merged)
+{
+    QDict *response;
+    const QListEntry *entry;
+    bool found = false;
+
+    response = qmp("{ 'execute': 'query-blockstats' }");
+    g_assert(qdict_haskey(response, "return"));
+
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(response, "return"), entry) {
+        QDict *dev = qobject_to_qdict(qlist_entry_obj(entry));
+        QDict *stats;
+
+        if (!qdict_haskey(dev, "device") ||
+            strcmp(qdict_get_str(dev, "device"), device)) {
+            continue;
+        }
+        stats = qdict_get_qdict(dev, "stats");
+        g_assert_cmpint(qdict_get_int(stats, "rd_merged"), ==, rd_merged);
+        g_assert_cmpint(qdict_get_int(stats, "wr_merged"), ==, wr_merged);
+        found = true;
+    }
+    g_assert(found);
+
+    QDECREF(response);
+}
+
+/*
+ * Write two adjacent sectors and read them back, each pair made available
+ * with a single notification so that the device merges it into one request.
+ * With @werror_stop the merged write fails once and stops the VM; after
+ * 'cont' every request must still complete exactly once.
+ */
+static void test_merge(bool werror_stop)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci;
+    QGuestAllocator *alloc;
+    QVirtioBlkReq req;
+    QDict *response;
+    uint64_t req_addr[2];
+    uint32_t features;
+    uint32_t free_head[2];
+    uint8_t status;
+    char debug_path[] = "/tmp/qtest-blkdebug.XXXXXX";
+    char expected[16];
+    char *data;
+    int fd, i;
+
+    if (werror_stop) {
+        fd = mkstemp(debug_path);
+        g_assert(fd >= 0);
+        close(fd);
+        prepare_blkdebug_script(debug_path, "write_aio");
+        bus = test_start_with(debug_path);
+    } else {
+        bus = test_start();
+    }
+
+    dev = virtio_blk_init(bus, PCI_SLOT);
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    QVIRTIO_F_RING_INDIRECT_DESC | QVIRTIO_F_RING_EVENT_IDX |
+                            QVIRTIO_BLK_F_SCSI);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+
+    alloc = pc_alloc_init();
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                                                    alloc, 0);
+
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* Write requests */
+    for (i = 0; i < 2; i++) {
+        req.type = QVIRTIO_BLK_T_OUT;
+        req.ioprio = 1;
+        req.sector = i;
+        req.data = g_malloc0(512);
+        snprintf(req.data, 512, "TEST%d", i);
+
+        req_addr[i] = virtio_blk_request(alloc, &req, 512);
+
+        g_free(req.data);
+
+        free_head[i] = qvirtqueue_add(&vqpci->vq, req_addr[i], 528, false,
+                                      true);
+        qvirtqueue_add(&vqpci->vq, req_addr[i] + 528, 1, true, false);
+    }
+    virtqueue_add_avail(&vqpci->vq, free_head[0]);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci->vq, free_head[1]);
+
+    if (werror_stop) {
+        for (;; response = NULL) {
+            response = qmp_receive();
+            if ((qdict_haskey(response, "event")) &&
+                (strcmp(qdict_get_str(response, "event"), "STOP") == 0)) {
+                QDECREF(response);
+                break;
+            }
+            QDECREF(response);
+        }
+        qmp_discard_response("{'execute':'cont' }");
+    }
+
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, &vqpci->vq,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    /* vq->used->idx */
+    g_assert_cmpint(readw(vqpci->vq.used + 2), ==, 2);
+
+    for (i = 0; i < 2; i++) {
+        status = readb(req_addr[i] + 528);
+        g_assert_cmpint(status, ==, 0);
+        /* Only the status byte is written to the guest */
+        g_assert_cmpint(virtqueue_used_len(&vqpci->vq, free_head[i]), ==, 1);
+        guest_free(alloc, req_addr[i]);
+    }
+
+    /* Read requests */
+    for (i = 0; i < 2; i++) {
+        req.type = QVIRTIO_BLK_T_IN;
+        req.ioprio = 1;
+        req.sector = i;
+        req.data = g_malloc0(512);
+
+        req_addr[i] = virtio_blk_request(alloc, &req, 512);
+
+        g_free(req.data);
+
+        free_head[i] = qvirtqueue_add(&vqpci->vq, req_addr[i], 16, false,
+                                      true);
+        qvirtqueue_add(&vqpci->vq, req_addr[i] + 16, 513, true, false);
+    }
+    virtqueue_add_avail(&vqpci->vq, free_head[0]);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci->vq, free_head[1]);
+
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, &vqpci->vq,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    g_assert_cmpint(readw(vqpci->vq.used + 2), ==, 4);
+
+    data = g_malloc0(512);
+    for (i = 0; i < 2; i++) {
+        status = readb(req_addr[i] + 528);
+        g_assert_cmpint(status, ==, 0);
+        /* Each request reports its own data, not the merged length */
+        g_assert_cmpint(virtqueue_used_len(&vqpci->vq, free_head[i]), ==,
+                        513);
+
+        memread(req_addr[i] + 16, data, 512);
+        snprintf(expected, sizeof(expected), "TEST%d", i);
+        g_assert_cmpstr(data, ==, expected);
+
+        guest_free(alloc, req_addr[i]);
+    }
+    g_free(data);
+
+    /* The restarted write is merged and accounted for a second time */
+    check_merged_stats("drive0", 1, werror_stop ? 2 : 1);
+
+    /* End test */
+    guest_free(alloc, vqpci->vq.desc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    test_end();
+
+    if (werror_stop) {
+        unlink(debug_path);
+    }
+}
+
+static void pci_merge(void)
+{
+    test_merge(false);
+}
+
+static void pci_merge_werror_stop(void)
+{
+    test_merge(true);
+}
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -675,6 +1039,10 @@ int main(int argc, char **argv)
     g_test_add_func("/virtio/blk/pci/msix", pci_msix);
     g_test_add_func("/virtio/blk/pci/idx", pci_idx);
     g_test_add_func("/virtio/blk/pci/hotplug", hotplug);
+    g_test_add_func("/virtio/blk/pci/mq", pci_mq);
+    g_test_add_func("/virtio/blk/pci/merge", pci_merge);
+    g_test_add_func("/virtio/blk/pci/merge-werror-stop",
+                    pci_merge_werror_stop);
 
     ret = g_test_run();
 
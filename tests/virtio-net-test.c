@@ -9,35 +9,905 @@
 
 #include <glib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include "libqtest.h"
 #include "qemu/osdep.h"
 #include "libqos/pci.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc.h"
+#include "libqos/malloc-pc.h"
+#include "hw/pci/pci_regs.h"
+
+#define PCI_SLOT                0x04
+#define PCI_FN                  0x00
 
 #define PCI_SLOT_HP             0x06
+#define PCI_SLOT_TESTDEV        0x05
+
+/* Frames that tap_send() reads before handing them to the NIC together */
+#define TAP_BATCH_SIZE          16
+
+/*
+ * pci-testdev counts the writes of a given byte to a register of its
+ * "no-eventfd" MMIO test, which is test 0.  Its header gives the offset of
+ * the register, the byte and the count.
+ */
+#define TESTDEV_OFFSET          4
+#define TESTDEV_DATA            8
+#define TESTDEV_COUNT           12
+
+#define QVIRTIO_NET_TIMEOUT_US  (30 * 1000 * 1000)
+
+#define QVIRTIO_NET_F_GUEST_CSUM 0x00000002
+#define QVIRTIO_NET_F_GUEST_TSO4 0x00000080
+#define QVIRTIO_NET_F_MRG_RXBUF 0x00008000
+
+#define VIRTIO_NET_OK           0
+
+#define VIRTIO_NET_CTRL_RX      0
+#define VIRTIO_NET_CTRL_RX_PROMISC 0
+#define VIRTIO_NET_CTRL_MAC     1
+#define VIRTIO_NET_CTRL_MAC_TABLE_SET 0
+#define VIRTIO_NET_CTRL_MQ      4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+
+#define RSS_QUEUES              2
+#define RSS_FLOWS               32
+#define MULTICAST_GROUPS        60
+
+#define GRO_SEGMENTS            8
+#define GRO_MSS                 1000
+#define GRO_TIMEOUT_NS          50000
+
+/* struct virtio_net_hdr, without mergeable receive buffers */
+#define VNET_HDR_SIZE           10
+
+#define RX_PACKET_SIZE          64
+#define RX_BUF_SIZE             (VNET_HDR_SIZE + 1514)
+#define TX_BUF_SIZE             (VNET_HDR_SIZE + RX_PACKET_SIZE)
+
+/* Ethernet, IPv4 and TCP headers, and room for a coalesced frame */
+#define TCP_HDRS_SIZE           (14 + 20 + 20)
+#define GRO_BUF_SIZE            (VNET_HDR_SIZE + 14 + 0xffff)
 
 /* Tests only initialization so far. TODO: Replace with functional tests */
 static void pci_nop(void)
 {
+    qtest_start("-device virtio-net-pci");
+    qtest_end();
 }
 
 static void hotplug(void)
 {
+    qtest_start("-device virtio-net-pci");
     qpci_plug_device_test("virtio-net-pci", "net1", PCI_SLOT_HP, NULL);
     qpci_unplug_acpi_device_test("net1", PCI_SLOT_HP);
+    qtest_end();
 }
 
-int main(int argc, char **argv)
+/*
+ * The tap backend reads one frame per read(), so the host side of a
+ * SOCK_SEQPACKET socket pair can stand in for a tap device and act as a
+ * packet generator.
+ */
+static QPCIBus *pci_test_start(int socket, const char *opts)
 {
-    int ret;
+    char *cmdline;
 
-    g_test_init(&argc, &argv, NULL);
-    qtest_add_func("/virtio/net/pci/nop", pci_nop);
-    qtest_add_func("/virtio/net/pci/hotplug", hotplug);
+    cmdline = g_strdup_printf("-netdev tap,id=hs0,fd=%d "
+                              "-device virtio-net-pci,netdev=hs0,addr=%x.%x%s",
+                              socket, PCI_SLOT, PCI_FN, opts);
+    qtest_start(cmdline);
+    g_free(cmdline);
 
-    qtest_start("-device virtio-net-pci");
-    ret = g_test_run();
+    return qpci_init_pc();
+}
+
+static QVirtioPCIDevice *virtio_net_pci_init(QPCIBus *bus, int slot)
+{
+    QVirtioPCIDevice *dev;
+
+    dev = qvirtio_pci_device_find(bus, QVIRTIO_NET_DEVICE_ID);
+    g_assert(dev != NULL);
+    g_assert_cmphex(dev->vdev.device_type, ==, QVIRTIO_NET_DEVICE_ID);
+    g_assert_cmphex(dev->pdev->devfn, ==, ((slot << 3) | PCI_FN));
+
+    qvirtio_pci_device_enable(dev);
+    qvirtio_reset(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_acknowledge(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_driver(&qvirtio_pci, &dev->vdev);
+
+    return dev;
+}
+
+static void fill_packet(uint8_t *pkt, int n)
+{
+    /* Broadcast, so that the receive filter always lets it through */
+    memset(pkt, 0xff, 6);
+    memset(pkt + 6, 0x52, 6);
+    pkt[12] = 0x08;
+    pkt[13] = 0x00;
+    memset(pkt + 14, n & 0xff, RX_PACKET_SIZE - 14);
+}
+
+static uint16_t used_idx(QVirtQueue *vq)
+{
+    /* vq->used->idx */
+    return readw(vq->used + 2);
+}
+
+static void wait_used_idx(QVirtQueue *vq, uint16_t idx)
+{
+    gint64 start_time = g_get_monotonic_time();
+
+    while (used_idx(vq) != idx) {
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+    }
+}
+
+/* Make all the buffers at @bufs available to the device, in order */
+static void rx_post_buffers(QVirtioPCIDevice *dev, QVirtQueue *vq,
+                            uint64_t bufs, int count)
+{
+    int i;
+
+    /* The descriptors of the previous round have all been used */
+    vq->free_head = 0;
+    vq->num_free = vq->size;
+
+    for (i = 0; i < count; i++) {
+        uint32_t head;
+
+        head = qvirtqueue_add(vq, bufs + i * RX_BUF_SIZE, RX_BUF_SIZE,
+                              true, false);
+        qvirtqueue_kick(&qvirtio_pci, &dev->vdev, vq, head);
+    }
+}
+
+/* UDP over IPv4, flow @n is told apart by its source port */
+static void fill_udp_packet(uint8_t *pkt, int n)
+{
+    static const uint8_t ip[] = {
+        0x45, 0x00, 0x00, RX_PACKET_SIZE - 14,  /* version, length */
+        0x00, 0x00, 0x00, 0x00,                 /* not fragmented */
+        0x40, 0x11, 0x00, 0x00,                 /* ttl, UDP */
+        0x0a, 0x00, 0x00, 0x01,                 /* 10.0.0.1 */
+        0x0a, 0x00, 0x00, 0x02,                 /* 10.0.0.2 */
+    };
+
+    fill_packet(pkt, n);
+    memcpy(pkt + 14, ip, sizeof(ip));
+    pkt[34] = (1024 + n) >> 8;
+    pkt[35] = (1024 + n) & 0xff;
+    pkt[36] = 0;
+    pkt[37] = 7;
+}
+
+/* Add @len bytes to an Internet checksum, as 16-bit big endian words */
+static uint32_t csum_add(uint32_t sum, const uint8_t *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        sum += (i & 1) ? buf[i] : buf[i] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_finish(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+/*
+ * A TCP segment over IPv4 from 10.0.0.1:1024 to 10.0.0.2:80 with @len bytes
+ * of payload starting at sequence number @seq.  The payload byte at sequence
+ * number n is n & 0xff.
+ */
+static size_t fill_tcp_packet(uint8_t *pkt, uint32_t seq, int len)
+{
+    static const uint8_t hdrs[] = {
+        0x45, 0x00, 0x00, 0x00,                 /* version, length */
+        0x00, 0x00, 0x40, 0x00,                 /* don't fragment */
+        0x40, 0x06, 0x00, 0x00,                 /* ttl, TCP */
+        0x0a, 0x00, 0x00, 0x01,                 /* 10.0.0.1 */
+        0x0a, 0x00, 0x00, 0x02,                 /* 10.0.0.2 */
+        0x04, 0x00, 0x00, 0x50,                 /* ports 1024, 80 */
+        0x00, 0x00, 0x00, 0x00,                 /* sequence number */
+        0x00, 0x00, 0x00, 0x01,                 /* acknowledgment number */
+        0x50, 0x10, 0xff, 0xff,                 /* ACK, window */
+        0x00, 0x00, 0x00, 0x00,                 /* checksum */
+    };
+    uint8_t *ip = pkt + 14;
+    uint8_t *tcp = ip + 20;
+    uint16_t csum;
+    int i;
+
+    fill_packet(pkt, 0);
+    memcpy(ip, hdrs, sizeof(hdrs));
+    ip[2] = (20 + 20 + len) >> 8;
+    ip[3] = (20 + 20 + len) & 0xff;
+    csum = csum_finish(csum_add(0, ip, 20));
+    ip[10] = csum >> 8;
+    ip[11] = csum & 0xff;
+
+    tcp[4] = seq >> 24;
+    tcp[5] = seq >> 16;
+    tcp[6] = seq >> 8;
+    tcp[7] = seq;
+    for (i = 0; i < len; i++) {
+        tcp[20 + i] = (seq + i) & 0xff;
+    }
+    /* The pseudo header has the addresses, the protocol and the length */
+    csum = csum_finish(csum_add(6 + 20 + len, ip + 12, 8) +
+                       csum_add(0, tcp, 20 + len));
+    tcp[16] = csum >> 8;
+    tcp[17] = csum & 0xff;
+
+    return TCP_HDRS_SIZE + len;
+}
+
+/* Send @count frames through the stand-in tap device */
+static void rx_send_packets(int socket, int count)
+{
+    uint8_t pkt[RX_PACKET_SIZE];
+    int i;
+
+    for (i = 0; i < count; i++) {
+        fill_packet(pkt, i);
+        g_assert_cmpint(send(socket, pkt, sizeof(pkt), 0), ==, sizeof(pkt));
+    }
+}
+
+/* Send one UDP frame of each of @flows flows, @count frames in total */
+static void rx_send_flows(int socket, int count, int flows)
+{
+    uint8_t pkt[RX_PACKET_SIZE];
+    int i;
+
+    for (i = 0; i < count; i++) {
+        fill_udp_packet(pkt, i % flows);
+        g_assert_cmpint(send(socket, pkt, sizeof(pkt), 0), ==, sizeof(pkt));
+    }
+}
+
+/* Send @count frames to the multicast address @mac */
+static void rx_send_multicast(int socket, int count, const uint8_t *mac)
+{
+    uint8_t pkt[RX_PACKET_SIZE];
+    int i;
+
+    for (i = 0; i < count; i++) {
+        fill_packet(pkt, i);
+        memcpy(pkt, mac, 6);
+        g_assert_cmpint(send(socket, pkt, sizeof(pkt), 0), ==, sizeof(pkt));
+    }
+}
+
+/* Run a command on the control virtqueue and return its ack */
+static uint8_t ctrl_cmd(QVirtioPCIDevice *dev, QGuestAllocator *alloc,
+                        QVirtQueue *vq, uint8_t class, uint8_t cmd,
+                        const void *data, size_t len)
+{
+    uint8_t hdr[2] = { class, cmd };
+    uint16_t idx = used_idx(vq) + 1;
+    uint64_t req;
+    uint32_t head;
+    uint8_t ack;
+
+    req = guest_alloc(alloc, sizeof(hdr) + len + 1);
+    memwrite(req, hdr, sizeof(hdr));
+    memwrite(req + sizeof(hdr), data, len);
+    writeb(req + sizeof(hdr) + len, 0xff);
+
+    head = qvirtqueue_add(vq, req, sizeof(hdr) + len, false, true);
+    qvirtqueue_add(vq, req + sizeof(hdr) + len, 1, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, vq, head);
+    wait_used_idx(vq, idx);
+
+    ack = readb(req + sizeof(hdr) + len);
+    guest_free(alloc, req);
+    return ack;
+}
+
+static QVirtQueue *rx_setup(QVirtioPCIDevice *dev, QGuestAllocator *alloc)
+{
+    QVirtQueue *vq;
+    uint32_t features;
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            QVIRTIO_F_RING_INDIRECT_DESC |
+                            QVIRTIO_F_RING_EVENT_IDX |
+                            QVIRTIO_NET_F_MRG_RXBUF);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+
+    vq = qvirtqueue_setup(&qvirtio_pci, &dev->vdev, alloc, 0);
+
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+    return vq;
+}
+
+static void rx_batch(void)
+{
+    QVirtioPCIDevice *dev;
+    QGuestAllocator *alloc;
+    QVirtQueue *vq;
+    QPCIBus *bus;
+    uint64_t bufs;
+    uint8_t expected[RX_PACKET_SIZE];
+    uint8_t data[RX_PACKET_SIZE];
+    int sv[2];
+    int count, i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), ==, 0);
+
+    bus = pci_test_start(sv[1], "");
+    dev = virtio_net_pci_init(bus, PCI_SLOT);
+    alloc = pc_alloc_init();
+    vq = rx_setup(dev, alloc);
+
+    /* More frames than a single tap_send() batch */
+    count = 64;
+    bufs = guest_alloc(alloc, count * RX_BUF_SIZE);
+    rx_post_buffers(dev, vq, bufs, count);
+
+    rx_send_packets(sv[0], count);
+    wait_used_idx(vq, count);
+
+    for (i = 0; i < count; i++) {
+        /* vq->used->ring[i] */
+        uint64_t elem = vq->used + 4 + i * sizeof(QVRingUsedElem);
+
+        g_assert_cmpint(readl(elem), ==, i);
+        g_assert_cmpint(readl(elem + 4), ==, VNET_HDR_SIZE + RX_PACKET_SIZE);
+
+        fill_packet(expected, i);
+        memread(bufs + i * RX_BUF_SIZE + VNET_HDR_SIZE, data, sizeof(data));
+        g_assert(memcmp(data, expected, sizeof(data)) == 0);
+    }
+
+    guest_free(alloc, bufs);
+    guest_free(alloc, vq->desc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qtest_end();
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * Point the MSI-X vector of the receive queue at a pci-testdev register,
+ * so that every interrupt is counted, and check that a batch of frames
+ * read in one go raises a single interrupt.
+ */
+static void rx_batch_irq(void)
+{
+    QVirtioPCIDevice *dev;
+    QVirtQueuePCI *vqpci;
+    QGuestAllocator *alloc;
+    QPCIDevice *testdev;
+    QPCIBus *bus;
+    uint64_t bufs;
+    uint64_t counter;
+    uint32_t features;
+    uint8_t data;
+    void *bar, *entry;
+    int sv[2];
+    char *opts;
 
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), ==, 0);
+
+    opts = g_strdup_printf(" -device pci-testdev,addr=%x.%x",
+                           PCI_SLOT_TESTDEV, PCI_FN);
+    bus = pci_test_start(sv[1], opts);
+    g_free(opts);
+
+    testdev = qpci_device_find(bus, QPCI_DEVFN(PCI_SLOT_TESTDEV, PCI_FN));
+    g_assert(testdev != NULL);
+    qpci_device_enable(testdev);
+    bar = qpci_iomap(testdev, 0, NULL);
+    qpci_io_writeb(testdev, bar, 0);
+    counter = (uintptr_t)bar + qpci_io_readl(testdev, bar + TESTDEV_OFFSET);
+    data = qpci_io_readb(testdev, bar + TESTDEV_DATA);
+
+    dev = virtio_net_pci_init(bus, PCI_SLOT);
+    alloc = pc_alloc_init();
+    qpci_msix_enable(dev->pdev);
+    qvirtio_pci_set_msix_configuration_vector(dev, alloc, 0);
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            QVIRTIO_F_RING_INDIRECT_DESC |
+                            QVIRTIO_F_RING_EVENT_IDX |
+                            QVIRTIO_NET_F_MRG_RXBUF);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                              alloc, 0);
+    qvirtqueue_pci_msix_setup(dev, vqpci, alloc, 1);
+    entry = dev->pdev->msix_table + 16;
+    qpci_io_writel(dev->pdev, entry + PCI_MSIX_ENTRY_LOWER_ADDR,
+                   counter & ~0U);
+    qpci_io_writel(dev->pdev, entry + PCI_MSIX_ENTRY_UPPER_ADDR,
+                   counter >> 32);
+    qpci_io_writel(dev->pdev, entry + PCI_MSIX_ENTRY_DATA, data);
+
+    bufs = guest_alloc(alloc, TAP_BATCH_SIZE * RX_BUF_SIZE);
+    rx_post_buffers(dev, &vqpci->vq, bufs, TAP_BATCH_SIZE);
+
+    /*
+     * The tap backend does not read while the driver is not ready, so all
+     * the frames are waiting for it when it starts.
+     */
+    rx_send_packets(sv[0], TAP_BATCH_SIZE);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+    wait_used_idx(&vqpci->vq, TAP_BATCH_SIZE);
+
+    g_assert_cmpint(qpci_io_readl(testdev, bar + TESTDEV_COUNT), ==, 1);
+
+    guest_free(alloc, bufs);
+    guest_free(alloc, vqpci->vq.desc);
+    qpci_msix_disable(dev->pdev);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    g_free(testdev);
+    qtest_end();
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * Receive and transmit with the queues processed in an IOThread.  Kicks
+ * reach it through the main loop here, as qtest has no ioeventfd.
+ */
+static void dataplane(void)
+{
+    QVirtioPCIDevice *dev;
+    QGuestAllocator *alloc;
+    QVirtQueue *rxq, *txq;
+    QPCIBus *bus;
+    uint64_t bufs;
+    uint8_t expected[RX_PACKET_SIZE];
+    uint8_t data[RX_PACKET_SIZE];
+    uint8_t hdr[VNET_HDR_SIZE] = { 0 };
+    uint32_t features;
+    int sv[2];
+    int count = 16;
+    int i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), ==, 0);
+
+    bus = pci_test_start(sv[1], ",iothread=iothread0 "
+                         "-object iothread,id=iothread0");
+    dev = virtio_net_pci_init(bus, PCI_SLOT);
+    alloc = pc_alloc_init();
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            QVIRTIO_F_RING_INDIRECT_DESC |
+                            QVIRTIO_F_RING_EVENT_IDX |
+                            QVIRTIO_NET_F_MRG_RXBUF);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+
+    /* The dataplane maps both rings when the driver becomes ready */
+    rxq = qvirtqueue_setup(&qvirtio_pci, &dev->vdev, alloc, 0);
+    txq = qvirtqueue_setup(&qvirtio_pci, &dev->vdev, alloc, 1);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* Receive */
+    bufs = guest_alloc(alloc, count * RX_BUF_SIZE);
+    rx_post_buffers(dev, rxq, bufs, count);
+
+    rx_send_packets(sv[0], count);
+    wait_used_idx(rxq, count);
+
+    for (i = 0; i < count; i++) {
+        fill_packet(expected, i);
+        memread(bufs + i * RX_BUF_SIZE + VNET_HDR_SIZE, data, sizeof(data));
+        g_assert(memcmp(data, expected, sizeof(data)) == 0);
+    }
+    guest_free(alloc, bufs);
+
+    /* Transmit */
+    bufs = guest_alloc(alloc, count * TX_BUF_SIZE);
+    for (i = 0; i < count; i++) {
+        uint64_t buf = bufs + i * TX_BUF_SIZE;
+        uint32_t head;
+
+        fill_packet(expected, i);
+        memwrite(buf, hdr, sizeof(hdr));
+        memwrite(buf + VNET_HDR_SIZE, expected, sizeof(expected));
+        head = qvirtqueue_add(txq, buf, TX_BUF_SIZE, false, false);
+        qvirtqueue_kick(&qvirtio_pci, &dev->vdev, txq, head);
+    }
+
+    for (i = 0; i < count; i++) {
+        fill_packet(expected, i);
+        g_assert_cmpint(recv(sv[0], data, sizeof(data), 0), ==, sizeof(data));
+        g_assert(memcmp(data, expected, sizeof(data)) == 0);
+    }
+    wait_used_idx(txq, count);
+
+    guest_free(alloc, bufs);
+    guest_free(alloc, txq->desc);
+    guest_free(alloc, rxq->desc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qtest_end();
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * Blast full rings worth of frames at the guest and measure how quickly
+ * they show up in the used ring.  Posting the buffers is not timed.
+ */
+static void rx_perf(void)
+{
+    QVirtioPCIDevice *dev;
+    QGuestAllocator *alloc;
+    QVirtQueue *vq;
+    QPCIBus *bus;
+    uint64_t bufs;
+    uint16_t idx = 0;
+    double duration = 0;
+    int sv[2];
+    int rounds = 100;
+    int i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), ==, 0);
+
+    bus = pci_test_start(sv[1], "");
+    dev = virtio_net_pci_init(bus, PCI_SLOT);
+    alloc = pc_alloc_init();
+    vq = rx_setup(dev, alloc);
+
+    bufs = guest_alloc(alloc, vq->size * RX_BUF_SIZE);
+
+    for (i = 0; i < rounds; i++) {
+        rx_post_buffers(dev, vq, bufs, vq->size);
+
+        g_test_timer_start();
+        rx_send_packets(sv[0], vq->size);
+        idx += vq->size;
+        wait_used_idx(vq, idx);
+        duration += g_test_timer_elapsed();
+    }
+
+    g_test_message("Received %u frames of %d bytes in %f s, %.0f frames/s",
+                   rounds * vq->size, RX_PACKET_SIZE, duration,
+                   rounds * vq->size / duration);
+
+    guest_free(alloc, bufs);
+    guest_free(alloc, vq->desc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
     qtest_end();
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * Transmit more frames than the stand-in tap device takes before it is read,
+ * so that the rest wait in the queue of the tap backend.  They must still
+ * arrive in order and intact, and their buffers must be used only then.
+ */
+static void tx_backlog(void)
+{
+    QVirtioPCIDevice *dev;
+    QGuestAllocator *alloc;
+    QVirtQueue *rxq, *txq;
+    QPCIBus *bus;
+    uint64_t bufs;
+    uint8_t expected[RX_PACKET_SIZE];
+    uint8_t data[RX_PACKET_SIZE];
+    uint8_t hdr[VNET_HDR_SIZE] = { 0 };
+    int sv[2];
+    int count = 64;
+    int i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), ==, 0);
+
+    bus = pci_test_start(sv[1], "");
+    dev = virtio_net_pci_init(bus, PCI_SLOT);
+    alloc = pc_alloc_init();
+    rxq = rx_setup(dev, alloc);
+    txq = qvirtqueue_setup(&qvirtio_pci, &dev->vdev, alloc, 1);
+
+    bufs = guest_alloc(alloc, count * TX_BUF_SIZE);
+    for (i = 0; i < count; i++) {
+        uint64_t buf = bufs + i * TX_BUF_SIZE;
+        uint32_t head;
+
+        fill_packet(expected, i);
+        memwrite(buf, hdr, sizeof(hdr));
+        memwrite(buf + VNET_HDR_SIZE, expected, sizeof(expected));
+        head = qvirtqueue_add(txq, buf, TX_BUF_SIZE, false, false);
+        qvirtqueue_kick(&qvirtio_pci, &dev->vdev, txq, head);
+    }
+
+    /* The socket only holds a few frames, the others cannot have been used */
+    g_assert_cmpint(used_idx(txq), <, count);
+
+    for (i = 0; i < count; i++) {
+        fill_packet(expected, i);
+        g_assert_cmpint(recv(sv[0], data, sizeof(data), 0), ==, sizeof(data));
+        g_assert(memcmp(data, expected, sizeof(data)) == 0);
+    }
+    wait_used_idx(txq, count);
+
+    guest_free(alloc, bufs);
+    guest_free(alloc, txq->desc);
+    guest_free(alloc, rxq->desc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qtest_end();
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * With gro=on, a burst of TCP segments from a netdev without vnet headers
+ * reaches the guest as one TSO frame once the timeout has expired.  A frame
+ * that is not TCP is passed on right away.
+ */
+static void rx_gro(void)
+{
+    QVirtioPCIDevice *dev;
+    QGuestAllocator *alloc;
+    QVirtQueue *vq;
+    QPCIBus *bus;
+    uint64_t bufs, hdr, elem;
+    uint8_t pkt[TCP_HDRS_SIZE + GRO_MSS];
+    uint32_t features;
+    size_t len;
+    int sv[2];
+    int i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), ==, 0);
+
+    bus = pci_test_start(sv[1], ",gro=on");
+    dev = virtio_net_pci_init(bus, PCI_SLOT);
+    alloc = pc_alloc_init();
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    g_assert(features & QVIRTIO_NET_F_GUEST_CSUM);
+    g_assert(features & QVIRTIO_NET_F_GUEST_TSO4);
+    vq = rx_setup(dev, alloc);
+
+    bufs = guest_alloc(alloc, 2 * GRO_BUF_SIZE);
+    for (i = 0; i < 2; i++) {
+        uint32_t head = qvirtqueue_add(vq, bufs + i * GRO_BUF_SIZE,
+                                       GRO_BUF_SIZE, true, false);
+        qvirtqueue_kick(&qvirtio_pci, &dev->vdev, vq, head);
+    }
+
+    for (i = 0; i < GRO_SEGMENTS; i++) {
+        len = fill_tcp_packet(pkt, i * GRO_MSS, GRO_MSS);
+        g_assert_cmpint(send(sv[0], pkt, len, 0), ==, len);
+    }
+
+    /* Once this one is through, every segment has been received */
+    fill_packet(pkt, 0);
+    g_assert_cmpint(send(sv[0], pkt, RX_PACKET_SIZE, 0), ==, RX_PACKET_SIZE);
+    wait_used_idx(vq, 1);
+    g_assert_cmpint(readl(vq->used + 4 + 4), ==,
+                    VNET_HDR_SIZE + RX_PACKET_SIZE);
+
+    clock_step(GRO_TIMEOUT_NS);
+    wait_used_idx(vq, 2);
+
+    /* vq->used->ring[1] */
+    elem = vq->used + 4 + sizeof(QVRingUsedElem);
+    g_assert_cmpint(readl(elem), ==, 1);
+    g_assert_cmpint(readl(elem + 4), ==,
+                    VNET_HDR_SIZE + TCP_HDRS_SIZE + GRO_SEGMENTS * GRO_MSS);
+
+    /* flags, gso_type, hdr_len, gso_size, csum_start, csum_offset */
+    hdr = bufs + GRO_BUF_SIZE;
+    g_assert_cmpint(readb(hdr), ==, 1);
+    g_assert_cmpint(readb(hdr + 1), ==, 1);
+    g_assert_cmpint(readw(hdr + 2), ==, TCP_HDRS_SIZE);
+    g_assert_cmpint(readw(hdr + 4), ==, GRO_MSS);
+    g_assert_cmpint(readw(hdr + 6), ==, 14 + 20);
+    g_assert_cmpint(readw(hdr + 8), ==, 16);
+
+    /* IPv4 total length, then the payload of all segments in order */
+    hdr += VNET_HDR_SIZE;
+    g_assert_cmpint((readb(hdr + 16) << 8) | readb(hdr + 17), ==,
+                    20 + 20 + GRO_SEGMENTS * GRO_MSS);
+    for (i = 0; i < GRO_SEGMENTS * GRO_MSS; i += 199) {
+        g_assert_cmpint(readb(hdr + TCP_HDRS_SIZE + i), ==, i & 0xff);
+    }
+
+    guest_free(alloc, bufs);
+    guest_free(alloc, vq->desc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qtest_end();
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * With receive side scaling over two queue pairs on a single queue netdev,
+ * the frames of every flow end up in one receive queue, and the flows are
+ * spread over both queues.
+ */
+static void rx_rss(void)
+{
+    QVirtioPCIDevice *dev;
+    QGuestAllocator *alloc;
+    QVirtQueue *rxq[RSS_QUEUES], *ctrlq;
+    QPCIBus *bus;
+    uint64_t bufs[RSS_QUEUES];
+    uint16_t pairs = GUINT16_TO_LE(RSS_QUEUES);
+    int flow_queue[RSS_FLOWS];
+    gint64 start_time;
+    int sv[2];
+    int count = 4 * RSS_FLOWS;
+    int received = 0;
+    int i, j;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), ==, 0);
+
+    bus = pci_test_start(sv[1], ",mq=on,rss=on,rss-queues=2");
+    dev = virtio_net_pci_init(bus, PCI_SLOT);
+    alloc = pc_alloc_init();
+    rxq[0] = rx_setup(dev, alloc);
+    rxq[1] = qvirtqueue_setup(&qvirtio_pci, &dev->vdev, alloc, 2);
+    ctrlq = qvirtqueue_setup(&qvirtio_pci, &dev->vdev, alloc,
+                             2 * RSS_QUEUES);
+
+    g_assert_cmpint(ctrl_cmd(dev, alloc, ctrlq, VIRTIO_NET_CTRL_MQ,
+                             VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+                             &pairs, sizeof(pairs)), ==, VIRTIO_NET_OK);
+
+    for (i = 0; i < RSS_QUEUES; i++) {
+        bufs[i] = guest_alloc(alloc, count * RX_BUF_SIZE);
+        rx_post_buffers(dev, rxq[i], bufs[i], count);
+    }
+
+    rx_send_flows(sv[0], count, RSS_FLOWS);
+    start_time = g_get_monotonic_time();
+    while (used_idx(rxq[0]) + used_idx(rxq[1]) != count) {
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+    }
+
+    memset(flow_queue, -1, sizeof(flow_queue));
+    for (i = 0; i < RSS_QUEUES; i++) {
+        g_assert_cmpint(used_idx(rxq[i]), >, 0);
+
+        for (j = 0; j < used_idx(rxq[i]); j++) {
+            /* vq->used->ring[j].id, and the UDP source port of its frame */
+            uint32_t id = readl(rxq[i]->used + 4 + j * sizeof(QVRingUsedElem));
+            uint64_t udp = bufs[i] + id * RX_BUF_SIZE + VNET_HDR_SIZE + 34;
+            int flow = ((readb(udp) << 8) | readb(udp + 1)) - 1024;
+
+            g_assert_cmpint(flow, >=, 0);
+            g_assert_cmpint(flow, <, RSS_FLOWS);
+            g_assert(flow_queue[flow] == -1 || flow_queue[flow] == i);
+            flow_queue[flow] = i;
+            received++;
+        }
+    }
+    g_assert_cmpint(received, ==, count);
+
+    for (i = 0; i < RSS_QUEUES; i++) {
+        guest_free(alloc, bufs[i]);
+        guest_free(alloc, rxq[i]->desc);
+    }
+    guest_free(alloc, ctrlq->desc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qtest_end();
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * Join many multicast groups with promiscuous mode off, and measure how
+ * quickly frames for the last group make it through the receive filter.
+ */
+static void rx_perf_multicast(void)
+{
+    QVirtioPCIDevice *dev;
+    QGuestAllocator *alloc;
+    QVirtQueue *vq, *ctrlq;
+    QPCIBus *bus;
+    uint8_t table[2 * 4 + MULTICAST_GROUPS * 6];
+    uint8_t *mac = table + 2 * 4 + (MULTICAST_GROUPS - 1) * 6;
+    uint32_t entries;
+    uint8_t promisc = 0;
+    uint64_t bufs;
+    uint16_t idx = 0;
+    double duration = 0;
+    int sv[2];
+    int rounds = 100;
+    int i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), ==, 0);
+
+    bus = pci_test_start(sv[1], "");
+    dev = virtio_net_pci_init(bus, PCI_SLOT);
+    alloc = pc_alloc_init();
+    vq = rx_setup(dev, alloc);
+    ctrlq = qvirtqueue_setup(&qvirtio_pci, &dev->vdev, alloc, 2);
+
+    /* No unicast entries, then 01:00:5e:00:00:01 and up */
+    entries = 0;
+    memcpy(table, &entries, 4);
+    entries = GUINT32_TO_LE(MULTICAST_GROUPS);
+    memcpy(table + 4, &entries, 4);
+    for (i = 0; i < MULTICAST_GROUPS; i++) {
+        uint8_t *group = table + 2 * 4 + i * 6;
+
+        group[0] = 0x01;
+        group[1] = 0x00;
+        group[2] = 0x5e;
+        group[3] = 0x00;
+        group[4] = (i + 1) >> 8;
+        group[5] = (i + 1) & 0xff;
+    }
+
+    g_assert_cmpint(ctrl_cmd(dev, alloc, ctrlq, VIRTIO_NET_CTRL_MAC,
+                             VIRTIO_NET_CTRL_MAC_TABLE_SET,
+                             table, sizeof(table)), ==, VIRTIO_NET_OK);
+    g_assert_cmpint(ctrl_cmd(dev, alloc, ctrlq, VIRTIO_NET_CTRL_RX,
+                             VIRTIO_NET_CTRL_RX_PROMISC,
+                             &promisc, sizeof(promisc)), ==, VIRTIO_NET_OK);
+
+    bufs = guest_alloc(alloc, vq->size * RX_BUF_SIZE);
+
+    for (i = 0; i < rounds; i++) {
+        rx_post_buffers(dev, vq, bufs, vq->size);
+
+        g_test_timer_start();
+        rx_send_multicast(sv[0], vq->size, mac);
+        idx += vq->size;
+        wait_used_idx(vq, idx);
+        duration += g_test_timer_elapsed();
+    }
+
+    g_test_message("Received %u frames for 1 of %d groups in %f s, "
+                   "%.0f frames/s", rounds * vq->size, MULTICAST_GROUPS,
+                   duration, rounds * vq->size / duration);
+
+    guest_free(alloc, bufs);
+    guest_free(alloc, vq->desc);
+    guest_free(alloc, ctrlq->desc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qtest_end();
+    close(sv[0]);
+    close(sv[1]);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/virtio/net/pci/nop", pci_nop);
+    qtest_add_func("/virtio/net/pci/hotplug", hotplug);
+    qtest_add_func("/virtio/net/pci/rx-batch", rx_batch);
+    qtest_add_func("/virtio/net/pci/rx-batch-irq", rx_batch_irq);
+    qtest_add_func("/virtio/net/pci/rss", rx_rss);
+    qtest_add_func("/virtio/net/pci/tx-backlog", tx_backlog);
+    qtest_add_func("/virtio/net/pci/gro", rx_gro);
+    qtest_add_func("/virtio/net/pci/dataplane", dataplane);
+    if (g_test_perf()) {
+        qtest_add_func("/virtio/net/pci/perf/rx", rx_perf);
+        qtest_add_func("/virtio/net/pci/perf/rx-multicast",
+                       rx_perf_multicast);
+    }
 
-    return ret;
+    return g_test_run();
 }
@@ -59,7 +59,9 @@
 
 #include "exec/cputlb.h"
 #include "translate-all.h"
+#include "tb-cache.h"
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -129,6 +131,8 @@ TCGContext tcg_ctx;
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
+static int tb_superblock_restore_state(CPUState *cpu, TranslationBlock *tb,
+                                       uintptr_t searched_pc);
 
 void cpu_gen_init(void)
 {
@@ -211,6 +215,10 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
     int64_t ti;
 #endif
 
+    if (tb->cflags & CF_SUPERBLOCK) {
+        return tb_superblock_restore_state(cpu, tb, searched_pc);
+    }
+
 #ifdef CONFIG_PROFILER
     ti = profile_getclock();
 #endif
@@ -260,7 +268,10 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
 bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
 {
     TranslationBlock *tb;
+    bool found = false;
 
+    /* another vCPU may be adding to or flushing the TB array */
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (tb) {
         cpu_restore_state_from_tb(cpu, tb, retaddr);
@@ -270,9 +281,10 @@ bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
             tb_phys_invalidate(tb, -1);
             tb_free(tb);
         }
-        return true;
+        found = true;
     }
-    return false;
+    tb_unlock();
+    return found;
 }
 
 #ifdef _WIN32
@@ -661,7 +673,13 @@ static inline void *alloc_code_gen_buffer(void)
 static inline void code_gen_alloc(size_t tb_size)
 {
     tcg_ctx.code_gen_buffer_size = size_code_gen_buffer(tb_size);
-    tcg_ctx.code_gen_buffer = alloc_code_gen_buffer();
+    /* the block count must match the one computed below */
+    tcg_ctx.code_gen_buffer = tb_cache_alloc(tcg_ctx.code_gen_buffer_size,
+            (tcg_ctx.code_gen_buffer_size - 1024) / CODE_GEN_AVG_BLOCK_SIZE,
+            &tcg_ctx.tb_ctx.tbs);
+    if (tcg_ctx.code_gen_buffer == NULL) {
+        tcg_ctx.code_gen_buffer = alloc_code_gen_buffer();
+    }
     if (tcg_ctx.code_gen_buffer == NULL) {
         fprintf(stderr, "Could not allocate dynamic translator buffer\n");
         exit(1);
@@ -683,8 +701,20 @@ static inline void code_gen_alloc(size_t tb_size)
         (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
     tcg_ctx.code_gen_max_blocks = tcg_ctx.code_gen_buffer_size /
             CODE_GEN_AVG_BLOCK_SIZE;
-    tcg_ctx.tb_ctx.tbs =
-            g_malloc(tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock));
+    if (tcg_ctx.tb_ctx.tbs == NULL) {
+        tcg_ctx.tb_ctx.tbs = g_malloc(tcg_ctx.code_gen_max_blocks *
+                                      sizeof(TranslationBlock));
+    }
+}
+
+static TBHashTable *tb_hash_alloc(unsigned int bits)
+{
+    TBHashTable *ht;
+
+    ht = g_malloc0(sizeof(*ht) + (sizeof(TranslationBlock *) << bits));
+    ht->bits = bits;
+    ht->mask = (1U << bits) - 1;
+    return ht;
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -693,6 +723,10 @@ static inline void code_gen_alloc(size_t tb_size)
 void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
+#if !defined(CONFIG_USER_ONLY)
+    qemu_mutex_init(&tcg_ctx.tb_ctx.tb_lock);
+#endif
+    tcg_ctx.tb_ctx.tb_phys_hash = tb_hash_alloc(CODE_GEN_PHYS_HASH_BITS);
     code_gen_alloc(tb_size);
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     tcg_register_jit(tcg_ctx.code_gen_buffer, tcg_ctx.code_gen_buffer_size);
@@ -701,6 +735,7 @@ void tcg_exec_init(unsigned long tb_size)
     /* There's no guest base to take into account, so go ahead and
        initialize the prologue now.  */
     tcg_prologue_init(&tcg_ctx);
+    tb_cache_init();
 #endif
 }
 
@@ -709,6 +744,68 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
+/* Nesting depth of tb_lock() in the current thread.  Translation and
+   invalidation paths call each other freely, so only the outermost
+   tb_lock()/tb_unlock() pair touches the mutex.  */
+static DEFINE_TLS(int, have_tb_lock);
+
+static inline bool tb_lock_needed(void)
+{
+#if defined(CONFIG_USER_ONLY)
+    return true;
+#else
+    return qemu_tcg_mttcg_enabled();
+#endif
+}
+
+/* Take the lock protecting the TB tables and the code buffer.  In user
+   mode and in single-threaded system emulation only cpu_exec() needs it;
+   with -machine tcg-thread=multi every translation and invalidation must
+   hold it.  Lock ordering: the iothread mutex is taken before tb_lock.  */
+static inline void tb_lock_acquire(void)
+{
+#if defined(CONFIG_USER_ONLY)
+    spin_lock(&tcg_ctx.tb_ctx.tb_lock);
+#else
+    qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
+#endif
+}
+
+static inline void tb_lock_release(void)
+{
+#if defined(CONFIG_USER_ONLY)
+    spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
+#else
+    qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+#endif
+}
+
+void tb_lock(void)
+{
+    if (tb_lock_needed() && tls_var(have_tb_lock)++ == 0) {
+        tb_lock_acquire();
+    }
+}
+
+void tb_unlock(void)
+{
+    if (tb_lock_needed()) {
+        assert(tls_var(have_tb_lock) > 0);
+        if (--tls_var(have_tb_lock) == 0) {
+            tb_lock_release();
+        }
+    }
+}
+
+/* Drop tb_lock after a longjmp back into cpu_exec().  */
+void tb_lock_reset(void)
+{
+    if (tls_var(have_tb_lock)) {
+        tls_var(have_tb_lock) = 0;
+        tb_lock_release();
+    }
+}
+
 /* Allocate a new translation block. Flush the translation buffer if
    too many translation blocks or too much generated code. */
 static TranslationBlock *tb_alloc(target_ulong pc)
@@ -723,6 +820,8 @@ static TranslationBlock *tb_alloc(target_ulong pc)
     tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+    tb->exec_count = 0;
+    tb->superblock = NULL;
     return tb;
 }
 
@@ -780,12 +879,62 @@ static void page_flush_tb(void)
     }
 }
 
+#if !defined(CONFIG_USER_ONLY)
+/* With multi-threaded TCG the code buffer may only be reset while no vCPU
+   thread is inside cpu_exec().  Outside of a vCPU thread (gdbstub, monitor)
+   the caller holds the iothread mutex, so vCPUs that are stopped stay
+   stopped until we are done.  */
+static bool tb_flush_needs_exclusive(void)
+{
+    CPUState *cpu;
+
+    if (!qemu_tcg_mttcg_enabled()) {
+        return false;
+    }
+    if (current_cpu) {
+        return true;
+    }
+    CPU_FOREACH(cpu) {
+        if (!cpu->stopped) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+static void do_tb_flush(CPUArchState *env1);
+
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
+/* XXX: tb_flush is currently not thread safe in user mode */
 void tb_flush(CPUArchState *env1)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (tb_flush_needs_exclusive()) {
+        CPUState *cpu;
+
+        /* Other vCPU threads may be executing from the code buffer.
+           Defer the flush until every vCPU has been brought out of
+           cpu_exec(); they check for it before running guest code again
+           and perform it as an exclusive operation.  */
+        atomic_mb_set(&tcg_ctx.tb_ctx.tb_flush_pending, true);
+        CPU_FOREACH(cpu) {
+            cpu_exit(cpu);
+        }
+        return;
+    }
+#endif
+    do_tb_flush(env1);
+}
+
+static void do_tb_flush(CPUArchState *env1)
 {
     CPUState *cpu = ENV_GET_CPU(env1);
 
+#if !defined(CONFIG_USER_ONLY)
+    tb_lock();
+#endif
+
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
            (unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer),
@@ -797,31 +946,68 @@ void tb_flush(CPUArchState *env1)
         > tcg_ctx.code_gen_buffer_size) {
         cpu_abort(cpu, "Internal error: code buffer overflow\n");
     }
+    tb_cache_flush();
     tcg_ctx.tb_ctx.nb_tbs = 0;
+    while (tcg_ctx.tb_ctx.superblocks) {
+        TBSuperblock *sb = tcg_ctx.tb_ctx.superblocks;
+
+        tcg_ctx.tb_ctx.superblocks = sb->next;
+        g_free(sb);
+    }
 
     CPU_FOREACH(cpu) {
         memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
     }
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0, sizeof(tcg_ctx.tb_ctx.tb_phys_hash));
+    memset(tcg_ctx.tb_ctx.tb_phys_hash->buckets, 0,
+           sizeof(TranslationBlock *) << tcg_ctx.tb_ctx.tb_phys_hash->bits);
+    tcg_ctx.tb_ctx.tb_phys_hash_count = 0;
+    /* nobody can be walking the tables a resize replaced any more */
+    while (tcg_ctx.tb_ctx.tb_phys_hash_retired) {
+        TBHashTable *ht = tcg_ctx.tb_ctx.tb_phys_hash_retired;
+
+        tcg_ctx.tb_ctx.tb_phys_hash_retired = ht->retired_next;
+        g_free(ht);
+    }
     page_flush_tb();
 
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tcg_ctx.tb_ctx.tb_flush_count++;
+#if !defined(CONFIG_USER_ONLY)
+    atomic_mb_set(&tcg_ctx.tb_ctx.tb_flush_pending, false);
+    tb_unlock();
+#endif
+}
+
+#if !defined(CONFIG_USER_ONLY)
+bool tb_flush_is_pending(void)
+{
+    return atomic_mb_read(&tcg_ctx.tb_ctx.tb_flush_pending);
 }
 
+/* Perform a flush requested by tb_flush() while vCPUs were running.  Must
+   be called outside cpu_exec() while no other vCPU is executing.  */
+void tb_flush_deferred(CPUArchState *env)
+{
+    if (tb_flush_is_pending()) {
+        do_tb_flush(env);
+    }
+}
+#endif
+
 #ifdef DEBUG_TB_CHECK
 
 static void tb_invalidate_check(target_ulong address)
 {
+    TBHashTable *ht = tcg_ctx.tb_ctx.tb_phys_hash;
     TranslationBlock *tb;
     int i;
 
     address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+    for (i = 0; i <= ht->mask; i++) {
+        for (tb = ht->buckets[i]; tb != NULL; tb = tb->phys_hash_next) {
             if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
                   address >= tb->pc + tb->size)) {
                 printf("ERROR invalidate: address=" TARGET_FMT_lx
@@ -835,12 +1021,12 @@ static void tb_invalidate_check(target_ulong address)
 /* verify that all the pages have correct rights for code */
 static void tb_page_check(void)
 {
+    TBHashTable *ht = tcg_ctx.tb_ctx.tb_phys_hash;
     TranslationBlock *tb;
     int i, flags1, flags2;
 
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
+    for (i = 0; i <= ht->mask; i++) {
+        for (tb = ht->buckets[i]; tb != NULL; tb = tb->phys_hash_next) {
             flags1 = page_get_flags(tb->pc);
             flags2 = page_get_flags(tb->pc + tb->size - 1);
             if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
@@ -853,18 +1039,114 @@ static void tb_page_check(void)
 
 #endif
 
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+static inline unsigned int tb_hash_of(TranslationBlock *tb)
 {
-    TranslationBlock *tb1;
+    tb_page_addr_t phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
 
-    for (;;) {
-        tb1 = *ptb;
+    return tb_hash_func(phys_pc, tb->pc, tb->cs_base, tb->flags);
+}
+
+/* Double the number of buckets.  Must be called with tb_lock held.
+   Lockless readers still walking the old table may be diverted into a
+   chain of the new one and miss; they then retry under tb_lock.  TBs are
+   moved one at a time in chain order, so no chain ever becomes cyclic. */
+static TBHashTable *tb_hash_resize(TBHashTable *old)
+{
+    TBHashTable *ht = tb_hash_alloc(old->bits + 1);
+    TranslationBlock *tb, *next;
+    unsigned int i, h;
+
+    for (i = 0; i <= old->mask; i++) {
+        for (tb = old->buckets[i]; tb != NULL; tb = next) {
+            next = tb->phys_hash_next;
+            h = tb_hash_of(tb) & ht->mask;
+            atomic_set(&tb->phys_hash_next, ht->buckets[h]);
+            ht->buckets[h] = tb;
+        }
+    }
+    smp_wmb();
+    atomic_set(&tcg_ctx.tb_ctx.tb_phys_hash, ht);
+
+    old->retired_next = tcg_ctx.tb_ctx.tb_phys_hash_retired;
+    tcg_ctx.tb_ctx.tb_phys_hash_retired = old;
+    tcg_ctx.tb_ctx.tb_phys_hash_resize_count++;
+    return ht;
+}
+
+static void tb_hash_insert(TranslationBlock *tb)
+{
+    TBHashTable *ht = tcg_ctx.tb_ctx.tb_phys_hash;
+    unsigned int h;
+
+    if (tcg_ctx.tb_ctx.tb_phys_hash_count >=
+        (ht->mask + 1) * TB_HASH_MAX_LOAD) {
+        ht = tb_hash_resize(ht);
+    }
+    h = tb_hash_of(tb) & ht->mask;
+    tb->phys_hash_next = ht->buckets[h];
+    /* the TB must be complete before it becomes visible to lookups */
+    smp_wmb();
+    atomic_set(&ht->buckets[h], tb);
+    tcg_ctx.tb_ctx.tb_phys_hash_count++;
+}
+
+static void tb_hash_remove(TranslationBlock *tb)
+{
+    TBHashTable *ht = tcg_ctx.tb_ctx.tb_phys_hash;
+    TranslationBlock **ptb, *tb1;
+
+    ptb = &ht->buckets[tb_hash_of(tb) & ht->mask];
+    for (tb1 = *ptb; tb1 != NULL; tb1 = *ptb) {
         if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
-            break;
+            /* tb->phys_hash_next stays valid for concurrent lookups */
+            atomic_set(ptb, tb1->phys_hash_next);
+            tcg_ctx.tb_ctx.tb_phys_hash_count--;
+            return;
         }
         ptb = &tb1->phys_hash_next;
     }
+    /* the TB was already invalidated and is no longer hashed */
+}
+
+/* Find a TB for the given CPU state without taking tb_lock.  A miss is
+   not authoritative while other threads translate or resize the table;
+   callers that go on to translate must look again under tb_lock. */
+TranslationBlock *tb_htable_lookup(CPUState *cpu, target_ulong pc,
+                                   target_ulong cs_base, uint64_t flags)
+{
+    CPUArchState *env = cpu->env_ptr;
+    TBHashTable *ht;
+    TranslationBlock *tb;
+    tb_page_addr_t phys_pc, phys_page1, phys_page2;
+    target_ulong virt_page2;
+    unsigned int h;
+
+    phys_pc = get_page_addr_code(env, pc);
+    phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    h = tb_hash_func(phys_pc, pc, cs_base, flags);
+
+    ht = atomic_read(&tcg_ctx.tb_ctx.tb_phys_hash);
+    smp_read_barrier_depends();
+    tb = atomic_read(&ht->buckets[h & ht->mask]);
+    while (tb) {
+        smp_read_barrier_depends();
+        if (tb->pc == pc &&
+            tb->page_addr[0] == phys_page1 &&
+            tb->cs_base == cs_base &&
+            tb->flags == flags) {
+            /* check next page if needed */
+            if (tb->page_addr[1] == -1) {
+                return tb;
+            }
+            virt_page2 = (pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+            phys_page2 = get_page_addr_code(env, virt_page2);
+            if (tb->page_addr[1] == phys_page2) {
+                return tb;
+            }
+        }
+        tb = atomic_read(&tb->phys_hash_next);
+    }
+    return NULL;
 }
 
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
@@ -926,13 +1208,11 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     CPUState *cpu;
     PageDesc *p;
     unsigned int h, n1;
-    tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
     /* remove the TB from the hash list */
-    phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    tb_hash_remove(tb);
+    tb_cache_invalidate(tb);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -975,6 +1255,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     }
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
 
+    /* lookups that found the TB before it was unlinked must not chain it */
+    atomic_set(&tb->cflags, tb->cflags | CF_INVALID);
     tcg_ctx.tb_ctx.tb_phys_invalidate_count++;
 }
 
@@ -1048,8 +1330,25 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if (use_icount) {
         cflags |= CF_USE_ICOUNT;
     }
+    /* a block translated by a previous run may still be usable */
+    tb = tb_cache_find(cpu, pc, cs_base, flags, cflags);
+    if (tb) {
+        tb->exec_count = 0;
+        tb_link_page(tb, phys_pc, tb->page_addr[1]);
+        return tb;
+    }
     tb = tb_alloc(pc);
     if (!tb) {
+#if !defined(CONFIG_USER_ONLY)
+        if (qemu_tcg_mttcg_enabled()) {
+            /* The flush is deferred until every vCPU is out of the code
+               buffer, so there is no room yet.  Leave cpu_exec() and
+               translate again once the flush has happened.  */
+            tb_flush(env);
+            cpu->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(cpu);
+        }
+#endif
         /* flush must be done */
         tb_flush(env);
         /* cannot fail at this point */
@@ -1072,9 +1371,304 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
     tb_link_page(tb, phys_pc, phys_page2);
+    tb_cache_record(cpu, tb);
     return tb;
 }
 
+/* Superblocks.  Once a block has run tb_hot_threshold times it leaves
+   to cpu_exec(), which calls tb_gen_superblock().  Starting from that
+   block, the most executed block chained to one of its goto_tb slots is
+   followed, and so on, and the resulting path is translated again as a
+   single unit.  On the path, goto_tb exits become branches to the next
+   block, so tcg/optimize.c and the register allocator see the whole
+   trace; every other exit goes back to cpu_exec() unchained.  The
+   superblock then replaces its first block in the hash table.  */
+
+/* Return the block goto_tb slot 'n' of 'tb' is chained to, if any.  */
+static TranslationBlock *tb_jmp_dest(TranslationBlock *tb, int n)
+{
+    TranslationBlock *tb1;
+    uintptr_t p = (uintptr_t)tb->jmp_next[n];
+
+    if (!p) {
+        return NULL;
+    }
+    /* walk the circular list of jumps to the destination block */
+    while ((p & 3) != 2) {
+        tb1 = (TranslationBlock *)(p & ~3);
+        p = (uintptr_t)tb1->jmp_next[p & 3];
+    }
+    return (TranslationBlock *)(p & ~3);
+}
+
+static bool tb_superblock_can_add(TranslationBlock *head, TranslationBlock *tb)
+{
+    /* Keep everything on the first page of the head, at or after its pc,
+       so that pc and size of the superblock cover all of its code.  */
+    return tb->cflags == 0 &&
+           tb->cs_base == head->cs_base && tb->flags == head->flags &&
+           tb->pc >= head->pc &&
+           tb->page_addr[0] == head->page_addr[0] && tb->page_addr[1] == -1;
+}
+
+/* Generate the ops of the first 'nb_blocks' blocks of superblock 'tb',
+   recording the index of the first op of each block in 'op_start'.
+   Returns -1, or the index of the first block that could not be merged
+   because it no longer translates the way it did on its own.  */
+static int tb_superblock_gen_ops(CPUArchState *env, TranslationBlock *tb,
+                                 int nb_blocks, bool search_pc, int *op_start)
+{
+    TCGContext *s = &tcg_ctx;
+    TBSuperblock *sb = tb->superblock;
+    TranslationBlock block;
+    int labels[TB_SUPERBLOCK_MAX_BLOCKS];
+    uint16_t *opc;
+    TCGArg *args;
+    int i, n, nb_args, hot_exits;
+
+    for (i = 0; i < sb->nb_blocks; i++) {
+        labels[i] = gen_new_label();
+    }
+    for (i = 0; i < nb_blocks; i++) {
+        gen_set_label(labels[i]);
+        opc = s->gen_opc_ptr;
+        args = s->gen_opparam_ptr;
+        op_start[i] = opc - s->gen_opc_buf;
+
+        memset(&block, 0, sizeof(block));
+        block.pc = sb->pc[i];
+        block.cs_base = tb->cs_base;
+        block.flags = tb->flags;
+        block.cflags = CF_SUPERBLOCK;
+        if (search_pc) {
+            gen_intermediate_code_pc(env, &block);
+        } else {
+            gen_intermediate_code(env, &block);
+        }
+        /* a shorter block means the op buffer is full */
+        if (block.size != sb->size[i]) {
+            return i;
+        }
+
+        /* redirect the exits of the block */
+        hot_exits = 0;
+        for (; opc < s->gen_opc_ptr; opc++) {
+            const TCGOpDef *def = &tcg_op_defs[*opc];
+
+            nb_args = def->nb_args;
+            switch (*opc) {
+            case INDEX_op_call:
+                nb_args = (args[0] >> 16) + (args[0] & 0xffff) +
+                          def->nb_cargs + 1;
+                break;
+            case INDEX_op_nopn:
+                nb_args = args[0];
+                break;
+            case INDEX_op_goto_tb:
+                /* superblocks are never chained */
+                *opc = INDEX_op_nop1;
+                break;
+            case INDEX_op_exit_tb:
+                if ((args[0] & ~TB_EXIT_MASK) != (uintptr_t)&block) {
+                    break;
+                }
+                n = args[0] & TB_EXIT_MASK;
+                if (n == TB_EXIT_REQUESTED || n == TB_EXIT_ICOUNT_EXPIRED) {
+                    args[0] = (uintptr_t)tb + n;
+                } else if (n == sb->next_slot[i]) {
+                    /* the pc has been stored already, just go on */
+                    *opc = INDEX_op_br;
+                    args[0] = labels[i + 1 < sb->nb_blocks ? i + 1
+                                                            : sb->loop_to];
+                    hot_exits++;
+                } else {
+                    args[0] = 0;
+                }
+                break;
+            default:
+                break;
+            }
+            args += nb_args;
+        }
+        if (sb->next_slot[i] >= 0 && hot_exits != 1) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Called with tb_lock held when 'head' has just become hot.  'head' was
+   found without the lock, so another vCPU may have invalidated it or
+   already replaced it with a superblock in the meantime.  */
+void tb_gen_superblock(CPUState *cpu, TranslationBlock *head)
+{
+    CPUArchState *env = cpu->env_ptr;
+    TCGContext *s = &tcg_ctx;
+    TranslationBlock *path[TB_SUPERBLOCK_MAX_BLOCKS];
+    TranslationBlock *tb, *dest, *best;
+    TBSuperblock *sb;
+    tb_page_addr_t phys_pc;
+    target_ulong end;
+    int op_start[TB_SUPERBLOCK_MAX_BLOCKS];
+    int i, n, slot, best_slot, failed, gen_code_size;
+
+    /* CF_INVALID is set once the head was invalidated, which is also
+       what happens when a superblock takes over from it */
+    if (head->cflags != 0 || head->exec_count < tb_hot_threshold ||
+        head->page_addr[1] != -1 ||
+        singlestep || cpu->singlestep_enabled ||
+        !QTAILQ_EMPTY(&cpu->breakpoints)) {
+        return;
+    }
+
+    /* follow the hottest chained successor until the path loops, leaves
+       the page or gets too long */
+    sb = g_new0(TBSuperblock, 1);
+    sb->loop_to = -1;
+    path[0] = head;
+    for (n = 1; ; n++) {
+        sb->pc[n - 1] = path[n - 1]->pc;
+        sb->size[n - 1] = path[n - 1]->size;
+        sb->next_slot[n - 1] = -1;
+
+        best = NULL;
+        best_slot = -1;
+        for (slot = 0; slot < 2; slot++) {
+            if (path[n - 1]->tb_next_offset[slot] == 0xffff) {
+                continue;
+            }
+            dest = tb_jmp_dest(path[n - 1], slot);
+            if (dest && (!best || dest->exec_count > best->exec_count)) {
+                best = dest;
+                best_slot = slot;
+            }
+        }
+        if (!best) {
+            break;
+        }
+        for (i = 0; i < n && path[i] != best; i++) {
+            continue;
+        }
+        if (i < n) {
+            sb->next_slot[n - 1] = best_slot;
+            sb->loop_to = i;
+            break;
+        }
+        if (n == TB_SUPERBLOCK_MAX_BLOCKS ||
+            !tb_superblock_can_add(head, best)) {
+            break;
+        }
+        sb->next_slot[n - 1] = best_slot;
+        path[n] = best;
+    }
+    sb->nb_blocks = n;
+
+    for (;;) {
+        if (sb->nb_blocks < 2) {
+            g_free(sb);
+            return;
+        }
+        tb = tb_alloc(head->pc);
+        if (!tb) {
+            /* no room, leave it to the next flush */
+            g_free(sb);
+            return;
+        }
+        tb->tc_ptr = s->code_gen_ptr;
+        tb->cs_base = head->cs_base;
+        tb->flags = head->flags;
+        tb->cflags = CF_SUPERBLOCK;
+        tb->superblock = sb;
+
+        tcg_func_start(s);
+        failed = tb_superblock_gen_ops(env, tb, sb->nb_blocks, false,
+                                       op_start);
+        if (failed < 0) {
+            break;
+        }
+        /* drop the offending block and everything after it */
+        tb_free(tb);
+        sb->nb_blocks = failed;
+        if (failed > 0) {
+            sb->next_slot[failed - 1] = -1;
+        }
+        sb->loop_to = -1;
+    }
+
+    tb->tb_next_offset[0] = 0xffff;
+    tb->tb_next_offset[1] = 0xffff;
+    s->tb_next_offset = tb->tb_next_offset;
+#ifdef USE_DIRECT_JUMP
+    s->tb_jmp_offset = tb->tb_jmp_offset;
+    s->tb_next = NULL;
+#else
+    s->tb_jmp_offset = NULL;
+    s->tb_next = tb->tb_next;
+#endif
+    gen_code_size = tcg_gen_code(s, tb->tc_ptr);
+    s->code_gen_ptr = (void *)(((uintptr_t)s->code_gen_ptr +
+            gen_code_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+
+    end = tb->pc;
+    for (i = 0; i < sb->nb_blocks; i++) {
+        end = MAX(end, sb->pc[i] + sb->size[i]);
+    }
+    tb->size = end - tb->pc;
+
+    sb->next = tcg_ctx.tb_ctx.superblocks;
+    tcg_ctx.tb_ctx.superblocks = sb;
+    tcg_ctx.tb_ctx.tb_superblock_count++;
+
+    /* the superblock takes over from its head */
+    phys_pc = head->page_addr[0] + (head->pc & ~TARGET_PAGE_MASK);
+    tb_phys_invalidate(head, -1);
+    tb_link_page(tb, phys_pc, -1);
+}
+
+/* The op index arrays filled by gen_intermediate_code_pc() only survive
+   for the block translated last, so find the block first and then
+   translate up to that block again.  */
+static int tb_superblock_restore_state(CPUState *cpu, TranslationBlock *tb,
+                                       uintptr_t searched_pc)
+{
+    CPUArchState *env = cpu->env_ptr;
+    TCGContext *s = &tcg_ctx;
+    uintptr_t tc_ptr = (uintptr_t)tb->tc_ptr;
+    int op_start[TB_SUPERBLOCK_MAX_BLOCKS];
+    int i, j;
+
+    if (searched_pc < tc_ptr) {
+        return -1;
+    }
+    tcg_func_start(s);
+    tb_superblock_gen_ops(env, tb, tb->superblock->nb_blocks, false,
+                          op_start);
+    s->tb_next_offset = tb->tb_next_offset;
+#ifdef USE_DIRECT_JUMP
+    s->tb_jmp_offset = tb->tb_jmp_offset;
+    s->tb_next = NULL;
+#else
+    s->tb_jmp_offset = NULL;
+    s->tb_next = tb->tb_next;
+#endif
+    j = tcg_gen_code_search_pc(s, (tcg_insn_unit *)tc_ptr,
+                               searched_pc - tc_ptr);
+    if (j < 0) {
+        return -1;
+    }
+    for (i = tb->superblock->nb_blocks - 1; i > 0 && op_start[i] > j; i--) {
+        continue;
+    }
+
+    tcg_func_start(s);
+    tb_superblock_gen_ops(env, tb, i + 1, true, op_start);
+    while (s->gen_opc_instr_start[j] == 0) {
+        j--;
+    }
+    restore_state_to_opc(env, tb, j);
+    return 0;
+}
+
 /*
  * Invalidate all TBs which intersect with the target physical address range
  * [start;end[. NOTE: start and end may refer to *different* physical pages.
@@ -1380,17 +1974,9 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
-
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1412,6 +1998,9 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
         tb_reset_jump(tb, 1);
     }
 
+    /* add in the hash table last, lookups do not take tb_lock */
+    tb_hash_insert(tb);
+
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
@@ -1465,7 +2054,9 @@ void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr)
     }
     ram_addr = (memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK)
         + addr;
+    tb_lock();
     tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
+    tb_unlock();
 }
 #endif /* TARGET_HAS_ICE && !defined(CONFIG_USER_ONLY) */
 
@@ -1473,6 +2064,7 @@ void tb_check_watchpoint(CPUState *cpu)
 {
     TranslationBlock *tb;
 
+    tb_lock();
     tb = tb_find_pc(cpu->mem_io_pc);
     if (!tb) {
         cpu_abort(cpu, "check_watchpoint: could not find TB for pc=%p",
@@ -1480,6 +2072,7 @@ void tb_check_watchpoint(CPUState *cpu)
     }
     cpu_restore_state_from_tb(cpu, tb, cpu->mem_io_pc);
     tb_phys_invalidate(tb, -1);
+    tb_unlock();
 }
 
 #ifndef CONFIG_USER_ONLY
@@ -1525,6 +2118,7 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     target_ulong pc, cs_base;
     uint64_t flags;
 
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (!tb) {
         cpu_abort(cpu, "cpu_io_recompile: could not find TB for pc=%p",
@@ -1568,6 +2162,7 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     /* FIXME: In theory this could raise an exception.  In practice
        we have already translated the block once so it's probably ok.  */
     tb_gen_code(cpu, pc, cs_base, flags, cflags);
+    tb_unlock();
     /* TODO: If env->pc != tb->pc (i.e. the faulting instruction was not
        the first in the TB) then we end up generating a whole new TB and
        repeating the fault, which is horribly inefficient.
@@ -1595,7 +2190,12 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
     int i, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    int used_buckets, chain_len, max_chain_len;
+    TBHashTable *ht = tcg_ctx.tb_ctx.tb_phys_hash;
+    uint64_t lookups, misses;
+    uint64_t tlb_victim_hits, tlb_full_walks;
     TranslationBlock *tb;
+    CPUState *cpu;
 
     target_code_size = 0;
     max_target_code_size = 0;
@@ -1618,6 +2218,28 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
             }
         }
     }
+    used_buckets = 0;
+    max_chain_len = 0;
+    for (i = 0; i <= ht->mask; i++) {
+        chain_len = 0;
+        for (tb = ht->buckets[i]; tb != NULL; tb = tb->phys_hash_next) {
+            chain_len++;
+        }
+        if (chain_len) {
+            used_buckets++;
+        }
+        if (chain_len > max_chain_len) {
+            max_chain_len = chain_len;
+        }
+    }
+    lookups = atomic_read(&tcg_ctx.tb_ctx.tb_lookup_count);
+    misses = atomic_read(&tcg_ctx.tb_ctx.tb_lookup_miss_count);
+    tlb_victim_hits = 0;
+    tlb_full_walks = 0;
+    CPU_FOREACH(cpu) {
+        tlb_victim_hits += cpu->tlb_victim_hits;
+        tlb_full_walks += cpu->tlb_full_walks;
+    }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
     cpu_fprintf(f, "gen code size       %td/%zd\n",
@@ -1646,11 +2268,33 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 direct_jmp2_count,
                 tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
                         tcg_ctx.tb_ctx.nb_tbs : 0);
+    cpu_fprintf(f, "TB hash buckets     %d/%d (%d resizes)\n",
+                used_buckets, ht->mask + 1,
+                tcg_ctx.tb_ctx.tb_phys_hash_resize_count);
+    cpu_fprintf(f, "TB hash chain       avg %0.2f max=%d\n",
+                used_buckets ?
+                (double)tcg_ctx.tb_ctx.tb_phys_hash_count / used_buckets : 0,
+                max_chain_len);
+    cpu_fprintf(f, "TB hash lookups     %" PRId64 " (hit rate %0.1f%%)\n",
+                lookups,
+                lookups ? (double)(lookups - misses) * 100 / lookups : 0);
+    if (tb_hot_threshold) {
+        cpu_fprintf(f, "superblocks         %d\n",
+                    tcg_ctx.tb_ctx.tb_superblock_count);
+    }
+    tb_cache_dump_info(f, cpu_fprintf);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TLB entries         %d per MMU mode\n", CPU_TLB_SIZE);
+    cpu_fprintf(f, "TLB victim hits     %" PRId64 " (%0.1f%% of misses)\n",
+                tlb_victim_hits,
+                tlb_victim_hits + tlb_full_walks ?
+                (double)tlb_victim_hits * 100 /
+                (tlb_victim_hits + tlb_full_walks) : 0);
+    cpu_fprintf(f, "TLB full walks      %" PRId64 "\n", tlb_full_walks);
     tcg_dump_info(f, cpu_fprintf);
 }
 
@@ -274,6 +274,27 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
     hb_set_between(hb, HBITMAP_LEVELS - 1, start, last);
 }
 
+uint64_t hbitmap_set_word(HBitmap *hb, uint64_t pos, unsigned long val)
+{
+    unsigned long *elem;
+    unsigned long new_bits;
+
+    assert(hb->granularity == 0);
+    assert(pos < (hb->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL);
+
+    elem = &hb->levels[HBITMAP_LEVELS - 1][pos];
+    new_bits = val & ~*elem;
+    if (!new_bits) {
+        return 0;
+    }
+    if (*elem == 0) {
+        hb_set_between(hb, HBITMAP_LEVELS - 2, pos, pos);
+    }
+    *elem |= new_bits;
+    hb->count += ctpopl(new_bits);
+    return ctpopl(new_bits);
+}
+
 /* Resetting works the other way round: propagate up if the new
  * value is zero.
  */
@@ -154,6 +154,7 @@ CharDriverState *virtcon_hds[MAX_VIRTIO_CONSOLES];
 CharDriverState *sclp_hds[MAX_SCLP_CONSOLES];
 int win2k_install_hack = 0;
 int singlestep = 0;
+unsigned int tb_hot_threshold;
 int smp_cpus = 1;
 int max_cpus = 0;
 int smp_cores = 1;
@@ -3606,6 +3607,12 @@ int main(int argc, char **argv, char **envp)
                     tcg_tb_size = 0;
                 }
                 break;
+            case QEMU_OPTION_tb_cache:
+                tcg_tb_cache_file = optarg;
+                break;
+            case QEMU_OPTION_superblock:
+                tb_hot_threshold = strtoul(optarg, NULL, 0);
+                break;
             case QEMU_OPTION_icount:
                 icount_opts = qemu_opts_parse(qemu_find_opts("icount"),
                                               optarg, 1);